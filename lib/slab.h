@@ -0,0 +1,141 @@
+/**
+ * @file slab.h
+ * @brief A fixed-size object allocator backed by cache-line aligned slabs
+ *
+ * Each cache hands out objects of a single size. Objects are carved out of slabs of
+ * many objects each and returned to a free list when freed, so once a cache has grown
+ * to its working set, allocating and freeing never call malloc or free. Every object
+ * starts on a cache line boundary and its size is rounded up to whole cache lines, so
+ * objects never share a line. Slabs are only given back by slab_cache_destroy.
+ *
+ * Not thread safe; callers serialize access (the kernel only runs one thread at a time).
+ *
+ * Usage example:
+ * @code
+ * slab_cache cache = SLAB_CACHE_INIT(sizeof(my_struct), 64);
+ * my_struct *obj = slab_alloc(&cache);
+ * slab_free(&cache, obj);
+ * slab_cache_destroy(&cache);
+ * @endcode
+ */
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#define SLAB_ALIGN 64 // cache line size
+
+/**
+ * @brief Round a size up to a whole number of cache lines
+ */
+#define SLAB_ROUND_UP(size) (((size) + SLAB_ALIGN - 1) / SLAB_ALIGN * SLAB_ALIGN)
+
+/**
+ * @brief A free object, linked through its first bytes
+ */
+typedef struct slab_free_obj_st
+{
+    struct slab_free_obj_st *next;
+} slab_free_obj;
+
+/**
+ * @brief The first cache line of every slab, linking the slabs of a cache together
+ */
+typedef struct slab_header_st
+{
+    struct slab_header_st *next;
+} slab_header;
+
+/**
+ * @brief A cache of objects of one size
+ */
+typedef struct slab_cache_st
+{
+    size_t obj_size;      // rounded up to a multiple of SLAB_ALIGN
+    size_t objs_per_slab;
+    slab_free_obj *free_list;
+    slab_header *slabs;
+
+    // usage counters
+    size_t n_slabs;  // slabs allocated, each holding objs_per_slab objects
+    size_t n_in_use; // objects handed out and not yet freed
+    size_t n_allocs; // calls to slab_alloc that returned an object
+} slab_cache;
+
+/**
+ * @brief Initializer for an empty cache of objects of obj_size bytes, allocating
+ * objs_per_slab of them at a time. No memory is allocated until the first slab_alloc.
+ */
+#define SLAB_CACHE_INIT(obj_size, objs_per_slab) {SLAB_ROUND_UP(obj_size), (objs_per_slab), NULL, NULL, 0, 0, 0}
+
+/**
+ * @brief Allocate an object, growing the cache by one slab if it has no free objects
+ * @return A pointer to the object, which is not zeroed, or NULL if a new slab was needed
+ * and could not be allocated
+ */
+static inline void *slab_alloc(slab_cache *cache)
+{
+    if (cache->free_list == NULL)
+    {
+        slab_header *slab = (slab_header *)aligned_alloc(SLAB_ALIGN, SLAB_ALIGN + cache->objs_per_slab * cache->obj_size);
+        if (slab == NULL)
+        {
+            return NULL;
+        }
+        slab->next = cache->slabs;
+        cache->slabs = slab;
+        cache->n_slabs += 1;
+
+        // thread the new objects onto the free list, first object first
+        char *objs = (char *)slab + SLAB_ALIGN;
+        for (size_t i = cache->objs_per_slab; i-- > 0;)
+        {
+            slab_free_obj *obj = (slab_free_obj *)(objs + i * cache->obj_size);
+            obj->next = cache->free_list;
+            cache->free_list = obj;
+        }
+    }
+
+    slab_free_obj *obj = cache->free_list;
+    cache->free_list = obj->next;
+    cache->n_in_use += 1;
+    cache->n_allocs += 1;
+    return obj;
+}
+
+/**
+ * @brief Return an object to its cache. Freeing NULL does nothing.
+ * @param obj An object returned by slab_alloc on the same cache
+ */
+static inline void slab_free(slab_cache *cache, void *obj)
+{
+    if (obj == NULL)
+    {
+        return;
+    }
+    slab_free_obj *free_obj = (slab_free_obj *)obj;
+    free_obj->next = cache->free_list;
+    cache->free_list = free_obj;
+    cache->n_in_use -= 1;
+}
+
+/**
+ * @brief Free every slab of a cache, including objects still in use, leaving it empty
+ * and ready to be used again
+ */
+static inline void slab_cache_destroy(slab_cache *cache)
+{
+    while (cache->slabs != NULL)
+    {
+        slab_header *next = cache->slabs->next;
+        free(cache->slabs);
+        cache->slabs = next;
+    }
+    cache->free_list = NULL;
+    cache->n_slabs = 0;
+    cache->n_in_use = 0;
+}
+
+#endif // SLAB_H
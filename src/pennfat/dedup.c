@@ -0,0 +1,279 @@
+#include "src/pennfat/dedup.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define DEDUP_INITIAL_CAPACITY 1024
+#define DEDUP_SIDECAR_MAGIC 0x44444650 // "PFDD"
+#define DEDUP_SIDECAR_VERSION 1
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+typedef struct dedup_sidecar_header_st
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+    uint32_t reserved;
+} dedup_sidecar_header;
+
+typedef struct dedup_sidecar_record_st
+{
+    uint64_t key;
+    uint32_t block; // was a uint16_t followed by zero padding, so older sidecars read the same
+    uint8_t padding[4];
+} dedup_sidecar_record;
+
+/**
+ * splitmix64 finalizer, used to spread bits before indexing the table
+ */
+static uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+uint64_t dedup_hash_block(const void *data, size_t len)
+{
+    // FNV-1a over 8 byte words (block sizes are always a multiple of 8)
+    const uint8_t *bytes = (const uint8_t *)data;
+    uint64_t hash = FNV_OFFSET_BASIS;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, bytes + i, sizeof(word));
+        hash = (hash ^ word) * FNV_PRIME;
+    }
+    for (; i < len; i++)
+    {
+        hash = (hash ^ bytes[i]) * FNV_PRIME;
+    }
+    hash = mix64(hash);
+    return hash == 0 ? 1 : hash;
+}
+
+uint64_t dedup_chain_key(uint64_t content_hash, uint32_t next_block)
+{
+    uint64_t key = mix64(content_hash ^ ((uint64_t)next_block * 0x9e3779b97f4a7c15ULL));
+    return key == 0 ? 1 : key;
+}
+
+dedup_index *dedup_index_new(void)
+{
+    dedup_index *index = (dedup_index *)malloc(sizeof(dedup_index));
+    if (index == NULL)
+    {
+        return NULL;
+    }
+    index->slots = (dedup_slot *)calloc(DEDUP_INITIAL_CAPACITY, sizeof(dedup_slot));
+    if (index->slots == NULL)
+    {
+        free(index);
+        return NULL;
+    }
+    index->capacity = DEDUP_INITIAL_CAPACITY;
+    index->count = 0;
+    return index;
+}
+
+void dedup_index_free(dedup_index *index)
+{
+    if (index == NULL)
+    {
+        return;
+    }
+    free(index->slots);
+    free(index);
+}
+
+/**
+ * Find the slot holding key, or the empty slot where key would go.
+ */
+static dedup_slot *find_slot(dedup_slot *slots, uint32_t capacity, uint64_t key)
+{
+    uint32_t mask = capacity - 1;
+    uint32_t i = (uint32_t)key & mask;
+    while (slots[i].key != 0 && slots[i].key != key)
+    {
+        i = (i + 1) & mask;
+    }
+    return &slots[i];
+}
+
+bool dedup_index_lookup(dedup_index *index, uint64_t key, uint32_t *block_ptr)
+{
+    dedup_slot *slot = find_slot(index->slots, index->capacity, key);
+    if (slot->key == 0)
+    {
+        return false;
+    }
+    *block_ptr = slot->block;
+    return true;
+}
+
+static int grow(dedup_index *index)
+{
+    uint32_t new_capacity = index->capacity * 2;
+    dedup_slot *new_slots = (dedup_slot *)calloc(new_capacity, sizeof(dedup_slot));
+    if (new_slots == NULL)
+    {
+        return EDEDUP_MALLOC_FAILED;
+    }
+    for (uint32_t i = 0; i < index->capacity; i++)
+    {
+        if (index->slots[i].key != 0)
+        {
+            *find_slot(new_slots, new_capacity, index->slots[i].key) = index->slots[i];
+        }
+    }
+    free(index->slots);
+    index->slots = new_slots;
+    index->capacity = new_capacity;
+    return 0;
+}
+
+int dedup_index_insert(dedup_index *index, uint64_t key, uint32_t block)
+{
+    // keep the load factor under 3/4 so probe sequences stay short
+    if ((index->count + 1) * 4 > index->capacity * 3)
+    {
+        int grow_status = grow(index);
+        if (grow_status != 0)
+        {
+            return grow_status;
+        }
+    }
+
+    dedup_slot *slot = find_slot(index->slots, index->capacity, key);
+    if (slot->key == 0)
+    {
+        index->count += 1;
+    }
+    slot->key = key;
+    slot->block = block;
+    return 0;
+}
+
+void dedup_index_prune(dedup_index *index, bool (*keep)(uint32_t block))
+{
+    // rebuild into a fresh table, since deleting from a linear probing table
+    // would otherwise break probe chains. Entries are only hints, so if the
+    // allocation fails keeping the stale ones around is harmless
+    dedup_slot *new_slots = (dedup_slot *)calloc(index->capacity, sizeof(dedup_slot));
+    if (new_slots == NULL)
+    {
+        return;
+    }
+    index->count = 0;
+    for (uint32_t i = 0; i < index->capacity; i++)
+    {
+        if (index->slots[i].key != 0 && keep(index->slots[i].block))
+        {
+            *find_slot(new_slots, index->capacity, index->slots[i].key) = index->slots[i];
+            index->count += 1;
+        }
+    }
+    free(index->slots);
+    index->slots = new_slots;
+}
+
+int dedup_index_load(dedup_index *index, const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        // no sidecar yet: nothing has been deduplicated on this image
+        return 0;
+    }
+
+    int status = 0;
+    dedup_sidecar_header header;
+    if (read(fd, &header, sizeof(header)) != sizeof(header))
+    {
+        status = EDEDUP_READ_FAILED;
+        goto cleanup;
+    }
+    if (header.magic != DEDUP_SIDECAR_MAGIC || header.version != DEDUP_SIDECAR_VERSION)
+    {
+        status = EDEDUP_BAD_SIDECAR;
+        goto cleanup;
+    }
+
+    for (uint32_t i = 0; i < header.count; i++)
+    {
+        dedup_sidecar_record record;
+        if (read(fd, &record, sizeof(record)) != sizeof(record))
+        {
+            status = EDEDUP_READ_FAILED;
+            goto cleanup;
+        }
+        if (record.key == 0)
+        {
+            continue;
+        }
+        if (dedup_index_insert(index, record.key, record.block) != 0)
+        {
+            status = EDEDUP_MALLOC_FAILED;
+            goto cleanup;
+        }
+    }
+
+cleanup:
+    close(fd);
+    return status;
+}
+
+int dedup_index_save(dedup_index *index, const char *path)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+    {
+        return EDEDUP_OPEN_FAILED;
+    }
+
+    int status = 0;
+    dedup_sidecar_header header = {
+        .magic = DEDUP_SIDECAR_MAGIC,
+        .version = DEDUP_SIDECAR_VERSION,
+        .count = index->count,
+        .reserved = 0};
+    if (write(fd, &header, sizeof(header)) != sizeof(header))
+    {
+        status = EDEDUP_WRITE_FAILED;
+        goto cleanup;
+    }
+
+    for (uint32_t i = 0; i < index->capacity; i++)
+    {
+        if (index->slots[i].key == 0)
+        {
+            continue;
+        }
+        dedup_sidecar_record record = {
+            .key = index->slots[i].key,
+            .block = index->slots[i].block,
+            .padding = {0}};
+        if (write(fd, &record, sizeof(record)) != sizeof(record))
+        {
+            status = EDEDUP_WRITE_FAILED;
+            goto cleanup;
+        }
+    }
+
+cleanup:
+    if (close(fd) != 0 && status == 0)
+    {
+        status = EDEDUP_WRITE_FAILED;
+    }
+    return status;
+}
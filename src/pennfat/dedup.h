@@ -0,0 +1,81 @@
+#ifndef PENNFAT_DEDUP_H
+#define PENNFAT_DEDUP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define EDEDUP_MALLOC_FAILED 1
+#define EDEDUP_OPEN_FAILED 2
+#define EDEDUP_READ_FAILED 3
+#define EDEDUP_WRITE_FAILED 4
+#define EDEDUP_BAD_SIDECAR 5
+
+typedef struct dedup_slot_st
+{
+    uint64_t key;   // 0 marks an empty slot
+    uint32_t block;
+} dedup_slot;
+
+/**
+ * Content-addressed index from (block contents, successor block) to a block number.
+ * An open addressing hash table with linear probing. Entries are hints only: callers
+ * must verify a hit against the FAT and the block contents before sharing the block.
+ */
+typedef struct dedup_index_st
+{
+    dedup_slot *slots;
+    uint32_t capacity; // always a power of 2
+    uint32_t count;
+} dedup_index;
+
+/**
+ * Hash the contents of a block. Never returns 0 so 0 can mean "unknown".
+ */
+uint64_t dedup_hash_block(const void *data, size_t len);
+
+/**
+ * Combine a block content hash with the block that follows it in its chain.
+ * Two blocks can only be shared if both their contents and their successors match.
+ */
+uint64_t dedup_chain_key(uint64_t content_hash, uint32_t next_block);
+
+/**
+ * Allocate an empty index. Returns NULL if malloc fails.
+ */
+dedup_index *dedup_index_new(void);
+
+void dedup_index_free(dedup_index *index);
+
+/**
+ * Look up key, storing the block number in *block_ptr if found.
+ * Returns true if the key was found.
+ */
+bool dedup_index_lookup(dedup_index *index, uint64_t key, uint32_t *block_ptr);
+
+/**
+ * Insert (or replace) key -> block.
+ * Returns 0 on success and EDEDUP_MALLOC_FAILED if the table could not grow.
+ */
+int dedup_index_insert(dedup_index *index, uint64_t key, uint32_t block);
+
+/**
+ * Drop every entry for which keep(block) returns false. Used to shed entries
+ * pointing at blocks that have since been freed before the index is saved.
+ */
+void dedup_index_prune(dedup_index *index, bool (*keep)(uint32_t block));
+
+/**
+ * Load the index stored in the sidecar file at path into index. A missing
+ * sidecar is not an error (the index just starts empty).
+ * Returns 0 on success and an EDEDUP_* error code on error.
+ */
+int dedup_index_load(dedup_index *index, const char *path);
+
+/**
+ * Save index into the sidecar file at path, replacing it.
+ * Returns 0 on success and an EDEDUP_* error code on error.
+ */
+int dedup_index_save(dedup_index *index, const char *path);
+
+#endif // PENNFAT_DEDUP_H
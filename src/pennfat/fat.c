@@ -1,15 +1,22 @@
+#define _GNU_SOURCE // for copy_file_range
 #include "src/pennfat/fat.h"
 #include "src/pennfat/fat_utils.h"
+#include "src/pennfat/dedup.h"
+#include "src/pennfat/name_filter.h"
 #include "src/utils/error_codes.h"
+#include "lib/slab.h"
 
 #include <stdint.h>
 #include <stdbool.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdarg.h>
+#include <limits.h>
 
 // should be a value storable in a uint16_t
 // and less than GLOBAL_FD_TABLE_ENTRY_NOT_FOUND_SENTINEL
@@ -18,16 +25,108 @@
 #define GLOBAL_FD_TABLE_ENTRY_NOT_FOUND_SENTINEL 0xFFFF
 #define MIN_FILENAME_SIZE 1
 #define MAX_FILENAME_SIZE 31
-#define FAT_END_OF_FILE 0xFFFF
+#define FAT_END_OF_FILE 0xFFFFFFFF   // end of file marker as get_fat returns it, whatever the width of the FAT
+#define FAT16_END_OF_FILE 0xFFFF     // end of file marker as it is stored in a fat16 FAT
+#define DEDUP_SIDECAR_SUFFIX ".dedup"
+#define SNAPSHOT_INDEX_SUFFIX ".snapshots"
+#define SNAPSHOT_SUFFIX_FORMAT ".snap.%s"
+#define SNAPSHOT_MAGIC 0x50534650 // "PFSP"
+#define SNAPSHOT_VERSION 1
+#define COPY_RANGE_MAX_RUN_BLOCKS 64 // most blocks k_copy_range moves in one host I/O call
+#define COPY_RANGE_BOUNCE_SIZE 16384 // most bytes k_copy_range moves at a time between volumes
+#define MAX_MMAPS 64
+#define FRAGMENT_SLOT_SIZE 64 // packed files take up whole slots of their fragment block
+#define RECLAIM_SYNC_MAX_BLOCKS 16 // chains up to this long are always freed on the spot
+#define DIRECTORY_PERMISSION 7 // rwx
 
 global_fd_entry global_fd_table[GLOBAL_FD_TABLE_SIZE] = {0};
-fat16_fs fs = {
-    .fat = NULL,
-    .fat_size = 0,
-    .block_size = 0,
-    .blocks_in_fat = 0,
-    .fd = -1,
-    .block_buf = NULL};
+// unused entries of global_fd_table are linked through next_free, most recently released first
+uint16_t global_fd_free_head = GLOBAL_FD_TABLE_ENTRY_NOT_FOUND_SENTINEL;
+// every mounted image. volumes[0] is the default volume, the others are named (see mount_volume)
+fat16_fs volumes[MAX_VOLUMES] = {0};
+
+// the volume the k_* call running on this thread works on. Every entry point selects it from
+// the name or fd it was passed before doing anything else (see select_volume), and everything
+// below works on it through fs. It is per thread so that readers of read-only volumes on
+// different threads don't step on each other
+_Thread_local fat16_fs *current_volume = &volumes[0];
+#define fs (*current_volume)
+
+// a snapshot sidecar is this header, then a copy of the FAT, then copies of the root directory blocks,
+// then the number of subdirectory blocks and a (block number, copy of the block) record for each of them
+typedef struct snapshot_header_st
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t fat_size;
+    uint16_t block_size;
+    uint16_t n_root_dir_blocks;
+} snapshot_header;
+
+// a block shared by packed small files. Bit i of used is set if slot i (FRAGMENT_SLOT_SIZE
+// bytes at offset i * FRAGMENT_SLOT_SIZE) belongs to a file. Blocks are at most 4096 bytes, so 64 bits is enough
+typedef struct fragment_block_st
+{
+    uint32_t block;
+    uint64_t used;
+} fragment_block;
+
+// a directory as the lookups below see it. The root directory is a list of blocks ending at
+// the first entry with name[0] == 0. A subdirectory is a power of two of buckets, one block
+// each, and a name always lives in bucket name_hash(name) & (n_buckets - 1)
+typedef struct dir_ref_st
+{
+    uint32_t first_block;
+    uint32_t n_buckets;   // 0 for the root directory
+    uint32_t entry_block; // where the subdirectory's own entry is (in its parent)
+    uint8_t entry_idx;
+} dir_ref;
+
+// a live k_mmap mapping. Each one holds a reference to its global fd until it is unmapped
+typedef struct mmap_entry_st
+{
+    char *addr;      // address handed out by k_mmap, NULL if the slot is free
+    pid_t pid;       // process the mapping belongs to (see k_munmap_all)
+    void *host_base; // start of the host mmap of the image for direct mappings, NULL for buffered ones
+    size_t host_len;
+    int fd;
+    uint32_t offset;
+    uint32_t len;
+    int prot;
+} mmap_entry;
+
+mmap_entry mmap_table[MAX_MMAPS] = {0};
+
+// always on, reset at mount and by k_fsstats_reset
+fs_stats stats = {0};
+
+// the in-memory copies of the directory entries of open files
+slab_cache dir_entry_slab = SLAB_CACHE_INIT(sizeof(directory_entry), 64);
+
+#define BLOCK_MAP_INITIAL_CAPACITY 32 // one cache line of blocks
+
+// block maps of open files that fit in BLOCK_MAP_INITIAL_CAPACITY blocks. Only larger ones are malloc'd
+slab_cache block_map_slab = SLAB_CACHE_INIT(BLOCK_MAP_INITIAL_CAPACITY * sizeof(uint32_t), 64);
+
+bool reclaim_async = false; // see k_reclaim_async
+
+void clear_fat_file(uint32_t block);
+uint32_t clear_fat_blocks(uint32_t block, uint32_t *budget);
+uint32_t nth_block(uint32_t block, uint32_t idx);
+uint32_t get_blocks_in_data_region(void);
+int get_block(uint32_t block_num, void *data);
+int get_block_io(uint32_t block_num, void *data, bool direct);
+int write_block(uint32_t block_num, void *data);
+int write_block_io(uint32_t block_num, const void *data, bool direct);
+uint32_t first_empty_block(void);
+bool open_direct_fd(void);
+void close_direct_fd(void);
+bool check_filename_charset(const char *str, uint8_t strlen);
+int reclaim_volume(uint32_t max_blocks);
+static int compact_root_dir(void);
+void free_log_reader(global_fd_entry *fd_entry);
+int write_file(global_fd_entry *fd_entry, const char *str, int n);
+int allocate_blocks(uint32_t n, uint32_t *first_ptr, uint32_t *last_ptr);
 
 int min(int a, int b)
 {
@@ -38,1487 +137,6420 @@ int min(int a, int b)
 
 bool is_mounted(void)
 {
-    return fs.fd != -1;
-}
-
-int mount(char *fs_name)
-{
-    if (is_mounted())
+    for (int i = 0; i < MAX_VOLUMES; i++)
     {
-        return EMOUNT_ALREADY_MOUNTED;
+        if (volumes[i].fat != NULL)
+        {
+            return true;
+        }
     }
+    return false;
+}
 
-    int fs_fd = open(fs_name, O_RDWR);
-    if (fs_fd == -1)
-    {
-        return EMOUNT_OPEN_FAILED;
-    }
+/**
+ * Whether the current volume is mounted
+ */
+bool volume_is_mounted(void)
+{
+    return fs.fat != NULL;
+}
 
-    // compute the fat size
-    uint16_t first_entry;
-    if (read(fs_fd, &first_entry, 2) == -1)
+/**
+ * Make the volume a file name is on the current volume, and return the name of the file on it
+ * (without the volume prefix). Returns NULL if the name is on a volume that isn't mounted; names
+ * without a prefix are on the default volume, which is selected even when it isn't mounted.
+ */
+const char *select_volume(const char *fname)
+{
+    const char *separator = strchr(fname, VOLUME_SEPARATOR);
+    if (separator == NULL)
     {
-        return EMOUNT_READ_FAILED;
+        current_volume = &volumes[0];
+        return fname;
     }
-
-    uint8_t blocks_in_fat;
-    uint16_t block_size;
-    if (parse_first_fat_entry(first_entry, &block_size, &blocks_in_fat) == -1)
+    size_t len = separator - fname;
+    for (int i = 0; i < MAX_VOLUMES; i++)
     {
-        return EMOUNT_BAD_FAT_FIRST_ENTRY;
+        // the default volume is also reachable as ":f"
+        if ((i == 0 || volumes[i].fat != NULL) && strlen(volumes[i].volume_name) == len && strncmp(volumes[i].volume_name, fname, len) == 0)
+        {
+            current_volume = &volumes[i];
+            return separator + 1;
+        }
     }
+    return NULL;
+}
 
-    size_t fat_size = (size_t)blocks_in_fat * block_size;
-    uint16_t *fat = mmap(NULL, fat_size, PROT_READ | PROT_WRITE, MAP_SHARED, fs_fd, 0);
-    if (fat == MAP_FAILED)
+/**
+ * Make the volume of the file open as fd the current volume. Special, unused and out of
+ * range fds select the default volume, so that the checks of the caller report them.
+ */
+void select_fd_volume(int fd)
+{
+    if (fd >= 0 && fd < GLOBAL_FD_TABLE_SIZE && global_fd_table[fd].ref_count > 0 && global_fd_table[fd].volume != NULL)
     {
-        return EMOUNT_MMAP_FAILED;
+        current_volume = global_fd_table[fd].volume;
     }
-
-    void *block_buf = malloc(block_size);
-    if (block_buf == NULL)
+    else
     {
-        return EMOUNT_MALLOC_FAILED;
+        current_volume = &volumes[0];
     }
+}
 
-    fs = (fat16_fs){
-        .fat = fat,
-        .fat_size = fat_size,
-        .block_size = block_size,
-        .blocks_in_fat = blocks_in_fat,
-        .fd = fs_fd,
-        .block_buf = block_buf};
+bool is_read_only(void)
+{
+    return fs.flags & MOUNT_READ_ONLY;
+}
 
-    // initialize the global fd table with entries for 0, 1, 2
-    // as STDIN, STDOUT, and STDERR
-    // These are special non-closeable files
-    for (int i = 0; i < 3; i++)
+/**
+ * Returns entry block of fat, a FAT laid out like the one of the current volume (e.g., a
+ * copy of it in a snapshot). The end of file marker of a fat16 FAT is widened to FAT_END_OF_FILE
+ */
+uint32_t fat_entry(const void *fat, uint32_t block)
+{
+    if (fs.fat32)
     {
-        global_fd_table[i].ref_count = 1;
-        global_fd_table[i].ptr_to_dir_entry = NULL;
-        global_fd_table[i].dir_entry_block_num = 0;
-        global_fd_table[i].dir_entry_idx = 0;
-        global_fd_table[i].write_locked = 0;
-        global_fd_table[i].offset = 0;
+        return ((const uint32_t *)fat)[block];
     }
-
-    return 0;
+    uint16_t entry = ((const uint16_t *)fat)[block];
+    return entry == FAT16_END_OF_FILE ? FAT_END_OF_FILE : entry;
 }
 
-int unmount(void)
+/**
+ * Returns the FAT entry of block: 0 if it is free, FAT_END_OF_FILE if it ends its chain and the
+ * next block of the chain otherwise
+ */
+uint32_t get_fat(uint32_t block)
 {
-    if (!is_mounted())
-    {
-        return EFS_NOT_MOUNTED;
-    }
+    return fat_entry(fs.fat, block);
+}
 
-    // best effort to close all open files
-    for (int i = 0; i < GLOBAL_FD_TABLE_SIZE; i++)
+/**
+ * Set the FAT entry of block to value. Every change to the FAT goes through here, so that
+ * fs.n_free_blocks stays up to date
+ */
+void set_fat(uint32_t block, uint32_t value)
+{
+    if ((get_fat(block) == 0) != (value == 0))
     {
-        if (global_fd_table[i].ref_count > 0)
+        if (fs.snap_refs[block] == 0)
         {
-            global_fd_table[i].ref_count = 1; // set this
-            k_close(i);
+            fs.n_free_blocks += value == 0 ? 1 : -1;
         }
+        fs.largest_free_run_stale = true;
     }
-
-    free(fs.block_buf);
-    if (munmap(fs.fat, fs.fat_size) == -1)
+    if (fs.fat32)
     {
-        return EUNMOUNT_MUNMAP_FAILED;
+        ((uint32_t *)fs.fat)[block] = value;
     }
-    if (close(fs.fd) != 0)
+    else
     {
-        return EUNMOUNT_CLOSE_FAILED;
+        ((uint16_t *)fs.fat)[block] = value == FAT_END_OF_FILE ? FAT16_END_OF_FILE : value;
     }
-    fs = (fat16_fs){0};
-    fs.fat = NULL; // just to be safe, set the ptr to NULL (in case NULL != 0)
-    fs.block_buf = NULL;
-    fs.fd = -1;
-    return 0;
 }
 
-char K_FPRINTF_SHORT_BUF[1024];
+uint32_t dir_entry_first_block(const directory_entry *dir_entry)
+{
+    return ((uint32_t)dir_entry->first_block_hi << 16) | dir_entry->first_block;
+}
 
-int k_fprintf_short(int fd, const char *format, ...) {
-    va_list args;
-    va_start(args, format);
-    int status = vsnprintf(K_FPRINTF_SHORT_BUF, sizeof(K_FPRINTF_SHORT_BUF), format, args);
-    va_end(args);
-    if (status < 0) {
-        return E_STR_FORMAT_FAILED;
-    }
-    if (status >= sizeof(K_FPRINTF_SHORT_BUF)) {
-        return E_STR_TOO_LONG_FOR_FPRINTF_BUF;
+void set_dir_entry_first_block(directory_entry *dir_entry, uint32_t block)
+{
+    dir_entry->first_block = block & 0xFFFF;
+    dir_entry->first_block_hi = block >> 16;
+}
+
+uint32_t dir_entry_frag_block(const directory_entry *dir_entry)
+{
+    return ((uint32_t)dir_entry->frag_block_hi << 16) | dir_entry->frag_block;
+}
+
+void set_dir_entry_frag_block(directory_entry *dir_entry, uint32_t block)
+{
+    dir_entry->frag_block = block & 0xFFFF;
+    dir_entry->frag_block_hi = block >> 16;
+}
+
+uint64_t dir_entry_size(const directory_entry *dir_entry)
+{
+    return ((uint64_t)dir_entry->size_hi << 32) | dir_entry->size;
+}
+
+void set_dir_entry_size(directory_entry *dir_entry, uint64_t size)
+{
+    dir_entry->size = size & 0xFFFFFFFF;
+    dir_entry->size_hi = size >> 32;
+}
+
+/**
+ * Recount fs.n_free_blocks after the FAT was replaced as a whole
+ */
+void count_free_blocks(void)
+{
+    uint32_t n_blocks = get_blocks_in_data_region();
+    uint32_t n_free = fs.fat32 ? count_zero_entries32((const uint32_t *)fs.fat + 1, n_blocks) : count_zero_entries((const uint16_t *)fs.fat + 1, n_blocks);
+    if (fs.n_snapshots > 0)
+    {
+        for (uint32_t block = 1; block <= n_blocks; block++)
+        {
+            n_free -= get_fat(block) == 0 && fs.snap_refs[block] > 0;
+        }
     }
-    return k_write(fd, K_FPRINTF_SHORT_BUF, strlen(K_FPRINTF_SHORT_BUF));
+    fs.n_free_blocks = n_free;
+    fs.largest_free_run_stale = true;
 }
 
 /**
- * Clear a file starting at block. It is expected that block is
- * the first block in the file. If it is not
- *
- * Note that this function does not validate that the blocks at each
- * stage (including the initially passed block) are in bounds. It assumes
- * the FAT is maintained as valid.
+ * Returns a malloc'd path for the sidecar file next to the mounted image
+ * (i.e., fs_name followed by suffix), or NULL if malloc fails.
  */
-void clear_fat_file(uint16_t block)
+char *sidecar_path(const char *suffix)
 {
-    while (block != FAT_END_OF_FILE)
+    size_t len = strlen(fs.fs_name) + strlen(suffix) + 1;
+    char *path = (char *)malloc(len);
+    if (path == NULL)
     {
-        uint16_t next_block = fs.fat[block];
-        fs.fat[block] = 0;
-        block = next_block;
+        return NULL;
     }
+    snprintf(path, len, "%s%s", fs.fs_name, suffix);
+    return path;
+}
+
+bool is_allocated_block(uint32_t block)
+{
+    return block >= 1 && block <= get_blocks_in_data_region() && get_fat(block) != 0;
 }
 
+#define WALK_SUBDIRS_CONTINUE 0
+#define WALK_SUBDIRS_WRITE_BACK 1
+#define WALK_SUBDIRS_STOP 2
+
+#define EWALK_SUBDIRS_MALLOC_FAILED 1
+#define EWALK_SUBDIRS_GET_BLOCK_FAILED 2
+#define EWALK_SUBDIRS_WRITE_BLOCK_FAILED 3
+#define EWALK_SUBDIRS_LOOP 4
+
 /**
- * Finds the first empty block by walking the fat from index 1. Returns the
- * block index if such a block exists and 0 if there is no empty block
+ * Call visit on every block of every subdirectory below the directory starting at
+ * start_block (1 for the whole volume), with the entries of the block in a buffer of its
+ * own. start_block itself is visited too unless it is the root directory. visit returns
+ * WALK_SUBDIRS_WRITE_BACK to have the block written back after changing its entries,
+ * WALK_SUBDIRS_STOP to end the walk, WALK_SUBDIRS_CONTINUE otherwise, or a negative value,
+ * which ends the walk and is returned as is.
+ *
+ * Returns 0 on success and an EWALK_SUBDIRS_* error code on error. A corrupt directory
+ * that links back to itself fails the walk rather than looping forever.
  */
-uint16_t first_empty_block(void)
+int walk_subdirs(uint32_t start_block, int (*visit)(uint32_t block, directory_entry *entries, void *arg), void *arg)
 {
-    // look for the first empty block in the fat
-    uint32_t n_fat_entries = fs.fat_size == 65536 ? fs.fat_size / 2 : 65535;
-    if (n_fat_entries >= (1 << 16))
+    uint32_t n_blocks = get_blocks_in_data_region();
+    uint8_t n_dir_entry_per_block = fs.block_size / sizeof(directory_entry);
+    directory_entry *dir_entry_buf = (directory_entry *)malloc(fs.block_size);
+    uint32_t capacity = 16;
+    uint32_t *pending = (uint32_t *)malloc(capacity * sizeof(uint32_t)); // first blocks of the directories left to walk
+    int status = 0;
+    if (dir_entry_buf == NULL || pending == NULL)
     {
-        n_fat_entries = FAT_END_OF_FILE;
+        status = EWALK_SUBDIRS_MALLOC_FAILED;
+        goto cleanup;
     }
 
-    for (uint16_t i = 1; i < n_fat_entries; i++)
+    uint32_t n_pending = 1;
+    uint32_t n_visited = 0;
+    pending[0] = start_block;
+    while (n_pending > 0)
     {
-        if (fs.fat[i] == 0)
+        uint32_t dir_block = pending[--n_pending];
+        bool end = false;
+        for (uint32_t block = dir_block; block != FAT_END_OF_FILE && !end; block = get_fat(block))
         {
-            return i;
+            if (block == 0 || block > n_blocks || ++n_visited > n_blocks)
+            {
+                status = EWALK_SUBDIRS_LOOP;
+                goto cleanup;
+            }
+            if (get_block(block, dir_entry_buf) != 0)
+            {
+                status = EWALK_SUBDIRS_GET_BLOCK_FAILED;
+                goto cleanup;
+            }
+            if (dir_block != 1)
+            {
+                int action = visit(block, dir_entry_buf, arg);
+                if (action < 0 || action == WALK_SUBDIRS_STOP)
+                {
+                    status = action < 0 ? action : 0;
+                    goto cleanup;
+                }
+                if (action == WALK_SUBDIRS_WRITE_BACK && write_block(block, dir_entry_buf) != 0)
+                {
+                    status = EWALK_SUBDIRS_WRITE_BLOCK_FAILED;
+                    goto cleanup;
+                }
+            }
+
+            for (uint8_t i = 0; i < n_dir_entry_per_block; i++)
+            {
+                if (dir_block == 1 && dir_entry_buf[i].name[0] == 0)
+                {
+                    end = true;
+                    break;
+                }
+                if (dir_entry_buf[i].name[0] <= 2 || dir_entry_buf[i].type != FILE_TYPE_DIRECTORY || dir_entry_first_block(&dir_entry_buf[i]) == 0)
+                {
+                    continue;
+                }
+                if (n_pending == capacity)
+                {
+                    uint32_t *grown = (uint32_t *)realloc(pending, 2 * capacity * sizeof(uint32_t));
+                    if (grown == NULL)
+                    {
+                        status = EWALK_SUBDIRS_MALLOC_FAILED;
+                        goto cleanup;
+                    }
+                    pending = grown;
+                    capacity *= 2;
+                }
+                pending[n_pending++] = dir_entry_first_block(&dir_entry_buf[i]);
+            }
         }
     }
-    return 0;
+
+cleanup:
+    free(dir_entry_buf);
+    free(pending);
+    return status;
 }
 
 /**
- * Whether the provided string fits thei POSIX filename charset
+ * walk_subdirs visitor for build_extra_refs, with arg being the reference counts
  */
-bool check_filename_charset(const char *str, uint8_t strlen)
+int count_subdir_refs(uint32_t block, directory_entry *entries, void *arg)
 {
-    for (uint8_t i = 0; i < strlen; i++)
+    uint16_t *refs = (uint16_t *)arg;
+    uint32_t n_blocks = get_blocks_in_data_region();
+    uint8_t n_dir_entry_per_block = fs.block_size / sizeof(directory_entry);
+    for (uint8_t i = 0; i < n_dir_entry_per_block; i++)
     {
-        if (
-            !(
-                ('a' <= str[i] && str[i] <= 'z') ||
-                ('A' <= str[i] && str[i] <= 'Z') ||
-                ('0' <= str[i] && str[i] <= '9') ||
-                str[i] == '.' ||
-                str[i] == '_' ||
-                str[i] == '-'))
+        uint32_t first_block = dir_entry_first_block(&entries[i]);
+        if (entries[i].name[0] <= 1 || first_block == 0 || first_block > n_blocks)
         {
-            return false;
+            continue;
+        }
+        if (refs[first_block] < UINT16_MAX)
+        {
+            refs[first_block] += 1;
         }
     }
-    return true;
-}
-
-uint32_t get_blocks_in_data_region(void)
-{
-    return ((fs.fat_size) / 2) - 1;
-}
-
-uint32_t get_byte_offset_of_block(uint16_t block_num)
-{
-    return fs.fat_size + ((size_t)block_num - 1) * fs.block_size;
+    return WALK_SUBDIRS_CONTINUE;
 }
 
-#define EGET_BLOCK_BLOCK_NUM_0 1
-#define EGET_BLOCK_BLOCK_NUM_TOO_HIGH 2
-#define EGET_BLOCK_LSEEK_FAILED 4
-#define EGET_BLOCK_READ_FAILED 5
-#define EGET_BLOCK_TOO_FEW_BYTES_READ 6
+#define EBUILD_EXTRA_REFS_GET_BLOCK_FAILED 1
 
 /**
- * Get the data inside of a block and store it into the buffer pointed to
- * by data. It is assumed that the memory pointed to by data has sufficient
- * capacity to store a full block (fs.block_size).
+ * Derive fs.extra_refs by counting the pointers into every block: links in the FAT,
+ * the first_block of directory entries (in subdirectories too) and the root directory
+ * itself (block 1). Deleted entries (name[0] == 1) may still hold a stale first_block, so they are skipped.
  *
- * Returns 0 on success and an error code on error. See the EGET_BLOCK_* error code.
+ * Returns 0 on success and an EBUILD_EXTRA_REFS_* error code on error.
  */
-int get_block(uint16_t block_num, void *data)
+int build_extra_refs(void)
 {
-    uint32_t blocks_in_data_region = get_blocks_in_data_region();
-    if (block_num < 1)
-    {
-        return EGET_BLOCK_BLOCK_NUM_0;
-    }
+    uint32_t n_blocks = get_blocks_in_data_region();
+    uint16_t *refs = fs.extra_refs; // holds the total reference count until the end
+    memset(refs, 0, ((size_t)n_blocks + 1) * sizeof(uint16_t));
 
-    if (block_num > blocks_in_data_region)
+    refs[1] = 1;
+    for (uint32_t block = 1; block <= n_blocks; block++)
     {
-        return EGET_BLOCK_BLOCK_NUM_TOO_HIGH;
+        uint32_t next_block = get_fat(block);
+        if (next_block != 0 && next_block != FAT_END_OF_FILE && next_block <= n_blocks && refs[next_block] < UINT16_MAX)
+        {
+            refs[next_block] += 1;
+        }
     }
 
-    if (lseek(fs.fd, get_byte_offset_of_block(block_num), SEEK_SET) < 0)
+    uint32_t block = 1;
+    directory_entry *dir_entry_buf = fs.block_buf;
+    uint8_t n_dir_entry_per_block = fs.block_size / sizeof(directory_entry);
+    while (block != FAT_END_OF_FILE)
     {
-        return EGET_BLOCK_LSEEK_FAILED;
+        if (get_block(block, dir_entry_buf) != 0)
+        {
+            return EBUILD_EXTRA_REFS_GET_BLOCK_FAILED;
+        }
+        for (uint8_t i = 0; i < n_dir_entry_per_block; i++)
+        {
+            if (dir_entry_buf[i].name[0] == 0)
+            {
+                block = FAT_END_OF_FILE;
+                break;
+            }
+            uint32_t first_block = dir_entry_first_block(&dir_entry_buf[i]);
+            if (dir_entry_buf[i].name[0] == 1 || first_block == 0 || first_block > n_blocks)
+            {
+                continue;
+            }
+            if (refs[first_block] < UINT16_MAX)
+            {
+                refs[first_block] += 1;
+            }
+        }
+        if (block != FAT_END_OF_FILE)
+        {
+            block = get_fat(block);
+        }
     }
-
-    ssize_t bytes_read = read(fs.fd, data, fs.block_size);
-    if (bytes_read == -1)
+    if (walk_subdirs(1, count_subdir_refs, refs) != 0)
     {
-        return EGET_BLOCK_READ_FAILED;
+        return EBUILD_EXTRA_REFS_GET_BLOCK_FAILED;
     }
 
-    if (bytes_read < fs.block_size)
+    for (uint32_t i = 1; i <= n_blocks; i++)
     {
-        return EGET_BLOCK_TOO_FEW_BYTES_READ;
+        if (refs[i] > 0)
+        {
+            refs[i] -= 1;
+        }
     }
-
     return 0;
 }
 
-#define ENEXT_BLOCK_NUM_BLOCK_NUM_0 1
-#define ENEXT_BLOCK_NUM_BLOCK_NUM_TOO_HIGH 2
-// TODO: add a return condition for already being at the end file
-
 /**
- * Get the next block number from the FAT table.
+ * Returns the index of block in fs.fragment_blocks, or -1 if it isn't a fragment block
  */
-int next_block_num(uint16_t block_num, uint16_t *next_block_num)
+int find_fragment_block(uint32_t block)
 {
-    uint32_t blocks_in_data_region = get_blocks_in_data_region();
-    if (block_num < 1)
-    {
-        return ENEXT_BLOCK_NUM_BLOCK_NUM_0;
-    }
-
-    if (block_num > blocks_in_data_region)
+    for (uint32_t i = 0; i < fs.n_fragment_blocks; i++)
     {
-        return ENEXT_BLOCK_NUM_BLOCK_NUM_TOO_HIGH;
+        if (fs.fragment_blocks[i].block == block)
+        {
+            return i;
+        }
     }
-    *next_block_num = fs.fat[block_num];
-    return 0;
+    return -1;
 }
 
-#define EWRITE_BLOCK_BLOCK_NUM_0 1
-#define EWRITE_BLOCK_BLOCK_NUM_TOO_HIGH 2
-#define EWRITE_BLOCK_LSEEK_FAILED 4
-#define EWRITE_BLOCK_WRITE_FAILED 5
-#define EWRITE_BLOCK_TOO_FEW_BYTES_WRITTEN 6
-
 /**
- * A thin wrapper around wrapper that makes it easier to write exactly 1 block of data
+ * Mark the slots holding len bytes at offset in block as used, adding block to
+ * fs.fragment_blocks if it isn't there yet.
+ *
+ * Returns 0 on success and -1 if malloc fails.
  */
-int write_block(uint16_t block_num, void *data)
+int use_fragment(uint32_t block, uint16_t offset, uint32_t len)
 {
-    uint32_t blocks_in_data_region = get_blocks_in_data_region();
-    if (block_num < 1)
-    {
-        return EWRITE_BLOCK_BLOCK_NUM_0;
-    }
-
-    if (block_num > blocks_in_data_region)
+    int i = find_fragment_block(block);
+    if (i == -1)
     {
-        return EWRITE_BLOCK_BLOCK_NUM_TOO_HIGH;
+        fragment_block *fragment_blocks = (fragment_block *)realloc(fs.fragment_blocks, (fs.n_fragment_blocks + 1) * sizeof(fragment_block));
+        if (fragment_blocks == NULL)
+        {
+            return -1;
+        }
+        fs.fragment_blocks = fragment_blocks;
+        i = fs.n_fragment_blocks;
+        fs.fragment_blocks[i] = (fragment_block){.block = block, .used = 0};
+        fs.n_fragment_blocks += 1;
     }
+    uint32_t n_slots = (len + FRAGMENT_SLOT_SIZE - 1) / FRAGMENT_SLOT_SIZE;
+    fs.fragment_blocks[i].used |= (((uint64_t)1 << n_slots) - 1) << (offset / FRAGMENT_SLOT_SIZE);
+    return 0;
+}
 
-    if (lseek(fs.fd, get_byte_offset_of_block(block_num), SEEK_SET) < 0)
+/**
+ * Release the slots holding len bytes at offset in block. Once no file uses the block
+ * it is freed like any other block.
+ */
+void free_fragment(uint32_t block, uint16_t offset, uint32_t len)
+{
+    int i = find_fragment_block(block);
+    if (i == -1)
     {
-        return EWRITE_BLOCK_LSEEK_FAILED;
+        return;
     }
-
-    ssize_t bytes_written = write(fs.fd, data, fs.block_size);
-    if (bytes_written == -1)
+    uint32_t n_slots = (len + FRAGMENT_SLOT_SIZE - 1) / FRAGMENT_SLOT_SIZE;
+    fs.fragment_blocks[i].used &= ~((((uint64_t)1 << n_slots) - 1) << (offset / FRAGMENT_SLOT_SIZE));
+    if (fs.fragment_blocks[i].used != 0)
     {
-        return EWRITE_BLOCK_WRITE_FAILED;
+        return;
     }
 
-    if (bytes_written < fs.block_size)
+    set_fat(block, 0);
+    if (fs.block_hashes != NULL)
     {
-        return EWRITE_BLOCK_TOO_FEW_BYTES_WRITTEN;
+        fs.block_hashes[block] = 0;
     }
-
-    return 0;
+    fs.n_fragment_blocks -= 1;
+    fs.fragment_blocks[i] = fs.fragment_blocks[fs.n_fragment_blocks];
 }
 
-#define EFIND_FILE_IN_ROOT_DIR_GET_BLOCK_FAILED -1
-#define EFIND_FILE_IN_ROOT_DIR_NEXT_BLOCK_FAILED -2
-#define RFIND_FILE_IN_ROOT_DIR_FILE_NOT_FOUND 1
-#define RFIND_FILE_IN_ROOT_DIR_FILE_FOUND 0
-#define RFIND_FILE_IN_ROOT_DIR_FILE_DELETED 2
-
 /**
- * Find the file with name fname in the root directory of the filesystem. If it is found,
- * mallocs new directory_entry and returns a pointer to it via the ptr_to_dir_entry_buf
+ * Find room for len bytes (at most half a block) in a fragment block, allocating a new
+ * fragment block if none has enough free slots in a row, and mark it as used.
+ * Fragment blocks that are part of a snapshot are never written to, since the slots
+ * free in the live volume may still hold files of the snapshot.
  *
- * Returns >= 0 on success (see RFIND_FILE_IN_ROOT_DIR_* return codes) and < 0 on error (see EFIND_FILE_IN_ROOT_DIR_* error codes)
+ * Returns 0 on success and -1 if there is no space left (or malloc fails).
  */
-int find_file_in_root_dir(const char *fname, directory_entry *ptr_to_dir_entry, uint16_t *ptr_to_block, uint8_t *ptr_to_dir_entry_idx)
+int alloc_fragment(uint32_t len, uint32_t *block_ptr, uint16_t *offset_ptr)
 {
-    uint16_t block = 1;
-    directory_entry *dir_entry_buf = fs.block_buf;
-    // n_dir_entry_per_block is at most 4096 / 64 = 64
-    uint8_t n_dir_entry_per_block = fs.block_size / sizeof(directory_entry);
+    uint32_t n_slots_per_block = fs.block_size / FRAGMENT_SLOT_SIZE;
+    uint32_t n_slots = (len + FRAGMENT_SLOT_SIZE - 1) / FRAGMENT_SLOT_SIZE;
+    uint64_t mask = ((uint64_t)1 << n_slots) - 1;
 
-    while (true)
+    // the most recently added blocks are the likeliest to have room
+    for (uint32_t i = fs.n_fragment_blocks; i-- > 0;)
     {
-        if (get_block(block, dir_entry_buf) != 0)
+        if (fs.snap_refs[fs.fragment_blocks[i].block] > 0)
         {
-            return EFIND_FILE_IN_ROOT_DIR_GET_BLOCK_FAILED;
+            continue;
         }
-
-        for (uint8_t i = 0; i < n_dir_entry_per_block; i++)
+        for (uint32_t slot = 0; slot + n_slots <= n_slots_per_block; slot++)
         {
-            directory_entry curr_dir_entry = dir_entry_buf[i];
-            if (curr_dir_entry.name[0] == 0)
-            {
-                return RFIND_FILE_IN_ROOT_DIR_FILE_NOT_FOUND;
-            }
-
-            // use strcmp because both fname and the directory entries in the fat should
-            // have been checked for proper null termination
-            if (strcmp(fname, curr_dir_entry.name) == 0)
+            if ((fs.fragment_blocks[i].used & (mask << slot)) == 0)
             {
-                // memcpy into the passed buffer so we're not
-                // pointing to the fs.block_buf, which could
-                // change
-                memcpy(ptr_to_dir_entry, dir_entry_buf + i, sizeof(directory_entry));
-                *ptr_to_block = block;
-                *ptr_to_dir_entry_idx = i;
-
-                // TODO: the below should never happen
-                if (curr_dir_entry.name[0] == 1 || curr_dir_entry.name[0] == 2)
-                {
-                    return RFIND_FILE_IN_ROOT_DIR_FILE_DELETED;
-                }
-                return RFIND_FILE_IN_ROOT_DIR_FILE_FOUND;
+                fs.fragment_blocks[i].used |= mask << slot;
+                *block_ptr = fs.fragment_blocks[i].block;
+                *offset_ptr = slot * FRAGMENT_SLOT_SIZE;
+                return 0;
             }
         }
+    }
 
-        if (next_block_num(block, &block) != 0)
-        {
-            return EFIND_FILE_IN_ROOT_DIR_GET_BLOCK_FAILED;
-        }
-    };
+    uint32_t block = first_empty_block();
+    if (block == 0)
+    {
+        return -1;
+    }
+    if (use_fragment(block, 0, len) != 0)
+    {
+        return -1;
+    }
+    set_fat(block, FAT_END_OF_FILE);
+    *block_ptr = block;
+    *offset_ptr = 0;
+    return 0;
 }
 
-#define RFIND_FILE_IN_GLOBAL_FD_TABLE_NOT_FOUND 1
-
 /**
- * Looks for a file in the global file table matching fname, returning 0 and
- * setting the memory address at ptr_to_fd_idx to the index in the file table if found
- * and returning RFIND_FILE_IN_GLOBAL_FD_TABLE_NOT_FOUND (1) if not found.
- *
- * Note that this function skips files that have 0,1 or 2 as the first byte of their name
- * because these entries are not valid entries (in fact, they've have their name mangled, so
- * they should not match any but an adversarial fname). It also skips files with a ref_count of 0
+ * walk_subdirs visitor for build_fragment_index. Returns -1 if malloc fails
  */
-int find_file_in_global_fd_table(const char *fname, uint16_t *ptr_to_fd_idx)
+int use_subdir_fragments(uint32_t block, directory_entry *entries, void *arg)
 {
-    // Skip the first 3 entries because they are special
-    for (uint16_t i = 3; i < GLOBAL_FD_TABLE_SIZE; i++)
+    uint8_t n_dir_entry_per_block = fs.block_size / sizeof(directory_entry);
+    for (uint8_t i = 0; i < n_dir_entry_per_block; i++)
     {
-        // use strcmp because both fname and the directory entries in the fat/global fd table should
-        // have been checked for proper null termination
-        if (global_fd_table[i].ref_count == 0 || global_fd_table[i].ptr_to_dir_entry->name[0] < 3)
+        if (entries[i].name[0] <= 1 || dir_entry_frag_block(&entries[i]) == 0)
+        {
             continue;
-        if (strcmp(global_fd_table[i].ptr_to_dir_entry->name, fname) == 0)
+        }
+        if (use_fragment(dir_entry_frag_block(&entries[i]), entries[i].frag_offset, dir_entry_size(&entries[i])) != 0)
         {
-            *ptr_to_fd_idx = i;
-            return 0;
+            return -1;
         }
     }
-    return RFIND_FILE_IN_GLOBAL_FD_TABLE_NOT_FOUND;
+    return WALK_SUBDIRS_CONTINUE;
 }
 
-#define EFIND_EMPTY_SPOT_IN_ROOT_DIR_GET_BLOCK_FAILED -1
-#define EFIND_EMPTY_SPOT_IN_ROOT_DIR_NEXT_BLOCK_FAILED -2
-#define RFIND_EMPTY_SPOT_IN_ROOT_DIR_DELETED 0
-#define RFIND_EMPTY_SPOT_IN_ROOT_DIR_END_ENTRY 1
+#define EBUILD_FRAGMENT_INDEX_GET_BLOCK_FAILED 1
+#define EBUILD_FRAGMENT_INDEX_MALLOC_FAILED 2
 
-int find_empty_spot_in_root_dir(uint16_t *ptr_to_block, uint8_t *ptr_to_offset)
+/**
+ * Rebuild fs.fragment_blocks from the packed files in every directory.
+ *
+ * Returns 0 on success and an EBUILD_FRAGMENT_INDEX_* error code on error.
+ */
+int build_fragment_index(void)
 {
-    uint16_t block = 1;
+    free(fs.fragment_blocks);
+    fs.fragment_blocks = NULL;
+    fs.n_fragment_blocks = 0;
+
+    uint32_t block = 1;
     directory_entry *dir_entry_buf = fs.block_buf;
     uint8_t n_dir_entry_per_block = fs.block_size / sizeof(directory_entry);
-    while (true)
+    while (block != FAT_END_OF_FILE)
     {
         if (get_block(block, dir_entry_buf) != 0)
         {
-            return EFIND_EMPTY_SPOT_IN_ROOT_DIR_GET_BLOCK_FAILED;
+            return EBUILD_FRAGMENT_INDEX_GET_BLOCK_FAILED;
         }
-
-        // n_dir_entry_per_block is at most 4096 / 64 = 64
         for (uint8_t i = 0; i < n_dir_entry_per_block; i++)
         {
-            directory_entry curr_dir_entry = dir_entry_buf[i];
-            if (curr_dir_entry.name[0] > 2)
-            { // not a  special entry
-                continue;
+            if (dir_entry_buf[i].name[0] == 0)
+            {
+                block = FAT_END_OF_FILE;
+                break;
             }
-
-            *ptr_to_block = block;
-            *ptr_to_offset = i;
-            if (curr_dir_entry.name[0] == 0)
+            if (dir_entry_buf[i].name[0] == 1 || dir_entry_frag_block(&dir_entry_buf[i]) == 0)
             {
-                return RFIND_EMPTY_SPOT_IN_ROOT_DIR_END_ENTRY;
+                continue;
             }
-            if (curr_dir_entry.name[0] == 1 || curr_dir_entry.name[0] == 2)
+            if (use_fragment(dir_entry_frag_block(&dir_entry_buf[i]), dir_entry_buf[i].frag_offset, dir_entry_size(&dir_entry_buf[i])) != 0)
             {
-                return RFIND_EMPTY_SPOT_IN_ROOT_DIR_DELETED;
+                return EBUILD_FRAGMENT_INDEX_MALLOC_FAILED;
             }
         }
-
-        if (next_block_num(block, &block) != 0)
+        if (block != FAT_END_OF_FILE)
         {
-            return EFIND_EMPTY_SPOT_IN_ROOT_DIR_NEXT_BLOCK_FAILED;
+            block = get_fat(block);
         }
-    };
-}
-
-#define EWRITE_ROOT_DIR_ENTRY_GET_BLOCK_FAILED 1
-#define EWRITE_ROOT_DIR_ENTRY_NO_EMPTY_BLOCKS 2
-#define EWRITE_ROOT_DIR_ENTRY_WRITE_BLOCK_FAILED 3
+    }
 
-int write_root_dir_entry(directory_entry *ptr_to_dir_entry, uint16_t block, uint8_t directory_entry_offset)
-{
-    directory_entry *dir_entry_buf = (directory_entry *)fs.block_buf;
-    if (get_block(block, dir_entry_buf) != 0)
+    int status = walk_subdirs(1, use_subdir_fragments, NULL);
+    if (status == -1 || status == EWALK_SUBDIRS_MALLOC_FAILED)
     {
-        return EWRITE_ROOT_DIR_ENTRY_GET_BLOCK_FAILED;
+        return EBUILD_FRAGMENT_INDEX_MALLOC_FAILED;
     }
-
-    // the last entry of the end_block can now store our dir_entry (replacing the directory_entry that represents
-    // end of directory)
-    dir_entry_buf[directory_entry_offset] = *ptr_to_dir_entry;
-
-    // write the block
-    if (write_block(block, dir_entry_buf) != 0)
+    if (status != 0)
     {
-        return EWRITE_ROOT_DIR_ENTRY_WRITE_BLOCK_FAILED;
+        return EBUILD_FRAGMENT_INDEX_GET_BLOCK_FAILED;
     }
     return 0;
 }
 
-#define EWRITE_NEW_ROOT_DIR_ENTRY_FIND_EMPTY_SPOT_IN_ROOT_DIR_FAILED 1
-#define EWRITE_NEW_ROOT_DIR_ENTRY_WRITE_ROOT_DIR_ENTRY_FAILED 2
-
-int write_new_root_dir_entry(directory_entry *ptr_to_dir_entry, uint16_t *ptr_to_block, uint8_t *ptr_to_dir_entry_idx)
+/**
+ * Set fs.n_dir_entries and fs.n_dir_tombstones from the root directory.
+ *
+ * Returns 0 on success and -1 if a block can't be read.
+ */
+int count_root_dir_entries(void)
 {
-    // look for an empty spot in the root directory
-    uint16_t block;                 // the block where we found an empty spot
-    uint8_t directory_entry_offset; // the offset (in terms of directory_entry entries) where we found the empty spot
+    fs.n_dir_entries = 0;
+    fs.n_dir_tombstones = 0;
 
-    int find_empty_spot_status = find_empty_spot_in_root_dir(&block, &directory_entry_offset);
-    if (find_empty_spot_status < 0)
+    uint32_t block = 1;
+    directory_entry *dir_entry_buf = fs.block_buf;
+    uint8_t n_dir_entry_per_block = fs.block_size / sizeof(directory_entry);
+    while (block != FAT_END_OF_FILE)
     {
-        return EWRITE_NEW_ROOT_DIR_ENTRY_FIND_EMPTY_SPOT_IN_ROOT_DIR_FAILED;
+        if (get_block(block, dir_entry_buf) != 0)
+        {
+            return -1;
+        }
+        for (uint8_t i = 0; i < n_dir_entry_per_block; i++)
+        {
+            if (dir_entry_buf[i].name[0] == 0)
+            {
+                return 0;
+            }
+            fs.n_dir_entries += 1;
+            fs.n_dir_tombstones += dir_entry_buf[i].name[0] == 1;
+        }
+        block = get_fat(block);
     }
+    return 0;
+}
 
-    bool is_last_in_block = directory_entry_offset == (fs.block_size / sizeof(directory_entry) - 1);
-    if (find_empty_spot_status == RFIND_EMPTY_SPOT_IN_ROOT_DIR_END_ENTRY && !is_last_in_block)
+/**
+ * Rebuild fs.names from the root directory, with room for twice the files in it.
+ * Lookups just go without the filter if there isn't enough memory for it.
+ *
+ * Returns 0 on success and -1 if a block can't be read.
+ */
+int build_name_filter(void)
+{
+    name_filter_free(fs.names);
+    fs.names = name_filter_new(2 * (fs.n_dir_entries - fs.n_dir_tombstones));
+    if (fs.names == NULL)
     {
-        // case where we need to create an entry for the end of the block
-        directory_entry empty_dir_entry = {0};
-        write_root_dir_entry(&empty_dir_entry, block, directory_entry_offset + 1);
+        return 0;
     }
-    else if (find_empty_spot_status == RFIND_EMPTY_SPOT_IN_ROOT_DIR_END_ENTRY && is_last_in_block)
-    {
-        // case where we need to allocate a new block for the directory
 
-        uint16_t empty_block = first_empty_block();
-        if (empty_block == 0)
+    uint32_t block = 1;
+    directory_entry *dir_entry_buf = fs.block_buf;
+    uint8_t n_dir_entry_per_block = fs.block_size / sizeof(directory_entry);
+    while (block != FAT_END_OF_FILE)
+    {
+        if (get_block(block, dir_entry_buf) != 0)
         {
-            return EWRITE_ROOT_DIR_ENTRY_NO_EMPTY_BLOCKS;
+            name_filter_free(fs.names);
+            fs.names = NULL;
+            return -1;
         }
-
-        // zero out the new block
-        // this makes the first directory_entry in the new block
-        // the end directory entry
-        memset(fs.block_buf, 0, fs.block_size);
-        if (write_block(empty_block, fs.block_buf) != 0)
+        for (uint8_t i = 0; i < n_dir_entry_per_block; i++)
         {
-            return EWRITE_ROOT_DIR_ENTRY_WRITE_BLOCK_FAILED;
+            if (dir_entry_buf[i].name[0] == 0)
+            {
+                return 0;
+            }
+            if (dir_entry_buf[i].name[0] > 2)
+            {
+                name_filter_add(fs.names, dir_entry_buf[i].name);
+            }
         }
-
-        // add the new block to the FAT
-        fs.fat[block] = empty_block;
-        fs.fat[empty_block] = FAT_END_OF_FILE;
-    }
-
-    if (write_root_dir_entry(ptr_to_dir_entry, block, directory_entry_offset) != 0)
-    {
-        return EWRITE_NEW_ROOT_DIR_ENTRY_WRITE_ROOT_DIR_ENTRY_FAILED;
+        block = get_fat(block);
     }
-    *ptr_to_block = block;
-    *ptr_to_dir_entry_idx = directory_entry_offset;
     return 0;
 }
 
-uint16_t find_empty_fd()
+/**
+ * Set up the dedup index and block hashes for a MOUNT_DEDUP mount. The index only
+ * holds hints, so a corrupt or unreadable sidecar is discarded rather than failing the mount.
+ */
+int setup_dedup(void)
 {
-    // find an empty fd_idx // TODO: refactor into its own function
-    uint16_t fd_idx = GLOBAL_FD_TABLE_ENTRY_NOT_FOUND_SENTINEL;
-    // Skip the first 3 entries because they are special
-    for (uint16_t i = 3; i < GLOBAL_FD_TABLE_SIZE; i++)
+    fs.block_hashes = (uint64_t *)calloc((size_t)get_blocks_in_data_region() + 1, sizeof(uint64_t));
+    fs.dedup = dedup_index_new();
+    char *path = sidecar_path(DEDUP_SIDECAR_SUFFIX);
+    if (fs.block_hashes == NULL || fs.dedup == NULL || path == NULL)
+    {
+        free(path);
+        return EMOUNT_MALLOC_FAILED;
+    }
+
+    if (dedup_index_load(fs.dedup, path) != 0)
     {
-        if (global_fd_table[i].ref_count == 0)
+        dedup_index_free(fs.dedup);
+        fs.dedup = dedup_index_new();
+        if (fs.dedup == NULL)
         {
-            fd_idx = i;
-            break;
+            free(path);
+            return EMOUNT_MALLOC_FAILED;
         }
     }
-    return fd_idx;
+    free(path);
+
+    // the image may have been modified without dedup since the sidecar was written
+    dedup_index_prune(fs.dedup, is_allocated_block);
+    return 0;
 }
 
-bool is_valid_filename(const char *fname)
+/**
+ * Returns a malloc'd path for the sidecar holding the snapshot called name, or NULL if malloc fails.
+ */
+char *snapshot_path(const char *name)
 {
-    uint8_t strlen = strnlen(fname, MAX_FILENAME_SIZE);
-    if (strlen < 1)
-    {
-        return false;
-    }
-    if (fname[strlen] != '\0')
-    {
-        // the string must be longer than MAX_FILENAME_SIZE
-        return false;
-    }
-    if (!check_filename_charset(fname, strlen))
-    {
-        return false;
-    }
-    return true;
+    char suffix[sizeof(SNAPSHOT_SUFFIX_FORMAT) + SNAPSHOT_NAME_SIZE];
+    snprintf(suffix, sizeof(suffix), SNAPSHOT_SUFFIX_FORMAT, name);
+    return sidecar_path(suffix);
 }
 
-// TODO: these functions are extremely non-reentrant
+#define EREAD_SNAPSHOT_MALLOC_FAILED 1
+#define EREAD_SNAPSHOT_OPEN_FAILED 2
+#define EREAD_SNAPSHOT_READ_FAILED 3
+#define EREAD_SNAPSHOT_BAD_SIDECAR 4
 
-int k_open(const char *fname, int mode)
+/**
+ * Read the snapshot called name into fat_buf (fs.fat_size bytes) and, if root_dir_buf_ptr
+ * is not NULL, its root directory blocks into a malloc'd buffer stored in *root_dir_buf_ptr
+ * (with the number of blocks in *n_root_dir_blocks_ptr) and its subdirectory block records
+ * into another one stored in *subdir_buf_ptr (with the number of records in *n_subdir_blocks_ptr).
+ *
+ * Returns 0 on success and an EREAD_SNAPSHOT_* error code on error.
+ */
+int read_snapshot(
+    const char *name, void *fat_buf, char **root_dir_buf_ptr, uint16_t *n_root_dir_blocks_ptr,
+    char **subdir_buf_ptr, uint32_t *n_subdir_blocks_ptr)
 {
-    if (!is_mounted())
+    char *path = snapshot_path(name);
+    if (path == NULL)
     {
-        return EFS_NOT_MOUNTED;
+        return EREAD_SNAPSHOT_MALLOC_FAILED;
     }
-
-    if (!is_valid_filename(fname))
+    int fd = open(path, O_RDONLY);
+    free(path);
+    if (fd == -1)
     {
-        return EK_OPEN_INVALID_FILENAME;
+        return EREAD_SNAPSHOT_OPEN_FAILED;
     }
-    // NOTE: because of the above validation, you can never open a deleted file
-    // or end dir entry since they start with 0, 1, or 2 which are not part of the
-    // valid filename charset
-
-    uint16_t fd_idx;
-    int find_file_in_global_fd_table_status = find_file_in_global_fd_table(fname, &fd_idx);
 
-    // Already found the file in the global_fd_table
-    if (find_file_in_global_fd_table_status == 0)
+    int status = 0;
+    snapshot_header header;
+    if (read(fd, &header, sizeof(header)) != sizeof(header))
+    {
+        status = EREAD_SNAPSHOT_READ_FAILED;
+        goto cleanup;
+    }
+    if (
+        header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION ||
+        header.fat_size != fs.fat_size || header.block_size != fs.block_size || header.n_root_dir_blocks == 0)
+    {
+        status = EREAD_SNAPSHOT_BAD_SIDECAR;
+        goto cleanup;
+    }
+    if (read(fd, fat_buf, fs.fat_size) != (ssize_t)fs.fat_size)
+    {
+        status = EREAD_SNAPSHOT_READ_FAILED;
+        goto cleanup;
+    }
+
+    if (root_dir_buf_ptr != NULL)
+    {
+        size_t root_dir_size = (size_t)header.n_root_dir_blocks * fs.block_size;
+        char *root_dir_buf = (char *)malloc(root_dir_size);
+        if (root_dir_buf == NULL)
+        {
+            status = EREAD_SNAPSHOT_MALLOC_FAILED;
+            goto cleanup;
+        }
+        if (read(fd, root_dir_buf, root_dir_size) != (ssize_t)root_dir_size)
+        {
+            free(root_dir_buf);
+            status = EREAD_SNAPSHOT_READ_FAILED;
+            goto cleanup;
+        }
+
+        // sidecars written before there were subdirectories end here, which reads as none
+        uint32_t n_subdir_blocks = 0;
+        ssize_t bytes_read = read(fd, &n_subdir_blocks, sizeof(n_subdir_blocks));
+        if (bytes_read != 0 && bytes_read != sizeof(n_subdir_blocks))
+        {
+            free(root_dir_buf);
+            status = EREAD_SNAPSHOT_READ_FAILED;
+            goto cleanup;
+        }
+        if (n_subdir_blocks > get_blocks_in_data_region())
+        {
+            free(root_dir_buf);
+            status = EREAD_SNAPSHOT_BAD_SIDECAR;
+            goto cleanup;
+        }
+        size_t subdir_size = (size_t)n_subdir_blocks * (sizeof(uint32_t) + fs.block_size);
+        char *subdir_buf = (char *)malloc(subdir_size + 1); // never malloc(0)
+        if (subdir_buf == NULL)
+        {
+            free(root_dir_buf);
+            status = EREAD_SNAPSHOT_MALLOC_FAILED;
+            goto cleanup;
+        }
+        if (read(fd, subdir_buf, subdir_size) != (ssize_t)subdir_size)
+        {
+            free(root_dir_buf);
+            free(subdir_buf);
+            status = EREAD_SNAPSHOT_READ_FAILED;
+            goto cleanup;
+        }
+        *root_dir_buf_ptr = root_dir_buf;
+        *n_root_dir_blocks_ptr = header.n_root_dir_blocks;
+        *subdir_buf_ptr = subdir_buf;
+        *n_subdir_blocks_ptr = n_subdir_blocks;
+    }
+
+cleanup:
+    close(fd);
+    return status;
+}
+
+/**
+ * Add delta to the snapshot reference count of every block in use in snapshot_fat
+ */
+void pin_snapshot_blocks(const void *snapshot_fat, int delta)
+{
+    uint32_t n_blocks = get_blocks_in_data_region();
+    for (uint32_t block = 1; block <= n_blocks; block++)
+    {
+        if (fat_entry(snapshot_fat, block) != 0)
+        {
+            // blocks freed in the live volume only become allocatable once no snapshot has them
+            if (get_fat(block) == 0 && (fs.snap_refs[block] == 0) != (fs.snap_refs[block] + delta == 0))
+            {
+                fs.n_free_blocks += delta > 0 ? -1 : 1;
+                fs.largest_free_run_stale = true;
+            }
+            fs.snap_refs[block] += delta;
+        }
+    }
+}
+
+/**
+ * Load the list of snapshots from <fs_name>.snapshots and pin the blocks each of them uses.
+ * A snapshot we can't read fails the mount, since its blocks could otherwise be overwritten.
+ */
+int load_snapshots(void)
+{
+    char *path = sidecar_path(SNAPSHOT_INDEX_SUFFIX);
+    if (path == NULL)
+    {
+        return EMOUNT_MALLOC_FAILED;
+    }
+    int fd = open(path, O_RDONLY);
+    free(path);
+    if (fd == -1)
+    {
+        return 0; // no snapshots have been taken
+    }
+    ssize_t bytes_read = read(fd, fs.snapshots, MAX_SNAPSHOTS * sizeof(snapshot_info));
+    close(fd);
+    if (bytes_read < 0 || bytes_read % sizeof(snapshot_info) != 0)
+    {
+        return EMOUNT_SNAPSHOT_LOAD_FAILED;
+    }
+    fs.n_snapshots = bytes_read / sizeof(snapshot_info);
+
+    void *snapshot_fat = malloc(fs.fat_size);
+    if (snapshot_fat == NULL)
+    {
+        return EMOUNT_MALLOC_FAILED;
+    }
+    int status = 0;
+    for (uint8_t i = 0; i < fs.n_snapshots; i++)
+    {
+        if (read_snapshot(fs.snapshots[i].name, snapshot_fat, NULL, NULL, NULL, NULL) != 0)
+        {
+            status = EMOUNT_SNAPSHOT_LOAD_FAILED;
+            break;
+        }
+        pin_snapshot_blocks(snapshot_fat, 1);
+    }
+    free(snapshot_fat);
+    return status;
+}
+
+/**
+ * Free everything mount_with_flags allocates on top of the mmap'd FAT and the block buffer
+ */
+void free_mount_state(void)
+{
+    free(fs.fs_name);
+    free(fs.extra_refs);
+    free(fs.snap_refs);
+    free(fs.snapshots);
+    free(fs.fragment_blocks);
+    free(fs.block_hashes);
+    dedup_index_free(fs.dedup);
+    name_filter_free(fs.names);
+    close_direct_fd();
+    fs.names = NULL;
+    fs.fragment_blocks = NULL;
+    fs.n_fragment_blocks = 0;
+    fs.fs_name = NULL;
+    fs.extra_refs = NULL;
+    fs.snap_refs = NULL;
+    fs.snapshots = NULL;
+    fs.n_snapshots = 0;
+    fs.block_hashes = NULL;
+    fs.dedup = NULL;
+}
+
+/**
+ * Apply the MOUNT_* hints about how the FAT mapping (the whole image, on a read-only mount)
+ * is used. The madvise hints are only hints, so one the kernel doesn't support (e.g., huge
+ * pages for files outside tmpfs) is skipped. MOUNT_MLOCK is asked for outright though, so
+ * returns false if the mapping couldn't be locked into memory, and true otherwise.
+ */
+bool advise_fat_mapping(void *fat, size_t map_size, int flags)
+{
+    if (flags & MOUNT_HUGEPAGE)
+    {
+        madvise(fat, map_size, MADV_HUGEPAGE);
+    }
+    if (flags & MOUNT_POPULATE)
+    {
+        madvise(fat, map_size, MADV_WILLNEED);
+#ifdef MADV_POPULATE_READ
+        if (flags & MOUNT_HUGEPAGE)
+        {
+            madvise(fat, map_size, MADV_POPULATE_READ); // mmap didn't, see mount_volume
+        }
+#endif
+    }
+    if (flags & MOUNT_RANDOM)
+    {
+        madvise(fat, map_size, MADV_RANDOM);
+    }
+    else if (flags & MOUNT_SEQUENTIAL)
+    {
+        madvise(fat, map_size, MADV_SEQUENTIAL);
+    }
+    return !(flags & MOUNT_MLOCK) || mlock(fat, map_size) == 0;
+}
+
+int mount(char *fs_name)
+{
+    return mount_with_flags(fs_name, 0);
+}
+
+int mount_with_flags(char *fs_name, int flags)
+{
+    return mount_volume("", fs_name, flags);
+}
+
+int mount_volume(const char *volume, char *fs_name, int flags)
+{
+    size_t volume_name_len = strlen(volume);
+    if (volume_name_len >= VOLUME_NAME_SIZE || !check_filename_charset(volume, volume_name_len))
+    {
+        return EMOUNT_BAD_VOLUME_NAME;
+    }
+
+    // the default volume always lives in volumes[0], named ones anywhere after it
+    fat16_fs *slot = NULL;
+    for (int i = 0; i < MAX_VOLUMES; i++)
+    {
+        if (volumes[i].fat != NULL && strcmp(volumes[i].volume_name, volume) == 0)
+        {
+            return EMOUNT_ALREADY_MOUNTED;
+        }
+        if (slot == NULL && volumes[i].fat == NULL && (i == 0) == (volume_name_len == 0))
+        {
+            slot = &volumes[i];
+        }
+    }
+    if (slot == NULL)
+    {
+        return EMOUNT_TOO_MANY_VOLUMES;
+    }
+
+    // state shared by all volumes is set up by the first one
+    bool first_volume = !is_mounted();
+    if (first_volume)
+    {
+        stats = (fs_stats){0};
+    }
+    current_volume = slot;
+
+    // there is nothing to share or pack when nothing is written
+    bool read_only = flags & MOUNT_READ_ONLY;
+    if (read_only)
+    {
+        flags &= ~(MOUNT_DEDUP | MOUNT_PACK | MOUNT_DIRECT);
+    }
+
+    int fs_fd = open(fs_name, read_only ? O_RDONLY : O_RDWR);
+    if (fs_fd == -1)
+    {
+        return EMOUNT_OPEN_FAILED;
+    }
+
+    // compute the fat size. The first entry tells whether the entries are 16 or 32 bits wide,
+    // and every image has at least two of either
+    uint32_t first_entry;
+    if (read(fs_fd, &first_entry, sizeof(first_entry)) != sizeof(first_entry))
+    {
+        return EMOUNT_READ_FAILED;
+    }
+
+    uint16_t blocks_in_fat;
+    uint16_t block_size;
+    bool fat32;
+    if (parse_first_fat_entry(first_entry, &block_size, &blocks_in_fat, &fat32) == -1)
+    {
+        return EMOUNT_BAD_FAT_FIRST_ENTRY;
+    }
+
+    // a read-only mount maps the data region too, so blocks can be read in place (see mapped_block)
+    size_t fat_size = (size_t)blocks_in_fat * block_size;
+    size_t n_fat_entries = fat_size / (fat32 ? sizeof(uint32_t) : sizeof(uint16_t));
+    size_t map_size = fat_size;
+    if (read_only)
+    {
+        struct stat image_stat;
+        if (fstat(fs_fd, &image_stat) != 0 || (size_t)image_stat.st_size < fat_size)
+        {
+            return EMOUNT_READ_FAILED;
+        }
+        map_size = image_stat.st_size;
+    }
+    // huge pages have to be asked for before the pages are faulted in, so then the mapping is
+    // populated after the hint (see advise_fat_mapping) rather than by mmap
+    int map_flags = read_only ? MAP_PRIVATE : MAP_SHARED;
+    if ((flags & MOUNT_POPULATE) && !(flags & MOUNT_HUGEPAGE))
+    {
+        map_flags |= MAP_POPULATE;
+    }
+    void *fat = mmap(NULL, map_size, read_only ? PROT_READ : PROT_READ | PROT_WRITE, map_flags, fs_fd, 0);
+    if (fat == MAP_FAILED)
+    {
+        return EMOUNT_MMAP_FAILED;
+    }
+    if (!advise_fat_mapping(fat, map_size, flags))
+    {
+        munmap(fat, map_size);
+        close(fs_fd);
+        return EMOUNT_MLOCK_FAILED;
+    }
+
+    // aligned so that whole blocks can be read into it with O_DIRECT (see get_block_io)
+    void *block_buf;
+    if (posix_memalign(&block_buf, DIRECT_IO_ALIGN, block_size) != 0)
+    {
+        return EMOUNT_MALLOC_FAILED;
+    }
+
+    fs = (fat16_fs){
+        .fat = fat,
+        .fat_size = fat_size,
+        .fat32 = fat32,
+        .block_size = block_size,
+        .blocks_in_fat = blocks_in_fat,
+        .fd = fs_fd,
+        .block_buf = block_buf,
+        .direct_fd = -1,
+        .direct_buf = NULL,
+        .flags = flags,
+        .image_size = read_only ? map_size : 0,
+        .fs_name = strdup(fs_name),
+        .extra_refs = (uint16_t *)calloc(n_fat_entries, sizeof(uint16_t)),
+        .snap_refs = (uint8_t *)calloc(n_fat_entries, sizeof(uint8_t)),
+        .snapshots = (snapshot_info *)calloc(MAX_SNAPSHOTS, sizeof(snapshot_info)),
+        .n_snapshots = 0,
+        .fragment_blocks = NULL,
+        .n_fragment_blocks = 0,
+        .n_dir_entries = 0,
+        .n_dir_tombstones = 0,
+        .names = NULL,
+        .n_free_blocks = 0,
+        .largest_free_run = 0,
+        .largest_free_run_stale = true,
+        .reclaim_queue_start = 0,
+        .reclaim_queue_len = 0,
+        .block_hashes = NULL,
+        .dedup = NULL};
+    strcpy(fs.volume_name, volume); // checked to fit above
+
+    int status = 0;
+    if (fs.fs_name == NULL || fs.extra_refs == NULL || fs.snap_refs == NULL || fs.snapshots == NULL)
+    {
+        status = EMOUNT_MALLOC_FAILED;
+        goto cleanup;
+    }
+    if (build_extra_refs() != 0 || build_fragment_index() != 0 || count_root_dir_entries() != 0 || build_name_filter() != 0)
+    {
+        status = EMOUNT_READ_FAILED;
+        goto cleanup;
+    }
+    status = load_snapshots();
+    if (status != 0)
+    {
+        goto cleanup;
+    }
+    count_free_blocks();
+    if ((flags & MOUNT_DIRECT) && !open_direct_fd())
+    {
+        status = EMOUNT_DIRECT_UNSUPPORTED;
+        goto cleanup;
+    }
+    if (flags & MOUNT_DEDUP)
+    {
+        status = setup_dedup();
+        if (status != 0)
+        {
+            goto cleanup;
+        }
+    }
+
+    if (!first_volume)
+    {
+        return 0; // the global fd table is shared and already in use
+    }
+
+    // initialize the global fd table with entries for 0, 1, 2
+    // as STDIN, STDOUT, and STDERR
+    // These are special non-closeable files
+    for (int i = 0; i < 3; i++)
+    {
+        global_fd_table[i].ref_count = 1;
+        global_fd_table[i].volume = NULL;
+        global_fd_table[i].ptr_to_dir_entry = NULL;
+        global_fd_table[i].dir_entry_block_num = 0;
+        global_fd_table[i].dir_entry_idx = 0;
+        global_fd_table[i].dir_block = 0;
+        global_fd_table[i].write_locked = 0;
+        global_fd_table[i].offset = 0;
+        global_fd_table[i].dirty = false;
+        global_fd_table[i].direct = false;
+    }
+    global_fd_free_head = GLOBAL_FD_TABLE_ENTRY_NOT_FOUND_SENTINEL;
+    for (int i = GLOBAL_FD_TABLE_SIZE - 1; i >= 3; i--)
+    {
+        global_fd_table[i].next_free = global_fd_free_head;
+        global_fd_free_head = i;
+    }
+
+    return 0;
+
+cleanup:
+    free_mount_state();
+    free(block_buf);
+    munmap(fat, map_size);
+    close(fs_fd);
+    fs = (fat16_fs){0};
+    fs.fd = -1;
+    fs.direct_fd = -1;
+    return status;
+}
+
+int unmount(void)
+{
+    if (!is_mounted())
+    {
+        return EFS_NOT_MOUNTED;
+    }
+
+    int status = 0;
+    for (int i = 0; i < MAX_VOLUMES; i++)
+    {
+        if (volumes[i].fat != NULL)
+        {
+            int volume_status = unmount_volume(volumes[i].volume_name);
+            status = volume_status != 0 ? volume_status : status;
+        }
+    }
+    return status;
+}
+
+int unmount_volume(const char *volume)
+{
+    fat16_fs *target = NULL;
+    for (int i = 0; i < MAX_VOLUMES && target == NULL; i++)
+    {
+        if (volumes[i].fat != NULL && strcmp(volumes[i].volume_name, volume) == 0)
+        {
+            target = &volumes[i];
+        }
+    }
+    if (target == NULL)
+    {
+        return EK_UNKNOWN_VOLUME;
+    }
+
+    // best effort to write back and release the mappings of files on this volume, which also
+    // drops their file references
+    for (int i = 0; i < MAX_MMAPS; i++)
+    {
+        if (mmap_table[i].addr != NULL && global_fd_table[mmap_table[i].fd].volume == target)
+        {
+            k_munmap(mmap_table[i].addr);
+        }
+    }
+
+    // best effort to close all files open on this volume
+    for (int i = 0; i < GLOBAL_FD_TABLE_SIZE; i++)
+    {
+        if (global_fd_table[i].ref_count > 0 && global_fd_table[i].volume == target)
+        {
+            global_fd_table[i].ref_count = 1; // set this
+            k_close(i);
+        }
+    }
+
+    // nothing may be left half freed on disk
+    current_volume = target;
+    reclaim_volume(UINT32_MAX);
+
+    int status = 0;
+    if (fs.dedup != NULL)
+    {
+        // drop hints for blocks freed since they were recorded before persisting them
+        dedup_index_prune(fs.dedup, is_allocated_block);
+        char *path = sidecar_path(DEDUP_SIDECAR_SUFFIX);
+        if (path == NULL || dedup_index_save(fs.dedup, path) != 0)
+        {
+            status = EUNMOUNT_DEDUP_SAVE_FAILED;
+        }
+        free(path);
+    }
+    free_mount_state();
+
+    free(fs.block_buf);
+    if (munmap(fs.fat, fs.image_size != 0 ? fs.image_size : fs.fat_size) == -1)
+    {
+        return EUNMOUNT_MUNMAP_FAILED;
+    }
+    if (close(fs.fd) != 0)
+    {
+        return EUNMOUNT_CLOSE_FAILED;
+    }
+    fs = (fat16_fs){0};
+    fs.fat = NULL; // just to be safe, set the ptr to NULL (in case NULL != 0)
+    fs.block_buf = NULL;
+    fs.fd = -1;
+    fs.direct_fd = -1;
+
+    // every open file on every volume is closed once the last one goes
+    if (!is_mounted())
+    {
+        slab_cache_destroy(&dir_entry_slab);
+        slab_cache_destroy(&block_map_slab);
+    }
+    return status;
+}
+
+char K_FPRINTF_SHORT_BUF[1024];
+
+int k_fprintf_short(int fd, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int status = vsnprintf(K_FPRINTF_SHORT_BUF, sizeof(K_FPRINTF_SHORT_BUF), format, args);
+    va_end(args);
+    if (status < 0) {
+        return E_STR_FORMAT_FAILED;
+    }
+    if (status >= sizeof(K_FPRINTF_SHORT_BUF)) {
+        return E_STR_TOO_LONG_FOR_FPRINTF_BUF;
+    }
+    return k_write(fd, K_FPRINTF_SHORT_BUF, strlen(K_FPRINTF_SHORT_BUF));
+}
+
+/**
+ * Clear a file starting at block. It is expected that block is
+ * the first block in the file. If it is not
+ *
+ * Blocks are reference counted (see fs.extra_refs): once we reach a block that is
+ * also referenced from somewhere else, the rest of the chain is still in use, so
+ * we drop our reference to it and stop.
+ *
+ * Note that this function does not validate that the blocks at each
+ * stage (including the initially passed block) are in bounds. It assumes
+ * the FAT is maintained as valid.
+ */
+void clear_fat_file(uint32_t block)
+{
+    uint32_t budget = UINT32_MAX;
+    clear_fat_blocks(block, &budget);
+}
+
+/**
+ * Like clear_fat_file, but frees at most *budget blocks, subtracting the number freed from *budget.
+ *
+ * Returns the block to carry on from, or FAT_END_OF_FILE once all of the chain is released.
+ */
+uint32_t clear_fat_blocks(uint32_t block, uint32_t *budget)
+{
+    while (block != FAT_END_OF_FILE && *budget > 0)
+    {
+        if (fs.extra_refs[block] > 0)
+        {
+            fs.extra_refs[block] -= 1;
+            return FAT_END_OF_FILE;
+        }
+        uint32_t next_block = get_fat(block);
+        set_fat(block, 0);
+        if (fs.block_hashes != NULL)
+        {
+            fs.block_hashes[block] = 0;
+        }
+        *budget -= 1;
+        block = next_block;
+    }
+    return block;
+}
+
+/**
+ * Free the chain of a file of size bytes that starts at first_block, once the file no longer refers to it.
+ *
+ * Long chains are queued for the background reclaimer when there is one (see k_reclaim_async),
+ * so that deleting a large file doesn't walk its whole chain on the caller's time. Everything
+ * else, including chains that don't fit in the queue, is freed right away.
+ */
+void free_file_blocks(uint32_t first_block, uint64_t size)
+{
+    uint32_t n_blocks = (size + fs.block_size - 1) / fs.block_size;
+    if (reclaim_async && n_blocks > RECLAIM_SYNC_MAX_BLOCKS && fs.reclaim_queue_len < RECLAIM_QUEUE_SIZE)
+    {
+        fs.reclaim_queue[(fs.reclaim_queue_start + fs.reclaim_queue_len) % RECLAIM_QUEUE_SIZE] = first_block;
+        fs.reclaim_queue_len += 1;
+        stats.reclaim_queued += 1;
+        return;
+    }
+    clear_fat_file(first_block);
+}
+
+/**
+ * Whether block can be allocated: it is free in the FAT and not part of a snapshot
+ */
+bool is_free_block(uint32_t block)
+{
+    stats.alloc_scan_blocks += 1;
+    return get_fat(block) == 0 && fs.snap_refs[block] == 0;
+}
+
+/**
+ * Finds the first empty block by walking the fat from index 1. Returns the
+ * block index if such a block exists and 0 if there is no empty block
+ */
+uint32_t first_empty_block(void)
+{
+    stats.alloc_scans += 1;
+    // look for the first empty block in the fat
+    uint32_t n_blocks = get_blocks_in_data_region();
+    for (uint32_t i = 1; i <= n_blocks; i++)
+    {
+        if (is_free_block(i))
+        {
+            return i;
+        }
+    }
+    // the space may only be waiting for the reclaimer, in which case we free it ourselves
+    if (fs.reclaim_queue_len > 0)
+    {
+        reclaim_volume(UINT32_MAX);
+        return first_empty_block();
+    }
+    return 0;
+}
+
+/**
+ * Whether the provided string fits thei POSIX filename charset
+ */
+bool check_filename_charset(const char *str, uint8_t strlen)
+{
+    for (uint8_t i = 0; i < strlen; i++)
+    {
+        if (
+            !(
+                ('a' <= str[i] && str[i] <= 'z') ||
+                ('A' <= str[i] && str[i] <= 'Z') ||
+                ('0' <= str[i] && str[i] <= '9') ||
+                str[i] == '.' ||
+                str[i] == '_' ||
+                str[i] == '-'))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+uint32_t get_blocks_in_data_region(void)
+{
+    // block 0xFFFF of a fat16 image can't be used since its number is the end of file marker
+    if (fs.fat32)
+    {
+        return fs.fat_size / sizeof(uint32_t) - 1;
+    }
+    uint32_t n_blocks = ((fs.fat_size) / 2) - 1;
+    return n_blocks < FAT16_END_OF_FILE ? n_blocks : FAT16_END_OF_FILE - 1;
+}
+
+off_t get_byte_offset_of_block(uint32_t block_num)
+{
+    return fs.fat_size + ((off_t)block_num - 1) * fs.block_size;
+}
+
+#define EGET_BLOCK_BLOCK_NUM_0 1
+#define EGET_BLOCK_BLOCK_NUM_TOO_HIGH 2
+#define EGET_BLOCK_LSEEK_FAILED 4
+#define EGET_BLOCK_READ_FAILED 5
+#define EGET_BLOCK_TOO_FEW_BYTES_READ 6
+
+/**
+ * In a read-only mount, where the whole image is mapped, returns where the block is in the
+ * mapping. Reading it there needs neither fs.block_buf nor the file offset of fs.fd, so
+ * threads can do it at the same time. Returns NULL when the image isn't mapped (any other
+ * mount) or doesn't hold the block.
+ */
+const void *mapped_block(uint32_t block_num)
+{
+    if (fs.image_size == 0 || block_num < 1 || block_num > get_blocks_in_data_region())
+    {
+        return NULL;
+    }
+    size_t byte_offset = get_byte_offset_of_block(block_num);
+    if (byte_offset + fs.block_size > fs.image_size)
+    {
+        return NULL;
+    }
+    return (const char *)fs.fat + byte_offset;
+}
+
+/**
+ * Whether data can be handed to O_DIRECT reads and writes as it is
+ */
+bool is_direct_io_aligned(const void *data)
+{
+    return (uintptr_t)data % DIRECT_IO_ALIGN == 0;
+}
+
+/**
+ * Open fs.direct_fd and its bounce buffer, if they aren't already. Returns false if
+ * O_DIRECT can't be used on this volume: the host filesystem refuses it or the blocks
+ * are smaller than the host's sectors.
+ */
+bool open_direct_fd(void)
+{
+    if (fs.direct_fd >= 0)
+    {
+        return true;
+    }
+    if (fs.block_size < DIRECT_IO_MIN_BLOCK_SIZE || posix_memalign(&fs.direct_buf, DIRECT_IO_ALIGN, fs.block_size) != 0)
+    {
+        fs.direct_buf = NULL;
+        return false;
+    }
+    fs.direct_fd = open(fs.fs_name, O_RDWR | O_DIRECT);
+    if (fs.direct_fd == -1)
+    {
+        free(fs.direct_buf);
+        fs.direct_buf = NULL;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Close fs.direct_fd and free its bounce buffer, if they were opened
+ */
+void close_direct_fd(void)
+{
+    if (fs.direct_fd >= 0)
+    {
+        close(fs.direct_fd);
+    }
+    free(fs.direct_buf);
+    fs.direct_fd = -1;
+    fs.direct_buf = NULL;
+}
+
+/**
+ * Get the data inside of a block and store it into the buffer pointed to
+ * by data. It is assumed that the memory pointed to by data has sufficient
+ * capacity to store a full block (fs.block_size).
+ *
+ * Returns 0 on success and an error code on error. See the EGET_BLOCK_* error code.
+ */
+int get_block(uint32_t block_num, void *data)
+{
+    return get_block_io(block_num, data, false);
+}
+
+/**
+ * get_block, but with direct true the block is read through fs.direct_fd (which must be
+ * open), skipping the host page cache. Unaligned buffers are filled through fs.direct_buf.
+ */
+int get_block_io(uint32_t block_num, void *data, bool direct)
+{
+    uint32_t blocks_in_data_region = get_blocks_in_data_region();
+    if (block_num < 1)
+    {
+        return EGET_BLOCK_BLOCK_NUM_0;
+    }
+
+    if (block_num > blocks_in_data_region)
+    {
+        return EGET_BLOCK_BLOCK_NUM_TOO_HIGH;
+    }
+
+    if (fs.image_size != 0)
+    {
+        const void *mapped = mapped_block(block_num);
+        if (mapped == NULL)
+        {
+            return EGET_BLOCK_TOO_FEW_BYTES_READ;
+        }
+        memcpy(data, mapped, fs.block_size);
+    }
+    else if (direct)
+    {
+        void *io_buf = is_direct_io_aligned(data) ? data : fs.direct_buf;
+        ssize_t bytes_read = pread(fs.direct_fd, io_buf, fs.block_size, get_byte_offset_of_block(block_num));
+        if (bytes_read == -1)
+        {
+            return EGET_BLOCK_READ_FAILED;
+        }
+
+        if (bytes_read < fs.block_size)
+        {
+            return EGET_BLOCK_TOO_FEW_BYTES_READ;
+        }
+
+        if (io_buf != data)
+        {
+            memcpy(data, io_buf, fs.block_size);
+        }
+    }
+    else
+    {
+        if (lseek(fs.fd, get_byte_offset_of_block(block_num), SEEK_SET) < 0)
+        {
+            return EGET_BLOCK_LSEEK_FAILED;
+        }
+
+        ssize_t bytes_read = read(fs.fd, data, fs.block_size);
+        if (bytes_read == -1)
+        {
+            return EGET_BLOCK_READ_FAILED;
+        }
+
+        if (bytes_read < fs.block_size)
+        {
+            return EGET_BLOCK_TOO_FEW_BYTES_READ;
+        }
+    }
+
+    stats.get_block_calls += 1;
+    stats.get_block_bytes += fs.block_size;
+    return 0;
+}
+
+#define ENEXT_BLOCK_NUM_BLOCK_NUM_0 1
+#define ENEXT_BLOCK_NUM_BLOCK_NUM_TOO_HIGH 2
+// TODO: add a return condition for already being at the end file
+
+/**
+ * Get the next block number from the FAT table.
+ */
+int next_block_num(uint32_t block_num, uint32_t *next_block_num)
+{
+    uint32_t blocks_in_data_region = get_blocks_in_data_region();
+    if (block_num < 1)
+    {
+        return ENEXT_BLOCK_NUM_BLOCK_NUM_0;
+    }
+
+    if (block_num > blocks_in_data_region)
+    {
+        return ENEXT_BLOCK_NUM_BLOCK_NUM_TOO_HIGH;
+    }
+    stats.chain_hops += 1;
+    *next_block_num = get_fat(block_num);
+    return 0;
+}
+
+#define EWRITE_BLOCK_BLOCK_NUM_0 1
+#define EWRITE_BLOCK_BLOCK_NUM_TOO_HIGH 2
+#define EWRITE_BLOCK_LSEEK_FAILED 4
+#define EWRITE_BLOCK_WRITE_FAILED 5
+#define EWRITE_BLOCK_TOO_FEW_BYTES_WRITTEN 6
+
+/**
+ * A thin wrapper around wrapper that makes it easier to write exactly 1 block of data
+ */
+int write_block(uint32_t block_num, void *data)
+{
+    return write_block_io(block_num, data, false);
+}
+
+/**
+ * write_block, but with direct true the block is written through fs.direct_fd (which must
+ * be open), skipping the host page cache. Unaligned buffers are copied to fs.direct_buf first.
+ */
+int write_block_io(uint32_t block_num, const void *data, bool direct)
+{
+    uint32_t blocks_in_data_region = get_blocks_in_data_region();
+    if (block_num < 1)
+    {
+        return EWRITE_BLOCK_BLOCK_NUM_0;
+    }
+
+    if (block_num > blocks_in_data_region)
+    {
+        return EWRITE_BLOCK_BLOCK_NUM_TOO_HIGH;
+    }
+
+    ssize_t bytes_written;
+    if (direct)
+    {
+        const void *io_buf = data;
+        if (!is_direct_io_aligned(data))
+        {
+            memcpy(fs.direct_buf, data, fs.block_size);
+            io_buf = fs.direct_buf;
+        }
+        bytes_written = pwrite(fs.direct_fd, io_buf, fs.block_size, get_byte_offset_of_block(block_num));
+    }
+    else
+    {
+        if (lseek(fs.fd, get_byte_offset_of_block(block_num), SEEK_SET) < 0)
+        {
+            return EWRITE_BLOCK_LSEEK_FAILED;
+        }
+        bytes_written = write(fs.fd, data, fs.block_size);
+    }
+    if (bytes_written == -1)
+    {
+        return EWRITE_BLOCK_WRITE_FAILED;
+    }
+
+    if (bytes_written < fs.block_size)
+    {
+        return EWRITE_BLOCK_TOO_FEW_BYTES_WRITTEN;
+    }
+
+    if (fs.block_hashes != NULL)
+    {
+        fs.block_hashes[block_num] = dedup_hash_block(data, fs.block_size);
+    }
+
+    stats.write_block_calls += 1;
+    stats.write_block_bytes += fs.block_size;
+    return 0;
+}
+
+/**
+ * Release the memory of the block map of fd_entry, which is then empty
+ */
+void free_block_map(global_fd_entry *fd_entry)
+{
+    if (fd_entry->block_map_capacity == BLOCK_MAP_INITIAL_CAPACITY)
+    {
+        slab_free(&block_map_slab, fd_entry->block_map);
+    }
+    else
+    {
+        free(fd_entry->block_map);
+    }
+    fd_entry->block_map = NULL;
+    fd_entry->block_map_len = 0;
+    fd_entry->block_map_capacity = 0;
+}
+
+/**
+ * Returns the idx-th block of the open file fd_entry, or FAT_END_OF_FILE if it has fewer blocks.
+ *
+ * fd_entry->block_map caches the chain as an array. It is only extended as far as a lookup
+ * needs, by walking on from the last block it knows, so a file is walked at most once no
+ * matter how it is accessed and a block already in the map costs no FAT hops at all.
+ */
+uint32_t file_block(global_fd_entry *fd_entry, uint32_t idx)
+{
+    if (idx < fd_entry->block_map_len)
+    {
+        return fd_entry->block_map[idx];
+    }
+
+    uint32_t block = fd_entry->block_map_len == 0 ? dir_entry_first_block(fd_entry->ptr_to_dir_entry) : get_fat(fd_entry->block_map[fd_entry->block_map_len - 1]);
+    if (block == 0)
+    {
+        return FAT_END_OF_FILE; // empty file
+    }
+    while (fd_entry->block_map_len <= idx && block != FAT_END_OF_FILE)
+    {
+        if (fd_entry->block_map_len == fd_entry->block_map_capacity)
+        {
+            uint32_t new_capacity = fd_entry->block_map_capacity == 0 ? BLOCK_MAP_INITIAL_CAPACITY : fd_entry->block_map_capacity * 2;
+            uint32_t *new_map = fd_entry->block_map_capacity == 0 ? (uint32_t *)slab_alloc(&block_map_slab) : (uint32_t *)malloc(new_capacity * sizeof(uint32_t));
+            if (new_map == NULL)
+            {
+                // the map is only a cache, so just walk the rest of the way
+                return nth_block(block, idx - fd_entry->block_map_len);
+            }
+            uint32_t len = fd_entry->block_map_len;
+            if (fd_entry->block_map_capacity != 0)
+            {
+                memcpy(new_map, fd_entry->block_map, len * sizeof(uint32_t));
+                free_block_map(fd_entry);
+            }
+            fd_entry->block_map = new_map;
+            fd_entry->block_map_len = len;
+            fd_entry->block_map_capacity = new_capacity;
+        }
+        fd_entry->block_map[fd_entry->block_map_len] = block;
+        fd_entry->block_map_len += 1;
+        stats.chain_hops += 1;
+        block = get_fat(block);
+    }
+    return idx < fd_entry->block_map_len ? fd_entry->block_map[idx] : FAT_END_OF_FILE;
+}
+
+/**
+ * Extend the block map of fd_entry to the end of its chain. Returns whether it got there,
+ * which it only fails to do when growing the map fails
+ */
+bool map_whole_file(global_fd_entry *fd_entry)
+{
+    file_block(fd_entry, UINT32_MAX);
+    if (fd_entry->block_map_len == 0)
+    {
+        return dir_entry_first_block(fd_entry->ptr_to_dir_entry) == 0;
+    }
+    return get_fat(fd_entry->block_map[fd_entry->block_map_len - 1]) == FAT_END_OF_FILE;
+}
+
+/**
+ * Forget the block map of fd_entry from index idx on, because that part of the chain changed
+ */
+void truncate_block_map(global_fd_entry *fd_entry, uint32_t idx)
+{
+    if (idx < fd_entry->block_map_len)
+    {
+        fd_entry->block_map_len = idx;
+    }
+}
+
+#define EUNSHARE_FILE_BLOCKS_NO_EMPTY_BLOCKS 1
+#define EUNSHARE_FILE_BLOCKS_GET_BLOCK_FAILED 2
+#define EUNSHARE_FILE_BLOCKS_WRITE_BLOCK_FAILED 3
+
+/**
+ * Copy-on-write: make the blocks at indices 0..last_idx of the file exclusively owned by it.
+ *
+ * Once we hit a block with extra references (or one that is part of a snapshot), everything
+ * after it in the chain is reachable from elsewhere as well. So we copy from there up to last_idx into
+ * freshly allocated blocks, splice the copies onto the (still shared) rest of the
+ * chain and drop our reference to the old blocks. Nothing is changed on failure.
+ *
+ * The caller is responsible for writing the directory entry through, since its
+ * first_block may have changed. The block map of the file is cut back to the first copied block.
+ *
+ * Returns 0 on success and an EUNSHARE_FILE_BLOCKS_* error code on error.
+ */
+int unshare_file_blocks(global_fd_entry *fd_entry, uint32_t last_idx)
+{
+    directory_entry *ptr_to_dir_entry = fd_entry->ptr_to_dir_entry;
+    uint32_t prev_block = 0; // 0 means the directory entry points at block
+    uint32_t block = dir_entry_first_block(ptr_to_dir_entry);
+    uint32_t idx = 0;
+    while (block != FAT_END_OF_FILE && idx <= last_idx && fs.extra_refs[block] == 0 && fs.snap_refs[block] == 0)
+    {
+        prev_block = block;
+        block = get_fat(block);
+        idx += 1;
+    }
+    if (block == FAT_END_OF_FILE || idx > last_idx)
+    {
+        return 0;
+    }
+
+    // copy the run. We keep going past last_idx if the next block can't take another
+    // reference, which only happens with absurd numbers of copies
+    uint32_t shared_head = block;
+    uint32_t shared_idx = idx;
+    uint32_t new_head = 0;
+    uint32_t new_tail = 0;
+    int status = 0;
+    while (block != FAT_END_OF_FILE && (idx <= last_idx || fs.extra_refs[block] == UINT16_MAX))
+    {
+        uint32_t new_block = first_empty_block();
+        if (new_block == 0)
+        {
+            status = EUNSHARE_FILE_BLOCKS_NO_EMPTY_BLOCKS;
+            goto rollback;
+        }
+        set_fat(new_block, FAT_END_OF_FILE); // reserve it
+        if (new_tail == 0)
+        {
+            new_head = new_block;
+        }
+        else
+        {
+            set_fat(new_tail, new_block);
+        }
+        new_tail = new_block;
+
+        if (get_block(block, fs.block_buf) != 0)
+        {
+            status = EUNSHARE_FILE_BLOCKS_GET_BLOCK_FAILED;
+            goto rollback;
+        }
+        if (write_block(new_block, fs.block_buf) != 0)
+        {
+            status = EUNSHARE_FILE_BLOCKS_WRITE_BLOCK_FAILED;
+            goto rollback;
+        }
+        block = get_fat(block);
+        idx += 1;
+    }
+
+    // block is now the first block we did not copy, which the copied run shares
+    set_fat(new_tail, block);
+    if (block != FAT_END_OF_FILE)
+    {
+        fs.extra_refs[block] += 1;
+    }
+    if (prev_block == 0)
+    {
+        set_dir_entry_first_block(ptr_to_dir_entry, new_head);
+    }
+    else
+    {
+        set_fat(prev_block, new_head);
+    }
+    clear_fat_file(shared_head);
+    truncate_block_map(fd_entry, shared_idx);
+    return 0;
+
+rollback:
+    if (new_head != 0)
+    {
+        clear_fat_file(new_head);
+    }
+    return status;
+}
+
+#define EFIND_FILE_IN_ROOT_DIR_GET_BLOCK_FAILED -1
+#define EFIND_FILE_IN_ROOT_DIR_NEXT_BLOCK_FAILED -2
+#define RFIND_FILE_IN_ROOT_DIR_FILE_NOT_FOUND 1
+#define RFIND_FILE_IN_ROOT_DIR_FILE_FOUND 0
+#define RFIND_FILE_IN_ROOT_DIR_FILE_DELETED 2
+
+/**
+ * Find the file with name fname in the root directory of the filesystem. If it is found,
+ * mallocs new directory_entry and returns a pointer to it via the ptr_to_dir_entry_buf
+ *
+ * Returns >= 0 on success (see RFIND_FILE_IN_ROOT_DIR_* return codes) and < 0 on error (see EFIND_FILE_IN_ROOT_DIR_* error codes)
+ */
+int find_file_in_root_dir(const char *fname, directory_entry *ptr_to_dir_entry, uint32_t *ptr_to_block, uint8_t *ptr_to_dir_entry_idx)
+{
+    uint32_t block = 1;
+    // n_dir_entry_per_block is at most 4096 / 64 = 64
+    uint8_t n_dir_entry_per_block = fs.block_size / sizeof(directory_entry);
+
+    // lookups in a read-only mount may run on several threads at once, so they must not write
+    // anything shared: not the stats, and not fs.block_buf (blocks are read in place instead)
+    bool read_only = is_read_only();
+    if (!read_only)
+    {
+        stats.dir_lookups += 1;
+    }
+    if (fs.names != NULL && name_filter_is_full(fs.names) && build_name_filter() != 0)
+    {
+        return EFIND_FILE_IN_ROOT_DIR_GET_BLOCK_FAILED;
+    }
+    if (fs.names != NULL && !name_filter_may_contain(fs.names, fname))
+    {
+        if (!read_only)
+        {
+            stats.name_filter_skips += 1;
+        }
+        return RFIND_FILE_IN_ROOT_DIR_FILE_NOT_FOUND;
+    }
+
+    while (true)
+    {
+        const directory_entry *dir_entry_buf = mapped_block(block);
+        if (dir_entry_buf == NULL)
+        {
+            if (read_only || get_block(block, fs.block_buf) != 0)
+            {
+                return EFIND_FILE_IN_ROOT_DIR_GET_BLOCK_FAILED;
+            }
+            dir_entry_buf = fs.block_buf;
+        }
+        if (!read_only)
+        {
+            stats.dir_block_reads += 1;
+        }
+
+        for (uint8_t i = 0; i < n_dir_entry_per_block; i++)
+        {
+            directory_entry curr_dir_entry = dir_entry_buf[i];
+            if (curr_dir_entry.name[0] == 0)
+            {
+                if (!read_only)
+                {
+                    stats.name_filter_fps += fs.names != NULL;
+                }
+                return RFIND_FILE_IN_ROOT_DIR_FILE_NOT_FOUND;
+            }
+
+            // use strcmp because both fname and the directory entries in the fat should
+            // have been checked for proper null termination
+            if (strcmp(fname, curr_dir_entry.name) == 0)
+            {
+                // memcpy into the passed buffer so we're not
+                // pointing to the fs.block_buf, which could
+                // change
+                memcpy(ptr_to_dir_entry, dir_entry_buf + i, sizeof(directory_entry));
+                *ptr_to_block = block;
+                *ptr_to_dir_entry_idx = i;
+
+                // TODO: the below should never happen
+                if (curr_dir_entry.name[0] == 1 || curr_dir_entry.name[0] == 2)
+                {
+                    return RFIND_FILE_IN_ROOT_DIR_FILE_DELETED;
+                }
+                return RFIND_FILE_IN_ROOT_DIR_FILE_FOUND;
+            }
+        }
+
+        if (read_only)
+        {
+            block = get_fat(block); // mapped_block checked it is in range. next_block_num would count the hop
+        }
+        else if (next_block_num(block, &block) != 0)
+        {
+            return EFIND_FILE_IN_ROOT_DIR_GET_BLOCK_FAILED;
+        }
+    };
+}
+
+#define RFIND_FILE_IN_GLOBAL_FD_TABLE_NOT_FOUND 1
+
+/**
+ * Looks for a file in the global file table matching fname in the directory starting at dir_block, returning 0 and
+ * setting the memory address at ptr_to_fd_idx to the index in the file table if found
+ * and returning RFIND_FILE_IN_GLOBAL_FD_TABLE_NOT_FOUND (1) if not found.
+ *
+ * Note that this function skips files that have 0,1 or 2 as the first byte of their name
+ * because these entries are not valid entries (in fact, they've have their name mangled, so
+ * they should not match any but an adversarial fname). It also skips files with a ref_count of 0
+ * and files on volumes other than the current one
+ */
+int find_file_in_global_fd_table(uint32_t dir_block, const char *fname, uint16_t *ptr_to_fd_idx)
+{
+    // Skip the first 3 entries because they are special
+    for (uint16_t i = 3; i < GLOBAL_FD_TABLE_SIZE; i++)
+    {
+        // use strcmp because both fname and the directory entries in the fat/global fd table should
+        // have been checked for proper null termination
+        if (
+            global_fd_table[i].ref_count == 0 || global_fd_table[i].volume != current_volume ||
+            global_fd_table[i].dir_block != dir_block || global_fd_table[i].ptr_to_dir_entry->name[0] < 3)
+            continue;
+        if (strcmp(global_fd_table[i].ptr_to_dir_entry->name, fname) == 0)
+        {
+            *ptr_to_fd_idx = i;
+            return 0;
+        }
+    }
+    return RFIND_FILE_IN_GLOBAL_FD_TABLE_NOT_FOUND;
+}
+
+#define EFIND_EMPTY_SPOT_IN_ROOT_DIR_GET_BLOCK_FAILED -1
+#define EFIND_EMPTY_SPOT_IN_ROOT_DIR_NEXT_BLOCK_FAILED -2
+#define RFIND_EMPTY_SPOT_IN_ROOT_DIR_DELETED 0
+#define RFIND_EMPTY_SPOT_IN_ROOT_DIR_END_ENTRY 1
+
+int find_empty_spot_in_root_dir(uint32_t *ptr_to_block, uint8_t *ptr_to_offset)
+{
+    uint32_t block = 1;
+    directory_entry *dir_entry_buf = fs.block_buf;
+    uint8_t n_dir_entry_per_block = fs.block_size / sizeof(directory_entry);
+    stats.dir_lookups += 1;
+    while (true)
+    {
+        if (get_block(block, dir_entry_buf) != 0)
+        {
+            return EFIND_EMPTY_SPOT_IN_ROOT_DIR_GET_BLOCK_FAILED;
+        }
+        stats.dir_block_reads += 1;
+
+        // n_dir_entry_per_block is at most 4096 / 64 = 64
+        for (uint8_t i = 0; i < n_dir_entry_per_block; i++)
+        {
+            directory_entry curr_dir_entry = dir_entry_buf[i];
+            if (curr_dir_entry.name[0] > 1)
+            { // in use, including by files that are deleted but still open (which write their entry back at close)
+                continue;
+            }
+
+            *ptr_to_block = block;
+            *ptr_to_offset = i;
+            if (curr_dir_entry.name[0] == 0)
+            {
+                return RFIND_EMPTY_SPOT_IN_ROOT_DIR_END_ENTRY;
+            }
+            if (curr_dir_entry.name[0] == 1)
+            {
+                return RFIND_EMPTY_SPOT_IN_ROOT_DIR_DELETED;
+            }
+        }
+
+        if (next_block_num(block, &block) != 0)
+        {
+            return EFIND_EMPTY_SPOT_IN_ROOT_DIR_NEXT_BLOCK_FAILED;
+        }
+    };
+}
+
+#define EWRITE_ROOT_DIR_ENTRY_GET_BLOCK_FAILED 1
+#define EWRITE_ROOT_DIR_ENTRY_NO_EMPTY_BLOCKS 2
+#define EWRITE_ROOT_DIR_ENTRY_WRITE_BLOCK_FAILED 3
+
+int write_root_dir_entry(directory_entry *ptr_to_dir_entry, uint32_t block, uint8_t directory_entry_offset)
+{
+    directory_entry *dir_entry_buf = (directory_entry *)fs.block_buf;
+    if (get_block(block, dir_entry_buf) != 0)
+    {
+        return EWRITE_ROOT_DIR_ENTRY_GET_BLOCK_FAILED;
+    }
+
+    // the last entry of the end_block can now store our dir_entry (replacing the directory_entry that represents
+    // end of directory)
+    dir_entry_buf[directory_entry_offset] = *ptr_to_dir_entry;
+
+    // write the block
+    if (write_block(block, dir_entry_buf) != 0)
+    {
+        return EWRITE_ROOT_DIR_ENTRY_WRITE_BLOCK_FAILED;
+    }
+    return 0;
+}
+
+#define EWRITE_NEW_ROOT_DIR_ENTRY_FIND_EMPTY_SPOT_IN_ROOT_DIR_FAILED 1
+#define EWRITE_NEW_ROOT_DIR_ENTRY_WRITE_ROOT_DIR_ENTRY_FAILED 2
+
+int write_new_root_dir_entry(directory_entry *ptr_to_dir_entry, uint32_t *ptr_to_block, uint8_t *ptr_to_dir_entry_idx)
+{
+    // look for an empty spot in the root directory
+    uint32_t block;                 // the block where we found an empty spot
+    uint8_t directory_entry_offset; // the offset (in terms of directory_entry entries) where we found the empty spot
+
+    int find_empty_spot_status = find_empty_spot_in_root_dir(&block, &directory_entry_offset);
+    if (find_empty_spot_status < 0)
+    {
+        return EWRITE_NEW_ROOT_DIR_ENTRY_FIND_EMPTY_SPOT_IN_ROOT_DIR_FAILED;
+    }
+
+    bool is_last_in_block = directory_entry_offset == (fs.block_size / sizeof(directory_entry) - 1);
+    if (find_empty_spot_status == RFIND_EMPTY_SPOT_IN_ROOT_DIR_END_ENTRY && !is_last_in_block)
+    {
+        // case where we need to create an entry for the end of the block
+        directory_entry empty_dir_entry = {0};
+        write_root_dir_entry(&empty_dir_entry, block, directory_entry_offset + 1);
+    }
+    else if (find_empty_spot_status == RFIND_EMPTY_SPOT_IN_ROOT_DIR_END_ENTRY && is_last_in_block)
+    {
+        // case where we need to allocate a new block for the directory
+
+        uint32_t empty_block = first_empty_block();
+        if (empty_block == 0)
+        {
+            return EWRITE_ROOT_DIR_ENTRY_NO_EMPTY_BLOCKS;
+        }
+
+        // zero out the new block
+        // this makes the first directory_entry in the new block
+        // the end directory entry
+        memset(fs.block_buf, 0, fs.block_size);
+        if (write_block(empty_block, fs.block_buf) != 0)
+        {
+            return EWRITE_ROOT_DIR_ENTRY_WRITE_BLOCK_FAILED;
+        }
+
+        // add the new block to the FAT
+        set_fat(block, empty_block);
+        set_fat(empty_block, FAT_END_OF_FILE);
+    }
+
+    if (write_root_dir_entry(ptr_to_dir_entry, block, directory_entry_offset) != 0)
+    {
+        return EWRITE_NEW_ROOT_DIR_ENTRY_WRITE_ROOT_DIR_ENTRY_FAILED;
+    }
+    if (fs.names != NULL)
+    {
+        name_filter_add(fs.names, ptr_to_dir_entry->name);
+    }
+    if (find_empty_spot_status == RFIND_EMPTY_SPOT_IN_ROOT_DIR_END_ENTRY)
+    {
+        fs.n_dir_entries += 1;
+    }
+    else
+    {
+        fs.n_dir_tombstones -= 1;
+    }
+    *ptr_to_block = block;
+    *ptr_to_dir_entry_idx = directory_entry_offset;
+    return 0;
+}
+
+/**
+ * Compact the root directory (see k_compact_root_dir) if at least half of it is deleted
+ * entries and there are at least a block's worth of them. This is best effort, since the
+ * directory is still valid, if slower to search, when it isn't compacted.
+ */
+void maybe_compact_root_dir(void)
+{
+    uint32_t n_dir_entry_per_block = fs.block_size / sizeof(directory_entry);
+    if (fs.n_dir_tombstones >= n_dir_entry_per_block && fs.n_dir_tombstones * 2 >= fs.n_dir_entries)
+    {
+        compact_root_dir();
+    }
+}
+
+/**
+ * Returns an unused entry of the global fd table, or GLOBAL_FD_TABLE_ENTRY_NOT_FOUND_SENTINEL
+ * if it is full. The entry stays on the free list until its ref_count is first incremented
+ * (see k_open), so it is fine to give up on it before then.
+ */
+uint16_t find_empty_fd()
+{
+    return global_fd_free_head;
+}
+
+bool is_valid_filename(const char *fname)
+{
+    uint8_t strlen = strnlen(fname, MAX_FILENAME_SIZE);
+    if (strlen < 1)
+    {
+        return false;
+    }
+    if (fname[strlen] != '\0')
+    {
+        // the string must be longer than MAX_FILENAME_SIZE
+        return false;
+    }
+    if (!check_filename_charset(fname, strlen))
+    {
+        return false;
+    }
+    // these name the current and parent directory in paths (see join_path)
+    if (strcmp(fname, ".") == 0 || strcmp(fname, "..") == 0)
+    {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Whether every component of path (separated by '/', with empty components ignored)
+ * is a valid filename and there is at least one
+ */
+bool is_valid_path(const char *path)
+{
+    bool has_component = false;
+    while (*path != '\0')
+    {
+        size_t len = strcspn(path, "/");
+        if (len > 0)
+        {
+            char component[MAX_FILENAME_SIZE + 1];
+            if (len > MAX_FILENAME_SIZE)
+            {
+                return false;
+            }
+            memcpy(component, path, len);
+            component[len] = '\0';
+            if (!is_valid_filename(component))
+            {
+                return false;
+            }
+            has_component = true;
+        }
+        path += len;
+        path += *path == '/';
+    }
+    return has_component;
+}
+
+/**
+ * Record that an entry of the directory starting at dir_block was deleted. Only the root
+ * directory keeps count of its tombstones (see maybe_compact_root_dir), since a subdirectory
+ * reuses a free slot of the right bucket whenever it needs one.
+ */
+void note_deleted_entry(uint32_t dir_block)
+{
+    if (dir_block == 1)
+    {
+        fs.n_dir_tombstones += 1;
+        maybe_compact_root_dir();
+    }
+}
+
+/**
+ * Returns the bucket of dir (a subdirectory) that fname belongs in. The buckets are found
+ * by following the FAT, which is in memory, so no directory block is read on the way.
+ */
+uint32_t dir_bucket(const dir_ref *dir, const char *fname)
+{
+    uint32_t idx = name_hash(fname) & (dir->n_buckets - 1);
+    uint32_t block = dir->first_block;
+    for (uint32_t i = 0; i < idx && block != FAT_END_OF_FILE; i++)
+    {
+        block = get_fat(block);
+    }
+    // as in find_file_in_root_dir, a read-only mount doesn't touch the stats
+    if (!is_read_only())
+    {
+        stats.chain_hops += idx;
+    }
+    return block;
+}
+
+/**
+ * Like find_file_in_root_dir, but for a subdirectory, where only the bucket of fname is read
+ */
+int find_file_in_subdir(const dir_ref *dir, const char *fname, directory_entry *ptr_to_dir_entry, uint32_t *ptr_to_block, uint8_t *ptr_to_dir_entry_idx)
+{
+    uint8_t n_dir_entry_per_block = fs.block_size / sizeof(directory_entry);
+    bool read_only = is_read_only();
+    uint32_t block = dir_bucket(dir, fname);
+    const directory_entry *dir_entry_buf = mapped_block(block);
+    if (dir_entry_buf == NULL)
+    {
+        if (read_only || get_block(block, fs.block_buf) != 0)
+        {
+            return EFIND_FILE_IN_ROOT_DIR_GET_BLOCK_FAILED;
+        }
+        dir_entry_buf = fs.block_buf;
+    }
+    if (!read_only)
+    {
+        stats.dir_lookups += 1;
+        stats.dir_block_reads += 1;
+    }
+
+    for (uint8_t i = 0; i < n_dir_entry_per_block; i++)
+    {
+        if (dir_entry_buf[i].name[0] > 2 && strcmp(fname, dir_entry_buf[i].name) == 0)
+        {
+            memcpy(ptr_to_dir_entry, dir_entry_buf + i, sizeof(directory_entry));
+            *ptr_to_block = block;
+            *ptr_to_dir_entry_idx = i;
+            return RFIND_FILE_IN_ROOT_DIR_FILE_FOUND;
+        }
+    }
+    return RFIND_FILE_IN_ROOT_DIR_FILE_NOT_FOUND;
+}
+
+/**
+ * Find the file with name fname in dir, with the same return codes as find_file_in_root_dir
+ */
+int find_file_in_dir(const dir_ref *dir, const char *fname, directory_entry *ptr_to_dir_entry, uint32_t *ptr_to_block, uint8_t *ptr_to_dir_entry_idx)
+{
+    if (dir->n_buckets == 0)
+    {
+        return find_file_in_root_dir(fname, ptr_to_dir_entry, ptr_to_block, ptr_to_dir_entry_idx);
+    }
+    return find_file_in_subdir(dir, fname, ptr_to_dir_entry, ptr_to_block, ptr_to_dir_entry_idx);
+}
+
+#define EGROW_SUBDIR_NO_EMPTY_BLOCKS 1
+#define EGROW_SUBDIR_MALLOC_FAILED 2
+#define EGROW_SUBDIR_GET_BLOCK_FAILED 3
+#define EGROW_SUBDIR_WRITE_BLOCK_FAILED 4
+
+/**
+ * Whether dir_entry, in the given bucket of a subdirectory with n_buckets buckets, moves to
+ * bucket + n_buckets when the directory doubles. Entries of files deleted while open stay
+ * where their fds will write them back.
+ */
+bool moves_on_split(const directory_entry *dir_entry, uint32_t bucket, uint32_t n_buckets)
+{
+    return dir_entry->name[0] > 2 && (name_hash(dir_entry->name) & (2 * n_buckets - 1)) != bucket;
+}
+
+/**
+ * Double the buckets of dir (a subdirectory), splitting bucket i into buckets i and
+ * i + n_buckets by the next bit of the hash of each name. Open files whose entries move
+ * are pointed at their new slot, and the size in dir's own entry is updated.
+ *
+ * The new buckets are all written before any old one loses an entry, and the directory only
+ * doubles when its size is written, last. If any of it fails, the old buckets are put back as
+ * they were and the new blocks are freed, so the directory is left as it was.
+ *
+ * Returns 0 on success and an EGROW_SUBDIR_* error code on error.
+ */
+int grow_subdir(dir_ref *dir)
+{
+    uint32_t n_buckets = dir->n_buckets;
+    uint8_t n_dir_entry_per_block = fs.block_size / sizeof(directory_entry);
+    uint32_t first_new_block;
+    uint32_t last_new_block;
+    if (allocate_blocks(n_buckets, &first_new_block, &last_new_block) != 0)
+    {
+        return EGROW_SUBDIR_NO_EMPTY_BLOCKS;
+    }
+
+    // the open files in dir, which are the only ones that can be on an entry that moves
+    uint16_t n_open = 0;
+    for (uint16_t fd = 3; fd < GLOBAL_FD_TABLE_SIZE; fd++)
+    {
+        n_open += global_fd_table[fd].ref_count > 0 && global_fd_table[fd].volume == current_volume && global_fd_table[fd].dir_block == dir->first_block;
+    }
+    // the old buckets as they were, to take the moved entries out of and to put back on failure
+    directory_entry *old_bufs = (directory_entry *)malloc((size_t)n_buckets * fs.block_size);
+    directory_entry *buf = (directory_entry *)malloc(fs.block_size);
+    uint32_t *old_blocks = (uint32_t *)malloc(n_buckets * sizeof(uint32_t));
+    uint32_t *new_blocks = (uint32_t *)malloc(n_buckets * sizeof(uint32_t));
+    uint16_t *open_fds = (uint16_t *)malloc((n_open + 1) * sizeof(uint16_t));
+    uint32_t n_rewritten = 0;
+    int status = 0;
+    if (old_bufs == NULL || buf == NULL || old_blocks == NULL || new_blocks == NULL || open_fds == NULL)
+    {
+        status = EGROW_SUBDIR_MALLOC_FAILED;
+        goto undo;
+    }
+    n_open = 0;
+    for (uint16_t fd = 3; fd < GLOBAL_FD_TABLE_SIZE; fd++)
+    {
+        if (global_fd_table[fd].ref_count > 0 && global_fd_table[fd].volume == current_volume && global_fd_table[fd].dir_block == dir->first_block)
+        {
+            open_fds[n_open++] = fd;
+        }
+    }
+    old_blocks[0] = dir->first_block;
+    new_blocks[0] = first_new_block;
+    for (uint32_t i = 1; i < n_buckets; i++)
+    {
+        old_blocks[i] = get_fat(old_blocks[i - 1]);
+        new_blocks[i] = get_fat(new_blocks[i - 1]);
+    }
+
+    // the moved entries are written to the new buckets first, while the old ones still have them
+    for (uint32_t i = 0; i < n_buckets; i++)
+    {
+        directory_entry *old_buf = old_bufs + i * n_dir_entry_per_block;
+        if (get_block(old_blocks[i], old_buf) != 0)
+        {
+            status = EGROW_SUBDIR_GET_BLOCK_FAILED;
+            goto undo;
+        }
+        memset(buf, 0, fs.block_size);
+        uint8_t n_moved = 0;
+        for (uint8_t j = 0; j < n_dir_entry_per_block; j++)
+        {
+            if (moves_on_split(&old_buf[j], i, n_buckets))
+            {
+                buf[n_moved++] = old_buf[j];
+            }
+        }
+        if (write_block(new_blocks[i], buf) != 0)
+        {
+            status = EGROW_SUBDIR_WRITE_BLOCK_FAILED;
+            goto undo;
+        }
+    }
+
+    // then the old buckets lose them
+    for (uint32_t i = 0; i < n_buckets; i++)
+    {
+        memcpy(buf, old_bufs + i * n_dir_entry_per_block, fs.block_size);
+        bool changed = false;
+        for (uint8_t j = 0; j < n_dir_entry_per_block; j++)
+        {
+            if (moves_on_split(&buf[j], i, n_buckets))
+            {
+                memset(&buf[j], 0, sizeof(directory_entry));
+                changed = true;
+            }
+        }
+        if (changed && write_block(old_blocks[i], buf) != 0)
+        {
+            status = EGROW_SUBDIR_WRITE_BLOCK_FAILED;
+            goto undo;
+        }
+        n_rewritten = i + 1;
+    }
+
+    // and the directory only doubles once its size says so
+    set_fat(old_blocks[n_buckets - 1], first_new_block);
+    directory_entry *entries = (directory_entry *)fs.block_buf;
+    if (get_block(dir->entry_block, entries) != 0)
+    {
+        set_fat(old_blocks[n_buckets - 1], FAT_END_OF_FILE);
+        status = EGROW_SUBDIR_GET_BLOCK_FAILED;
+        goto undo;
+    }
+    set_dir_entry_size(&entries[dir->entry_idx], (uint64_t)2 * n_buckets * fs.block_size);
+    if (write_block(dir->entry_block, entries) != 0)
+    {
+        set_fat(old_blocks[n_buckets - 1], FAT_END_OF_FILE);
+        status = EGROW_SUBDIR_WRITE_BLOCK_FAILED;
+        goto undo;
+    }
+    dir->n_buckets = 2 * n_buckets;
+
+    // now that the split happened, open files follow their entries to where they moved
+    for (uint32_t i = 0; i < n_buckets; i++)
+    {
+        directory_entry *old_buf = old_bufs + i * n_dir_entry_per_block;
+        uint8_t n_moved = 0;
+        for (uint8_t j = 0; j < n_dir_entry_per_block; j++)
+        {
+            if (!moves_on_split(&old_buf[j], i, n_buckets))
+            {
+                continue;
+            }
+            for (uint16_t k = 0; k < n_open; k++)
+            {
+                global_fd_entry *fd_entry = &global_fd_table[open_fds[k]];
+                if (fd_entry->dir_entry_block_num == old_blocks[i] && fd_entry->dir_entry_idx == j)
+                {
+                    fd_entry->dir_entry_block_num = new_blocks[i];
+                    fd_entry->dir_entry_idx = n_moved;
+                }
+            }
+            n_moved += 1;
+        }
+    }
+    stats.dir_splits += 1;
+    goto cleanup;
+
+undo:
+    // best effort: if putting an old bucket back fails too, there is nothing left to try
+    for (uint32_t i = 0; i < n_rewritten; i++)
+    {
+        write_block(old_blocks[i], old_bufs + i * n_dir_entry_per_block);
+    }
+    clear_fat_file(first_new_block);
+
+cleanup:
+    free(old_bufs);
+    free(buf);
+    free(old_blocks);
+    free(new_blocks);
+    free(open_fds);
+    return status;
+}
+
+#define EWRITE_NEW_SUBDIR_ENTRY_GET_BLOCK_FAILED 1
+#define EWRITE_NEW_SUBDIR_ENTRY_WRITE_BLOCK_FAILED 2
+#define EWRITE_NEW_SUBDIR_ENTRY_GROW_SUBDIR_FAILED 3
+
+/**
+ * Like write_new_root_dir_entry, but for a subdirectory. The entry goes in a free slot of
+ * the bucket of its name, and the directory is grown until that bucket has one.
+ *
+ * Returns 0 on success and an EWRITE_NEW_SUBDIR_ENTRY_* error code on error.
+ */
+int write_new_subdir_entry(dir_ref *dir, directory_entry *ptr_to_dir_entry, uint32_t *ptr_to_block, uint8_t *ptr_to_dir_entry_idx)
+{
+    uint8_t n_dir_entry_per_block = fs.block_size / sizeof(directory_entry);
+    directory_entry *dir_entry_buf = (directory_entry *)fs.block_buf;
+    while (true)
+    {
+        uint32_t block = dir_bucket(dir, ptr_to_dir_entry->name);
+        if (get_block(block, dir_entry_buf) != 0)
+        {
+            return EWRITE_NEW_SUBDIR_ENTRY_GET_BLOCK_FAILED;
+        }
+        stats.dir_lookups += 1;
+        stats.dir_block_reads += 1;
+
+        for (uint8_t i = 0; i < n_dir_entry_per_block; i++)
+        {
+            if (dir_entry_buf[i].name[0] > 1)
+            {
+                continue;
+            }
+            dir_entry_buf[i] = *ptr_to_dir_entry;
+            if (write_block(block, dir_entry_buf) != 0)
+            {
+                return EWRITE_NEW_SUBDIR_ENTRY_WRITE_BLOCK_FAILED;
+            }
+            *ptr_to_block = block;
+            *ptr_to_dir_entry_idx = i;
+            return 0;
+        }
+
+        if (grow_subdir(dir) != 0)
+        {
+            return EWRITE_NEW_SUBDIR_ENTRY_GROW_SUBDIR_FAILED;
+        }
+    }
+}
+
+/**
+ * Write a new entry into dir (see write_new_root_dir_entry and write_new_subdir_entry).
+ *
+ * Returns 0 on success and non-zero on error.
+ */
+int write_new_dir_entry(dir_ref *dir, directory_entry *ptr_to_dir_entry, uint32_t *ptr_to_block, uint8_t *ptr_to_dir_entry_idx)
+{
+    if (dir->n_buckets == 0)
+    {
+        return write_new_root_dir_entry(ptr_to_dir_entry, ptr_to_block, ptr_to_dir_entry_idx);
+    }
+    return write_new_subdir_entry(dir, ptr_to_dir_entry, ptr_to_block, ptr_to_dir_entry_idx);
+}
+
+/**
+ * Set up dir for the subdirectory whose entry (at idx in block) is dir_entry.
+ *
+ * Returns false if it isn't a directory or its size isn't a power of two of blocks.
+ */
+bool enter_dir(const directory_entry *dir_entry, uint32_t block, uint8_t idx, dir_ref *dir)
+{
+    uint64_t size = dir_entry_size(dir_entry);
+    uint64_t n_buckets = size / fs.block_size;
+    if (
+        dir_entry->type != FILE_TYPE_DIRECTORY || dir_entry_first_block(dir_entry) == 0 ||
+        size % fs.block_size != 0 || n_buckets == 0 || n_buckets > UINT32_MAX || (n_buckets & (n_buckets - 1)) != 0)
+    {
+        return false;
+    }
+    *dir = (dir_ref){
+        .first_block = dir_entry_first_block(dir_entry),
+        .n_buckets = (uint32_t)n_buckets,
+        .entry_block = block,
+        .entry_idx = idx};
+    return true;
+}
+
+#define ERESOLVE_PARENT_FIND_FILE_FAILED -1
+#define RRESOLVE_PARENT_FOUND 0
+#define RRESOLVE_PARENT_NOT_FOUND 1
+#define RRESOLVE_PARENT_INVALID_NAME 2
+
+/**
+ * Find the directory holding the last component of path, which is relative to the root
+ * directory of the current volume, and copy that component into name (MAX_FILENAME_SIZE + 1
+ * bytes). Components are separated by '/', and empty ones are ignored, so name is empty
+ * if path is the root directory itself. Each level costs one lookup (see find_file_in_dir).
+ *
+ * Returns RRESOLVE_PARENT_FOUND on success, RRESOLVE_PARENT_NOT_FOUND if a directory on
+ * the way doesn't exist (or isn't a directory), RRESOLVE_PARENT_INVALID_NAME if a component
+ * isn't a valid filename, and ERESOLVE_PARENT_FIND_FILE_FAILED on error.
+ */
+int resolve_parent(const char *path, dir_ref *dir, char *name)
+{
+    *dir = (dir_ref){.first_block = 1, .n_buckets = 0, .entry_block = 0, .entry_idx = 0};
+    name[0] = '\0';
+    while (true)
+    {
+        path += strspn(path, "/");
+        if (*path == '\0')
+        {
+            return RRESOLVE_PARENT_FOUND;
+        }
+        size_t len = strcspn(path, "/");
+        if (len > MAX_FILENAME_SIZE)
+        {
+            return RRESOLVE_PARENT_INVALID_NAME;
+        }
+        memcpy(name, path, len);
+        name[len] = '\0';
+        if (!is_valid_filename(name))
+        {
+            return RRESOLVE_PARENT_INVALID_NAME;
+        }
+        path += len;
+        if (path[strspn(path, "/")] == '\0')
+        {
+            return RRESOLVE_PARENT_FOUND;
+        }
+
+        directory_entry dir_entry;
+        uint32_t block;
+        uint8_t idx;
+        int status = find_file_in_dir(dir, name, &dir_entry, &block, &idx);
+        if (status < 0)
+        {
+            return ERESOLVE_PARENT_FIND_FILE_FAILED;
+        }
+        if (status != RFIND_FILE_IN_ROOT_DIR_FILE_FOUND || !enter_dir(&dir_entry, block, idx, dir))
+        {
+            return RRESOLVE_PARENT_NOT_FOUND;
+        }
+    }
+}
+
+// TODO: these functions are extremely non-reentrant
+
+/**
+ * Move the data of a small file that was just closed into a fragment block shared with
+ * other small files, and free the block it had to itself. Only files that fit in half a
+ * block and own their only block are packed.
+ *
+ * The caller is responsible for writing the directory entry through.
+ *
+ * Returns whether the file was packed. It is left as it was if not.
+ */
+bool pack_file(global_fd_entry *fd_entry)
+{
+    directory_entry *ptr_to_dir_entry = fd_entry->ptr_to_dir_entry;
+    uint32_t first_block = dir_entry_first_block(ptr_to_dir_entry);
+    uint64_t size = dir_entry_size(ptr_to_dir_entry);
+    if (
+        first_block == 0 || size == 0 || size > fs.block_size / 2 ||
+        get_fat(first_block) != FAT_END_OF_FILE || fs.extra_refs[first_block] > 0)
+    {
+        return false;
+    }
+
+    char *data = (char *)malloc(size);
+    if (data == NULL)
+    {
+        return false;
+    }
+    uint32_t frag_block;
+    uint16_t frag_offset;
+    if (get_block(first_block, fs.block_buf) != 0)
+    {
+        free(data);
+        return false;
+    }
+    memcpy(data, fs.block_buf, size);
+    if (alloc_fragment(size, &frag_block, &frag_offset) != 0)
+    {
+        free(data);
+        return false;
+    }
+    // the other slots of the fragment block belong to other files
+    if (get_block(frag_block, fs.block_buf) != 0)
+    {
+        free_fragment(frag_block, frag_offset, size);
+        free(data);
+        return false;
+    }
+    memcpy((char *)fs.block_buf + frag_offset, data, size);
+    free(data);
+    if (write_block(frag_block, fs.block_buf) != 0)
+    {
+        free_fragment(frag_block, frag_offset, size);
+        return false;
+    }
+
+    clear_fat_file(first_block);
+    set_dir_entry_first_block(ptr_to_dir_entry, 0);
+    set_dir_entry_frag_block(ptr_to_dir_entry, frag_block);
+    ptr_to_dir_entry->frag_offset = frag_offset;
+    truncate_block_map(fd_entry, 0);
+    return true;
+}
+
+#define EUNPACK_FILE_NO_EMPTY_BLOCKS 1
+#define EUNPACK_FILE_GET_BLOCK_FAILED 2
+#define EUNPACK_FILE_WRITE_BLOCK_FAILED 3
+#define EUNPACK_FILE_WRITE_ROOT_DIR_ENTRY_FAILED 4
+
+/**
+ * Give a packed file (see pack_file) a block of its own again, so that it can be written
+ * to or shared like any other file. Does nothing if the file isn't packed.
+ *
+ * Returns 0 on success and an EUNPACK_FILE_* error code on error.
+ */
+int unpack_file(global_fd_entry *fd_entry)
+{
+    directory_entry *ptr_to_dir_entry = fd_entry->ptr_to_dir_entry;
+    if (dir_entry_frag_block(ptr_to_dir_entry) == 0)
+    {
+        return 0;
+    }
+
+    uint32_t block = first_empty_block();
+    if (block == 0)
+    {
+        return EUNPACK_FILE_NO_EMPTY_BLOCKS;
+    }
+    if (get_block(dir_entry_frag_block(ptr_to_dir_entry), fs.block_buf) != 0)
+    {
+        return EUNPACK_FILE_GET_BLOCK_FAILED;
+    }
+    char *buf = (char *)fs.block_buf;
+    memmove(buf, buf + ptr_to_dir_entry->frag_offset, dir_entry_size(ptr_to_dir_entry));
+    memset(buf + dir_entry_size(ptr_to_dir_entry), 0, fs.block_size - dir_entry_size(ptr_to_dir_entry));
+    if (write_block(block, buf) != 0)
+    {
+        return EUNPACK_FILE_WRITE_BLOCK_FAILED;
+    }
+
+    set_fat(block, FAT_END_OF_FILE);
+    free_fragment(dir_entry_frag_block(ptr_to_dir_entry), ptr_to_dir_entry->frag_offset, dir_entry_size(ptr_to_dir_entry));
+    set_dir_entry_first_block(ptr_to_dir_entry, block);
+    set_dir_entry_frag_block(ptr_to_dir_entry, 0);
+    ptr_to_dir_entry->frag_offset = 0;
+    truncate_block_map(fd_entry, 0);
+    if (write_root_dir_entry(ptr_to_dir_entry, fd_entry->dir_entry_block_num, fd_entry->dir_entry_idx) != 0)
+    {
+        return EUNPACK_FILE_WRITE_ROOT_DIR_ENTRY_FAILED;
+    }
+    return 0;
+}
+
+/**
+ * Release the fragment a packed file's data is in (see pack_file), if it has one
+ */
+void free_file_fragment(directory_entry *ptr_to_dir_entry)
+{
+    if (dir_entry_frag_block(ptr_to_dir_entry) != 0)
+    {
+        free_fragment(dir_entry_frag_block(ptr_to_dir_entry), ptr_to_dir_entry->frag_offset, dir_entry_size(ptr_to_dir_entry));
+        set_dir_entry_frag_block(ptr_to_dir_entry, 0);
+        ptr_to_dir_entry->frag_offset = 0;
+    }
+}
+
+int k_open(const char *fname, int mode)
+{
+    fname = select_volume(fname);
+    if (fname == NULL)
+    {
+        return EK_UNKNOWN_VOLUME;
+    }
+    if (!volume_is_mounted())
+    {
+        return EFS_NOT_MOUNTED;
+    }
+
+    dir_ref dir;
+    char name[MAX_FILENAME_SIZE + 1];
+    int resolve_status = resolve_parent(fname, &dir, name);
+    if (resolve_status < 0)
+    {
+        return EK_OPEN_FIND_FILE_IN_ROOT_DIR_FAILED;
+    }
+    if (resolve_status == RRESOLVE_PARENT_INVALID_NAME || name[0] == '\0')
+    {
+        return EK_OPEN_INVALID_FILENAME;
+    }
+    if (resolve_status == RRESOLVE_PARENT_NOT_FOUND)
+    {
+        return EK_OPEN_FILE_DOES_NOT_EXIST;
+    }
+    // NOTE: because resolve_parent validates every component, you can never open a deleted file
+    // or end dir entry since they start with 0, 1, or 2 which are not part of the
+    // valid filename charset
+
+    // F_DIRECT only changes how the data moves, so the rest of the mode is checked as usual.
+    // A read-only mount reads from its mapping, which never touches the page cache twice anyway
+    bool direct = ((mode & F_DIRECT) || (fs.flags & MOUNT_DIRECT)) && !is_read_only();
+    bool log = mode & F_LOG;
+    mode &= ~(F_DIRECT | F_LOG);
+
+    if (is_read_only() && mode != F_READ)
+    {
+        return EK_READ_ONLY_FS;
+    }
+
+    if (direct && !open_direct_fd())
+    {
+        return EK_OPEN_DIRECT_UNSUPPORTED;
+    }
+
+    // in a read-only mount every open gets an entry of its own, so threads reading through
+    // different fds never share an offset or a block map
+    uint16_t fd_idx;
+    int find_file_in_global_fd_table_status = is_read_only() ? RFIND_FILE_IN_GLOBAL_FD_TABLE_NOT_FOUND : find_file_in_global_fd_table(dir.first_block, name, &fd_idx);
+
+    // Already found the file in the global_fd_table
+    if (find_file_in_global_fd_table_status == 0)
+    {
+        global_fd_entry *fd_entry = &global_fd_table[fd_idx];
+
+        // we already have an entry in the global file table
+        if (fd_entry->write_locked && (mode == F_WRITE || mode == F_APPEND))
+        {
+            return EK_OPEN_ALREADY_WRITE_LOCKED;
+        }
+    }
+    else
+    {
+
+        // Otherwise: the fd_idx was not found so we need to make a new entry
+        // in the global file table
+        fd_idx = find_empty_fd();
+        if (fd_idx == GLOBAL_FD_TABLE_ENTRY_NOT_FOUND_SENTINEL)
+        {
+            return EK_OPEN_GLOBAL_FD_TABLE_FULL;
+        }
+
+        // find or create a dir entry (allocated here so we can keep a copy of the entry around and
+        // store it in the global file table)
+        directory_entry *ptr_to_dir_entry = (directory_entry *)slab_alloc(&dir_entry_slab);
+        uint32_t dir_entry_block_num;
+        uint8_t dir_entry_idx;
+        if (ptr_to_dir_entry == NULL)
+        {
+            return EK_OPEN_MALLOC_FAILED;
+        }
+        int find_dir_entry_status = find_file_in_dir(&dir, name, ptr_to_dir_entry, &dir_entry_block_num, &dir_entry_idx);
+        if (find_dir_entry_status < 0)
+        { // indicates an error
+            slab_free(&dir_entry_slab, ptr_to_dir_entry);
+            return EK_OPEN_FIND_FILE_IN_ROOT_DIR_FAILED;
+        }
+        if (find_dir_entry_status == RFIND_FILE_IN_ROOT_DIR_FILE_FOUND && ptr_to_dir_entry->type == FILE_TYPE_DIRECTORY)
+        {
+            slab_free(&dir_entry_slab, ptr_to_dir_entry);
+            return EK_OPEN_IS_DIRECTORY;
+        }
+
+        // case: we couldn't find the file
+        if (find_dir_entry_status != RFIND_FILE_IN_ROOT_DIR_FILE_FOUND)
+        {
+            // RFIND_FILE_IN_ROOT_DIR_FILE_NOT_FOUND or RFIND_FILE_IN_ROOT_DIR_FILE_DELETED
+            if (mode == F_READ)
+            {
+                slab_free(&dir_entry_slab, ptr_to_dir_entry);
+                return EK_OPEN_FILE_DOES_NOT_EXIST;
+            }
+
+            // create a dir entry
+            time_t mtime = time(NULL);
+            if (mtime == (time_t)-1)
+            {
+                slab_free(&dir_entry_slab, ptr_to_dir_entry);
+                return EK_OPEN_TIME_FAILED;
+            }
+
+            *ptr_to_dir_entry = (directory_entry){
+                .name = {0},
+                .size = 0,
+                .first_block = 0,
+                .type = log ? FILE_TYPE_LOG : FILE_TYPE_REGULAR,
+                .perm = P_READ_WRITE_FILE_PERMISSION, // read and write
+                .mtime = mtime,
+                .frag_block = 0,
+                .frag_offset = 0,
+                .first_block_hi = 0,
+                .frag_block_hi = 0,
+                .size_hi = 0};
+            strcpy(ptr_to_dir_entry->name, name); // can safely use strcpy because we checked name
+
+            // write the dir entry
+            if (write_new_dir_entry(&dir, ptr_to_dir_entry, &dir_entry_block_num, &dir_entry_idx) != 0)
+            {
+                slab_free(&dir_entry_slab, ptr_to_dir_entry);
+                return EK_OPEN_WRITE_NEW_ROOT_DIR_ENTRY_FAILED;
+            }
+        }
+        // create an entry in the global file table
+        global_fd_table[fd_idx] = (global_fd_entry){
+            .ref_count = 0,
+            .volume = current_volume,
+            .dir_entry_block_num = dir_entry_block_num,
+            .dir_entry_idx = dir_entry_idx,
+            .dir_block = dir.first_block,
+            .ptr_to_dir_entry = ptr_to_dir_entry,
+            .write_locked = mode, // 0 for read, 1 for write, 2 for append
+            .offset = 0,
+            .direct = false,
+            .generation = global_fd_table[fd_idx].generation,
+            .next_free = global_fd_table[fd_idx].next_free};
+    }
+
+    uint8_t perm = global_fd_table[fd_idx].ptr_to_dir_entry->perm;
+    if (
+        perm == P_NO_FILE_PERMISSION ||
+        (perm == P_WRITE_ONLY_FILE_PERMISSION && mode == F_READ) || // NOTE: F_WRITE also allows reading, but we only gate this on the f_write function
+        ((perm == P_READ_ONLY_FILE_PERMISSION || perm == P_READ_AND_EXECUTABLE_FILE_PERMISSION) && (mode == F_WRITE || mode == F_APPEND)))
+    {
+        // an entry we just set up is still on the free list, so only its dir entry needs releasing
+        if (global_fd_table[fd_idx].ref_count == 0)
+        {
+            slab_free(&dir_entry_slab, global_fd_table[fd_idx].ptr_to_dir_entry);
+            global_fd_table[fd_idx].ptr_to_dir_entry = NULL;
+        }
+        return EK_OPEN_WRONG_PERMISSIONS;
+    }
+
+    // only a file with nothing in it yet (or about to be emptied) can become a log
+    directory_entry *ptr_to_dir_entry = global_fd_table[fd_idx].ptr_to_dir_entry;
+    if (log && ptr_to_dir_entry->type != FILE_TYPE_LOG)
+    {
+        if (mode == F_READ || (mode == F_APPEND && dir_entry_size(ptr_to_dir_entry) > 0))
+        {
+            if (global_fd_table[fd_idx].ref_count == 0)
+            {
+                slab_free(&dir_entry_slab, ptr_to_dir_entry);
+                global_fd_table[fd_idx].ptr_to_dir_entry = NULL;
+            }
+            return EK_OPEN_NOT_A_LOG;
+        }
+        ptr_to_dir_entry->type = FILE_TYPE_LOG;
+        if (write_root_dir_entry(ptr_to_dir_entry, global_fd_table[fd_idx].dir_entry_block_num, global_fd_table[fd_idx].dir_entry_idx) != 0)
+        {
+            ptr_to_dir_entry->type = FILE_TYPE_REGULAR;
+            if (global_fd_table[fd_idx].ref_count == 0)
+            {
+                slab_free(&dir_entry_slab, ptr_to_dir_entry);
+                global_fd_table[fd_idx].ptr_to_dir_entry = NULL;
+            }
+            return EK_OPEN_WRITE_ROOT_DIR_ENTRY_FAILED;
+        }
+    }
+
+    // map the whole chain now, so that k_read never has to grow the block map (and allocate
+    // from block_map_slab) while other threads read
+    if (is_read_only() && !map_whole_file(&global_fd_table[fd_idx]))
+    {
+        // the dir entry and block map are shared with the other fds if the file is already open
+        if (global_fd_table[fd_idx].ref_count == 0)
+        {
+            slab_free(&dir_entry_slab, global_fd_table[fd_idx].ptr_to_dir_entry);
+            global_fd_table[fd_idx].ptr_to_dir_entry = NULL;
+            free_block_map(&global_fd_table[fd_idx]);
+        }
+        return EK_OPEN_MALLOC_FAILED;
+    }
+
+    // Only increment the ref count here since we know that the file exists and has the right permissions
+    // at this point
+    if (global_fd_table[fd_idx].ref_count == 0)
+    {
+        global_fd_free_head = global_fd_table[fd_idx].next_free; // it is the head, see find_empty_fd
+    }
+    global_fd_table[fd_idx].ref_count += 1; // increment the ref count
+
+    // case: we need to truncate the file because we are opening it for writing
+    if (mode == F_WRITE && dir_entry_size(global_fd_table[fd_idx].ptr_to_dir_entry) > 0)
+    {
+        // truncate the file
+        time_t mtime = time(NULL);
+        if (mtime == (time_t)-1)
+        {
+            return EK_OPEN_TIME_FAILED;
+        }
+        if (dir_entry_first_block(global_fd_table[fd_idx].ptr_to_dir_entry) != 0)
+        {
+            free_file_blocks(dir_entry_first_block(global_fd_table[fd_idx].ptr_to_dir_entry), dir_entry_size(global_fd_table[fd_idx].ptr_to_dir_entry));
+        }
+        free_file_fragment(global_fd_table[fd_idx].ptr_to_dir_entry);
+        set_dir_entry_size(global_fd_table[fd_idx].ptr_to_dir_entry, 0);
+        global_fd_table[fd_idx].ptr_to_dir_entry->n_records = 0;
+        global_fd_table[fd_idx].ptr_to_dir_entry->mtime = mtime;
+        set_dir_entry_first_block(global_fd_table[fd_idx].ptr_to_dir_entry, 0);
+        truncate_block_map(&global_fd_table[fd_idx], 0);
+        free_log_reader(&global_fd_table[fd_idx]);
+
+        // write the dir entry
+        if (write_root_dir_entry(global_fd_table[fd_idx].ptr_to_dir_entry, global_fd_table[fd_idx].dir_entry_block_num, global_fd_table[fd_idx].dir_entry_idx) != 0)
+        {
+            return EK_OPEN_WRITE_ROOT_DIR_ENTRY_FAILED;
+        }
+    }
+
+    uint64_t offset = 0;
+    if (mode == F_APPEND)
+    {
+        offset = dir_entry_size(global_fd_table[fd_idx].ptr_to_dir_entry);
+    }
+    else if (mode == F_WRITE)
+    {
+        offset = 0;
+    }
+    else if (mode == F_READ)
+    {
+        offset = global_fd_table[fd_idx].offset;
+    }
+    global_fd_table[fd_idx].write_locked = mode;
+    global_fd_table[fd_idx].offset = offset;
+    global_fd_table[fd_idx].direct |= direct;
+
+    return (int)fd_idx; // semi-safe cast because uint16_t should fit in int on most systems
+}
+
+/**
+ * walk_subdirs visitor that stops at the block arg points to, setting it to 0
+ */
+int find_subdir_block(uint32_t block, directory_entry *entries, void *arg)
+{
+    uint32_t *target = (uint32_t *)arg;
+    if (block != *target)
+    {
+        return WALK_SUBDIRS_CONTINUE;
+    }
+    *target = 0;
+    return WALK_SUBDIRS_STOP;
+}
+
+/**
+ * Whether block belongs to the directory starting at dir_block or to one below it. Only
+ * subdirectories are searched when dir_block is the root directory. A walk that fails
+ * counts as a match, to be safe.
+ */
+bool is_subdir_block(uint32_t dir_block, uint32_t block)
+{
+    uint32_t target = block;
+    return walk_subdirs(dir_block, find_subdir_block, &target) != 0 || target == 0;
+}
+
+/**
+ * Whether block is one of the blocks of a directory. These are rewritten in place, so
+ * they must never be shared with a file. A walk that fails counts as a match, to be safe.
+ */
+bool is_dir_block(uint32_t block)
+{
+    for (uint32_t dir_block = 1; dir_block != FAT_END_OF_FILE; dir_block = get_fat(dir_block))
+    {
+        if (dir_block == block)
+        {
+            return true;
+        }
+    }
+    return is_subdir_block(1, block);
+}
+
+#define EDEDUP_FILE_MALLOC_FAILED 1
+#define EDEDUP_FILE_GET_BLOCK_FAILED 2
+
+/**
+ * Share the blocks of a file with identical blocks already on disk (MOUNT_DEDUP only).
+ *
+ * A FAT stores the next block number inside each block's entry, so two files can only
+ * share a block if they also share everything after it. We therefore key the index on
+ * (contents, next block) and go from the last block of the file towards the first: each
+ * block we replace makes the previous block's key match the copy it has elsewhere.
+ *
+ * Index hits are only hints, so they are checked against the FAT and compared byte for
+ * byte before anything is relinked. The caller writes the directory entry through, since
+ * its first_block may have changed.
+ *
+ * Returns 0 on success and an EDEDUP_FILE_* error code on error. The file is consistent
+ * (just possibly less deduplicated) on error.
+ */
+int dedup_file(directory_entry *ptr_to_dir_entry)
+{
+    if (dir_entry_first_block(ptr_to_dir_entry) == 0)
+    {
+        return 0;
+    }
+
+    uint32_t n_blocks = 0;
+    for (uint32_t block = dir_entry_first_block(ptr_to_dir_entry); block != FAT_END_OF_FILE; block = get_fat(block))
+    {
+        n_blocks += 1;
+    }
+
+    uint32_t *chain = (uint32_t *)malloc(n_blocks * sizeof(uint32_t));
+    char *candidate_buf = (char *)malloc(fs.block_size);
+    if (chain == NULL || candidate_buf == NULL)
+    {
+        free(chain);
+        free(candidate_buf);
+        return EDEDUP_FILE_MALLOC_FAILED;
+    }
+    uint32_t i = 0;
+    for (uint32_t block = dir_entry_first_block(ptr_to_dir_entry); block != FAT_END_OF_FILE; block = get_fat(block))
+    {
+        chain[i++] = block;
+    }
+
+    int status = 0;
+    for (i = n_blocks; i-- > 0;)
+    {
+        uint32_t block = chain[i];
+        uint32_t next_block = get_fat(block);
+        bool have_contents = false;
+        if (fs.block_hashes[block] == 0)
+        {
+            if (get_block(block, fs.block_buf) != 0)
+            {
+                status = EDEDUP_FILE_GET_BLOCK_FAILED;
+                break;
+            }
+            have_contents = true;
+            fs.block_hashes[block] = dedup_hash_block(fs.block_buf, fs.block_size);
+        }
+        uint64_t key = dedup_chain_key(fs.block_hashes[block], next_block);
+
+        uint32_t candidate;
+        if (
+            fs.extra_refs[block] == 0 && // already shared: nothing left to save
+            dedup_index_lookup(fs.dedup, key, &candidate) &&
+            candidate != block &&
+            is_allocated_block(candidate) &&
+            get_fat(candidate) == next_block &&
+            (fs.block_hashes[candidate] == 0 || fs.block_hashes[candidate] == fs.block_hashes[block]) && // 0 after a remount
+            fs.extra_refs[candidate] < UINT16_MAX &&
+            !is_dir_block(candidate) &&
+            find_fragment_block(candidate) == -1)
+        {
+            if (!have_contents && get_block(block, fs.block_buf) != 0)
+            {
+                status = EDEDUP_FILE_GET_BLOCK_FAILED;
+                break;
+            }
+            if (get_block(candidate, candidate_buf) != 0)
+            {
+                status = EDEDUP_FILE_GET_BLOCK_FAILED;
+                break;
+            }
+            if (memcmp(fs.block_buf, candidate_buf, fs.block_size) == 0)
+            {
+                if (i == 0)
+                {
+                    set_dir_entry_first_block(ptr_to_dir_entry, candidate);
+                }
+                else
+                {
+                    set_fat(chain[i - 1], candidate);
+                }
+                fs.extra_refs[candidate] += 1;
+                clear_fat_file(block); // frees block and drops its reference to next_block
+                chain[i] = candidate;
+                continue;
+            }
+        }
+
+        // failing to remember a block only costs us a future match
+        dedup_index_insert(fs.dedup, key, block);
+    }
+
+    free(chain);
+    free(candidate_buf);
+    return status;
+}
+
+int k_close(int fd)
+{
+    select_fd_volume(fd);
+    if (!volume_is_mounted())
+    {
+        return EFS_NOT_MOUNTED;
+    }
+
+    if (fd >= GLOBAL_FD_TABLE_SIZE || fd < 0)
+    {
+        return EK_CLOSE_FD_OUT_OF_RANGE;
+    }
+    if (fd == STDIN_FD || fd == STDOUT_FD || fd == STDERR_FD)
+    {
+        return EK_CLOSE_SPECIAL_FD;
+    }
+
+    // releasing an unused entry twice would put it on the free list twice
+    if (global_fd_table[fd].ref_count == 0)
+    {
+        return EK_CLOSE_FD_NOT_IN_TABLE;
+    }
+    global_fd_table[fd].ref_count -= 1;
+    if (global_fd_table[fd].ref_count == 0)
+    {
+        // release the entry. Nothing can reuse it before we return
+        global_fd_table[fd].generation += 1;
+        global_fd_table[fd].next_free = global_fd_free_head;
+        global_fd_free_head = fd;
+
+        // if the file was marked as deleted but still referenced
+        // then walk the FAT and zero it out
+        if (global_fd_table[fd].ptr_to_dir_entry->name[0] == 2)
+        {
+            uint32_t first_block = dir_entry_first_block(global_fd_table[fd].ptr_to_dir_entry);
+            if (first_block != 0)
+            {
+                free_file_blocks(first_block, dir_entry_size(global_fd_table[fd].ptr_to_dir_entry));
+            }
+            free_file_fragment(global_fd_table[fd].ptr_to_dir_entry);
+
+            // mark the file as deleted and write it through
+            directory_entry *ptr_to_dir_entry = global_fd_table[fd].ptr_to_dir_entry;
+            uint32_t dir_entry_block_num = global_fd_table[fd].dir_entry_block_num;
+            uint8_t dir_entry_idx = global_fd_table[fd].dir_entry_idx;
+            ptr_to_dir_entry->name[0] = 1;
+            set_dir_entry_first_block(ptr_to_dir_entry, 0);
+            if (write_root_dir_entry(ptr_to_dir_entry, dir_entry_block_num, dir_entry_idx) != 0)
+            {
+                return EK_CLOSE_WRITE_ROOT_DIR_ENTRY_FAILED;
+            }
+            note_deleted_entry(global_fd_table[fd].dir_block); // this entry has a ref_count of 0, so it isn't followed
+        }
+        else if ((fs.flags & MOUNT_PACK) && global_fd_table[fd].dirty && pack_file(&global_fd_table[fd]))
+        {
+            if (write_root_dir_entry(global_fd_table[fd].ptr_to_dir_entry, global_fd_table[fd].dir_entry_block_num, global_fd_table[fd].dir_entry_idx) != 0)
+            {
+                return EK_CLOSE_WRITE_ROOT_DIR_ENTRY_FAILED;
+            }
+        }
+        else if (fs.dedup != NULL && global_fd_table[fd].dirty)
+        {
+            // dedup is best effort, the file is left consistent even if it fails part way
+            dedup_file(global_fd_table[fd].ptr_to_dir_entry);
+            if (write_root_dir_entry(global_fd_table[fd].ptr_to_dir_entry, global_fd_table[fd].dir_entry_block_num, global_fd_table[fd].dir_entry_idx) != 0)
+            {
+                return EK_CLOSE_WRITE_ROOT_DIR_ENTRY_FAILED;
+            }
+        }
+
+        // free the memory we allocated for the the copy of the directory_entry
+        slab_free(&dir_entry_slab, global_fd_table[fd].ptr_to_dir_entry);
+        global_fd_table[fd].ptr_to_dir_entry = NULL;
+        free_block_map(&global_fd_table[fd]);
+        free_log_reader(&global_fd_table[fd]);
+        global_fd_table[fd].write_locked = 0;
+        global_fd_table[fd].dirty = false;
+    }
+    return 0;
+}
+
+int k_read(int fd, int n, char *buf)
+{
+    // allow reading from stdin, stdout, stderr before mounting
+    if (fd == STDIN_FD || fd == STDOUT_FD || fd == STDERR_FD)
+    {
+        // special case read for stdin, stdout, stderr
+        // we just read from the buffer
+        int bytes_read = read(fd, buf, n); // NOTE: unix systems typically assign STDIN, STDOUT, STDERR in the same way we do, so this should work
+        // We allow reading from stdin here because it's possible that there has been some redirection
+        // so we let it play out
+        if (bytes_read < 0)
+        {
+            return EK_READ_READ_FAILED;
+        };
+        return bytes_read;
+    }
+
+    select_fd_volume(fd);
+    if (!volume_is_mounted())
+    {
+        return EFS_NOT_MOUNTED;
+    }
+
+    if (fd >= GLOBAL_FD_TABLE_SIZE || fd < 0)
+    {
+        return EK_READ_FD_OUT_OF_RANGE;
+    }
+
+    global_fd_entry *fd_entry = &global_fd_table[fd];
+    if (fd_entry->ref_count == 0)
+    {
+        return EK_READ_FD_NOT_IN_TABLE;
+    }
+
+    uint64_t file_size = dir_entry_size(fd_entry->ptr_to_dir_entry);
+    uint64_t offset = fd_entry->offset;
+    uint16_t block_size = fs.block_size;
+    uint8_t perm = fd_entry->ptr_to_dir_entry->perm;
+
+    // can't read
+    if (perm < P_READ_ONLY_FILE_PERMISSION)
+    {
+        return EK_READ_WRONG_PERMISSIONS;
+    }
+
+    // if the offset is at or past the end of the file, there's nothing for us to read
+    // this also checks that the file is non-empty
+    if (offset >= file_size)
+    {
+        return 0;
+    }
+
+    // if n = 0, then we just return 0
+    if (n == 0)
+    {
+        return 0;
+    }
+
+    // a packed file is all in one place
+    if (file_size - offset < (uint64_t)n)
+    {
+        n = file_size - offset; // read at most the rest of the file
+    }
+    if (dir_entry_frag_block(fd_entry->ptr_to_dir_entry) != 0)
+    {
+        const char *frag = mapped_block(dir_entry_frag_block(fd_entry->ptr_to_dir_entry));
+        if (frag == NULL)
+        {
+            if (get_block(dir_entry_frag_block(fd_entry->ptr_to_dir_entry), fs.block_buf) != 0)
+            {
+                return EK_READ_GET_BLOCK_FAILED;
+            }
+            frag = fs.block_buf;
+        }
+        memcpy(buf, frag + fd_entry->ptr_to_dir_entry->frag_offset + offset, n);
+        fd_entry->offset += n;
+        return n;
+    }
+
+    // first we need to get to the offset, which the block map gives us without walking the chain
+    uint32_t n_blocks_to_skip = offset / block_size; // fits, since a file has at most as many blocks as the volume
+    uint16_t offset_in_block = offset % block_size;
+
+    // skip to the right block
+    uint32_t block = file_block(fd_entry, n_blocks_to_skip);
+    if (block == FAT_END_OF_FILE)
+    {
+        return EK_READ_COULD_NOT_JUMP_TO_BLOCK_FOR_OFFSET;
+    }
+
+    // start reading the blocks sequentialy and then memcpy-ing them out. A read-only mount
+    // copies straight out of the mapped image, so concurrent readers share no buffer
+    int n_copied = 0;
+    while (n > n_copied && block != FAT_END_OF_FILE)
+    { // NOTE: we shouldn't need to check for EOF here since we won't read more than the file size, but just in case
+        // we want to read at most the rest of the block
+        // but if n is smaller than that, then we should only read n
+        uint16_t n_to_copy = min(n - n_copied, block_size - offset_in_block);
+        const char *char_buf = mapped_block(block);
+        if (char_buf != NULL)
+        {
+            memcpy(buf + n_copied, char_buf + offset_in_block, n_to_copy);
+        }
+        else if (fd_entry->direct && n_to_copy == block_size)
+        {
+            // a whole block goes straight from the disk to the caller
+            if (get_block_io(block, buf + n_copied, true) != 0)
+            {
+                return EK_READ_GET_BLOCK_FAILED;
+            }
+        }
+        else
+        {
+            if (get_block_io(block, fs.block_buf, fd_entry->direct) != 0)
+            {
+                return EK_READ_GET_BLOCK_FAILED;
+            }
+            memcpy(buf + n_copied, (char *)fs.block_buf + offset_in_block, n_to_copy);
+        }
+        n_copied += n_to_copy;
+        // read the next block from the start
+        offset_in_block = 0;
+        // identify the next block (also filling in the block map as we go)
+        n_blocks_to_skip += 1;
+        block = file_block(fd_entry, n_blocks_to_skip);
+    }
+    // increment the file offset by the number of bytes read
+    fd_entry->offset += n_copied;
+    return n_copied;
+}
+
+int64_t k_lseek(int fd, int64_t offset, int whence)
+{
+    select_fd_volume(fd);
+    if (!volume_is_mounted())
+    {
+        return EFS_NOT_MOUNTED;
+    }
+
+    if (fd >= GLOBAL_FD_TABLE_SIZE || fd < 0)
+    {
+        return EK_LSEEK_FD_OUT_OF_RANGE;
+    }
+
+    if (fd == STDIN_FD || fd == STDOUT_FD || fd == STDERR_FD)
+    {
+        return EK_LSEEK_SPECIAL_FD;
+    }
+
+    global_fd_entry *fd_entry = &global_fd_table[fd];
+    if (fd_entry->ref_count == 0)
+    {
+        return EK_LSEEK_FD_NOT_IN_TABLE;
+    }
+
+    if (whence != F_SEEK_SET && whence != F_SEEK_CUR && whence != F_SEEK_END)
+    {
+        return EK_LSEEK_BAD_WHENCE;
+    }
+
+    // TODO: is this right?
+    // can't read = can't lseek
+    uint8_t perm = fd_entry->ptr_to_dir_entry->perm;
+    if (perm < P_READ_ONLY_FILE_PERMISSION)
+    {
+        return EK_LSEEK_WRONG_PERMISSIONS;
+    }
+
+    // check if total offset would be negative and if so return an error. Sizes and offsets
+    // of a fat16 image are 32 bits wide on disk, and 64 bits wide on a fat32 one
+    int64_t max_offset = fs.fat32 ? INT64_MAX : UINT32_MAX;
+    int64_t curr_offset = fd_entry->offset;
+    int64_t size = dir_entry_size(fd_entry->ptr_to_dir_entry);
+    int64_t new_offset;
+    if (whence == F_SEEK_SET)
+    {
+        if (offset < 0)
+            return EK_LSEEK_NEGATIVE_OFFSET;
+        else if (offset > max_offset)
+        {
+            return EK_LSEEK_OFFSET_OVERFLOW;
+        }
+        new_offset = offset;
+    }
+    else if (whence == F_SEEK_CUR)
+    {
+        if (offset < 0 && offset < -curr_offset)
+        {
+            return EK_LSEEK_NEGATIVE_OFFSET;
+        }
+        else if ((max_offset - curr_offset) < offset)
+        {
+            return EK_LSEEK_OFFSET_OVERFLOW;
+        }
+        new_offset = curr_offset + offset;
+    }
+    else
+    { // whence == F_SEEK_END
+        if (offset < 0 && offset < -size)
+        {
+            return EK_LSEEK_NEGATIVE_OFFSET;
+        }
+        else if ((max_offset - size) < offset)
+        {
+            return EK_LSEEK_OFFSET_OVERFLOW;
+        }
+        new_offset = size + offset;
+    }
+
+    fd_entry->offset = new_offset;
+    return new_offset;
+}
+
+int k_write(int fd, const char *str, int n)
+{
+    // allow writing to stdin, stdout, stderr before mounting
+    if (fd == STDIN_FD || fd == STDOUT_FD || fd == STDERR_FD)
+    {
+        // special case write for stdin, stdout, stderr
+        // we just write to the buffer
+        int bytes_written = write(fd, str, n); // NOTE: unix systems typically assign STDIN, STDOUT, STDERR in the same way we do, so this should work
+        // We allow writing to stdin here because it's possible that there has been some redirection
+        // so we let it play out
+        if (bytes_written < 0)
+        {
+            return EK_WRITE_WRITE_FAILED;
+        };
+        return bytes_written;
+    }
+    
+    select_fd_volume(fd);
+    if (!volume_is_mounted())
+    {
+        return EFS_NOT_MOUNTED;
+    }
+
+    if (is_read_only())
+    {
+        return EK_READ_ONLY_FS;
+    }
+
+    if (fd >= GLOBAL_FD_TABLE_SIZE || fd < 0)
+    {
+        return EK_WRITE_FD_OUT_OF_RANGE;
+    }
+
+    global_fd_entry *fd_entry = &global_fd_table[fd];
+    if (fd_entry->ref_count == 0)
+    {
+        return EK_WRITE_FD_NOT_IN_TABLE;
+    }
+
+    uint8_t perm = fd_entry->ptr_to_dir_entry->perm;
+    if (perm != P_WRITE_ONLY_FILE_PERMISSION && perm < P_READ_WRITE_AND_EXECUTABLE_FILE_PERMISSION)
+    {
+        return EK_WRITE_WRONG_PERMISSIONS;
+    }
+
+    // if n = 0, then we just return 0
+    if (n == 0)
+    {
+        return 0;
+    }
+
+    // anything written in place would garble the records of a log
+    if (fd_entry->ptr_to_dir_entry->type == FILE_TYPE_LOG)
+    {
+        return EK_WRITE_LOG_FILE;
+    }
+
+    return write_file(fd_entry, str, n);
+}
+
+/**
+ * Write n (> 0) bytes of str to the open file fd_entry, at its offset or at its end if it is
+ * opened with F_APPEND. This is k_write past the checks of the fd, shared with k_log_append.
+ * Returns the number of bytes written, or negative error code
+ */
+int write_file(global_fd_entry *fd_entry, const char *str, int n)
+{
+    // packed files are only written to in a block of their own
+    if (unpack_file(fd_entry) != 0)
+    {
+        return EK_WRITE_UNPACK_FAILED;
+    }
+
+    // if the file is empty, then we need to allocate a new block
+    uint64_t file_size = dir_entry_size(fd_entry->ptr_to_dir_entry);
+    uint64_t offset = fd_entry->write_locked == F_APPEND ? file_size : fd_entry->offset;
+    uint16_t block_size = fs.block_size;
+    if (offset / block_size >= get_blocks_in_data_region())
+    {
+        return 0; // the volume can't hold the blocks up to the offset, just like when it fills up on the way
+    }
+    uint32_t dir_entry_block_num = fd_entry->dir_entry_block_num;
+    uint8_t dir_entry_idx = fd_entry->dir_entry_idx;
+    bool is_writing_new_blocks = false; // we'll use this variable to track whether the block we're at is a new one (meaning we need to fetch the block from disk) or an old one (meaning we can just write to it)
+
+    // Copy any blocks we are about to modify that are shared with other files.
+    // Past the end of the write the chain is cut (see the end of this function),
+    // and when extending the file the last block gets relinked, so both are covered
+    // by unsharing up to whichever block comes first.
+    if (dir_entry_first_block(fd_entry->ptr_to_dir_entry) != 0)
+    {
+        uint32_t n_file_blocks = file_size == 0 ? 1 : (file_size + block_size - 1) / block_size;
+        uint32_t last_write_idx = (offset + n - 1) / block_size;
+        uint32_t last_idx = last_write_idx < n_file_blocks - 1 ? last_write_idx : n_file_blocks - 1;
+        if (unshare_file_blocks(fd_entry, last_idx) != 0)
+        {
+            return EK_WRITE_UNSHARE_FAILED;
+        }
+    }
+
+    // Get the first block of the file
+    if (dir_entry_first_block(fd_entry->ptr_to_dir_entry) == 0)
+    {
+        uint32_t new_block = first_empty_block();
+        if (new_block == 0)
+        {
+            return 0;
+        }
+        set_fat(new_block, FAT_END_OF_FILE);
+        set_dir_entry_first_block(fd_entry->ptr_to_dir_entry, new_block);
+    }
+    uint32_t block = dir_entry_first_block(fd_entry->ptr_to_dir_entry);
+
+    // Get the idx of the block we're writing to
+    uint32_t offset_block_idx = offset / block_size; // fits, see the check of the offset above
+    uint16_t offset_in_block = offset % block_size;
+
+    // Jump straight to the offset_block_idx if the file has that many blocks,
+    // otherwise to its last block and walk on from there.
+    char *char_buf = (char *)fs.block_buf;
+    uint32_t n_old_blocks = (file_size + block_size - 1) / block_size;
+    uint32_t n_blocks_deep = n_old_blocks == 0 ? 0 : min(offset_block_idx, n_old_blocks - 1); // index of block in the file
+    block = file_block(fd_entry, n_blocks_deep);
+    if (block == FAT_END_OF_FILE)
+    {
+        block = dir_entry_first_block(fd_entry->ptr_to_dir_entry);
+        n_blocks_deep = 0;
+    }
+    while (n_blocks_deep < offset_block_idx)
+    {
+        uint32_t next_block;
+        if (next_block_num(block, &next_block) != 0)
+        {
+            return EK_WRITE_NEXT_BLOCK_NUM_FAILED;
+        }
+
+        if (next_block == FAT_END_OF_FILE)
+        {
+            // need to 0 out whatever remains in this block
+
+            // this is the number of bytes in the file that are in the last block
+            uint32_t n_file_bytes_in_block = file_size - (uint64_t)n_blocks_deep * block_size;
+            if (get_block(block, char_buf) != 0)
+            {
+                return EK_WRITE_GET_BLOCK_FAILED;
+            }
+            memset(char_buf + n_file_bytes_in_block, 0, block_size - n_file_bytes_in_block);
+            if (write_block(block, fs.block_buf) != 0)
+            {
+                return EK_WRITE_WRITE_BLOCK_FAILED;
+            }
+            break;
+        }
+        block = next_block;
+        n_blocks_deep += 1;
+    }
+
+    // If in the previous step we exhausted the blocks in the file,
+    // we continue iterating, up to the offset block, writing each
+    // intermediate block as empty
+    for (; n_blocks_deep < offset_block_idx; n_blocks_deep++)
+    {
+        uint32_t prev_block = block;
+        block = first_empty_block();
+        if (block == 0)
+        {
+            // no free blocks
+            set_fat(prev_block, FAT_END_OF_FILE);
+            return 0; // we've written 0 bytes since we never got to the offset
+        }
+
+        // set FAT linkages (marking the new block as taken so it isn't handed out again)
+        set_fat(prev_block, block);
+        set_fat(block, FAT_END_OF_FILE);
+
+        // write block as empty
+        memset(fs.block_buf, 0, block_size);
+        if (write_block(block, fs.block_buf) != 0)
+        {
+            return EK_WRITE_WRITE_BLOCK_FAILED;
+        }
+    }
+
+    // At this point, block should point to `offset_block_idx`th block.
+    // Recall the examples above:
+    // 1. `offset_block_idx` was 2, so block will hold the block number of the
+    // newly created block where we'll start writing our file
+    // 2. `offset_block_idx` was 2, so block will just hold the block number of the
+    // second/last block in the file
+    // 3. `offset_block_idx` was 1, block will hold the block number of the first/
+    // last block in the file
+
+    int n_copied = 0;
+    while (n > n_copied) // NOTE: this check is basically only used to check if n == 0 (following checks occur at the if statement in the loop body)
+    {
+        // check if we're writing to a new block
+        // by comparing the initial size of the block with the current offset
+        uint32_t curr_block_idx = (offset + n_copied) / block_size;
+        uint32_t origin_file_max_block_idx = (file_size + block_size - 1) / block_size; // file_size - 1 because file_size is effectively 1-indexed
+        is_writing_new_blocks = curr_block_idx > origin_file_max_block_idx;
+        uint16_t n_to_copy = min(n - n_copied, block_size - offset_in_block);
+        if (fd_entry->direct && n_to_copy == block_size)
+        {
+            // a whole block goes straight from the caller to the disk, with nothing to merge
+            if (write_block_io(block, str + n_copied, true) != 0)
+            {
+                return EK_WRITE_WRITE_BLOCK_FAILED;
+            }
+            n_copied += n_to_copy;
+        }
+        else
+        {
+            if (is_writing_new_blocks)
+            {
+                memset(char_buf, 0, block_size);
+            }
+            else
+            {
+                if (get_block_io(block, char_buf, fd_entry->direct) != 0)
+                {
+                    return EK_WRITE_GET_BLOCK_FAILED;
+                }
+            }
+
+            memcpy(char_buf + offset_in_block, str + n_copied, n_to_copy);
+            n_copied += n_to_copy; // n_copied out of buf into the file
+            if (write_block_io(block, char_buf, fd_entry->direct))
+            {
+                return EK_WRITE_WRITE_BLOCK_FAILED;
+            }
+        }
+
+        if (n_copied >= n) // we're done
+        {
+            break;
+        }
+
+        // read the next block from the start
+        offset_in_block = 0;
+
+        // try to get the next block of the file
+        uint32_t next_block;
+        if (curr_block_idx + 1 < origin_file_max_block_idx)
+        {
+            if (next_block_num(block, &next_block) != 0)
+            {
+                return EK_WRITE_NEXT_BLOCK_NUM_FAILED;
+            }
+        }
+        else
+        {
+            set_fat(block, FAT_END_OF_FILE); // prevent a loop where we keep getting the same blocks
+            next_block = first_empty_block();
+            if (next_block == 0)
+            {
+                break;
+            }
+        }
+        set_fat(block, next_block);
+        block = next_block;
+    }
+    // the file ends here now, so release whatever followed in the old chain
+    // (it may be shared, in which case freeing it just drops our reference)
+    uint32_t n_new_blocks = (offset + n_copied + block_size - 1) / block_size;
+    uint32_t cut_block = get_fat(block);
+    set_fat(block, FAT_END_OF_FILE);
+    if (cut_block != 0 && cut_block != FAT_END_OF_FILE)
+    {
+        free_file_blocks(cut_block, n_old_blocks > n_new_blocks ? (uint64_t)(n_old_blocks - n_new_blocks) * block_size : 0);
+    }
+    fd_entry->dirty = true;
+
+    // blocks past the old end are new, and blocks past the new end are gone
+    truncate_block_map(fd_entry, n_old_blocks < n_new_blocks ? n_old_blocks : n_new_blocks);
+
+    // increment the file offset by the number of bytes written
+    fd_entry->offset = offset + n_copied;
+
+    // write the updated at time through to the directory entry
+    time_t mtime = time(NULL);
+    if (mtime == (time_t)-1)
+    {
+        return EK_WRITE_TIME_FAILED;
+    }
+    fd_entry->ptr_to_dir_entry->mtime = mtime;
+    set_dir_entry_size(fd_entry->ptr_to_dir_entry, offset + n_copied);
+    // write through to the updated entry to the filesystem
+    if (write_root_dir_entry(fd_entry->ptr_to_dir_entry, dir_entry_block_num, dir_entry_idx) != 0)
+    {
+        // TODO: should we rollback the ptr_to_dir_entry state on failure?
+        return EK_WRITE_WRITE_ROOT_DIR_ENTRY_FAILED;
+    }
+    return n_copied;
+}
+
+/**
+ * Release what k_log_read keeps about the open file fd_entry. It is set up again on the next k_log_read
+ */
+void free_log_reader(global_fd_entry *fd_entry)
+{
+    if (fd_entry->log == NULL)
+    {
+        return;
+    }
+    free(fd_entry->log->index);
+    free(fd_entry->log->window);
+    free(fd_entry->log);
+    fd_entry->log = NULL;
+}
+
+/**
+ * Add offset to the index of the log reader, as the start of the next indexed record.
+ * Returns whether there was room for it
+ */
+bool push_log_index(log_reader *reader, uint32_t offset)
+{
+    if (reader->index_len == reader->index_capacity)
+    {
+        uint32_t new_capacity = reader->index_capacity == 0 ? 16 : reader->index_capacity * 2;
+        uint32_t *new_index = (uint32_t *)realloc(reader->index, new_capacity * sizeof(uint32_t));
+        if (new_index == NULL)
+        {
+            return false;
+        }
+        reader->index = new_index;
+        reader->index_capacity = new_capacity;
+    }
+    reader->index[reader->index_len] = offset;
+    reader->index_len += 1;
+    return true;
+}
+
+/**
+ * k_read n bytes from offset of the open file fd, leaving the offset of fd where it was
+ */
+int read_file_at(int fd, uint64_t offset, int n, char *buf)
+{
+    uint64_t saved_offset = global_fd_table[fd].offset;
+    global_fd_table[fd].offset = offset;
+    int bytes_read = k_read(fd, n, buf);
+    global_fd_table[fd].offset = saved_offset;
+    return bytes_read;
+}
+
+/**
+ * Copy n bytes from offset of the log fd into buf. Whatever is in the window of its reader is
+ * copied from there, and the rest moves the window on to the block it is in, unless it is at
+ * least a block long (then it is read straight into buf). A log never changes before its end,
+ * so the window stays valid until the file is emptied, which frees the reader.
+ * Returns 0 on success, or negative error code (EK_LOG_READ_CORRUPT if the file ends first)
+ */
+int read_log_bytes(int fd, uint32_t offset, uint32_t n, char *buf)
+{
+    log_reader *reader = global_fd_table[fd].log;
+    while (n > 0)
+    {
+        if (offset < reader->window_start || offset >= reader->window_start + reader->window_len)
+        {
+            if (n >= fs.block_size)
+            {
+                int bytes_read = read_file_at(fd, offset, (int)n, buf);
+                if (bytes_read < 0)
+                {
+                    return bytes_read;
+                }
+                return (uint32_t)bytes_read == n ? 0 : EK_LOG_READ_CORRUPT;
+            }
+            uint32_t start = offset - offset % fs.block_size;
+            int bytes_read = read_file_at(fd, start, fs.block_size, reader->window);
+            if (bytes_read < 0)
+            {
+                return bytes_read;
+            }
+            reader->window_start = start;
+            reader->window_len = bytes_read;
+            if (offset >= start + bytes_read)
+            {
+                return EK_LOG_READ_CORRUPT;
+            }
+        }
+        uint32_t n_to_copy = min(n, reader->window_start + reader->window_len - offset);
+        memcpy(buf, reader->window + (offset - reader->window_start), n_to_copy);
+        buf += n_to_copy;
+        offset += n_to_copy;
+        n -= n_to_copy;
+    }
+    return 0;
+}
+
+/**
+ * Set up the reader of the log fd, indexing every LOG_INDEX_INTERVAL-th record with one pass
+ * over the record headers. Returns 0 on success, or negative error code
+ */
+int setup_log_reader(int fd)
+{
+    global_fd_entry *fd_entry = &global_fd_table[fd];
+    fd_entry->log = (log_reader *)calloc(1, sizeof(log_reader));
+    if (fd_entry->log == NULL)
+    {
+        return EK_LOG_READ_MALLOC_FAILED;
+    }
+    fd_entry->log->window = (char *)malloc(fs.block_size);
+    if (fd_entry->log->window == NULL)
+    {
+        free_log_reader(fd_entry);
+        return EK_LOG_READ_MALLOC_FAILED;
+    }
+
+    uint32_t offset = 0;
+    for (uint32_t record = 0; record < fd_entry->ptr_to_dir_entry->n_records; record++)
+    {
+        if (record % LOG_INDEX_INTERVAL == 0 && !push_log_index(fd_entry->log, offset))
+        {
+            free_log_reader(fd_entry);
+            return EK_LOG_READ_MALLOC_FAILED;
+        }
+        uint32_t len;
+        int status = read_log_bytes(fd, offset, LOG_RECORD_HEADER_SIZE, (char *)&len);
+        if (status != 0)
+        {
+            free_log_reader(fd_entry);
+            return status;
+        }
+        offset += LOG_RECORD_HEADER_SIZE + len;
+    }
+    return 0;
+}
+
+int k_log_append(int fd, const char *rec, int len)
+{
+    select_fd_volume(fd);
+    if (!volume_is_mounted())
+    {
+        return EFS_NOT_MOUNTED;
+    }
+
+    if (is_read_only())
+    {
+        return EK_READ_ONLY_FS;
+    }
+
+    if (fd >= GLOBAL_FD_TABLE_SIZE || fd < 0)
+    {
+        return EK_LOG_APPEND_FD_OUT_OF_RANGE;
+    }
+
+    global_fd_entry *fd_entry = &global_fd_table[fd];
+    if (fd_entry->ref_count == 0)
+    {
+        return EK_LOG_APPEND_FD_NOT_IN_TABLE;
+    }
+
+    directory_entry *ptr_to_dir_entry = fd_entry->ptr_to_dir_entry;
+    if (ptr_to_dir_entry->type != FILE_TYPE_LOG)
+    {
+        return EK_LOG_APPEND_NOT_A_LOG;
+    }
+
+    uint8_t perm = ptr_to_dir_entry->perm;
+    if (perm != P_WRITE_ONLY_FILE_PERMISSION && perm < P_READ_WRITE_AND_EXECUTABLE_FILE_PERMISSION)
+    {
+        return EK_LOG_APPEND_WRONG_PERMISSIONS;
+    }
+
+    uint64_t old_size = dir_entry_size(ptr_to_dir_entry);
+    if (len < 0 || len > INT_MAX - LOG_RECORD_HEADER_SIZE || old_size + LOG_RECORD_HEADER_SIZE + len > UINT32_MAX)
+    {
+        return EK_LOG_APPEND_BAD_LENGTH;
+    }
+
+    // the header and the record go out together, so the tail block is written once
+    char small_buf[256];
+    int n = LOG_RECORD_HEADER_SIZE + len;
+    char *record_buf = n <= (int)sizeof(small_buf) ? small_buf : (char *)malloc(n);
+    if (record_buf == NULL)
+    {
+        return EK_LOG_APPEND_MALLOC_FAILED;
+    }
+    uint32_t header = (uint32_t)len;
+    memcpy(record_buf, &header, LOG_RECORD_HEADER_SIZE);
+    memcpy(record_buf + LOG_RECORD_HEADER_SIZE, rec, len);
+
+    // counting the record first means the write puts the count on disk along with the new size
+    uint32_t idx = ptr_to_dir_entry->n_records;
+    ptr_to_dir_entry->n_records += 1;
+    fd_entry->offset = old_size;
+    int bytes_written = write_file(fd_entry, record_buf, n);
+    if (record_buf != small_buf)
+    {
+        free(record_buf);
+    }
+
+    if (bytes_written != n)
+    {
+        // cut off whatever part of the record made it, so the log still ends on a record
+        uint32_t n_blocks = (old_size + fs.block_size - 1) / fs.block_size;
+        uint32_t cut_block = dir_entry_first_block(ptr_to_dir_entry);
+        if (n_blocks == 0)
+        {
+            set_dir_entry_first_block(ptr_to_dir_entry, 0);
+        }
+        else
+        {
+            uint32_t last_block = file_block(fd_entry, n_blocks - 1);
+            cut_block = get_fat(last_block);
+            set_fat(last_block, FAT_END_OF_FILE);
+        }
+        if (cut_block != 0 && cut_block != FAT_END_OF_FILE)
+        {
+            clear_fat_file(cut_block);
+        }
+        truncate_block_map(fd_entry, n_blocks);
+        set_dir_entry_size(ptr_to_dir_entry, old_size);
+        ptr_to_dir_entry->n_records = idx;
+        fd_entry->offset = old_size;
+        write_root_dir_entry(ptr_to_dir_entry, fd_entry->dir_entry_block_num, fd_entry->dir_entry_idx);
+        return bytes_written < 0 ? bytes_written : EK_LOG_APPEND_NO_SPACE;
+    }
+
+    // keep the index of a log that is being read complete. It is only a cache, so if it
+    // can't grow it is dropped and rebuilt by the next k_log_read
+    if (fd_entry->log != NULL && idx % LOG_INDEX_INTERVAL == 0 && !push_log_index(fd_entry->log, old_size))
+    {
+        free_log_reader(fd_entry);
+    }
+    return (int)idx;
+}
+
+int k_log_read(int fd, uint32_t idx, char *buf, uint32_t size)
+{
+    select_fd_volume(fd);
+    if (!volume_is_mounted())
+    {
+        return EFS_NOT_MOUNTED;
+    }
+
+    if (fd >= GLOBAL_FD_TABLE_SIZE || fd < 0)
+    {
+        return EK_LOG_READ_FD_OUT_OF_RANGE;
+    }
+
+    global_fd_entry *fd_entry = &global_fd_table[fd];
+    if (fd_entry->ref_count == 0)
+    {
+        return EK_LOG_READ_FD_NOT_IN_TABLE;
+    }
+    if (fd_entry->ptr_to_dir_entry->type != FILE_TYPE_LOG)
+    {
+        return EK_LOG_READ_NOT_A_LOG;
+    }
+    if (idx >= fd_entry->ptr_to_dir_entry->n_records)
+    {
+        return EK_LOG_READ_NO_SUCH_RECORD;
+    }
+
+    if (fd_entry->log == NULL)
+    {
+        int status = setup_log_reader(fd);
+        if (status != 0)
+        {
+            return status;
+        }
+    }
+    log_reader *reader = fd_entry->log;
+
+    // start from the closest indexed record, or from where the last read left off if that is closer
+    uint32_t record = idx / LOG_INDEX_INTERVAL * LOG_INDEX_INTERVAL;
+    uint32_t offset = reader->index[idx / LOG_INDEX_INTERVAL];
+    if (reader->next_record > record && reader->next_record <= idx)
+    {
+        record = reader->next_record;
+        offset = reader->next_offset;
+    }
+
+    uint32_t len;
+    while (true)
+    {
+        int status = read_log_bytes(fd, offset, LOG_RECORD_HEADER_SIZE, (char *)&len);
+        if (status != 0)
+        {
+            return status;
+        }
+        offset += LOG_RECORD_HEADER_SIZE;
+        if (record == idx)
+        {
+            break;
+        }
+        offset += len;
+        record += 1;
+    }
+
+    int status = read_log_bytes(fd, offset, min(len, size), buf);
+    if (status != 0)
+    {
+        return status;
+    }
+    reader->next_record = idx + 1;
+    reader->next_offset = offset + len;
+    return (int)len;
+}
+
+/**
+ * Delete the file called name in dir, like k_unlink
+ */
+int unlink_file(const dir_ref *dir, const char *name)
+{
+    uint32_t dir_entry_block_num;
+    uint8_t dir_entry_idx;
+    directory_entry dir_entry; // we may or may not use this; see below
+    directory_entry *ptr_to_updated_dir_entry;
+    uint16_t fd_idx;
+
+    if (find_file_in_global_fd_table(dir->first_block, name, &fd_idx) == 0)
+    {
+        // update the directory entry in the fd and set update_dir_entry so it's written through
+        global_fd_entry *fd_entry = &global_fd_table[fd_idx];
+        ptr_to_updated_dir_entry = fd_entry->ptr_to_dir_entry;
+        if (fd_entry->ref_count > 0)
+        {
+            ptr_to_updated_dir_entry->name[0] = 2; // indicates that it is deleted but still open // TODO: no magic nums
+        }
+        else
+        {
+            ptr_to_updated_dir_entry->name[0] = 1;
+            if (dir_entry_first_block(ptr_to_updated_dir_entry) != 0)
+            {
+                free_file_blocks(dir_entry_first_block(ptr_to_updated_dir_entry), dir_entry_size(ptr_to_updated_dir_entry));
+            }
+            free_file_fragment(ptr_to_updated_dir_entry);
+        }
+        dir_entry_block_num = fd_entry->dir_entry_block_num;
+        dir_entry_idx = fd_entry->dir_entry_idx;
+    }
+    else
+    {
+        // if we've reached this point, either:
+        // - the reference count of the global_fd_entry is 0 or the name is not in the fd table
+        // - the file is already deleted, and thus we can't find it
+        // We can't really distinguish between these cases, so we have to look for the file in the
+        // directory
+        ptr_to_updated_dir_entry = &dir_entry;
+        int find_file_in_dir_status = find_file_in_dir(dir, name, ptr_to_updated_dir_entry, &dir_entry_block_num, &dir_entry_idx);
+        if (find_file_in_dir_status < 0)
+        {
+            return EK_UNLINK_FIND_FILE_IN_ROOT_DIR_FAILED;
+        }
+        if (
+            find_file_in_dir_status == RFIND_FILE_IN_ROOT_DIR_FILE_NOT_FOUND ||
+            find_file_in_dir_status == RFIND_FILE_IN_ROOT_DIR_FILE_DELETED)
+        {
+            return EK_UNLINK_FILE_NOT_FOUND;
+        }
+        // directories go through k_rmdir, which checks that they are empty
+        if (ptr_to_updated_dir_entry->type == FILE_TYPE_DIRECTORY)
+        {
+            return EK_UNLINK_IS_DIRECTORY;
+        }
+        ptr_to_updated_dir_entry->name[0] = 1; // mark as deleted
+        if (dir_entry_first_block(ptr_to_updated_dir_entry) != 0)
+        {
+            free_file_blocks(dir_entry_first_block(ptr_to_updated_dir_entry), dir_entry_size(ptr_to_updated_dir_entry));
+        }
+        free_file_fragment(ptr_to_updated_dir_entry);
+    }
+
+    // write through to the updated entry to the filesystem
+    if (write_root_dir_entry(ptr_to_updated_dir_entry, dir_entry_block_num, dir_entry_idx) != 0)
+    {
+        return EK_UNLINK_WRITE_ROOT_DIR_ENTRY_FAILED;
+    }
+
+    if (ptr_to_updated_dir_entry->name[0] == 1)
+    {
+        note_deleted_entry(dir->first_block);
+    }
+    return 0;
+}
+
+int k_unlink(const char *fname)
+{
+    fname = select_volume(fname);
+    if (fname == NULL)
+    {
+        return EK_UNKNOWN_VOLUME;
+    }
+    if (!volume_is_mounted())
+    {
+        return EFS_NOT_MOUNTED;
+    }
+
+    if (is_read_only())
+    {
+        return EK_READ_ONLY_FS;
+    }
+
+    // we check for invalid filenames to prevent access to deleted files
+    // (e.g., adversarially setting the first byte to 1 or 2 to discover deleted files)
+    dir_ref dir;
+    char name[MAX_FILENAME_SIZE + 1];
+    int resolve_status = resolve_parent(fname, &dir, name);
+    if (resolve_status < 0)
+    {
+        return EK_UNLINK_FIND_FILE_IN_ROOT_DIR_FAILED;
+    }
+    if (resolve_status == RRESOLVE_PARENT_INVALID_NAME || name[0] == '\0')
+    {
+        return EK_UNLINK_INVALID_FILENAME;
+    }
+    if (resolve_status == RRESOLVE_PARENT_NOT_FOUND)
+    {
+        return EK_UNLINK_FILE_NOT_FOUND;
+    }
+    return unlink_file(&dir, name);
+}
+
+int ls_dir_entry(directory_entry *ptr_to_dir_entry)
+{
+    // can write no more than block_size bytes
+    // this should be enough since
+    // - the block number is at most 4,294,967,294 on a fat32 image (10 bytes to represent)
+    // - the permission is 3 bytes
+    // - the size is at most 18,446,744,073,709,551,615 which is 20 bytes
+    // - the time is at most 18 bytes
+    // - the name is at most 31 bytes (since it's a null-terminated string)
+    // Including the 4 spaces between the columns, this is 86 bytes. Including the final newline and the null terminator, this is 88 bytes.
+    // so our block size of at least 256 is sufficient.
+
+    char *buf = (char *)fs.block_buf;
+    int total_bytes_written = 0;
+    int n_bytes_written;
+    if (dir_entry_first_block(ptr_to_dir_entry) != 0)
+    {
+        n_bytes_written = sprintf(buf, "%3u", dir_entry_first_block(ptr_to_dir_entry));
+        if (n_bytes_written < 0)
+        {
+            return EK_LS_WRITE_FAILED;
+        }
+        total_bytes_written += n_bytes_written;
+    }
+    else
+    {
+        n_bytes_written = sprintf(buf, "    ");
+        if (n_bytes_written < 0)
+        {
+            return EK_LS_WRITE_FAILED;
+        }
+        total_bytes_written += n_bytes_written;
+    }
+
+    // construct the permission string
+    char perm_str[5];
+    perm_str[0] = (ptr_to_dir_entry->type == FILE_TYPE_DIRECTORY) ? 'd' : '-';
+    perm_str[1] = (ptr_to_dir_entry->perm & 4) ? 'r' : '-'; // 0b100 = 4
+    perm_str[2] = (ptr_to_dir_entry->perm & 2) ? 'w' : '-'; // 0b010 = 2
+    perm_str[3] = (ptr_to_dir_entry->perm & 1) ? 'x' : '-'; // 0b001 = 1
+    perm_str[4] = '\0';
+
+    n_bytes_written = sprintf(buf + n_bytes_written, " %s", perm_str);
+    if (n_bytes_written < 0)
+    {
+        return EK_LS_WRITE_FAILED;
+    }
+    total_bytes_written += n_bytes_written;
+
+    n_bytes_written = sprintf(buf + total_bytes_written, " %llu", (unsigned long long)dir_entry_size(ptr_to_dir_entry));
+    if (n_bytes_written < 0)
+    {
+        return EK_LS_WRITE_FAILED;
+    }
+    total_bytes_written += n_bytes_written;
+
+    n_bytes_written = strftime(buf + total_bytes_written, 19, " %b %d %H:%M %Y", localtime(&ptr_to_dir_entry->mtime));
+    if (n_bytes_written < 0)
+    {
+        return EK_LS_WRITE_FAILED;
+    }
+    total_bytes_written += n_bytes_written;
+
+    n_bytes_written = sprintf(buf + total_bytes_written, " %s\n", ptr_to_dir_entry->name);
+
+    if (n_bytes_written < 0)
+    {
+        return EK_LS_WRITE_FAILED;
+    }
+    total_bytes_written += n_bytes_written;
+
+    k_write(STDOUT_FD, buf, total_bytes_written);
+
+    return 0;
+}
+
+int k_ls(const char *filename)
+{
+    // "scratch:" lists the whole volume mounted as scratch
+    if (filename != NULL)
+    {
+        filename = select_volume(filename);
+        if (filename != NULL && filename[0] == '\0')
+        {
+            filename = NULL;
+        }
+        else if (filename == NULL)
+        {
+            return EK_UNKNOWN_VOLUME;
+        }
+    }
+    else
+    {
+        current_volume = &volumes[0];
+    }
+    if (!volume_is_mounted())
+    {
+        return EFS_NOT_MOUNTED;
+    }
+
+    // a directory has its entries listed, and anything else just its own entry
+    dir_ref dir = {.first_block = 1, .n_buckets = 0, .entry_block = 0, .entry_idx = 0};
+    if (filename != NULL)
+    {
+        char name[MAX_FILENAME_SIZE + 1];
+        if (resolve_parent(filename, &dir, name) != RRESOLVE_PARENT_FOUND)
+        {
+            return EK_LS_FIND_FILE_IN_ROOT_DIR_FAILED;
+        }
+        if (name[0] != '\0')
+        {
+            directory_entry dir_entry;
+            uint32_t dir_entry_block_num;
+            uint8_t dir_entry_idx;
+            if (find_file_in_dir(&dir, name, &dir_entry, &dir_entry_block_num, &dir_entry_idx) != 0)
+            {
+                // either failed or the file doesn't exist (we don't distinguish here)
+                return EK_LS_FIND_FILE_IN_ROOT_DIR_FAILED;
+            }
+            if (!enter_dir(&dir_entry, dir_entry_block_num, dir_entry_idx, &dir))
+            {
+                return ls_dir_entry(&dir_entry);
+            }
+        }
+    }
+
+    uint32_t block = dir.first_block;
+    // we'll need a second buffer here, since ls_dir_entry uses the fs.block_buf
+    // and we'll need to keep track of the block as we go
+    directory_entry *dir_entry_buf = (directory_entry *)malloc(fs.block_size);
+    if (dir_entry_buf == NULL)
+    {
+        return EK_LS_MALLOC_FAILED;
+    }
+
+    // n_dir_entry_per_block is at most 4096 / 64 = 64
+    uint8_t n_dir_entry_per_block = fs.block_size / sizeof(directory_entry);
+    int status = 0;
+    // the root directory ends at its end of directory entry, and a subdirectory at the end of its chain
+    while (block != FAT_END_OF_FILE)
+    {
+        if (get_block(block, dir_entry_buf) != 0)
+        {
+            status = EK_LS_GET_BLOCK_FAILED;
+            goto cleanup;
+        }
+
+        for (uint8_t i = 0; i < n_dir_entry_per_block; i++)
+        {
+            directory_entry curr_dir_entry = dir_entry_buf[i];
+            if (curr_dir_entry.name[0] == 0 && dir.n_buckets == 0)
+            {
+                status = 0;
+                goto cleanup;
+            }
+            if (curr_dir_entry.name[0] <= 2)
+            {
+                continue;
+            }
+
+            ls_dir_entry(&curr_dir_entry);
+        }
+
+        if (next_block_num(block, &block) != 0)
+        {
+            status = EK_LS_NEXT_BLOCK_NUM_FAILED;
+            goto cleanup;
+        }
+    };
+
+cleanup:
+    free(dir_entry_buf);
+    return status;
+}
+
+int k_stat(const char *fname, directory_entry *dir_entry_ptr)
+{
+    fname = select_volume(fname);
+    if (fname == NULL)
+    {
+        return EK_UNKNOWN_VOLUME;
+    }
+    if (!volume_is_mounted())
+    {
+        return EFS_NOT_MOUNTED;
+    }
+
+    // as in k_chmod, invalid names would let deleted entries be looked up
+    dir_ref dir;
+    char name[MAX_FILENAME_SIZE + 1];
+    int status = resolve_parent(fname, &dir, name);
+    if (status < 0)
+    {
+        return EK_STAT_FIND_FILE_IN_ROOT_DIR_FAILED;
+    }
+    if (status != RRESOLVE_PARENT_FOUND || (name[0] == '\0' && fname[0] != '/'))
+    {
+        return EK_STAT_FILE_NOT_FOUND;
+    }
+    // the root directory has no entry of its own
+    if (name[0] == '\0')
+    {
+        *dir_entry_ptr = (directory_entry){
+            .name = "/",
+            .first_block = 1,
+            .type = FILE_TYPE_DIRECTORY,
+            .perm = DIRECTORY_PERMISSION};
+        return 0;
+    }
+
+    uint32_t dir_entry_block_num;
+    uint8_t dir_entry_idx;
+    status = find_file_in_dir(&dir, name, dir_entry_ptr, &dir_entry_block_num, &dir_entry_idx);
+    if (status < 0)
+    {
+        return EK_STAT_FIND_FILE_IN_ROOT_DIR_FAILED;
+    }
+    if (status != RFIND_FILE_IN_ROOT_DIR_FILE_FOUND)
+    {
+        return EK_STAT_FILE_NOT_FOUND;
+    }
+    return 0;
+}
+
+int k_chmod(const char *fname, uint8_t perm, int mode)
+{
+    fname = select_volume(fname);
+    if (fname == NULL)
+    {
+        return EK_UNKNOWN_VOLUME;
+    }
+    if (!volume_is_mounted())
+    {
+        return EFS_NOT_MOUNTED;
+    }
+
+    if (is_read_only())
+    {
+        return EK_READ_ONLY_FS;
+    }
+
+    // we check for invalid filenames to prevent access to deleted files
+    // (e.g., adversarially setting the first byte to 1 or 2 to discover deleted files)
+    dir_ref dir;
+    char name[MAX_FILENAME_SIZE + 1];
+    int resolve_status = resolve_parent(fname, &dir, name);
+    if (resolve_status == RRESOLVE_PARENT_INVALID_NAME || (resolve_status == RRESOLVE_PARENT_FOUND && name[0] == '\0'))
+    {
+        return EK_CHMOD_INVALID_FILENAME;
+    }
+
+    uint32_t dir_entry_block_num;
+    uint8_t dir_entry_idx;
+    directory_entry dir_entry;
+    if (resolve_status != RRESOLVE_PARENT_FOUND || find_file_in_dir(&dir, name, &dir_entry, &dir_entry_block_num, &dir_entry_idx) != 0)
+    {
+        return EK_CHMOD_FILE_NOT_FOUND;
+    }
+
+    if (perm < 0 || perm > 7)
+    {
+        return EK_CHMOD_WRONG_PERMISSIONS;
+    }
+
+    if (mode == F_CHMOD_SET) {
+        dir_entry.perm = perm;
+    } else if (mode == F_CHMOD_ADD) {
+        dir_entry.perm |= perm;
+    } else if (mode == F_CHMOD_REMOVE) {
+        dir_entry.perm &= ~perm;
+    } else {
+        return EK_CHMOD_INVALID_MODE;
+    }
+    if (write_root_dir_entry(&dir_entry, dir_entry_block_num, dir_entry_idx) != 0)
+    {
+        return EK_CHMOD_WRITE_ROOT_DIR_ENTRY_FAILED;
+    }
+
+    return 0;
+}
+
+int k_mkdir(const char *path)
+{
+    path = select_volume(path);
+    if (path == NULL)
+    {
+        return EK_UNKNOWN_VOLUME;
+    }
+    if (!volume_is_mounted())
+    {
+        return EFS_NOT_MOUNTED;
+    }
+
+    if (is_read_only())
+    {
+        return EK_READ_ONLY_FS;
+    }
+
+    dir_ref dir;
+    char name[MAX_FILENAME_SIZE + 1];
+    int status = resolve_parent(path, &dir, name);
+    if (status < 0)
+    {
+        return EK_MKDIR_FIND_FILE_FAILED;
+    }
+    if (status == RRESOLVE_PARENT_INVALID_NAME || name[0] == '\0')
+    {
+        return EK_MKDIR_INVALID_FILENAME;
+    }
+    if (status == RRESOLVE_PARENT_NOT_FOUND)
+    {
+        return EK_MKDIR_PARENT_NOT_FOUND;
+    }
+
+    directory_entry dir_entry;
+    uint32_t dir_entry_block_num;
+    uint8_t dir_entry_idx;
+    status = find_file_in_dir(&dir, name, &dir_entry, &dir_entry_block_num, &dir_entry_idx);
+    if (status < 0)
+    {
+        return EK_MKDIR_FIND_FILE_FAILED;
+    }
+    if (status == RFIND_FILE_IN_ROOT_DIR_FILE_FOUND)
+    {
+        return EK_MKDIR_EXISTS;
+    }
+
+    time_t mtime = time(NULL);
+    if (mtime == (time_t)-1)
+    {
+        return EK_MKDIR_TIME_FAILED;
+    }
+
+    // a new directory is a single empty bucket
+    uint32_t first_block = first_empty_block();
+    if (first_block == 0)
+    {
+        return EK_MKDIR_NO_SPACE;
+    }
+    memset(fs.block_buf, 0, fs.block_size);
+    if (write_block(first_block, fs.block_buf) != 0)
+    {
+        return EK_MKDIR_WRITE_BLOCK_FAILED;
+    }
+    set_fat(first_block, FAT_END_OF_FILE);
+
+    dir_entry = (directory_entry){
+        .name = {0},
+        .size = 0,
+        .first_block = 0,
+        .type = FILE_TYPE_DIRECTORY,
+        .perm = DIRECTORY_PERMISSION,
+        .mtime = mtime,
+        .frag_block = 0,
+        .frag_offset = 0,
+        .first_block_hi = 0,
+        .frag_block_hi = 0,
+        .size_hi = 0};
+    strcpy(dir_entry.name, name); // checked by resolve_parent
+    set_dir_entry_first_block(&dir_entry, first_block);
+    set_dir_entry_size(&dir_entry, fs.block_size);
+    if (write_new_dir_entry(&dir, &dir_entry, &dir_entry_block_num, &dir_entry_idx) != 0)
+    {
+        set_fat(first_block, 0);
+        return EK_MKDIR_WRITE_DIR_ENTRY_FAILED;
+    }
+    return 0;
+}
+
+int k_rmdir(const char *path)
+{
+    path = select_volume(path);
+    if (path == NULL)
+    {
+        return EK_UNKNOWN_VOLUME;
+    }
+    if (!volume_is_mounted())
+    {
+        return EFS_NOT_MOUNTED;
+    }
+
+    if (is_read_only())
+    {
+        return EK_READ_ONLY_FS;
+    }
+
+    dir_ref dir;
+    char name[MAX_FILENAME_SIZE + 1];
+    int status = resolve_parent(path, &dir, name);
+    if (status < 0)
+    {
+        return EK_RMDIR_FIND_FILE_FAILED;
+    }
+    if (status == RRESOLVE_PARENT_INVALID_NAME || name[0] == '\0')
+    {
+        return EK_RMDIR_INVALID_FILENAME;
+    }
+    if (status == RRESOLVE_PARENT_NOT_FOUND)
+    {
+        return EK_RMDIR_NOT_FOUND;
+    }
+
+    directory_entry dir_entry;
+    uint32_t dir_entry_block_num;
+    uint8_t dir_entry_idx;
+    status = find_file_in_dir(&dir, name, &dir_entry, &dir_entry_block_num, &dir_entry_idx);
+    if (status < 0)
+    {
+        return EK_RMDIR_FIND_FILE_FAILED;
+    }
+    if (status != RFIND_FILE_IN_ROOT_DIR_FILE_FOUND)
+    {
+        return EK_RMDIR_NOT_FOUND;
+    }
+    dir_ref subdir;
+    if (!enter_dir(&dir_entry, dir_entry_block_num, dir_entry_idx, &subdir))
+    {
+        return EK_RMDIR_NOT_A_DIRECTORY;
+    }
+
+    // files deleted while open (name[0] == 2) still have their entry written back at close
+    uint8_t n_dir_entry_per_block = fs.block_size / sizeof(directory_entry);
+    directory_entry *dir_entry_buf = (directory_entry *)fs.block_buf;
+    uint32_t block = subdir.first_block;
+    for (uint32_t i = 0; i < subdir.n_buckets; i++)
+    {
+        if (get_block(block, dir_entry_buf) != 0)
+        {
+            return EK_RMDIR_GET_BLOCK_FAILED;
+        }
+        for (uint8_t j = 0; j < n_dir_entry_per_block; j++)
+        {
+            if (dir_entry_buf[j].name[0] > 1)
+            {
+                return EK_RMDIR_NOT_EMPTY;
+            }
+        }
+        block = get_fat(block);
+    }
+
+    // the entry goes first, so it never points at blocks that may have been reused
+    dir_entry.name[0] = 1;
+    set_dir_entry_first_block(&dir_entry, 0);
+    if (write_root_dir_entry(&dir_entry, dir_entry_block_num, dir_entry_idx) != 0)
+    {
+        return EK_RMDIR_WRITE_DIR_ENTRY_FAILED;
+    }
+    free_file_blocks(subdir.first_block, dir_entry_size(&dir_entry));
+    note_deleted_entry(dir.first_block);
+    return 0;
+}
+
+// where k_mv moves a file from and to (see find_mv_entries)
+typedef struct mv_entries_st
+{
+    dir_ref src_dir;
+    char src_name[MAX_FILENAME_SIZE + 1];
+    directory_entry src_entry;
+    uint32_t src_block;
+    uint8_t src_idx;
+    dir_ref dest_dir;
+    char dest_name[MAX_FILENAME_SIZE + 1];
+    bool dest_exists;
+    directory_entry dest_entry;
+    uint32_t dest_block;
+    uint8_t dest_idx;
+} mv_entries;
+
+/**
+ * Look up src and dest for k_mv. When dest is a directory, the file moves into it under
+ * the name it has now.
+ *
+ * Returns 0 on success and an EK_MV_* error code on error.
+ */
+int find_mv_entries(const char *src, const char *dest, mv_entries *mv)
+{
+    int status = resolve_parent(src, &mv->src_dir, mv->src_name);
+    if (status < 0)
+    {
+        return EK_MV_FIND_FILE_FAILED;
+    }
+    if (status != RRESOLVE_PARENT_FOUND || mv->src_name[0] == '\0')
+    {
+        return EK_MV_FILE_NOT_FOUND;
+    }
+    status = find_file_in_dir(&mv->src_dir, mv->src_name, &mv->src_entry, &mv->src_block, &mv->src_idx);
+    if (status < 0)
+    {
+        return EK_MV_FIND_FILE_FAILED;
+    }
+    if (status != RFIND_FILE_IN_ROOT_DIR_FILE_FOUND)
+    {
+        return EK_MV_FILE_NOT_FOUND;
+    }
+
+    status = resolve_parent(dest, &mv->dest_dir, mv->dest_name);
+    if (status < 0)
+    {
+        return EK_MV_FIND_FILE_FAILED;
+    }
+    if (status == RRESOLVE_PARENT_INVALID_NAME)
+    {
+        return EK_MV_INVALID_FILENAME;
+    }
+    if (status == RRESOLVE_PARENT_NOT_FOUND)
+    {
+        return EK_MV_FILE_NOT_FOUND;
+    }
+    bool into_dir = mv->dest_name[0] == '\0'; // dest is the root directory
+    while (true)
+    {
+        if (into_dir)
+        {
+            strcpy(mv->dest_name, mv->src_name);
+        }
+        status = find_file_in_dir(&mv->dest_dir, mv->dest_name, &mv->dest_entry, &mv->dest_block, &mv->dest_idx);
+        if (status < 0)
+        {
+            return EK_MV_FIND_FILE_FAILED;
+        }
+        mv->dest_exists = status == RFIND_FILE_IN_ROOT_DIR_FILE_FOUND;
+        if (
+            into_dir || !mv->dest_exists || (mv->dest_block == mv->src_block && mv->dest_idx == mv->src_idx) ||
+            !enter_dir(&mv->dest_entry, mv->dest_block, mv->dest_idx, &mv->dest_dir))
+        {
+            return 0;
+        }
+        into_dir = true;
+    }
+}
+
+int k_mv(const char *src, const char *dest)
+{
+    const char *dest_path = select_volume(dest);
+    fat16_fs *dest_volume = current_volume;
+    const char *src_path = select_volume(src);
+    if (src_path == NULL || dest_path == NULL)
+    {
+        return EK_UNKNOWN_VOLUME;
+    }
+    if (!volume_is_mounted())
+    {
+        return EFS_NOT_MOUNTED;
+    }
+    if (current_volume != dest_volume)
+    {
+        return EK_MV_CROSS_VOLUME;
+    }
+
+    if (is_read_only())
+    {
+        return EK_READ_ONLY_FS;
+    }
+
+    // dest can be the root directory, to move into it, but not ""
+    bool dest_is_root = dest_path[0] == '/' && dest_path[strspn(dest_path, "/")] == '\0';
+    if (!dest_is_root && !is_valid_path(dest_path))
+    {
+        return EK_MV_INVALID_FILENAME;
+    }
+
+    mv_entries mv;
+    int status = find_mv_entries(src_path, dest_path, &mv);
+    if (status != 0)
+    {
+        return status;
+    }
+    if (mv.dest_exists && mv.dest_block == mv.src_block && mv.dest_idx == mv.src_idx)
+    {
+        return 0;
+    }
+    if (mv.dest_exists && mv.dest_entry.type == FILE_TYPE_DIRECTORY)
+    {
+        return EK_MV_DEST_IS_DIRECTORY;
+    }
+    // a file still needs read permission to be moved, as when k_mv opened it to do so
+    uint8_t perm = mv.src_entry.perm;
+    if (mv.src_entry.type != FILE_TYPE_DIRECTORY && (perm == P_NO_FILE_PERMISSION || perm == P_WRITE_ONLY_FILE_PERMISSION))
+    {
+        return EK_MV_WRONG_PERMISSIONS;
+    }
+    if (mv.src_entry.type == FILE_TYPE_DIRECTORY && is_subdir_block(dir_entry_first_block(&mv.src_entry), mv.dest_dir.first_block))
+    {
+        return EK_MV_INTO_ITSELF;
+    }
+
+    // if the dest file exists, we need to unlink it. That may compact the root directory,
+    // which moves entries around, so everything is looked up again
+    if (mv.dest_exists)
+    {
+        if (unlink_file(&mv.dest_dir, mv.dest_name) != 0)
+        {
+            return EK_MV_UNLINK_FAILED;
+        }
+        status = find_mv_entries(src_path, dest_path, &mv);
+        if (status != 0)
+        {
+            return status;
+        }
+    }
+
+    directory_entry moved_entry = mv.src_entry;
+    strcpy(moved_entry.name, mv.dest_name); // checked by find_mv_entries
+    uint32_t new_block = mv.src_block;
+    uint8_t new_idx = mv.src_idx;
+    bool in_place = mv.src_dir.n_buckets == 0 && mv.dest_dir.n_buckets == 0;
+    if (in_place)
+    {
+        // renaming within the root directory keeps the entry where it is
+        if (write_root_dir_entry(&moved_entry, mv.src_block, mv.src_idx) != 0)
+        {
+            return EK_MV_WRITE_ROOT_DIR_ENTRY_FAILED;
+        }
+        if (fs.names != NULL)
+        {
+            name_filter_add(fs.names, mv.dest_name);
+        }
+    }
+    else
+    {
+        // the old slot is freed first, since in a subdirectory it may be the only one left in the bucket
+        directory_entry deleted_entry = mv.src_entry;
+        deleted_entry.name[0] = 1;
+        if (write_root_dir_entry(&deleted_entry, mv.src_block, mv.src_idx) != 0)
+        {
+            return EK_MV_WRITE_ROOT_DIR_ENTRY_FAILED;
+        }
+        if (write_new_dir_entry(&mv.dest_dir, &moved_entry, &new_block, &new_idx) != 0)
+        {
+            write_root_dir_entry(&mv.src_entry, mv.src_block, mv.src_idx);
+            return EK_MV_WRITE_ROOT_DIR_ENTRY_FAILED;
+        }
+    }
+
+    // an open file follows its entry
+    uint16_t fd_idx;
+    if (find_file_in_global_fd_table(mv.src_dir.first_block, mv.src_name, &fd_idx) == 0)
     {
         global_fd_entry *fd_entry = &global_fd_table[fd_idx];
+        strcpy(fd_entry->ptr_to_dir_entry->name, mv.dest_name);
+        fd_entry->dir_block = mv.dest_dir.first_block;
+        fd_entry->dir_entry_block_num = new_block;
+        fd_entry->dir_entry_idx = new_idx;
+    }
+    if (!in_place)
+    {
+        note_deleted_entry(mv.src_dir.first_block);
+    }
+    return 0;
+}
+
+int k_clone(const char *src, const char *dest)
+{
+    // k_open below selects the volume again from the full names
+    const char *dest_name = select_volume(dest);
+    fat16_fs *dest_volume = current_volume;
+    const char *src_name = select_volume(src);
+    if (src_name == NULL || dest_name == NULL)
+    {
+        return EK_UNKNOWN_VOLUME;
+    }
+    if (!volume_is_mounted())
+    {
+        return EFS_NOT_MOUNTED;
+    }
+    if (current_volume != dest_volume)
+    {
+        return EK_CLONE_CROSS_VOLUME;
+    }
 
-        // we already have an entry in the global file table
-        if (fd_entry->write_locked && (mode == F_WRITE || mode == F_APPEND))
+    if (is_read_only())
+    {
+        return EK_READ_ONLY_FS;
+    }
+
+    if (!is_valid_path(dest_name))
+    {
+        return EK_CLONE_INVALID_FILENAME;
+    }
+
+    // opening dest for writing below would truncate src
+    if (strcmp(src_name, dest_name) == 0)
+    {
+        return 0;
+    }
+
+    int src_fd = k_open(src, F_READ);
+    if (src_fd == EK_OPEN_FILE_DOES_NOT_EXIST)
+    {
+        return EK_CLONE_FILE_NOT_FOUND;
+    }
+    else if (src_fd < 0)
+    {
+        return EK_CLONE_OPEN_FAILED;
+    }
+
+    // a fragment can't be shared by reference counting its block
+    int status = 0;
+    if (unpack_file(&global_fd_table[src_fd]) != 0)
+    {
+        status = EK_CLONE_UNPACK_FAILED;
+        goto cleanup_src;
+    }
+
+    int dest_fd = k_open(dest, F_WRITE); // truncates dest, dropping its references to its old blocks
+    if (dest_fd < 0)
+    {
+        status = EK_CLONE_OPEN_FAILED;
+        goto cleanup_src;
+    }
+
+    // the in memory copy of the source's directory entry is shared with any writers,
+    // so it reflects every write up to now
+    directory_entry *src_dir_entry = global_fd_table[src_fd].ptr_to_dir_entry;
+    directory_entry *dest_dir_entry = global_fd_table[dest_fd].ptr_to_dir_entry;
+    uint32_t first_block = dir_entry_first_block(src_dir_entry);
+    if (first_block != 0)
+    {
+        if (fs.extra_refs[first_block] == UINT16_MAX)
         {
-            return EK_OPEN_ALREADY_WRITE_LOCKED;
+            status = EK_CLONE_TOO_MANY_REFERENCES;
+            goto cleanup;
         }
+        // the whole chain is now reachable from dest too, and gets copied on write
+        fs.extra_refs[first_block] += 1;
     }
-    else
+
+    time_t mtime = time(NULL);
+    if (mtime == (time_t)-1)
     {
+        status = EK_CLONE_TIME_FAILED;
+        goto cleanup;
+    }
+    set_dir_entry_first_block(dest_dir_entry, first_block);
+    set_dir_entry_size(dest_dir_entry, dir_entry_size(src_dir_entry));
+    dest_dir_entry->mtime = mtime;
+    if (write_root_dir_entry(dest_dir_entry, global_fd_table[dest_fd].dir_entry_block_num, global_fd_table[dest_fd].dir_entry_idx) != 0)
+    {
+        status = EK_CLONE_WRITE_ROOT_DIR_ENTRY_FAILED;
+        goto cleanup;
+    }
 
-        // Otherwise: the fd_idx was not found so we need to make a new entry
-        // in the global file table
-        fd_idx = find_empty_fd();
-        if (fd_idx == GLOBAL_FD_TABLE_ENTRY_NOT_FOUND_SENTINEL)
+cleanup:
+    if (k_close(dest_fd) != 0)
+    {
+        status = EK_CLONE_CLOSE_FAILED;
+    }
+cleanup_src:
+    if (k_close(src_fd) != 0)
+    {
+        status = EK_CLONE_CLOSE_FAILED;
+    }
+    return status;
+}
+
+#define EALLOCATE_BLOCKS_NO_EMPTY_BLOCKS 1
+
+/**
+ * Allocate a chain of n blocks, storing its first and last block in *first_ptr and *last_ptr.
+ * A run of n consecutive free blocks is used if there is one, so that the chain can be read
+ * and written in large batches, and otherwise the first n free blocks are used.
+ * Nothing is allocated on failure.
+ *
+ * Returns 0 on success and an EALLOCATE_BLOCKS_* error code on error.
+ */
+int allocate_blocks(uint32_t n, uint32_t *first_ptr, uint32_t *last_ptr)
+{
+    stats.alloc_scans += 1;
+    uint32_t n_blocks = get_blocks_in_data_region();
+    uint32_t run_start = 0;
+    uint32_t run_len = 0;
+    for (uint32_t i = 1; i <= n_blocks && run_len < n; i++)
+    {
+        if (!is_free_block(i))
         {
-            return EK_OPEN_GLOBAL_FD_TABLE_FULL;
+            run_len = 0;
+            continue;
+        }
+        if (run_len == 0)
+        {
+            run_start = i;
         }
+        run_len += 1;
+    }
 
-        // find or create a dir entry (malloc here so we can keep a copy of the entry around and
-        // store it in the global file table)
-        directory_entry *ptr_to_dir_entry = (directory_entry *)malloc(sizeof(directory_entry));
-        uint16_t dir_entry_block_num;
-        uint8_t dir_entry_idx;
-        if (ptr_to_dir_entry == NULL)
+    uint32_t first = 0;
+    uint32_t last = 0;
+    uint32_t n_allocated = 0;
+    for (uint32_t i = run_len == n ? run_start : 1; i <= n_blocks && n_allocated < n; i++)
+    {
+        if (!is_free_block(i))
         {
-            return EK_OPEN_MALLOC_FAILED;
+            continue;
         }
-        int find_dir_entry_status = find_file_in_root_dir(fname, ptr_to_dir_entry, &dir_entry_block_num, &dir_entry_idx);
-        if (find_dir_entry_status < 0)
-        { // indicates an error
-            return EK_OPEN_FIND_FILE_IN_ROOT_DIR_FAILED;
+        if (last == 0)
+        {
+            first = i;
+        }
+        else
+        {
+            set_fat(last, i);
         }
+        set_fat(i, FAT_END_OF_FILE);
+        last = i;
+        n_allocated += 1;
+    }
 
-        // case: we couldn't find the file
-        if (find_dir_entry_status != RFIND_FILE_IN_ROOT_DIR_FILE_FOUND)
+    if (n_allocated < n)
+    {
+        if (first != 0)
         {
-            // RFIND_FILE_IN_ROOT_DIR_FILE_NOT_FOUND or RFIND_FILE_IN_ROOT_DIR_FILE_DELETED
-            if (mode == F_READ)
-            {
-                return EK_OPEN_FILE_DOES_NOT_EXIST;
-            }
+            clear_fat_file(first);
+        }
+        if (fs.reclaim_queue_len > 0)
+        {
+            reclaim_volume(UINT32_MAX);
+            return allocate_blocks(n, first_ptr, last_ptr);
+        }
+        return EALLOCATE_BLOCKS_NO_EMPTY_BLOCKS;
+    }
+    *first_ptr = first;
+    *last_ptr = last;
+    return 0;
+}
 
-            // create a dir entry
-            time_t mtime = time(NULL);
-            if (mtime == (time_t)-1)
+#define ECOPY_BLOCK_RUN_MALLOC_FAILED 1
+#define ECOPY_BLOCK_RUN_READ_FAILED 2
+#define ECOPY_BLOCK_RUN_WRITE_FAILED 3
+
+/**
+ * Copy n_blocks consecutive blocks starting at src_block to the n_blocks consecutive
+ * blocks starting at dest_block. Uses copy_file_range so the host can copy the data
+ * without it passing through us, falling back to reading and writing it ourselves.
+ * *bounce_buf_ptr is malloc'd (COPY_RANGE_MAX_RUN_BLOCKS blocks) on first use of the fallback.
+ *
+ * Returns 0 on success and an ECOPY_BLOCK_RUN_* error code on error.
+ */
+int copy_block_run(uint32_t src_block, uint32_t dest_block, uint32_t n_blocks, char **bounce_buf_ptr)
+{
+    loff_t src_offset = get_byte_offset_of_block(src_block);
+    loff_t dest_offset = get_byte_offset_of_block(dest_block);
+    size_t n_bytes = (size_t)n_blocks * fs.block_size;
+
+    while (n_bytes > 0)
+    {
+        ssize_t n_copied = copy_file_range(fs.fd, &src_offset, fs.fd, &dest_offset, n_bytes, 0);
+        if (n_copied <= 0)
+        {
+            break; // not supported for this file (or failed): do what is left ourselves
+        }
+        n_bytes -= n_copied;
+    }
+
+    if (n_bytes > 0)
+    {
+        if (*bounce_buf_ptr == NULL)
+        {
+            *bounce_buf_ptr = (char *)malloc((size_t)COPY_RANGE_MAX_RUN_BLOCKS * fs.block_size);
+            if (*bounce_buf_ptr == NULL)
             {
-                return EK_OPEN_TIME_FAILED;
+                return ECOPY_BLOCK_RUN_MALLOC_FAILED;
             }
+        }
+        if (pread(fs.fd, *bounce_buf_ptr, n_bytes, src_offset) != (ssize_t)n_bytes)
+        {
+            return ECOPY_BLOCK_RUN_READ_FAILED;
+        }
+        if (pwrite(fs.fd, *bounce_buf_ptr, n_bytes, dest_offset) != (ssize_t)n_bytes)
+        {
+            return ECOPY_BLOCK_RUN_WRITE_FAILED;
+        }
+    }
 
-            *ptr_to_dir_entry = (directory_entry){
-                .name = {0},
-                .size = 0,
-                .first_block = 0,
-                .type = 1,
-                .perm = P_READ_WRITE_FILE_PERMISSION, // read and write
-                .mtime = mtime,
-                .padding = {0}};
-            strcpy(ptr_to_dir_entry->name, fname); // can safely use strcpy because we checked fname
+    if (fs.block_hashes != NULL)
+    {
+        for (uint32_t i = 0; i < n_blocks; i++)
+        {
+            fs.block_hashes[dest_block + i] = fs.block_hashes[src_block + i];
+        }
+    }
+    return 0;
+}
 
-            // write the dir entry
-            if (write_new_root_dir_entry(ptr_to_dir_entry, &dir_entry_block_num, &dir_entry_idx) != 0)
+/**
+ * Returns the block at index idx in the chain starting at block, or FAT_END_OF_FILE
+ * if the chain is shorter than that.
+ */
+uint32_t nth_block(uint32_t block, uint32_t idx)
+{
+    for (uint32_t i = 0; i < idx && block != FAT_END_OF_FILE; i++)
+    {
+        stats.chain_hops += 1;
+        block = get_fat(block);
+    }
+    return block;
+}
+
+/**
+ * k_copy_range between files on different volumes, which the host can't copy within one
+ * image, so the data goes through a buffer: it is read from off_in of fd_in (with
+ * read_file_at) and written to off_out of fd_out, leaving the offsets of both where they were.
+ *
+ * Returns the number of bytes copied, or negative error code
+ */
+int copy_range_across_volumes(int fd_in, uint64_t off_in, int fd_out, uint64_t off_out, uint32_t len)
+{
+    char *buf = (char *)malloc(COPY_RANGE_BOUNCE_SIZE);
+    if (buf == NULL)
+    {
+        return EK_COPY_RANGE_MALLOC_FAILED;
+    }
+
+    global_fd_entry *out_entry = &global_fd_table[fd_out];
+    uint64_t saved_offset = out_entry->offset;
+    uint8_t saved_mode = out_entry->write_locked;
+    uint32_t n_copied = 0;
+    int status = 0;
+    while (n_copied < len)
+    {
+        int n_read = read_file_at(fd_in, off_in + n_copied, min(len - n_copied, COPY_RANGE_BOUNCE_SIZE), buf);
+        if (n_read <= 0)
+        {
+            status = n_read;
+            break;
+        }
+        // as within a volume, the bytes go to off_out even if fd_out is opened with F_APPEND
+        out_entry->offset = off_out + n_copied;
+        out_entry->write_locked = F_WRITE;
+        int n_written = k_write(fd_out, buf, n_read);
+        out_entry->offset = saved_offset;
+        out_entry->write_locked = saved_mode;
+        if (n_written < 0)
+        {
+            status = n_written;
+            break;
+        }
+        n_copied += n_written;
+        if (n_written < n_read)
+        {
+            break; // the volume of fd_out is full
+        }
+    }
+    free(buf);
+    return status < 0 ? status : (int)n_copied;
+}
+
+int k_copy_range(int fd_in, uint64_t off_in, int fd_out, uint64_t off_out, uint64_t len)
+{
+    select_fd_volume(fd_in);
+    if (!volume_is_mounted())
+    {
+        return EFS_NOT_MOUNTED;
+    }
+
+    if (fd_in >= GLOBAL_FD_TABLE_SIZE || fd_in < 0 || fd_out >= GLOBAL_FD_TABLE_SIZE || fd_out < 0)
+    {
+        return EK_COPY_RANGE_FD_OUT_OF_RANGE;
+    }
+    if (fd_in == STDIN_FD || fd_in == STDOUT_FD || fd_in == STDERR_FD || fd_out == STDIN_FD || fd_out == STDOUT_FD || fd_out == STDERR_FD)
+    {
+        return EK_COPY_RANGE_SPECIAL_FD;
+    }
+
+    global_fd_entry *in_entry = &global_fd_table[fd_in];
+    global_fd_entry *out_entry = &global_fd_table[fd_out];
+    if (in_entry->ref_count == 0 || out_entry->ref_count == 0)
+    {
+        return EK_COPY_RANGE_FD_NOT_IN_TABLE;
+    }
+    uint8_t in_perm = in_entry->ptr_to_dir_entry->perm;
+    uint8_t out_perm = out_entry->ptr_to_dir_entry->perm;
+    if (in_perm < P_READ_ONLY_FILE_PERMISSION || (out_perm != P_WRITE_ONLY_FILE_PERMISSION && out_perm < P_READ_WRITE_AND_EXECUTABLE_FILE_PERMISSION))
+    {
+        return EK_COPY_RANGE_WRONG_PERMISSIONS;
+    }
+    if (out_entry->ptr_to_dir_entry->type == FILE_TYPE_LOG)
+    {
+        return EK_COPY_RANGE_LOG_FILE;
+    }
+
+    // only fd_out's volume is written to then, which k_write checks
+    if (in_entry->volume != out_entry->volume)
+    {
+        return copy_range_across_volumes(fd_in, off_in, fd_out, off_out, len > INT_MAX ? INT_MAX : len);
+    }
+    if (is_read_only())
+    {
+        return EK_READ_ONLY_FS;
+    }
+
+    // copy at most the rest of the input, and no more than fits in the return value and the
+    // output, whose size is 32 bits wide on a fat16 image and 64 bits wide on a fat32 one
+    uint64_t in_size = dir_entry_size(in_entry->ptr_to_dir_entry);
+    uint64_t max_size = fs.fat32 ? INT64_MAX : UINT32_MAX;
+    if (off_out >= max_size)
+    {
+        return EK_COPY_RANGE_OFFSET_OVERFLOW;
+    }
+    if (off_in >= in_size || len == 0)
+    {
+        return 0;
+    }
+    len = len > INT_MAX ? INT_MAX : len;
+    if (in_size - off_in < len)
+    {
+        len = in_size - off_in;
+    }
+    if (max_size - off_out < len)
+    {
+        len = max_size - off_out;
+    }
+    if (in_entry == out_entry && off_in < off_out + len && off_out < off_in + len)
+    {
+        return EK_COPY_RANGE_OVERLAP;
+    }
+    // the volume can't hold the output that far out (nor count its blocks in 32 bits)
+    if ((off_out + len + fs.block_size - 1) / fs.block_size > get_blocks_in_data_region())
+    {
+        return EK_COPY_RANGE_NO_EMPTY_BLOCKS;
+    }
+
+    // blocks are copied or shared whole, which a fragment can't be
+    if (unpack_file(in_entry) != 0 || unpack_file(out_entry) != 0)
+    {
+        return EK_COPY_RANGE_UNPACK_FAILED;
+    }
+
+    directory_entry *out_dir_entry = out_entry->ptr_to_dir_entry;
+    uint64_t out_size = dir_entry_size(out_dir_entry);
+    uint16_t block_size = fs.block_size;
+
+    // we may modify every block of the output from the first we copy into up to its old
+    // last block, so none of them can be shared with other files
+    if (dir_entry_first_block(out_dir_entry) != 0)
+    {
+        uint32_t n_file_blocks = out_size == 0 ? 1 : (out_size + block_size - 1) / block_size;
+        uint32_t last_copy_idx = (off_out + len - 1) / block_size;
+        if (unshare_file_blocks(out_entry, last_copy_idx < n_file_blocks - 1 ? last_copy_idx : n_file_blocks - 1) != 0)
+        {
+            return EK_COPY_RANGE_UNSHARE_FAILED;
+        }
+    }
+
+    // grow the output chain so it covers off_out + len, allocating all the blocks at once
+    uint32_t n_have = 0;
+    uint32_t tail = 0;
+    for (uint32_t block = dir_entry_first_block(out_dir_entry); block != 0 && block != FAT_END_OF_FILE; block = get_fat(block))
+    {
+        n_have += 1;
+        tail = block;
+    }
+    uint32_t n_needed = (uint32_t)(((uint64_t)off_out + len + block_size - 1) / block_size);
+    if (n_needed > n_have)
+    {
+        uint32_t first_new;
+        uint32_t last_new;
+        if (allocate_blocks(n_needed - n_have, &first_new, &last_new) != 0)
+        {
+            return EK_COPY_RANGE_NO_EMPTY_BLOCKS;
+        }
+        if (tail == 0)
+        {
+            set_dir_entry_first_block(out_dir_entry, first_new);
+        }
+        else
+        {
+            set_fat(tail, first_new);
+        }
+
+        // new blocks before the one off_out is in are a hole, which reads as 0s
+        memset(fs.block_buf, 0, block_size);
+        uint32_t block = first_new;
+        for (uint32_t idx = n_have; idx < off_out / block_size; idx++)
+        {
+            if (write_block(block, fs.block_buf) != 0)
             {
-                return EK_OPEN_WRITE_NEW_ROOT_DIR_ENTRY_FAILED;
+                return EK_COPY_RANGE_WRITE_BLOCK_FAILED;
             }
+            block = get_fat(block);
         }
-        // create an entry in the global file table
-        global_fd_table[fd_idx] = (global_fd_entry){
-            .ref_count = 0,
-            .dir_entry_block_num = dir_entry_block_num,
-            .dir_entry_idx = dir_entry_idx,
-            .ptr_to_dir_entry = ptr_to_dir_entry,
-            .write_locked = mode, // 0 for read, 1 for write, 2 for append
-            .offset = 0};
     }
 
-    uint8_t perm = global_fd_table[fd_idx].ptr_to_dir_entry->perm;
-    if (
-        perm == P_NO_FILE_PERMISSION ||
-        (perm == P_WRITE_ONLY_FILE_PERMISSION && mode == F_READ) || // NOTE: F_WRITE also allows reading, but we only gate this on the f_write function
-        ((perm == P_READ_ONLY_FILE_PERMISSION || perm == P_READ_AND_EXECUTABLE_FILE_PERMISSION) && (mode == F_WRITE || mode == F_APPEND)))
+    // if we're leaving a hole after the old end of the file, 0 out the rest of its last block
+    if (off_out > out_size && out_size % block_size != 0 && out_size / block_size < n_have)
     {
-        return EK_OPEN_WRONG_PERMISSIONS;
+        uint32_t block = nth_block(dir_entry_first_block(out_dir_entry), out_size / block_size);
+        if (get_block(block, fs.block_buf) != 0)
+        {
+            return EK_COPY_RANGE_GET_BLOCK_FAILED;
+        }
+        memset((char *)fs.block_buf + out_size % block_size, 0, block_size - out_size % block_size);
+        if (write_block(block, fs.block_buf) != 0)
+        {
+            return EK_COPY_RANGE_WRITE_BLOCK_FAILED;
+        }
     }
 
-    // Only increment the ref count here since we know that the file exists and has the right permissions
-    // at this point
-    global_fd_table[fd_idx].ref_count += 1; // increment the ref count
+    char *dest_buf = (char *)malloc(block_size);
+    char *bounce_buf = NULL;
+    if (dest_buf == NULL)
+    {
+        return EK_COPY_RANGE_MALLOC_FAILED;
+    }
 
-    // case: we need to truncate the file because we are opening it for writing
-    if (mode == F_WRITE && global_fd_table[fd_idx].ptr_to_dir_entry->size > 0)
+    int status = 0;
+    uint32_t src_block = file_block(in_entry, off_in / block_size);
+    uint32_t dest_block = file_block(out_entry, off_out / block_size);
+    uint32_t dest_idx = off_out / block_size;
+    uint32_t last_touched_dest_block = 0;
+    uint32_t n_copied = 0;
+    while (n_copied < len)
     {
-        // truncate the file
-        time_t mtime = time(NULL);
-        if (mtime == (time_t)-1)
+        uint16_t src_pos = (off_in + n_copied) % block_size;
+        uint16_t dest_pos = (off_out + n_copied) % block_size;
+        uint32_t n_left = len - n_copied;
+
+        if (src_pos == 0 && dest_pos == 0 && n_left >= block_size)
+        {
+            // whole blocks: extend the run as long as both chains stay physically contiguous
+            uint32_t run = 1;
+            uint32_t src_last = src_block;
+            uint32_t dest_last = dest_block;
+            while (
+                run < COPY_RANGE_MAX_RUN_BLOCKS &&
+                (run + 1) * block_size <= n_left &&
+                get_fat(src_last) == src_last + 1 &&
+                get_fat(dest_last) == dest_last + 1)
+            {
+                src_last += 1;
+                dest_last += 1;
+                run += 1;
+            }
+            if (copy_block_run(src_block, dest_block, run, &bounce_buf) != 0)
+            {
+                status = EK_COPY_RANGE_WRITE_BLOCK_FAILED;
+                goto cleanup;
+            }
+            n_copied += run * block_size;
+            src_block = get_fat(src_last);
+            dest_block = get_fat(dest_last);
+            dest_idx += run;
+            continue;
+        }
+
+        // partial blocks: read-modify-write the piece that fits in both blocks
+        uint32_t n_to_copy = min(min(n_left, block_size - src_pos), block_size - dest_pos);
+        if (get_block(src_block, fs.block_buf) != 0)
+        {
+            status = EK_COPY_RANGE_GET_BLOCK_FAILED;
+            goto cleanup;
+        }
+        if (dest_block != last_touched_dest_block && dest_idx >= n_have)
         {
-            return EK_OPEN_TIME_FAILED;
+            memset(dest_buf, 0, block_size); // fresh block, so there is nothing to keep
         }
-        global_fd_table[fd_idx].ptr_to_dir_entry->size = 0;
-        global_fd_table[fd_idx].ptr_to_dir_entry->mtime = mtime;
-        if (global_fd_table[fd_idx].ptr_to_dir_entry->first_block != 0)
+        else if (get_block(dest_block, dest_buf) != 0)
         {
-            clear_fat_file(global_fd_table[fd_idx].ptr_to_dir_entry->first_block);
+            status = EK_COPY_RANGE_GET_BLOCK_FAILED;
+            goto cleanup;
+        }
+        memcpy(dest_buf + dest_pos, (char *)fs.block_buf + src_pos, n_to_copy);
+        if (write_block(dest_block, dest_buf) != 0)
+        {
+            status = EK_COPY_RANGE_WRITE_BLOCK_FAILED;
+            goto cleanup;
         }
-        global_fd_table[fd_idx].ptr_to_dir_entry->first_block = 0;
+        last_touched_dest_block = dest_block;
 
-        // write the dir entry
-        if (write_root_dir_entry(global_fd_table[fd_idx].ptr_to_dir_entry, global_fd_table[fd_idx].dir_entry_block_num, global_fd_table[fd_idx].dir_entry_idx) != 0)
+        n_copied += n_to_copy;
+        if (src_pos + n_to_copy == block_size)
         {
-            return EK_OPEN_WRITE_ROOT_DIR_ENTRY_FAILED;
+            src_block = get_fat(src_block);
+        }
+        if (dest_pos + n_to_copy == block_size)
+        {
+            dest_block = get_fat(dest_block);
+            dest_idx += 1;
         }
     }
 
-    uint32_t offset = 0;
-    if (mode == F_APPEND)
+    time_t mtime = time(NULL);
+    if (mtime == (time_t)-1)
     {
-        offset = global_fd_table[fd_idx].ptr_to_dir_entry->size;
+        status = EK_COPY_RANGE_TIME_FAILED;
+        goto cleanup;
     }
-    else if (mode == F_WRITE)
+    out_dir_entry->mtime = mtime;
+    if (off_out + len > out_size)
     {
-        offset = 0;
+        set_dir_entry_size(out_dir_entry, off_out + len);
     }
-    else if (mode == F_READ)
+    out_entry->dirty = true;
+    if (write_root_dir_entry(out_dir_entry, out_entry->dir_entry_block_num, out_entry->dir_entry_idx) != 0)
     {
-        offset = global_fd_table[fd_idx].offset;
+        status = EK_COPY_RANGE_WRITE_ROOT_DIR_ENTRY_FAILED;
+        goto cleanup;
     }
-    global_fd_table[fd_idx].write_locked = mode;
-    global_fd_table[fd_idx].offset = offset;
+    status = (int)len;
 
-    return (int)fd_idx; // semi-safe cast because uint16_t should fit in int on most systems
+cleanup:
+    free(dest_buf);
+    free(bounce_buf);
+    return status;
 }
 
-int k_close(int fd)
+int k_setmode(int fd, int mode)
 {
-    if (!is_mounted())
+    if (fd >= GLOBAL_FD_TABLE_SIZE)
     {
-        return EFS_NOT_MOUNTED;
+        return EK_SETMODE_FD_OUT_OF_RANGE;
+    }
+
+    if (global_fd_table[fd].ref_count <= 0)
+    {
+        return EK_SETMODE_FD_NOT_IN_USE;
+    }
+
+    if (mode != F_READ && mode != F_WRITE && mode != F_APPEND)
+    {
+        return EK_SETMODE_BAD_MODE;
+    }
+
+    global_fd_entry *fd_entry = &global_fd_table[fd];
+    fd_entry->write_locked = mode;
+
+    return 0;
+}
+
+int k_getmode(int fd) {
+    if (fd >= GLOBAL_FD_TABLE_SIZE) {
+        return EK_GETMODE_FD_OUT_OF_RANGE;
+    }
+    
+    if (global_fd_table[fd].ref_count <= 0) {
+        return EK_GETMODE_FD_NOT_IN_USE;
+    }
+
+    return global_fd_table[fd].write_locked;
+}
+
+int k_getgeneration(int fd) {
+    if (fd < 0 || fd >= GLOBAL_FD_TABLE_SIZE) {
+        return EK_GETGENERATION_FD_OUT_OF_RANGE;
+    }
+
+    if (global_fd_table[fd].ref_count <= 0) {
+        return EK_GETGENERATION_FD_NOT_IN_USE;
     }
 
+    return global_fd_table[fd].generation;
+}
+
+int k_bmap(int fd, uint32_t offset)
+{
+    select_fd_volume(fd);
     if (fd >= GLOBAL_FD_TABLE_SIZE || fd < 0)
     {
-        return EK_CLOSE_FD_OUT_OF_RANGE;
+        return EK_BMAP_FD_OUT_OF_RANGE;
     }
-    if (fd == STDIN_FD || fd == STDOUT_FD || fd == STDERR_FD)
+
+    global_fd_entry *fd_entry = &global_fd_table[fd];
+    if (fd_entry->ref_count == 0)
     {
-        return EK_CLOSE_SPECIAL_FD;
+        return EK_BMAP_FD_NOT_IN_TABLE;
+    }
+    if (fd_entry->volume == NULL || !volume_is_mounted())
+    {
+        return 0; // stdin, stdout and stderr aren't on a disk
     }
 
-    if (global_fd_table[fd].ref_count > 0) // just in case, we don't want to decrement a ref count that is already 0 (though this should never happen)
+    if (dir_entry_frag_block(fd_entry->ptr_to_dir_entry) != 0)
     {
-        global_fd_table[fd].ref_count -= 1;
+        return dir_entry_frag_block(fd_entry->ptr_to_dir_entry);
     }
-    if (global_fd_table[fd].ref_count == 0)
+    uint32_t block = file_block(fd_entry, offset / fs.block_size);
+    return block == FAT_END_OF_FILE ? 0 : block;
+}
+
+/**
+ * Returns the index of the snapshot called name in fs.snapshots, or -1 if there is none
+ */
+int find_snapshot(const char *name)
+{
+    for (uint8_t i = 0; i < fs.n_snapshots; i++)
     {
-        // if the file was marked as deleted but still referenced
-        // then walk the FAT and zero it out
-        if (global_fd_table[fd].ptr_to_dir_entry->name[0] == 2)
+        if (strcmp(fs.snapshots[i].name, name) == 0)
         {
-            uint16_t first_block = global_fd_table[fd].ptr_to_dir_entry->first_block;
-            if (first_block != 0)
-            {
-                clear_fat_file(first_block);
-            }
-
-            // mark the file as deleted and write it through
-            directory_entry *ptr_to_dir_entry = global_fd_table[fd].ptr_to_dir_entry;
-            uint16_t dir_entry_block_num = global_fd_table[fd].dir_entry_block_num;
-            uint8_t dir_entry_idx = global_fd_table[fd].dir_entry_idx;
-            ptr_to_dir_entry->name[0] = 1;
-            ptr_to_dir_entry->first_block = 0;
-            if (write_root_dir_entry(ptr_to_dir_entry, dir_entry_block_num, dir_entry_idx) != 0)
-            {
-                return EK_CLOSE_WRITE_ROOT_DIR_ENTRY_FAILED;
-            }
+            return i;
         }
+    }
+    return -1;
+}
 
-        // free the memory we allocated for the the copy of the directory_entry
-        free(global_fd_table[fd].ptr_to_dir_entry);
-        global_fd_table[fd].ptr_to_dir_entry = NULL;
-        global_fd_table[fd].write_locked = 0;
+/**
+ * Write fs.snapshots out to <fs_name>.snapshots. Returns 0 on success and -1 on error.
+ */
+int save_snapshot_index(void)
+{
+    char *path = sidecar_path(SNAPSHOT_INDEX_SUFFIX);
+    if (path == NULL)
+    {
+        return -1;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    free(path);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    ssize_t n_bytes = fs.n_snapshots * sizeof(snapshot_info);
+    ssize_t bytes_written = write(fd, fs.snapshots, n_bytes);
+    if (close(fd) != 0 || bytes_written != n_bytes)
+    {
+        return -1;
     }
     return 0;
 }
 
-int k_read(int fd, int n, char *buf)
+// where save_subdir_block writes the subdirectory blocks of a snapshot
+typedef struct subdir_block_writer_st
 {
-    // allow reading from stdin, stdout, stderr before mounting
-    if (fd == STDIN_FD || fd == STDOUT_FD || fd == STDERR_FD)
+    int fd;
+    uint32_t n_blocks;
+} subdir_block_writer;
+
+/**
+ * walk_subdirs visitor for k_snapshot_create, which appends a record for block to the
+ * sidecar. Returns -1 if the write fails
+ */
+int save_subdir_block(uint32_t block, directory_entry *entries, void *arg)
+{
+    subdir_block_writer *writer = (subdir_block_writer *)arg;
+    if (
+        write(writer->fd, &block, sizeof(block)) != sizeof(block) ||
+        write(writer->fd, entries, fs.block_size) != fs.block_size)
     {
-        // special case read for stdin, stdout, stderr
-        // we just read from the buffer
-        int bytes_read = read(fd, buf, n); // NOTE: unix systems typically assign STDIN, STDOUT, STDERR in the same way we do, so this should work
-        // We allow reading from stdin here because it's possible that there has been some redirection
-        // so we let it play out
-        if (bytes_read < 0)
-        {
-            return EK_READ_READ_FAILED;
-        };
-        return bytes_read;
+        return -1;
     }
+    writer->n_blocks += 1;
+    return WALK_SUBDIRS_CONTINUE;
+}
 
-    if (!is_mounted())
+int k_snapshot_create(const char *name)
+{
+    name = select_volume(name);
+    if (name == NULL)
+    {
+        return EK_UNKNOWN_VOLUME;
+    }
+    if (!volume_is_mounted())
     {
         return EFS_NOT_MOUNTED;
     }
 
-    if (fd >= GLOBAL_FD_TABLE_SIZE || fd < 0)
+    if (is_read_only())
     {
-        return EK_READ_FD_OUT_OF_RANGE;
+        return EK_READ_ONLY_FS;
     }
-
-    global_fd_entry *fd_entry = &global_fd_table[fd];
-    if (fd_entry->ref_count == 0)
+    if (!is_valid_filename(name))
     {
-        return EK_READ_FD_NOT_IN_TABLE;
+        return EK_SNAPSHOT_INVALID_NAME;
     }
-
-    uint32_t file_size = fd_entry->ptr_to_dir_entry->size;
-    uint32_t offset = fd_entry->offset;
-    uint16_t block_size = fs.block_size;
-    uint8_t perm = fd_entry->ptr_to_dir_entry->perm;
-
-    // can't read
-    if (perm < P_READ_ONLY_FILE_PERMISSION)
+    if (find_snapshot(name) != -1)
     {
-        return EK_READ_WRONG_PERMISSIONS;
+        return EK_SNAPSHOT_EXISTS;
     }
-
-    // if the offset is at or past the end of the file, there's nothing for us to read
-    // this also checks that the file is non-empty
-    if (offset >= file_size)
+    if (fs.n_snapshots == MAX_SNAPSHOTS)
     {
-        return 0;
+        return EK_SNAPSHOT_TOO_MANY;
     }
+    // chains waiting for the reclaimer aren't reachable from any file, so keep them out of the snapshot
+    reclaim_volume(UINT32_MAX);
 
-    // if n = 0, then we just return 0
-    if (n == 0)
+    uint16_t n_root_dir_blocks = 0;
+    for (uint32_t block = 1; block != FAT_END_OF_FILE; block = get_fat(block))
     {
-        return 0;
+        n_root_dir_blocks += 1;
     }
 
-    // first we need to get to the offset, which requires traversing some number of blocks
-    uint16_t block = fd_entry->ptr_to_dir_entry->first_block; // expect that this is non-zero since the file is non empty
-    uint16_t n_blocks_to_skip = offset / block_size;          // TODO: is there any chance that offset means the n_blocks_to_skip exceeds uint16_t size?
-    uint16_t offset_in_block = offset % block_size;
+    char *path = snapshot_path(name);
+    if (path == NULL)
+    {
+        return EK_SNAPSHOT_MALLOC_FAILED;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+    {
+        free(path);
+        return EK_SNAPSHOT_SIDECAR_FAILED;
+    }
 
-    // skip to the right block
-    for (int i = 0; i < n_blocks_to_skip; i++)
+    // the data blocks are frozen by pinning them below, so only the FAT and the directories
+    // (which are rewritten in place) need copying
+    int status = 0;
+    snapshot_header header = {
+        .magic = SNAPSHOT_MAGIC,
+        .version = SNAPSHOT_VERSION,
+        .fat_size = fs.fat_size,
+        .block_size = fs.block_size,
+        .n_root_dir_blocks = n_root_dir_blocks};
+    if (
+        write(fd, &header, sizeof(header)) != sizeof(header) ||
+        write(fd, fs.fat, fs.fat_size) != (ssize_t)fs.fat_size)
     {
-        if (next_block_num(block, &block) != 0)
+        status = EK_SNAPSHOT_SIDECAR_FAILED;
+        goto cleanup;
+    }
+    for (uint32_t block = 1; block != FAT_END_OF_FILE; block = get_fat(block))
+    {
+        if (get_block(block, fs.block_buf) != 0)
+        {
+            status = EK_SNAPSHOT_GET_BLOCK_FAILED;
+            goto cleanup;
+        }
+        if (write(fd, fs.block_buf, fs.block_size) != fs.block_size)
         {
-            // TODO: we should separate out the error case when n_blocks_to_skip is simply too many jumps
-            // and we end up jumping to to FFFF!
-            return EK_READ_COULD_NOT_JUMP_TO_BLOCK_FOR_OFFSET;
+            status = EK_SNAPSHOT_SIDECAR_FAILED;
+            goto cleanup;
         }
     }
 
-    // start reading the blocks sequentialy and then memcpy-ing them out
-    char *char_buf = (char *)fs.block_buf;
-    int n_copied = 0;
-    n = min(n, file_size - offset); // read at most the rest of the file
-    while (n > n_copied && block != FAT_END_OF_FILE)
-    { // NOTE: we shouldn't need to check for EOF here since we won't read more than the file size, but just in case
-        get_block(block, fs.block_buf);
-        // we want to read at most the rest of the block
-        // but if n is smaller than that, then we should only read n
-        uint16_t n_to_copy = min(n - n_copied, block_size - offset_in_block);
-        memcpy(buf + n_copied, char_buf + offset_in_block, n_to_copy);
-        n_copied += n_to_copy;
-        // read the next block from the start
-        offset_in_block = 0;
-        // identify the next block
-        next_block_num(block, &block);
+    // subdirectory blocks are anywhere on disk, so each is saved with its number. Their
+    // count goes first, and is filled in once the walk is done
+    subdir_block_writer writer = {.fd = fd, .n_blocks = 0};
+    off_t n_subdir_blocks_offset = lseek(fd, 0, SEEK_CUR);
+    if (n_subdir_blocks_offset == -1 || write(fd, &writer.n_blocks, sizeof(writer.n_blocks)) != sizeof(writer.n_blocks))
+    {
+        status = EK_SNAPSHOT_SIDECAR_FAILED;
+        goto cleanup;
     }
-    // increment the file offset by the number of bytes read
-    fd_entry->offset += n_copied;
-    return n_copied;
+    int walk_status = walk_subdirs(1, save_subdir_block, &writer);
+    if (walk_status != 0)
+    {
+        status = walk_status == -1 ? EK_SNAPSHOT_SIDECAR_FAILED : EK_SNAPSHOT_GET_BLOCK_FAILED;
+        goto cleanup;
+    }
+    if (pwrite(fd, &writer.n_blocks, sizeof(writer.n_blocks), n_subdir_blocks_offset) != sizeof(writer.n_blocks))
+    {
+        status = EK_SNAPSHOT_SIDECAR_FAILED;
+        goto cleanup;
+    }
+
+cleanup:
+    if (close(fd) != 0 && status == 0)
+    {
+        status = EK_SNAPSHOT_SIDECAR_FAILED;
+    }
+    if (status != 0)
+    {
+        unlink(path);
+        free(path);
+        return status;
+    }
+
+    snapshot_info *info = &fs.snapshots[fs.n_snapshots];
+    *info = (snapshot_info){.name = {0}, .ctime = time(NULL), .n_blocks = 0};
+    strcpy(info->name, name); // can safely use strcpy because we checked name
+    uint32_t n_blocks = get_blocks_in_data_region();
+    for (uint32_t block = 1; block <= n_blocks; block++)
+    {
+        info->n_blocks += get_fat(block) != 0;
+    }
+    fs.n_snapshots += 1;
+    if (save_snapshot_index() != 0)
+    {
+        fs.n_snapshots -= 1;
+        unlink(path);
+        free(path);
+        return EK_SNAPSHOT_SIDECAR_FAILED;
+    }
+    free(path);
+
+    pin_snapshot_blocks(fs.fat, 1);
+    return 0;
 }
 
-int64_t k_lseek(int fd, int offset, int whence)
+int k_snapshot_list(void)
 {
-    if (!is_mounted())
+    current_volume = &volumes[0];
+    if (!volume_is_mounted())
     {
         return EFS_NOT_MOUNTED;
     }
 
-    if (fd >= GLOBAL_FD_TABLE_SIZE || fd < 0)
+    for (uint8_t i = 0; i < fs.n_snapshots; i++)
     {
-        return EK_LSEEK_FD_OUT_OF_RANGE;
+        char time_str[32];
+        strftime(time_str, sizeof(time_str), "%b %d %H:%M %Y", localtime(&fs.snapshots[i].ctime));
+        if (k_fprintf_short(STDOUT_FD, "%s %u blocks %s\n", time_str, fs.snapshots[i].n_blocks, fs.snapshots[i].name) < 0)
+        {
+            return EK_SNAPSHOT_WRITE_FAILED;
+        }
     }
+    return 0;
+}
 
-    if (fd == STDIN_FD || fd == STDOUT_FD || fd == STDERR_FD)
+/**
+ * walk_subdirs visitor for k_snapshot_rollback that deletes the entries of files that
+ * were deleted while open, like k_close would have
+ */
+int release_deleted_open_files(uint32_t block, directory_entry *entries, void *arg)
+{
+    uint8_t n_dir_entry_per_block = fs.block_size / sizeof(directory_entry);
+    int action = WALK_SUBDIRS_CONTINUE;
+    for (uint8_t i = 0; i < n_dir_entry_per_block; i++)
     {
-        return EK_LSEEK_SPECIAL_FD;
+        if (entries[i].name[0] != 2)
+        {
+            continue;
+        }
+        entries[i].name[0] = 1;
+        if (dir_entry_first_block(&entries[i]) != 0)
+        {
+            clear_fat_file(dir_entry_first_block(&entries[i]));
+        }
+        set_dir_entry_first_block(&entries[i], 0);
+        action = WALK_SUBDIRS_WRITE_BACK;
     }
+    return action;
+}
 
-    global_fd_entry *fd_entry = &global_fd_table[fd];
-    if (fd_entry->ref_count == 0)
+int k_snapshot_rollback(const char *name)
+{
+    name = select_volume(name);
+    if (name == NULL)
     {
-        return EK_LSEEK_FD_NOT_IN_TABLE;
+        return EK_UNKNOWN_VOLUME;
     }
-
-    if (whence != F_SEEK_SET && whence != F_SEEK_CUR && whence != F_SEEK_END)
+    if (!volume_is_mounted())
     {
-        return EK_LSEEK_BAD_WHENCE;
+        return EFS_NOT_MOUNTED;
     }
 
-    // TODO: is this right?
-    // can't read = can't lseek
-    uint8_t perm = fd_entry->ptr_to_dir_entry->perm;
-    if (perm < P_READ_ONLY_FILE_PERMISSION)
+    if (is_read_only())
     {
-        return EK_LSEEK_WRONG_PERMISSIONS;
+        return EK_READ_ONLY_FS;
+    }
+    if (find_snapshot(name) == -1)
+    {
+        return EK_SNAPSHOT_NOT_FOUND;
+    }
+    // open files hold copies of directory entries and chains that are about to disappear
+    for (int i = 3; i < GLOBAL_FD_TABLE_SIZE; i++)
+    {
+        if (global_fd_table[i].ref_count > 0)
+        {
+            return EK_SNAPSHOT_FILES_OPEN;
+        }
     }
 
-    // check if total offset would be negative and if so return an error
-    uint32_t curr_offset = fd_entry->offset;
-    uint32_t size = fd_entry->ptr_to_dir_entry->size;
-    uint32_t new_offset;
-    if (whence == F_SEEK_SET)
+    // the queued chains refer to the FAT we are about to replace
+    reclaim_volume(UINT32_MAX);
+
+    // read everything before touching the volume so a bad sidecar leaves it alone
+    void *snapshot_fat = malloc(fs.fat_size);
+    if (snapshot_fat == NULL)
     {
-        if (offset < 0)
-            return EK_LSEEK_NEGATIVE_OFFSET;
-        // NOTE: no possibility of overflow
-        new_offset = offset;
+        return EK_SNAPSHOT_MALLOC_FAILED;
     }
-    else if (whence == F_SEEK_CUR)
+    char *root_dir_buf;
+    uint16_t n_root_dir_blocks;
+    char *subdir_buf;
+    uint32_t n_subdir_blocks;
+    if (read_snapshot(name, snapshot_fat, &root_dir_buf, &n_root_dir_blocks, &subdir_buf, &n_subdir_blocks) != 0)
+    {
+        free(snapshot_fat);
+        return EK_SNAPSHOT_SIDECAR_FAILED;
+    }
+
+    // every block the snapshot uses is pinned, so its data is exactly as it was
+    memcpy(fs.fat, snapshot_fat, fs.fat_size);
+    count_free_blocks();
+    free(snapshot_fat);
+
+    int status = 0;
+    uint32_t block = 1;
+    for (uint16_t i = 0; i < n_root_dir_blocks && block != FAT_END_OF_FILE; i++)
     {
-        if (offset < 0 && -offset > curr_offset)
+        if (write_block(block, root_dir_buf + (size_t)i * fs.block_size) != 0)
         {
-            return EK_LSEEK_NEGATIVE_OFFSET;
+            status = EK_SNAPSHOT_WRITE_BLOCK_FAILED;
+            goto cleanup;
         }
-        else if ((UINT32_MAX - curr_offset) < offset)
+        block = get_fat(block);
+    }
+    // the blocks of the snapshot's subdirectories are pinned too, so they go back where they were
+    for (uint32_t i = 0; i < n_subdir_blocks; i++)
+    {
+        char *record = subdir_buf + (size_t)i * (sizeof(uint32_t) + fs.block_size);
+        uint32_t subdir_block;
+        memcpy(&subdir_block, record, sizeof(subdir_block));
+        if (write_block(subdir_block, record + sizeof(subdir_block)) != 0)
         {
-            return EK_LSEEK_OFFSET_OVERFLOW;
+            status = EK_SNAPSHOT_WRITE_BLOCK_FAILED;
+            goto cleanup;
         }
-        new_offset = curr_offset + offset;
     }
-    else
-    { // whence == F_SEEK_END
-        if (offset < 0 && -offset > size)
+
+    if (build_extra_refs() != 0 || build_fragment_index() != 0 || count_root_dir_entries() != 0 || build_name_filter() != 0)
+    {
+        status = EK_SNAPSHOT_GET_BLOCK_FAILED;
+        goto cleanup;
+    }
+
+    // files that were deleted while open when the snapshot was taken have nobody left to close them
+    directory_entry *dir_entry_buf = (directory_entry *)root_dir_buf;
+    uint8_t n_dir_entry_per_block = fs.block_size / sizeof(directory_entry);
+    block = 1;
+    for (uint16_t i = 0; i < n_root_dir_blocks && block != FAT_END_OF_FILE; i++)
+    {
+        bool changed = false;
+        for (uint8_t j = 0; j < n_dir_entry_per_block; j++)
         {
-            return EK_LSEEK_NEGATIVE_OFFSET;
+            directory_entry *dir_entry = &dir_entry_buf[(size_t)i * n_dir_entry_per_block + j];
+            if (dir_entry->name[0] != 2)
+            {
+                continue;
+            }
+            dir_entry->name[0] = 1;
+            if (dir_entry_first_block(dir_entry) != 0)
+            {
+                clear_fat_file(dir_entry_first_block(dir_entry));
+            }
+            set_dir_entry_first_block(dir_entry, 0);
+            changed = true;
         }
-        else if ((UINT32_MAX - size) < offset)
+        if (changed && write_block(block, root_dir_buf + (size_t)i * fs.block_size) != 0)
         {
-            return EK_LSEEK_OFFSET_OVERFLOW;
+            status = EK_SNAPSHOT_WRITE_BLOCK_FAILED;
+            goto cleanup;
         }
-        new_offset = size + offset;
+        block = get_fat(block);
+    }
+    if (walk_subdirs(1, release_deleted_open_files, NULL) != 0)
+    {
+        status = EK_SNAPSHOT_WRITE_BLOCK_FAILED;
+        goto cleanup;
     }
 
-    fd_entry->offset = new_offset;
-    return new_offset;
+cleanup:
+    free(root_dir_buf);
+    free(subdir_buf);
+    return status;
 }
 
-int k_write(int fd, const char *str, int n)
+int k_snapshot_delete(const char *name)
 {
-    // allow writing to stdin, stdout, stderr before mounting
-    if (fd == STDIN_FD || fd == STDOUT_FD || fd == STDERR_FD)
+    name = select_volume(name);
+    if (name == NULL)
     {
-        // special case write for stdin, stdout, stderr
-        // we just write to the buffer
-        int bytes_written = write(fd, str, n); // NOTE: unix systems typically assign STDIN, STDOUT, STDERR in the same way we do, so this should work
-        // We allow writing to stdin here because it's possible that there has been some redirection
-        // so we let it play out
-        if (bytes_written < 0)
-        {
-            return EK_WRITE_WRITE_FAILED;
-        };
-        return bytes_written;
+        return EK_UNKNOWN_VOLUME;
     }
-    
-    if (!is_mounted())
+    if (!volume_is_mounted())
     {
         return EFS_NOT_MOUNTED;
     }
 
-    if (fd >= GLOBAL_FD_TABLE_SIZE || fd < 0)
+    if (is_read_only())
     {
-        return EK_WRITE_FD_OUT_OF_RANGE;
+        return EK_READ_ONLY_FS;
+    }
+    int idx = find_snapshot(name);
+    if (idx == -1)
+    {
+        return EK_SNAPSHOT_NOT_FOUND;
     }
 
-    global_fd_entry *fd_entry = &global_fd_table[fd];
-    if (fd_entry->ref_count == 0)
+    void *snapshot_fat = malloc(fs.fat_size);
+    if (snapshot_fat == NULL)
     {
-        return EK_WRITE_FD_NOT_IN_TABLE;
+        return EK_SNAPSHOT_MALLOC_FAILED;
+    }
+    char *path = snapshot_path(name);
+    if (path == NULL)
+    {
+        free(snapshot_fat);
+        return EK_SNAPSHOT_MALLOC_FAILED;
     }
 
-    uint8_t perm = fd_entry->ptr_to_dir_entry->perm;
-    if (perm != P_WRITE_ONLY_FILE_PERMISSION && perm < P_READ_WRITE_AND_EXECUTABLE_FILE_PERMISSION)
+    int status = 0;
+    if (read_snapshot(name, snapshot_fat, NULL, NULL, NULL, NULL) != 0 || unlink(path) != 0)
     {
-        return EK_WRITE_WRONG_PERMISSIONS;
+        status = EK_SNAPSHOT_SIDECAR_FAILED;
+        goto cleanup;
     }
 
-    // if n = 0, then we just return 0
-    if (n == 0)
+    // blocks the live volume freed since the snapshot become allocatable again
+    pin_snapshot_blocks(snapshot_fat, -1);
+    memmove(&fs.snapshots[idx], &fs.snapshots[idx + 1], (fs.n_snapshots - idx - 1) * sizeof(snapshot_info));
+    fs.n_snapshots -= 1;
+    if (save_snapshot_index() != 0)
     {
-        return 0;
+        status = EK_SNAPSHOT_SIDECAR_FAILED;
     }
 
-    // if the file is empty, then we need to allocate a new block
-    uint32_t file_size = fd_entry->ptr_to_dir_entry->size;
-    uint32_t offset = fd_entry->write_locked == F_APPEND ? file_size : fd_entry->offset;
-    uint16_t block_size = fs.block_size;
-    uint16_t dir_entry_block_num = fd_entry->dir_entry_block_num;
-    uint8_t dir_entry_idx = fd_entry->dir_entry_idx;
-    bool is_writing_new_blocks = false; // we'll use this variable to track whether the block we're at is a new one (meaning we need to fetch the block from disk) or an old one (meaning we can just write to it)
+cleanup:
+    free(snapshot_fat);
+    free(path);
+    return status;
+}
 
-    // Get the first block of the file
-    if (fd_entry->ptr_to_dir_entry->first_block == 0)
+/**
+ * Returns the mapping k_mmap handed out at addr, or NULL if there is none
+ */
+mmap_entry *find_mmap(void *addr)
+{
+    if (addr == NULL)
     {
-        uint16_t new_block = first_empty_block();
-        if (new_block == 0)
+        return NULL;
+    }
+    for (int i = 0; i < MAX_MMAPS; i++)
+    {
+        if (mmap_table[i].addr == addr)
         {
-            return 0;
+            return &mmap_table[i];
         }
-        fs.fat[new_block] = FAT_END_OF_FILE;
-        fd_entry->ptr_to_dir_entry->first_block = new_block;
     }
-    uint16_t block = fd_entry->ptr_to_dir_entry->first_block;
+    return NULL;
+}
 
-    // Get the idx of the block we're writing to
-    uint16_t offset_block_idx = (offset + block_size) / block_size; // TODO: is there any chance that offset means the n_blocks_to_skip exceeds uint16_t size?
-    uint16_t offset_in_block = offset % block_size;
+#define EREAD_FILE_RANGE_GET_BLOCK_FAILED 1
 
-    // Try to get to the offset_block_idx by
-    // using the blocks in the file.
-    char *char_buf = (char *)fs.block_buf;
-    uint16_t n_blocks_deep = 0; // how many blocks we've traversed
-    while (n_blocks_deep < offset_block_idx)
+/**
+ * Copy len bytes starting at offset of the file whose first block is first_block into buf.
+ * The range must lie within the file.
+ */
+int read_file_range(uint32_t first_block, uint32_t offset, uint32_t len, char *buf)
+{
+    uint16_t block_size = fs.block_size;
+    uint32_t block = nth_block(first_block, offset / block_size);
+    uint32_t offset_in_block = offset % block_size;
+    uint32_t n_copied = 0;
+    while (n_copied < len && block != FAT_END_OF_FILE)
     {
-        uint16_t next_block;
-        if (next_block_num(block, &next_block) != 0)
-        {
-            return EK_WRITE_NEXT_BLOCK_NUM_FAILED;
-        }
-        n_blocks_deep += 1;
-
-        if (next_block == FAT_END_OF_FILE)
+        if (get_block(block, fs.block_buf) != 0)
         {
-            // need to 0 out whatever remains in this block
-
-            // this is the number of bytes in the file that are in the last block
-            uint16_t n_file_bytes_in_block = file_size - (n_blocks_deep - 1) * block_size;
-            if (get_block(block, char_buf) != 0)
-            {
-                return EK_WRITE_GET_BLOCK_FAILED;
-            }
-            memset(char_buf + n_file_bytes_in_block, 0, block_size - n_file_bytes_in_block);
-            if (write_block(block, fs.block_buf) != 0)
-            {
-                return EK_WRITE_WRITE_BLOCK_FAILED;
-            }
-            break;
+            return EREAD_FILE_RANGE_GET_BLOCK_FAILED;
         }
-        block = next_block;
+        uint32_t n_to_copy = min(len - n_copied, block_size - offset_in_block);
+        memcpy(buf + n_copied, (char *)fs.block_buf + offset_in_block, n_to_copy);
+        n_copied += n_to_copy;
+        offset_in_block = 0;
+        block = get_fat(block);
     }
+    return 0;
+}
 
-    // If in the previous step we exhausted the blocks in the file,
-    // we continue iterating, up to the offset block, writing each
-    // intermediate block as empty
-    for (; n_blocks_deep < offset_block_idx; n_blocks_deep++)
+/**
+ * Write the buffer of a writable mapping back into its file. Bytes the file no longer
+ * has (because it was truncated while mapped) are dropped rather than growing it again.
+ */
+int write_mmap_back(mmap_entry *mapping)
+{
+    global_fd_entry *fd_entry = &global_fd_table[mapping->fd];
+    directory_entry *dir_entry = fd_entry->ptr_to_dir_entry;
+    uint64_t file_size = dir_entry_size(dir_entry);
+    if (mapping->offset >= file_size)
     {
-        uint16_t prev_block = block;
-        block = first_empty_block();
-        if (block == 0)
-        {
-            // no free blocks
-            fs.fat[prev_block] = FAT_END_OF_FILE;
-            return 0; // we've written 0 bytes since we never got to the offset
-        }
-
-        // set FAT linkages
-        fs.fat[prev_block] = block;
-
-        // write block as empty
-        memset(fs.block_buf, 0, block_size);
-        if (write_block(block, fs.block_buf) != 0)
-        {
-            return EK_WRITE_WRITE_BLOCK_FAILED;
-        }
+        return 0;
     }
+    uint32_t len = mapping->len < file_size - mapping->offset ? mapping->len : file_size - mapping->offset;
+    uint16_t block_size = fs.block_size;
 
-    // At this point, block should point to `offset_block_idx`th block.
-    // Recall the examples above:
-    // 1. `offset_block_idx` was 2, so block will hold the block number of the
-    // newly created block where we'll start writing our file
-    // 2. `offset_block_idx` was 2, so block will just hold the block number of the
-    // second/last block in the file
-    // 3. `offset_block_idx` was 1, block will hold the block number of the first/
-    // last block in the file
+    if (unshare_file_blocks(fd_entry, (mapping->offset + len - 1) / block_size) != 0)
+    {
+        return EK_MSYNC_UNSHARE_FAILED;
+    }
 
-    int n_copied = 0;
-    while (n > n_copied) // NOTE: this check is basically only used to check if n == 0 (following checks occur at the if statement in the loop body)
+    uint32_t block = nth_block(dir_entry_first_block(dir_entry), mapping->offset / block_size);
+    uint32_t offset_in_block = mapping->offset % block_size;
+    uint32_t n_written = 0;
+    while (n_written < len && block != FAT_END_OF_FILE)
     {
-        // check if we're writing to a new block
-        // by comparing the initial size of the block with the current offset
-        uint16_t curr_block_idx = (offset + n_copied) / block_size;
-        uint16_t origin_file_max_block_idx = (file_size + block_size - 1) / block_size; // file_size - 1 because file_size is effectively 1-indexed
-        is_writing_new_blocks = curr_block_idx > origin_file_max_block_idx;
-        if (is_writing_new_blocks)
-        {
-            memset(char_buf, 0, block_size);
-        }
-        else
+        uint32_t n_to_write = min(len - n_written, block_size - offset_in_block);
+        void *data = mapping->addr + n_written;
+        if (n_to_write < block_size)
         {
-            if (get_block(block, char_buf) != 0)
+            // partial block: merge with what is already on disk
+            if (get_block(block, fs.block_buf) != 0)
             {
-                return EK_WRITE_GET_BLOCK_FAILED;
+                return EK_MSYNC_GET_BLOCK_FAILED;
             }
+            memcpy((char *)fs.block_buf + offset_in_block, data, n_to_write);
+            data = fs.block_buf;
         }
-
-        uint16_t n_to_copy = min(n - n_copied, block_size - offset_in_block);
-        memcpy(char_buf + offset_in_block, str + n_copied, n_to_copy);
-        n_copied += n_to_copy; // n_copied out of buf into the file
-        if (write_block(block, char_buf))
-        {
-            return EK_WRITE_WRITE_BLOCK_FAILED;
-        }
-
-        if (n_copied >= n) // we're done
+        if (write_block(block, data) != 0)
         {
-            break;
+            return EK_MSYNC_WRITE_BLOCK_FAILED;
         }
-
-        // read the next block from the start
+        n_written += n_to_write;
         offset_in_block = 0;
-
-        // try to get the next block of the file
-        uint16_t next_block;
-        if (curr_block_idx + 1 < origin_file_max_block_idx)
-        {
-            if (next_block_num(block, &next_block) != 0)
-            {
-                return EK_WRITE_NEXT_BLOCK_NUM_FAILED;
-            }
-        }
-        else
-        {
-            fs.fat[block] = FAT_END_OF_FILE; // prevent a loop where we keep getting the same blocks
-            next_block = first_empty_block();
-            if (next_block == 0)
-            {
-                break;
-            }
-        }
-        fs.fat[block] = next_block;
-        block = next_block;
+        block = get_fat(block);
     }
-    fs.fat[block] = FAT_END_OF_FILE;
-
-    // increment the file offset by the number of bytes written
-    fd_entry->offset = offset + n_copied;
 
-    // write the updated at time through to the directory entry
     time_t mtime = time(NULL);
     if (mtime == (time_t)-1)
     {
-        return EK_WRITE_TIME_FAILED;
+        return EK_MSYNC_TIME_FAILED;
     }
-    fd_entry->ptr_to_dir_entry->mtime = mtime;
-    fd_entry->ptr_to_dir_entry->size = offset + n_copied;
-    // write through to the updated entry to the filesystem
-    if (write_root_dir_entry(fd_entry->ptr_to_dir_entry, dir_entry_block_num, dir_entry_idx) != 0)
+    dir_entry->mtime = mtime;
+    fd_entry->dirty = true;
+    if (write_root_dir_entry(dir_entry, fd_entry->dir_entry_block_num, fd_entry->dir_entry_idx) != 0)
     {
-        // TODO: should we rollback the ptr_to_dir_entry state on failure?
-        return EK_WRITE_WRITE_ROOT_DIR_ENTRY_FAILED;
+        return EK_MSYNC_WRITE_ROOT_DIR_ENTRY_FAILED;
     }
-    return n_copied;
+    return 0;
 }
 
-int k_unlink(const char *fname)
+int k_mmap(pid_t pid, int fd, uint32_t offset, uint32_t len, int prot, void **addr_ptr)
 {
-    if (!is_mounted())
+    select_fd_volume(fd);
+    if (!volume_is_mounted())
     {
         return EFS_NOT_MOUNTED;
     }
 
-    // we check for invalid filenames to prevent access to deleted files
-    // (e.g., adversarially setting the first byte to 1 or 2 to discover deleted files)
-    if (!is_valid_filename(fname))
+    if (fd >= GLOBAL_FD_TABLE_SIZE || fd < 0)
     {
-        return EK_UNLINK_INVALID_FILENAME;
+        return EK_MMAP_FD_OUT_OF_RANGE;
+    }
+    if (fd == STDIN_FD || fd == STDOUT_FD || fd == STDERR_FD)
+    {
+        return EK_MMAP_SPECIAL_FD;
     }
 
-    uint16_t dir_entry_block_num;
-    uint8_t dir_entry_idx;
-    directory_entry dir_entry; // we may or may not use this; see below
-    directory_entry *ptr_to_updated_dir_entry;
-    uint16_t fd_idx;
+    global_fd_entry *fd_entry = &global_fd_table[fd];
+    if (fd_entry->ref_count == 0)
+    {
+        return EK_MMAP_FD_NOT_IN_TABLE;
+    }
 
-    if (find_file_in_global_fd_table(fname, &fd_idx) == 0)
+    if (prot == 0 || (prot & ~(F_PROT_READ | F_PROT_WRITE)) != 0)
     {
-        // update the directory entry in the fd and set update_dir_entry so it's written through
-        global_fd_entry *fd_entry = &global_fd_table[fd_idx];
-        ptr_to_updated_dir_entry = fd_entry->ptr_to_dir_entry;
-        if (fd_entry->ref_count > 0)
-        {
-            ptr_to_updated_dir_entry->name[0] = 2; // indicates that it is deleted but still open // TODO: no magic nums
-        }
-        else
-        {
-            ptr_to_updated_dir_entry->name[0] = 1;
-            if (ptr_to_updated_dir_entry->first_block != 0)
-            {
-                clear_fat_file(ptr_to_updated_dir_entry->first_block);
-            }
-        }
-        dir_entry_block_num = fd_entry->dir_entry_block_num;
-        dir_entry_idx = fd_entry->dir_entry_idx;
+        return EK_MMAP_BAD_PROT;
     }
-    else
+    uint8_t perm = fd_entry->ptr_to_dir_entry->perm;
+    bool can_read = perm >= P_READ_ONLY_FILE_PERMISSION;
+    bool can_write = perm == P_WRITE_ONLY_FILE_PERMISSION || perm >= P_READ_WRITE_AND_EXECUTABLE_FILE_PERMISSION;
+    if (((prot & F_PROT_READ) && !can_read) || ((prot & F_PROT_WRITE) && !can_write))
     {
-        // if we've reached this point, either:
-        // - the reference count of the global_fd_entry is 0 or the fname is not in the fd table
-        // - the file is already deleted, and thus we can't find it
-        // We can't really distinguish between these cases, so we have to look for the file in the
-        // root directory
-        ptr_to_updated_dir_entry = &dir_entry;
-        int find_file_in_root_dir_status = find_file_in_root_dir(fname, ptr_to_updated_dir_entry, &dir_entry_block_num, &dir_entry_idx);
-        if (find_file_in_root_dir_status < 0)
-        {
-            return EK_UNLINK_FIND_FILE_IN_ROOT_DIR_FAILED;
-        }
-        if (
-            find_file_in_root_dir_status == RFIND_FILE_IN_ROOT_DIR_FILE_NOT_FOUND ||
-            find_file_in_root_dir_status == RFIND_FILE_IN_ROOT_DIR_FILE_DELETED)
-        {
-            return EK_UNLINK_FILE_NOT_FOUND;
-        }
-        ptr_to_updated_dir_entry->name[0] = 1; // mark as deleted
-        if (ptr_to_updated_dir_entry->first_block != 0)
+        return EK_MMAP_WRONG_PERMISSIONS;
+    }
+    if ((prot & F_PROT_WRITE) && fd_entry->ptr_to_dir_entry->type == FILE_TYPE_LOG)
+    {
+        return EK_MMAP_LOG_FILE;
+    }
+    if ((prot & F_PROT_WRITE) && is_read_only())
+    {
+        return EK_READ_ONLY_FS;
+    }
+
+    // mappings can't grow the file, so they are clamped to its current end
+    uint64_t file_size = dir_entry_size(fd_entry->ptr_to_dir_entry);
+    if (len == 0 || offset >= file_size)
+    {
+        return EK_MMAP_BAD_RANGE;
+    }
+    // a packed file can't be unpacked in a read-only mount, so it gets a buffered mapping
+    // copied out of its fragment block instead
+    bool packed = is_read_only() && dir_entry_frag_block(fd_entry->ptr_to_dir_entry) != 0;
+    if (!packed && unpack_file(fd_entry) != 0)
+    {
+        return EK_MMAP_UNPACK_FAILED;
+    }
+    if (len > file_size - offset)
+    {
+        len = file_size - offset;
+    }
+
+    mmap_entry *mapping = NULL;
+    for (int i = 0; i < MAX_MMAPS && mapping == NULL; i++)
+    {
+        if (mmap_table[i].addr == NULL)
         {
-            clear_fat_file(ptr_to_updated_dir_entry->first_block);
+            mapping = &mmap_table[i];
         }
     }
-
-    // write through to the updated entry to the filesystem
-    if (write_root_dir_entry(ptr_to_updated_dir_entry, dir_entry_block_num, dir_entry_idx) != 0)
+    if (mapping == NULL)
     {
-        return EK_UNLINK_WRITE_ROOT_DIR_ENTRY_FAILED;
+        return EK_MMAP_TOO_MANY_MAPPINGS;
     }
+    *mapping = (mmap_entry){.addr = NULL, .pid = pid, .host_base = NULL, .host_len = 0, .fd = fd, .offset = offset, .len = len, .prot = prot};
 
-    return 0;
-}
-
-int ls_dir_entry(directory_entry *ptr_to_dir_entry)
-{
-    // can write no more than block_size bytes
-    // this should be enough since
-    // - the block number is at most 65535 (5 bytes to represent)
-    // - the permission is 3 bytes
-    // - the size is at most 4,294,967,295 which is 10 bytes
-    // - the time is at most 18 bytes
-    // - the name is at most 31 bytes (since it's a null-terminated string)
-    // Including the 4 spaces between the columns, this is 68 bytes. Including the final newline and the null terminator, this is 70 bytes.
-    // so our block size of at least 256 is sufficient.
+    // a read-only range whose blocks are consecutive in the image can be handed out as is.
+    // Writable mappings always get a private buffer: writing straight into the image would
+    // bypass copy-on-write, so clones, snapshots and dedup would see the changes
+    uint16_t block_size = fs.block_size;
+    uint32_t first_idx = offset / block_size;
+    uint32_t last_idx = (offset + len - 1) / block_size;
+    uint32_t first_block = nth_block(dir_entry_first_block(fd_entry->ptr_to_dir_entry), first_idx);
+    bool contiguous = true;
+    uint32_t block = first_block;
+    for (uint32_t idx = first_idx; idx < last_idx && contiguous; idx++)
+    {
+        contiguous = get_fat(block) == block + 1;
+        block = get_fat(block);
+    }
 
-    char *buf = (char *)fs.block_buf;
-    int total_bytes_written = 0;
-    int n_bytes_written;
-    if (ptr_to_dir_entry->first_block != 0)
+    if (prot == F_PROT_READ && contiguous && !packed)
     {
-        n_bytes_written = sprintf(buf, "%3d", ptr_to_dir_entry->first_block);
-        if (n_bytes_written < 0)
+        off_t byte_offset = get_byte_offset_of_block(first_block) + offset % block_size;
+        off_t host_offset = byte_offset & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+        size_t host_len = len + (byte_offset - host_offset);
+        void *host_base = mmap(NULL, host_len, PROT_READ, MAP_SHARED, fs.fd, host_offset);
+        if (host_base != MAP_FAILED)
         {
-            return EK_LS_WRITE_FAILED;
+            mapping->host_base = host_base;
+            mapping->host_len = host_len;
+            mapping->addr = (char *)host_base + (byte_offset - host_offset);
         }
-        total_bytes_written += n_bytes_written;
+        // otherwise fall back to a buffered mapping
     }
-    else
+
+    if (mapping->addr == NULL)
     {
-        n_bytes_written = sprintf(buf, "    ");
-        if (n_bytes_written < 0)
+        char *buf = (char *)malloc(len);
+        if (buf == NULL)
         {
-            return EK_LS_WRITE_FAILED;
+            return EK_MMAP_MALLOC_FAILED;
         }
-        total_bytes_written += n_bytes_written;
+        const char *frag = packed ? mapped_block(dir_entry_frag_block(fd_entry->ptr_to_dir_entry)) : NULL;
+        if (frag != NULL)
+        {
+            memcpy(buf, frag + fd_entry->ptr_to_dir_entry->frag_offset + offset, len);
+        }
+        else if (packed || read_file_range(dir_entry_first_block(fd_entry->ptr_to_dir_entry), offset, len, buf) != 0)
+        {
+            free(buf);
+            return EK_MMAP_GET_BLOCK_FAILED;
+        }
+        mapping->addr = buf;
     }
 
-    // construct the permission string
-    char perm_str[5];
-    perm_str[0] = (ptr_to_dir_entry->type == 2) ? 'd' : '-';
-    perm_str[1] = (ptr_to_dir_entry->perm & 4) ? 'r' : '-'; // 0b100 = 4
-    perm_str[2] = (ptr_to_dir_entry->perm & 2) ? 'w' : '-'; // 0b010 = 2
-    perm_str[3] = (ptr_to_dir_entry->perm & 1) ? 'x' : '-'; // 0b001 = 1
-    perm_str[4] = '\0';
-
-    n_bytes_written = sprintf(buf + n_bytes_written, " %s", perm_str);
-    if (n_bytes_written < 0)
-    {
-        return EK_LS_WRITE_FAILED;
-    }
-    total_bytes_written += n_bytes_written;
+    // keep the file (and so its blocks) alive for as long as it is mapped
+    fd_entry->ref_count += 1;
+    *addr_ptr = mapping->addr;
+    return 0;
+}
 
-    n_bytes_written = sprintf(buf + total_bytes_written, " %d", ptr_to_dir_entry->size);
-    if (n_bytes_written < 0)
+int k_msync(void *addr)
+{
+    if (!is_mounted())
     {
-        return EK_LS_WRITE_FAILED;
+        return EFS_NOT_MOUNTED;
     }
-    total_bytes_written += n_bytes_written;
 
-    n_bytes_written = strftime(buf + total_bytes_written, 19, " %b %d %H:%M %Y", localtime(&ptr_to_dir_entry->mtime));
-    if (n_bytes_written < 0)
+    mmap_entry *mapping = find_mmap(addr);
+    if (mapping == NULL)
     {
-        return EK_LS_WRITE_FAILED;
+        return EK_MSYNC_NOT_MAPPED;
     }
-    total_bytes_written += n_bytes_written;
-
-    n_bytes_written = sprintf(buf + total_bytes_written, " %s\n", ptr_to_dir_entry->name);
-
-    if (n_bytes_written < 0)
+    select_fd_volume(mapping->fd);
+    if (!(mapping->prot & F_PROT_WRITE))
     {
-        return EK_LS_WRITE_FAILED;
+        return 0;
     }
-    total_bytes_written += n_bytes_written;
-
-    k_write(STDOUT_FD, buf, total_bytes_written);
-
-    return 0;
+    return write_mmap_back(mapping);
 }
 
-int k_ls(const char *filename)
+int k_munmap(void *addr)
 {
-    if (filename != NULL)
+    if (!is_mounted())
     {
-        directory_entry dir_entry;
-        uint16_t dir_entry_block_num;
-        uint8_t dir_entry_idx;
-        if (find_file_in_root_dir(filename, &dir_entry, &dir_entry_block_num, &dir_entry_idx) != 0)
-        {
-            // either failed or the file doesn't exist (we don't distinguish here)
-            return EK_LS_FIND_FILE_IN_ROOT_DIR_FAILED;
-        }
-        return ls_dir_entry(&dir_entry);
+        return EFS_NOT_MOUNTED;
     }
 
-    uint16_t block = 1;
-    // we'll need a second buffer here, since ls_dir_entry uses the fs.block_buf
-    // and we'll need to keep track of the block as we go
-    directory_entry *dir_entry_buf = (directory_entry *)malloc(fs.block_size);
-    if (dir_entry_buf == NULL)
+    mmap_entry *mapping = find_mmap(addr);
+    if (mapping == NULL)
     {
-        return EK_LS_MALLOC_FAILED;
+        return EK_MUNMAP_NOT_MAPPED;
     }
+    select_fd_volume(mapping->fd);
 
-    // n_dir_entry_per_block is at most 4096 / 64 = 64
-    uint8_t n_dir_entry_per_block = fs.block_size / sizeof(directory_entry);
-    int status;
-    while (true)
+    // the mapping goes away even if the write back fails, like munmap(2)
+    int status = 0;
+    if (mapping->prot & F_PROT_WRITE)
     {
-        if (get_block(block, dir_entry_buf) != 0)
-        {
-            status = EK_LS_GET_BLOCK_FAILED;
-            goto cleanup;
-        }
+        status = write_mmap_back(mapping);
+    }
+    if (mapping->host_base != NULL)
+    {
+        munmap(mapping->host_base, mapping->host_len);
+    }
+    else
+    {
+        free(mapping->addr);
+    }
+    int fd = mapping->fd;
+    *mapping = (mmap_entry){0};
 
-        for (uint8_t i = 0; i < n_dir_entry_per_block; i++)
+    int close_status = k_close(fd);
+    return status != 0 ? status : close_status;
+}
+
+int k_munmap_all(pid_t pid)
+{
+    int status = 0;
+    for (int i = 0; i < MAX_MMAPS; i++)
+    {
+        if (mmap_table[i].addr != NULL && mmap_table[i].pid == pid)
         {
-            directory_entry curr_dir_entry = dir_entry_buf[i];
-            if (curr_dir_entry.name[0] == 0)
-            {
-                status = 0;
-                goto cleanup;
-            }
-            if (curr_dir_entry.name[0] == 1 || curr_dir_entry.name[0] == 2)
+            int munmap_status = k_munmap(mmap_table[i].addr);
+            if (status == 0)
             {
-                continue;
+                status = munmap_status;
             }
-
-            ls_dir_entry(&curr_dir_entry);
         }
+    }
+    return status;
+}
 
-        if (next_block_num(block, &block) != 0)
-        {
-            status = EK_LS_NEXT_BLOCK_NUM_FAILED;
-            goto cleanup;
-        }
-    };
+/**
+ * Copy the usage of the slab caches into stats. They are gauges rather than counters, so
+ * they are read when the stats are rather than kept up to date
+ */
+void update_slab_stats(void)
+{
+    stats.slab_in_use = dir_entry_slab.n_in_use + block_map_slab.n_in_use;
+    stats.slab_capacity = (dir_entry_slab.n_slabs * dir_entry_slab.objs_per_slab) + (block_map_slab.n_slabs * block_map_slab.objs_per_slab);
+}
 
-cleanup:
-    free(dir_entry_buf);
-    return status;
+void k_fsstats(fs_stats *stats_ptr)
+{
+    update_slab_stats();
+    *stats_ptr = stats;
 }
 
-int k_chmod(const char *fname, uint8_t perm, int mode)
+void k_fsstats_reset(void)
+{
+    stats = (fs_stats){0};
+}
+
+int k_fsstats_print(void)
 {
     if (!is_mounted())
     {
         return EFS_NOT_MOUNTED;
     }
 
-    // we check for invalid filenames to prevent access to deleted files
-    // (e.g., adversarially setting the first byte to 1 or 2 to discover deleted files)
-    if (!is_valid_filename(fname))
+    update_slab_stats();
+    const char *names[] = {
+        "get_block_calls", "get_block_bytes", "write_block_calls", "write_block_bytes",
+        "chain_hops", "alloc_scans", "alloc_scan_blocks", "dir_lookups", "dir_block_reads",
+        "cache_hits", "cache_misses", "reclaim_queued", "reclaimed_blocks", "dir_compactions",
+        "dir_splits", "name_filter_skips", "name_filter_fps", "slab_in_use", "slab_capacity"};
+    uint64_t values[] = {
+        stats.get_block_calls, stats.get_block_bytes, stats.write_block_calls, stats.write_block_bytes,
+        stats.chain_hops, stats.alloc_scans, stats.alloc_scan_blocks, stats.dir_lookups, stats.dir_block_reads,
+        stats.cache_hits, stats.cache_misses, stats.reclaim_queued, stats.reclaimed_blocks, stats.dir_compactions,
+        stats.dir_splits, stats.name_filter_skips, stats.name_filter_fps, stats.slab_in_use, stats.slab_capacity};
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++)
     {
-        return EK_CHMOD_INVALID_FILENAME;
+        if (k_fprintf_short(STDOUT_FD, "%-20s %llu\n", names[i], (unsigned long long)values[i]) < 0)
+        {
+            return EK_FSSTATS_WRITE_FAILED;
+        }
     }
 
-    uint16_t dir_entry_block_num;
-    uint8_t dir_entry_idx;
-    directory_entry dir_entry;
-    if (find_file_in_root_dir(fname, &dir_entry, &dir_entry_block_num, &dir_entry_idx) != 0)
+    // the share of lookups of missing names that still had to scan the directory
+    uint64_t n_misses = stats.name_filter_skips + stats.name_filter_fps;
+    double fp_rate = n_misses == 0 ? 0.0 : (double)stats.name_filter_fps / n_misses;
+    if (k_fprintf_short(STDOUT_FD, "%-20s %.4f\n", "name_filter_fp_rate", fp_rate) < 0)
     {
-        return EK_CHMOD_FILE_NOT_FOUND;
+        return EK_FSSTATS_WRITE_FAILED;
     }
+    return 0;
+}
 
-    if (perm < 0 || perm > 7)
+int k_reclaim(uint32_t max_blocks)
+{
+    if (!is_mounted())
     {
-        return EK_CHMOD_WRONG_PERMISSIONS;
+        return EFS_NOT_MOUNTED;
     }
 
-    if (mode == F_CHMOD_SET) {
-        dir_entry.perm = perm;
-    } else if (mode == F_CHMOD_ADD) {
-        dir_entry.perm |= perm;
-    } else if (mode == F_CHMOD_REMOVE) {
-        dir_entry.perm &= ~perm;
-    } else {
-        return EK_CHMOD_INVALID_MODE;
-    }
-    if (write_root_dir_entry(&dir_entry, dir_entry_block_num, dir_entry_idx) != 0)
+    uint32_t n_freed = 0;
+    for (int i = 0; i < MAX_VOLUMES && n_freed < max_blocks; i++)
     {
-        return EK_CHMOD_WRITE_ROOT_DIR_ENTRY_FAILED;
+        if (volumes[i].fat != NULL)
+        {
+            current_volume = &volumes[i];
+            n_freed += reclaim_volume(max_blocks - n_freed);
+        }
     }
-
-    return 0;
+    return n_freed;
 }
 
-int k_mv(const char *src, const char *dest)
+/**
+ * k_reclaim for the current volume only
+ */
+int reclaim_volume(uint32_t max_blocks)
 {
-    if (!is_mounted())
+    uint32_t budget = max_blocks;
+    while (fs.reclaim_queue_len > 0 && budget > 0)
     {
-        return EFS_NOT_MOUNTED;
+        uint32_t next = clear_fat_blocks(fs.reclaim_queue[fs.reclaim_queue_start], &budget);
+        if (next != FAT_END_OF_FILE)
+        {
+            fs.reclaim_queue[fs.reclaim_queue_start] = next;
+            continue;
+        }
+        fs.reclaim_queue_start = (fs.reclaim_queue_start + 1) % RECLAIM_QUEUE_SIZE;
+        fs.reclaim_queue_len -= 1;
     }
+    stats.reclaimed_blocks += max_blocks - budget;
+    return max_blocks - budget;
+}
 
-    if (!is_valid_filename(dest))
+void k_reclaim_async(bool enabled)
+{
+    reclaim_async = enabled;
+    if (!enabled && is_mounted())
     {
-        return EK_MV_INVALID_FILENAME;
+        k_reclaim(UINT32_MAX);
     }
+}
 
-    // if the dest file exists, we need to unlink it
-    int unlink_status = k_unlink(dest);
-    if (unlink_status != 0 && unlink_status != EK_UNLINK_FILE_NOT_FOUND) // it's OK if the dest file doesn't exist
+int k_compact_root_dir(void)
+{
+    current_volume = &volumes[0];
+    if (!volume_is_mounted())
     {
-        return EK_MV_UNLINK_FAILED;
+        return EFS_NOT_MOUNTED;
     }
 
-    // TODO: do we need read perms to mv?
-    int src_fd = k_open(src, F_READ); // we only need to check read permissions here
-                                      // since the actual contents will not change and
-                                      // so we don't need to make sure there are no simultaneous
-                                      // writers
-    if (src_fd == EK_OPEN_FILE_DOES_NOT_EXIST)
+    if (is_read_only())
     {
-        return EK_MV_FILE_NOT_FOUND;
+        return EK_READ_ONLY_FS;
     }
-    else if (src_fd < 0)
+    return compact_root_dir();
+}
+
+/**
+ * k_compact_root_dir for the current volume, which must be mounted read-write
+ */
+static int compact_root_dir(void)
+{
+    uint32_t n_dir_entry_per_block = fs.block_size / sizeof(directory_entry);
+    uint32_t n_blocks = 0;
+    for (uint32_t block = 1; block != FAT_END_OF_FILE; block = get_fat(block))
     {
-        return EK_MV_OPEN_FAILED;
+        n_blocks += 1;
     }
 
-    global_fd_entry *src_fd_entry = &global_fd_table[src_fd];
-    strcpy(src_fd_entry->ptr_to_dir_entry->name, dest); // know dest must be a valid filename because we opened it
-
+    // the whole directory is compacted in memory, with new_idx[i] being where the i-th
+    // entry (counting from the start of the directory) ends up
+    uint32_t n_slots = n_blocks * n_dir_entry_per_block;
+    directory_entry *entries = (directory_entry *)malloc((size_t)n_blocks * fs.block_size);
+    uint32_t *blocks = (uint32_t *)malloc(n_blocks * sizeof(uint32_t));
+    uint32_t *new_blocks = (uint32_t *)malloc(n_blocks * sizeof(uint32_t));
+    uint32_t *new_idx = (uint32_t *)malloc(n_slots * sizeof(uint32_t));
     int status = 0;
-    if (write_root_dir_entry(src_fd_entry->ptr_to_dir_entry, src_fd_entry->dir_entry_block_num, src_fd_entry->dir_entry_idx) != 0)
+    if (entries == NULL || blocks == NULL || new_blocks == NULL || new_idx == NULL)
     {
-        status = EK_MV_WRITE_ROOT_DIR_ENTRY_FAILED;
+        status = EK_COMPACT_ROOT_DIR_MALLOC_FAILED;
         goto cleanup;
     }
 
-cleanup:
-    if (k_close(src_fd) != 0)
+    uint32_t i = 0;
+    for (uint32_t block = 1; block != FAT_END_OF_FILE; block = get_fat(block))
     {
-        status = EK_MV_CLOSE_FAILED;
+        blocks[i] = block;
+        if (get_block(block, entries + i * n_dir_entry_per_block) != 0)
+        {
+            status = EK_COMPACT_ROOT_DIR_GET_BLOCK_FAILED;
+            goto cleanup;
+        }
+        i += 1;
     }
-    return status;
-}
 
-int k_setmode(int fd, int mode)
-{
-    if (fd >= GLOBAL_FD_TABLE_SIZE)
+    // entries of files that were deleted while open (name[0] == 2) are kept, since they
+    // are written back when the file is closed
+    uint32_t n_live = 0;
+    for (i = 0; i < n_slots && entries[i].name[0] != 0; i++)
     {
-        return EK_SETMODE_FD_OUT_OF_RANGE;
+        if (entries[i].name[0] == 1)
+        {
+            continue;
+        }
+        entries[n_live] = entries[i];
+        new_idx[i] = n_live;
+        n_live += 1;
     }
+    memset(entries + n_live, 0, (n_slots - n_live) * sizeof(directory_entry));
 
-    if (global_fd_table[fd].ref_count <= 0)
+    // there is always an end of directory entry, even if that takes a block of its own
+    uint32_t n_new_blocks = n_live / n_dir_entry_per_block + 1;
+
+    // the directory has to start at block 1, but the rest of it is written to fresh blocks
+    // first, and block 1 last. A failed write then leaves the old directory as it was
+    new_blocks[0] = 1;
+    if (n_new_blocks > 1)
     {
-        return EK_SETMODE_FD_NOT_IN_USE;
+        uint32_t first_block;
+        uint32_t last_block;
+        if (allocate_blocks(n_new_blocks - 1, &first_block, &last_block) != 0)
+        {
+            status = EK_COMPACT_ROOT_DIR_NO_SPACE;
+            goto cleanup;
+        }
+        uint32_t block = first_block;
+        for (i = 1; i < n_new_blocks; i++)
+        {
+            new_blocks[i] = block;
+            block = get_fat(block);
+        }
+    }
+    for (i = n_new_blocks; i-- > 0;)
+    {
+        if (write_block(new_blocks[i], entries + i * n_dir_entry_per_block) != 0)
+        {
+            for (uint32_t j = 1; j < n_new_blocks; j++)
+            {
+                set_fat(new_blocks[j], 0);
+            }
+            status = EK_COMPACT_ROOT_DIR_WRITE_BLOCK_FAILED;
+            goto cleanup;
+        }
+    }
+    // only now does the directory move over to the new blocks
+    set_fat(1, n_new_blocks > 1 ? new_blocks[1] : FAT_END_OF_FILE);
+    for (i = 1; i < n_blocks; i++)
+    {
+        set_fat(blocks[i], 0);
     }
 
-    if (mode != F_READ && mode != F_WRITE && mode != F_APPEND)
+    for (uint16_t fd = 3; fd < GLOBAL_FD_TABLE_SIZE; fd++)
     {
-        return EK_SETMODE_BAD_MODE;
+        global_fd_entry *fd_entry = &global_fd_table[fd];
+        if (fd_entry->ref_count == 0 || fd_entry->volume != current_volume || fd_entry->dir_block != 1)
+        {
+            continue;
+        }
+        for (i = 0; i < n_blocks && blocks[i] != fd_entry->dir_entry_block_num; i++)
+            ;
+        uint32_t idx = new_idx[i * n_dir_entry_per_block + fd_entry->dir_entry_idx];
+        fd_entry->dir_entry_block_num = new_blocks[idx / n_dir_entry_per_block];
+        fd_entry->dir_entry_idx = idx % n_dir_entry_per_block;
     }
 
-    global_fd_entry *fd_entry = &global_fd_table[fd];
-    fd_entry->write_locked = mode;
+    fs.n_dir_entries = n_live;
+    fs.n_dir_tombstones = 0;
+    stats.dir_compactions += 1;
 
-    return 0;
+    // the filter still has the names of every file deleted since it was built
+    name_filter_free(fs.names);
+    fs.names = name_filter_new(2 * n_live);
+    for (i = 0; i < n_live && fs.names != NULL; i++)
+    {
+        if (entries[i].name[0] > 2)
+        {
+            name_filter_add(fs.names, entries[i].name);
+        }
+    }
+
+cleanup:
+    free(entries);
+    free(blocks);
+    free(new_blocks);
+    free(new_idx);
+    return status;
 }
 
-int k_getmode(int fd) {
-    if (fd >= GLOBAL_FD_TABLE_SIZE) {
-        return EK_GETMODE_FD_OUT_OF_RANGE;
+int k_statfs(fs_statfs *statfs_ptr)
+{
+    current_volume = &volumes[0];
+    if (!volume_is_mounted())
+    {
+        return EFS_NOT_MOUNTED;
     }
-    
-    if (global_fd_table[fd].ref_count <= 0) {
-        return EK_GETMODE_FD_NOT_IN_USE;
+
+    uint32_t n_blocks = get_blocks_in_data_region();
+    if (fs.largest_free_run_stale)
+    {
+        if (fs.n_snapshots == 0)
+        {
+            fs.largest_free_run = fs.fat32 ? longest_zero_run32((const uint32_t *)fs.fat + 1, n_blocks) : longest_zero_run((const uint16_t *)fs.fat + 1, n_blocks);
+        }
+        else
+        {
+            // blocks of snapshots break up runs even where the FAT is 0
+            uint32_t run = 0;
+            fs.largest_free_run = 0;
+            for (uint32_t block = 1; block <= n_blocks; block++)
+            {
+                run = get_fat(block) == 0 && fs.snap_refs[block] == 0 ? run + 1 : 0;
+                fs.largest_free_run = run > fs.largest_free_run ? run : fs.largest_free_run;
+            }
+        }
+        fs.largest_free_run_stale = false;
     }
 
-    return global_fd_table[fd].write_locked;
+    *statfs_ptr = (fs_statfs){
+        .block_size = fs.block_size,
+        .total_blocks = n_blocks,
+        .free_blocks = fs.n_free_blocks,
+        .largest_free_run = fs.largest_free_run};
+    return 0;
 }
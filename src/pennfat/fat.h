@@ -5,6 +5,7 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <time.h>
+#include <sys/types.h>
 #include "src/pennfat/fat_constants.h"
 
 #define EFS_NOT_MOUNTED 99
@@ -15,9 +16,28 @@
 #define EMOUNT_OPEN_FAILED 5
 #define EMOUNT_MMAP_FAILED 6
 #define EMOUNT_READ_FAILED 8
+#define EMOUNT_SNAPSHOT_LOAD_FAILED 9
+#define EMOUNT_TOO_MANY_VOLUMES 10
+#define EMOUNT_BAD_VOLUME_NAME 11
+#define EMOUNT_DIRECT_UNSUPPORTED 12
+#define EMOUNT_MLOCK_FAILED 13
 
 #define EUNMOUNT_MUNMAP_FAILED 1
 #define EUNMOUNT_CLOSE_FAILED 2
+#define EUNMOUNT_DEDUP_SAVE_FAILED 3
+
+// flags for mount_with_flags
+#define MOUNT_DEDUP 1 // share identical data blocks between files (see dedup.h)
+#define MOUNT_PACK 2  // pack small files into blocks shared with other small files when they are closed
+#define MOUNT_READ_ONLY 4 // reject every change to the image (see mount_with_flags). Overrides MOUNT_DEDUP and MOUNT_PACK
+#define MOUNT_DIRECT 8    // open every file as if with F_DIRECT. Ignored with MOUNT_READ_ONLY
+
+// hints about how the FAT mapping is used (see mount_with_flags)
+#define MOUNT_POPULATE 16    // fault the whole FAT in at mount, so the first walk of a chain doesn't
+#define MOUNT_MLOCK 32       // keep the FAT in memory. Mounting fails if it can't be locked
+#define MOUNT_HUGEPAGE 64    // back the FAT with transparent huge pages, where the kernel supports it
+#define MOUNT_SEQUENTIAL 128 // chains are mostly walked in order, so read ahead aggressively
+#define MOUNT_RANDOM 256     // chains are mostly jumped around in, so don't read ahead. Overrides MOUNT_SEQUENTIAL
 
 #define F_SEEK_SET 1
 #define F_SEEK_CUR 2
@@ -27,6 +47,28 @@
 #define STDOUT_FD 1
 #define STDERR_FD 2
 
+#define MAX_SNAPSHOTS 32
+#define SNAPSHOT_NAME_SIZE 32
+
+#define MAX_VOLUMES 8
+#define VOLUME_NAME_SIZE 16
+#define VOLUME_SEPARATOR ':' // "scratch:f" is the file f on the volume mounted as scratch
+#define RECLAIM_QUEUE_SIZE 64
+
+// O_DIRECT needs buffers aligned to this, and block sizes (so file offsets) that are a
+// multiple of the host's sector size, which is assumed to be DIRECT_IO_MIN_BLOCK_SIZE
+#define DIRECT_IO_ALIGN 4096
+#define DIRECT_IO_MIN_BLOCK_SIZE 512
+
+// a log file holds records written by k_log_append, each a uint32_t length followed by that many
+// bytes, and its in-memory record index has an entry for every LOG_INDEX_INTERVAL-th record
+#define LOG_RECORD_HEADER_SIZE 4
+#define LOG_INDEX_INTERVAL 64
+
+#define FILE_TYPE_REGULAR 1
+#define FILE_TYPE_DIRECTORY 2
+#define FILE_TYPE_LOG 3 // opened with F_LOG, and only ever appended to with k_log_append
+
 #define P_NO_FILE_PERMISSION 0
 #define P_WRITE_ONLY_FILE_PERMISSION 2
 #define P_READ_ONLY_FILE_PERMISSION 4
@@ -34,14 +76,93 @@
 #define P_READ_WRITE_FILE_PERMISSION 6
 #define P_READ_WRITE_AND_EXECUTABLE_FILE_PERMISSION 5
 
+typedef struct snapshot_info_st
+{
+    char name[SNAPSHOT_NAME_SIZE];
+    time_t ctime;
+    uint32_t n_blocks; // blocks in use when the snapshot was taken
+} snapshot_info;
+
+// counters for where the filesystem spends its time. Collected since the last mount or reset
+typedef struct fs_stats_st
+{
+    uint64_t get_block_calls;
+    uint64_t get_block_bytes;
+    uint64_t write_block_calls;
+    uint64_t write_block_bytes;
+    uint64_t chain_hops;        // FAT entries followed to walk a chain to some block
+    uint64_t alloc_scans;       // searches for free blocks
+    uint64_t alloc_scan_blocks; // blocks examined by those searches
+    uint64_t dir_lookups;       // directory searches for a name or a free entry
+    uint64_t dir_block_reads;   // directory blocks read by those searches
+    uint64_t cache_hits;        // block cache lookups (always 0 while there is no block cache)
+    uint64_t cache_misses;
+    uint64_t reclaim_queued;    // chains handed to the background reclaimer instead of freed on the spot
+    uint64_t reclaimed_blocks;  // blocks freed by k_reclaim
+    uint64_t dir_compactions;   // root directory rewrites that dropped deleted entries
+    uint64_t dir_splits;        // subdirectories that doubled their buckets to fit another entry
+    uint64_t name_filter_skips; // lookups of missing names answered without reading the root directory
+    uint64_t name_filter_fps;   // lookups of missing names the name filter let through anyway
+    uint64_t slab_in_use;       // open file metadata objects handed out by the slab caches (not reset)
+    uint64_t slab_capacity;     // objects the slab caches have room for without growing (not reset)
+} fs_stats;
+
 typedef struct fat16_fs_st
 {
-    uint16_t *fat;
+    void *fat;       // uint16_t entries, or uint32_t ones when fat32 (see get_fat)
     size_t fat_size; // the total size of the fat
+    bool fat32;      // whether the image was made with MKFS_FAT32
     uint16_t block_size;
     uint16_t blocks_in_fat;
     int fd;          // fd to the file of the FAT
-    void *block_buf; // buffer of size block_size bytes
+    void *block_buf; // buffer of size block_size bytes, aligned to DIRECT_IO_ALIGN
+    int direct_fd;   // second fd to the image, opened with O_DIRECT by the first mount or open that asks for it, else -1
+    void *direct_buf; // DIRECT_IO_ALIGN aligned bounce buffer of block_size bytes for direct I/O on unaligned buffers
+    int flags;       // MOUNT_* flags the filesystem was mounted with
+    char volume_name[VOLUME_NAME_SIZE]; // prefix of the names of files on this volume, "" for the default volume
+    size_t image_size; // bytes mapped at fat when mounted with MOUNT_READ_ONLY (the whole image), 0 otherwise
+    char *fs_name;   // copy of the host file name, used to locate sidecar files
+
+    // number of references to each block beyond the first (i.e., 0 means the block is
+    // free or owned by exactly one file). Blocks with extra references are copy-on-write.
+    // Derived from the FAT and root directory at mount time, so it is never stored on disk.
+    uint16_t *extra_refs;
+
+    // number of snapshots each block is part of. These blocks are copy-on-write and are
+    // never handed out again while the snapshot exists, even if the live volume frees them.
+    uint8_t *snap_refs;
+    snapshot_info *snapshots; // MAX_SNAPSHOTS entries, listed in <fs_name>.snapshots
+    uint8_t n_snapshots;
+
+    // blocks shared by packed small files (see directory_entry.frag_block), and which of their
+    // slots are in use. Derived from the root directory at mount time
+    struct fragment_block_st *fragment_blocks;
+    uint32_t n_fragment_blocks;
+
+    // root directory entries before the end of directory entry, and how many of those are
+    // deleted (name[0] == 1) and only waiting to be reused. Derived at mount time
+    uint32_t n_dir_entries;
+    uint32_t n_dir_tombstones;
+
+    // Bloom filter over the names in the root directory, or NULL if it couldn't be built
+    // (then every lookup scans the directory). Derived at mount time
+    struct name_filter_st *names;
+
+    // blocks that can be allocated, kept up to date by every change to the FAT (see set_fat)
+    // and to snap_refs. The longest run of them is only recomputed when asked for after a change
+    uint32_t n_free_blocks;
+    uint32_t largest_free_run;
+    bool largest_free_run_stale;
+
+    // chains of deleted or truncated files waiting to be freed by k_reclaim, oldest first.
+    // Their blocks stay marked as used in the FAT until then, so nothing can hand them out early
+    uint32_t reclaim_queue[RECLAIM_QUEUE_SIZE];
+    uint32_t reclaim_queue_start;
+    uint32_t reclaim_queue_len;
+
+    // only used when mounted with MOUNT_DEDUP
+    uint64_t *block_hashes;      // content hash of each block as last written, 0 if unknown
+    struct dedup_index_st *dedup; // content hash -> block index, persisted in <fs_name>.dedup
 } fat16_fs;
 
 typedef struct directory_entry_st
@@ -52,45 +173,169 @@ typedef struct directory_entry_st
     uint8_t type;         // 1
     uint8_t perm;         // 1
     time_t mtime;         // 8
-    char padding[16];     // 16
+    uint16_t frag_block;  // 2, block holding the data of a packed file (then first_block is 0), or 0
+    uint16_t frag_offset; // 2, where the data of a packed file starts in frag_block. It is size bytes long
+    uint32_t n_records;   // 4, records in a FILE_TYPE_LOG file, 0 for other files
+    // the high halves of first_block, frag_block and size, which are only ever non-zero on a
+    // MKFS_FAT32 image (where they were padding before). Use the dir_entry_* accessors
+    uint16_t first_block_hi; // 2
+    uint16_t frag_block_hi;  // 2
+    uint32_t size_hi;        // 4
 } directory_entry;        // 64 bytes in total!
 _Static_assert(sizeof(directory_entry) == 64, "directory_entry must be 64 byes");
 
+// what k_log_read keeps about an open log file, so it never has to scan from the start
+typedef struct log_reader_st
+{
+    // index[i] is the offset of record i * LOG_INDEX_INTERVAL, for every record in the file
+    uint32_t *index;
+    uint32_t index_len;
+    uint32_t index_capacity;
+    // the record after the one last read, and where it starts, so a scan never goes back to the index
+    uint32_t next_record;
+    uint32_t next_offset;
+    // window_len bytes of the file from window_start on (at most a block), so reading records
+    // one after another costs one read per block
+    char *window;
+    uint32_t window_start;
+    uint32_t window_len;
+} log_reader;
+
 typedef struct global_fd_entry_st
 {
     size_t ref_count;
+    fat16_fs *volume; // the volume the file is on, NULL for STDIN, STDOUT and STDERR
     directory_entry *ptr_to_dir_entry; // an in-memory copy of the dir entry. This should be maintained so it always matches what is on disk
-    uint16_t dir_entry_block_num;
+    uint32_t dir_entry_block_num;
     uint8_t dir_entry_idx;
+    uint32_t dir_block; // first block of the directory the entry is in, 1 for the root directory
     uint8_t write_locked; // mutex for whether this file is already being written to by another file. If the value is 0 the file is not write locked, 1 it opened with F_WRITE, and 2 it opened with F_APPEND
-    uint32_t offset;
+    uint64_t offset;
+    bool dirty; // whether the file has been written to since it was opened
+    bool direct; // whether the data of the file moves through fs.direct_fd (see F_DIRECT)
+    uint16_t generation; // bumped every time the entry is released, so stale references to it can be told apart (see k_getgeneration)
+    uint16_t next_free;  // next unused entry after this one while ref_count is 0
+
+    // block_map[i] is the i-th block of the file, for the first block_map_len blocks.
+    // Built lazily as the file is accessed and cut back whenever the chain changes
+    uint32_t *block_map;
+    uint32_t block_map_len;
+    uint32_t block_map_capacity;
+
+    log_reader *log; // set up by the first k_log_read of a log file, NULL until then
 } global_fd_entry;
 
 /**
- * @brief Mount the pennfat (fat16) filesystem from the file named fs_name
+ * @brief Get the first block of a file, which is 0 for empty and packed files
+ */
+uint32_t dir_entry_first_block(const directory_entry *dir_entry);
+
+/**
+ * @brief Get the block holding the data of a packed file, or 0
+ */
+uint32_t dir_entry_frag_block(const directory_entry *dir_entry);
+
+/**
+ * @brief Get the size of a file in bytes
+ */
+uint64_t dir_entry_size(const directory_entry *dir_entry);
+
+/**
+ * @brief Mount the pennfat (fat16) filesystem from the file named fs_name as the default
+ * volume, which holds the files whose names have no volume prefix
  * @param fs_name file name of the FAT in the host filesystem
  * @return int 0 on success, and an error code on error
  */
 int mount(char *fs_name);
 
 /**
- * @brief Unmount the pennfat (fat16) filesystem from the struct pointed to by ptr_to_fs.
- * This function will 0 out the struct on success (but may not on failure).
+ * @brief Mount the pennfat (fat16) filesystem from the file named fs_name with extra options
+ *
+ * Images made with MKFS_FAT32 are told apart by their first FAT entry and mounted the same
+ * way: only the width of the FAT entries differs, so everything else (the allocator, the
+ * block maps, the mount hints) works on both alike.
+ *
+ * With MOUNT_READ_ONLY the image is opened read-only and mapped whole, and every call that
+ * could change it fails with EK_READ_ONLY_FS. Nothing can change underneath a reader then, so
+ * once files are open, k_read and k_lseek on different fds, and k_stat, may be called from
+ * several host threads at once without locking: they read blocks in place from the mapping,
+ * every k_open gets its own fd with its block map built up front, and they leave fs_stats
+ * alone. Everything else, including k_open and k_close, must still be called from one thread.
+ *
+ * With MOUNT_DIRECT the data of every file is read and written with O_DIRECT (see k_open),
+ * which fails with EMOUNT_DIRECT_UNSUPPORTED if the host filesystem or the block size of the
+ * image doesn't allow it. The FAT and the root directory still go through the page cache.
+ *
+ * MOUNT_POPULATE, MOUNT_MLOCK, MOUNT_HUGEPAGE, MOUNT_SEQUENTIAL and MOUNT_RANDOM tune the
+ * mapping of the FAT (and, on a read-only mount, of the rest of the image). Apart from
+ * MOUNT_MLOCK, which fails with EMOUNT_MLOCK_FAILED when the memory can't be locked (see
+ * RLIMIT_MEMLOCK), they are hints that are quietly skipped where the kernel lacks them.
  *
+ * @param fs_name file name of the FAT in the host filesystem
+ * @param flags bitwise or of MOUNT_* flags (e.g., MOUNT_DEDUP)
  * @return int 0 on success, and an error code on error
  */
+int mount_with_flags(char *fs_name, int flags);
+
+/**
+ * @brief Mount another image next to the default volume. Every volume has its own FAT
+ * mapping, buffers, allocator state and sidecar files, and files on it are named with a
+ * prefix: after mount_volume("scratch", ...), k_open("scratch:f", ...) opens the file f on
+ * it, and names on volumes that aren't mounted fail with EK_UNKNOWN_VOLUME. Files can't be
+ * moved or cloned across volumes, and k_copy_range copies across them through a buffer. Calls that
+ * take no name (k_snapshot_list, k_compact_root_dir, k_statfs) work on the default volume.
+ * @param volume name of the volume, made of filename characters. "" mounts the default volume
+ * @param fs_name file name of the FAT in the host filesystem
+ * @param flags bitwise or of MOUNT_* flags (e.g., MOUNT_DEDUP)
+ * @return int 0 on success, and an error code on error
+ */
+int mount_volume(const char *volume, char *fs_name, int flags);
+
+/**
+ * @brief Unmount every mounted volume. This closes all files and releases all mappings.
+ *
+ * @return int 0 on success, and an error code on error (the last one, if several volumes fail)
+ */
 int unmount(void);
 
 /**
- * @brief Check if the pennfat (fat16) filesystem is mounted
- * @return bool true if the pennfat (fat16) filesystem is mounted, false otherwise
+ * @brief Unmount one volume, closing the files and releasing the mappings that are on it
+ * @param volume name the volume was mounted with, "" for the default volume
+ * @return int 0 on success, EK_UNKNOWN_VOLUME if no volume has that name, and an error code on error
+ */
+int unmount_volume(const char *volume);
+
+/**
+ * @brief Check if any pennfat (fat16) volume is mounted
+ * @return bool true if at least one volume is mounted, false otherwise
  */
 bool is_mounted(void);
 
 /**
  * @brief Open a file
+ *
+ * Every k_* call that takes a file name takes a path: components separated by '/' (with
+ * empty ones ignored), starting at the root directory of the volume, e.g. "scratch:a/b/f".
+ * Looking a name up in a subdirectory reads one block however many files it holds (see
+ * k_mkdir), so a path costs one lookup per component. Directories themselves can't be opened
+ * (EK_OPEN_IS_DIRECTORY).
+ *
+ * With F_DIRECT or'd into mode, k_read and k_write move the file's data with O_DIRECT, so
+ * streaming a large file doesn't fill the host page cache. Whole blocks then go straight
+ * between the disk and the caller's buffer, which is fastest when it is DIRECT_IO_ALIGN
+ * aligned. The flag sticks to the file until every fd to it is closed. It is ignored on
+ * read-only mounts, and fails with EK_OPEN_DIRECT_UNSUPPORTED if the host filesystem or the
+ * block size (less than DIRECT_IO_MIN_BLOCK_SIZE) doesn't allow O_DIRECT.
+ *
+ * @param fname file name
+ * With F_LOG or'd into mode, the file is a log (FILE_TYPE_LOG): a new or empty file becomes
+ * one when opened for writing, and opening any other file that isn't already a log fails with
+ * EK_OPEN_NOT_A_LOG. A log stays one after it is closed, and whatever it is opened with only
+ * k_log_append can add to it (k_write, k_copy_range and writable k_mmap fail). Opening it
+ * with F_WRITE empties it as usual.
+ *
  * @param fname file name
- * @param mode mode to open the file with (i.e., F_READ, F_WRITE, F_APPEND)
+ * @param mode mode to open the file with (i.e., F_READ, F_WRITE, F_APPEND), optionally with F_DIRECT and F_LOG
  * @return int global file descriptor, or negative error code
  */
 int k_open(const char *fname, int mode);
@@ -118,10 +363,10 @@ int k_read(int fd, int n, char *buf);
  * @param whence whence to seek from (i.e., F_SEEK_SET, F_SEEK_CUR, F_SEEK_END)
  * @return int64_t new offset, or negative error code
  * @note IMPORTANT: this function does not have the same signature as lseek(2) because
- * it returns a negative error code on error. On success, it returns the offset
- * which is guaranteed to fit in a uint32_t
+ * it returns a negative error code on error. On success, it returns the offset, which
+ * fits in a uint32_t on a fat16 image and may go up to INT64_MAX on a MKFS_FAT32 one
  */
-int64_t k_lseek(int fd, int offset, int whence);
+int64_t k_lseek(int fd, int64_t offset, int whence);
 
 /**
  * @brief Write to a file
@@ -133,19 +378,51 @@ int64_t k_lseek(int fd, int offset, int whence);
 int k_write(int fd, const char *str, int n);
 
 /**
- * @brief Remove (unlink) a file
+ * @brief Append a record to a log file (see F_LOG). It goes at the end of the file wherever
+ * the fd's offset is, in one write of the tail block (and whichever blocks it spills into),
+ * and the record count is kept in the directory entry, so an append never reads the log.
+ * Either the whole record is appended or none of it
+ * @param fd global file descriptor of the log
+ * @param rec bytes of the record
+ * @param len number of bytes in the record
+ * @return int index of the record in the log (the first is 0), or negative error code
+ */
+int k_log_append(int fd, const char *rec, int len);
+
+/**
+ * @brief Read a record of a log file (see F_LOG). The first k_log_read of an open log scans
+ * it once, block by block, to index every LOG_INDEX_INTERVAL-th record, so any record is found
+ * by reading at most that many record headers. Reading records in order reads each block once
+ * @param fd global file descriptor of the log
+ * @param idx index of the record (see k_log_append)
+ * @param buf buffer to read the record into
+ * @param size size of buf. Only that much of a longer record is read
+ * @return int length of the whole record (which may be more than size), or negative error code
+ */
+int k_log_read(int fd, uint32_t idx, char *buf, uint32_t size);
+
+/**
+ * @brief Remove (unlink) a file. Directories are removed with k_rmdir
  * @param fname file name
  * @return int 0 on success, or negative error code
  */
 int k_unlink(const char *fname);
 
 /**
- * @brief List the contents of a directory
- * @param filename directory to list the contents of
+ * @brief List the contents of a directory, or the entry of a file
+ * @param filename path of the directory or file, NULL or "" for the root directory
  * @return int 0 on success, or negative error code
  */
 int k_ls(const char *filename);
 
+/**
+ * @brief Look up a file. "/" gives a made up entry for the root directory, which has none
+ * @param fname file name
+ * @param dir_entry_ptr where to store a copy of the directory entry of the file
+ * @return int 0 on success, or negative error code
+ */
+int k_stat(const char *fname, directory_entry *dir_entry_ptr);
+
 /**
  * @brief Change the permissions of a file
  * @param fname file name
@@ -156,13 +433,176 @@ int k_ls(const char *filename);
 int k_chmod(const char *fname, uint8_t perm, int mode);
 
 /**
- * @brief Move a file from src to dest
+ * @brief Move a file or directory from src to dest, which may be in another directory.
+ * If dest is a directory, src is moved into it under the same name. An existing file
+ * at dest is replaced, but a directory never is
  * @param src source file name
  * @param dest destination file name
  * @return int 0 on success, or negative error code
  */
 int k_mv(const char *src, const char *dest);
 
+/**
+ * @brief Create a directory. A directory is a power of two of blocks, and a name always goes
+ * in the block picked by its hash, so a lookup reads a single block. When that block is
+ * full, the directory doubles, splitting each block in two by the next bit of the hash.
+ * The root directory is the exception: it is a list of blocks, searched in order behind
+ * a name filter (see k_compact_root_dir)
+ * @param path path of the new directory, whose parent must exist
+ * @return int 0 on success, or negative error code
+ */
+int k_mkdir(const char *path);
+
+/**
+ * @brief Remove an empty directory
+ * @param path path of the directory
+ * @return int 0 on success, or negative error code
+ */
+int k_rmdir(const char *path);
+
+/**
+ * @brief Create dest as a copy of src that shares src's blocks. Shared blocks are
+ * copied on write, so this takes the same time regardless of the size of src.
+ * dest is replaced if it exists.
+ * @param src source file name
+ * @param dest destination file name
+ * @return int 0 on success, or negative error code
+ */
+int k_clone(const char *src, const char *dest);
+
+/**
+ * @brief Copy len bytes at off_in in one file to off_out in another without passing
+ * them through the caller, modeled on copy_file_range(2). Like copy_file_range, the
+ * file offsets are not used or changed, and the output grows (but is never truncated)
+ * to fit the copied bytes. Between files on different volumes the bytes go through a buffer.
+ * @param fd_in global file descriptor to copy from
+ * @param off_in offset in fd_in to start copying from
+ * @param fd_out global file descriptor to copy to
+ * @param off_out offset in fd_out to start copying to
+ * @param len number of bytes to copy. At most INT_MAX are copied at a time
+ * @return int number of bytes copied (0 at the end of fd_in), or negative error code
+ */
+int k_copy_range(int fd_in, uint64_t off_in, int fd_out, uint64_t off_out, uint64_t len);
+
+/**
+ * @brief Snapshot the volume under the given name. Only the FAT and root directory
+ * are copied; data blocks are shared with the live volume and copied on write.
+ * @param name snapshot name (same rules as file names)
+ * @return int 0 on success, or negative error code
+ */
+int k_snapshot_create(const char *name);
+
+/**
+ * @brief List the snapshots of the volume to STDOUT
+ * @return int 0 on success, or negative error code
+ */
+int k_snapshot_list(void);
+
+/**
+ * @brief Roll the volume back to the given snapshot, discarding every change made since.
+ * The snapshot is kept. Fails if any files are open.
+ * @param name snapshot name
+ * @return int 0 on success, or negative error code
+ */
+int k_snapshot_rollback(const char *name);
+
+/**
+ * @brief Delete the given snapshot, releasing the blocks only it was using
+ * @param name snapshot name
+ * @return int 0 on success, or negative error code
+ */
+int k_snapshot_delete(const char *name);
+
+/**
+ * @brief Map part of a file into memory
+ * @param pid process the mapping belongs to, which unmaps it when it exits (see k_munmap_all)
+ * @param fd global file descriptor of the file to map
+ * @param offset offset in the file the mapping starts at
+ * @param len number of bytes to map, clamped to the end of the file
+ * @param prot F_PROT_READ, F_PROT_WRITE or both
+ * @param addr_ptr set to the start of the mapping on success
+ * @return int 0 on success, or negative error code
+ * @note Read-only mappings of blocks that are consecutive in the image point straight into
+ * an mmap of the image, so they see later writes that don't relocate blocks. All other
+ * mappings are private copies, and writes to them reach the file on k_msync or k_munmap.
+ * A mapping keeps the file open until it is unmapped.
+ */
+int k_mmap(pid_t pid, int fd, uint32_t offset, uint32_t len, int prot, void **addr_ptr);
+
+/**
+ * @brief Write a writable mapping back to its file (a no-op for read-only mappings)
+ * @param addr address returned by k_mmap
+ * @return int 0 on success, or negative error code
+ */
+int k_msync(void *addr);
+
+/**
+ * @brief Write back and remove a mapping made by k_mmap, releasing its reference to the file
+ * @param addr address returned by k_mmap
+ * @return int 0 on success, or negative error code
+ */
+int k_munmap(void *addr);
+
+/**
+ * @brief k_munmap every mapping of a process, which is exiting
+ * @param pid process whose mappings to remove
+ * @return int 0 on success, or the first negative error code (every mapping is removed regardless)
+ */
+int k_munmap_all(pid_t pid);
+
+/**
+ * @brief Copy the filesystem counters collected since the last mount or reset
+ * @param stats_ptr where to copy them to
+ */
+void k_fsstats(fs_stats *stats_ptr);
+
+/**
+ * @brief Zero the filesystem counters
+ */
+void k_fsstats_reset(void);
+
+/**
+ * @brief Print the filesystem counters to stdout, one per line
+ * @return int 0 on success, or negative error code
+ */
+int k_fsstats_print(void);
+
+/**
+ * @brief Free up to max_blocks blocks from chains queued for background reclamation.
+ * Deleting or truncating a large file only queues its chain while async reclamation is on,
+ * and this is what the reclaimer process calls to actually free it, a bit at a time.
+ * The allocator also calls it to free everything queued rather than run out of space.
+ * @param max_blocks most blocks to free
+ * @return int number of blocks freed (0 when nothing is queued), or negative error code
+ */
+int k_reclaim(uint32_t max_blocks);
+
+/**
+ * @brief Turn async reclamation on or off. It is off unless a reclaimer process is running,
+ * and turning it off frees everything still queued.
+ * @param enabled whether large chains should be queued for k_reclaim
+ */
+void k_reclaim_async(bool enabled);
+
+/**
+ * @brief Rewrite the root directory without its deleted entries, freeing the blocks it no
+ * longer needs. Open files follow their entries to where they move. The new directory is
+ * written to fresh blocks before the old one is let go of, so it needs a few free blocks,
+ * and the directory is left as it was on failure.
+ * This runs on its own once at least half of a large enough directory is deleted entries.
+ * @return int 0 on success, or negative error code
+ */
+int k_compact_root_dir(void);
+
+/**
+ * @brief Get the size of the filesystem and how much of it is free. Cheap enough to poll:
+ * the free block count is maintained as blocks are allocated and freed, and the longest
+ * free run is only recomputed (with a vectorized scan of the FAT) after the FAT changed
+ * @param statfs_ptr where to store the result
+ * @return int 0 on success, or negative error code
+ */
+int k_statfs(fs_statfs *statfs_ptr);
+
 /**
  * @brief Set the mode the global file descriptor is opened with
  * @param fd global file descriptor to set the mode of
@@ -178,6 +618,24 @@ int k_setmode(int fd, int mode);
  */
 int k_getmode(int fd);
 
+/**
+ * @brief Get the generation of an open global file descriptor. Together with the fd it
+ * identifies this particular open of the file, since fds are reused once released
+ * @param fd global file descriptor
+ * @return int generation of the global file descriptor, or negative error code
+ */
+int k_getgeneration(int fd);
+
+/**
+ * @brief Find the block on disk that holds a byte of an open file, for example to order
+ * requests by where they are on the disk
+ * @param fd global file descriptor
+ * @param offset offset of the byte in the file
+ * @return int block number, 0 if the byte is past the last block of the file (or fd is
+ * stdin, stdout or stderr), or negative error code
+ */
+int k_bmap(int fd, uint32_t offset);
+
 /**
  * @brief Like dprintf but using pennfat and limited to 1023 characters
  * 
@@ -1,9 +1,13 @@
 #ifndef PENNFAT_FAT_CONSTANTS_H
 #define PENNFAT_FAT_CONSTANTS_H
 
+#include <stdint.h>
+
 #define F_WRITE 1
 #define F_READ 0
 #define F_APPEND 2
+#define F_DIRECT 4 // or'd into the mode of an open: move the file's data with O_DIRECT, bypassing the host page cache
+#define F_LOG 8    // or'd into the mode of an open: the file is a log of records (see k_log_append)
 
 #define F_SEEK_SET 1
 #define F_SEEK_CUR 2
@@ -21,4 +25,18 @@
 #define F_CHMOD_W 2
 #define F_CHMOD_X 1 // TODO: should only be set if F_CHMOD_R is also set (enforce in chmod)
 
+#define F_PROT_READ 1
+#define F_PROT_WRITE 2
+
+#define MAX_PATH_SIZE 256 // longest path a process can be in (with its volume prefix and terminator), see join_path
+
+// filled in by k_statfs / s_statfs
+typedef struct fs_statfs_st
+{
+    uint32_t block_size;
+    uint32_t total_blocks;     // blocks in the data region
+    uint32_t free_blocks;      // blocks that can be allocated (free and not part of a snapshot)
+    uint32_t largest_free_run; // most free blocks in a row
+} fs_statfs;
+
 #endif // PENNFAT_FAT_CONSTANTS_H
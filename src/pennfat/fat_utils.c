@@ -1,6 +1,25 @@
 #include "src/pennfat/fat_utils.h"
+#include "src/pennfat/fat.h"
 
 #include <stdint.h>
+#include <string.h>
+
+// ZERO_MASK(p) has 2 bits set for each of the ZERO_LANES entries starting at p that is 0
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define ZERO_LANES 16
+#define ZERO_MASK_ALL 0xFFFFFFFFu
+#define ZERO_MASK(p) ((uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i*) (p)), _mm256_setzero_si256())))
+#define ZERO_MASK32(p) ((uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i*) (p)), _mm256_setzero_si256())))
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define ZERO_LANES 8
+#define ZERO_MASK_ALL 0xFFFFu
+#define ZERO_MASK(p) ((uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_loadu_si128((const __m128i*) (p)), _mm_setzero_si128())))
+#define ZERO_MASK32(p) ((uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*) (p)), _mm_setzero_si128())))
+#endif
+// ZERO_MASK32(p) has 4 bits set for each of the ZERO_LANES32 32-bit entries starting at p that is 0
+#define ZERO_LANES32 (ZERO_LANES / 2)
 
 uint16_t block_size_of_config(uint8_t block_size_config) {
 	switch (block_size_config) {
@@ -13,12 +32,219 @@ uint16_t block_size_of_config(uint8_t block_size_config) {
 	}
 }
 
-int parse_first_fat_entry(uint16_t first_entry, uint16_t* block_size_ptr, uint8_t* blocks_in_fat_ptr) {
-	*blocks_in_fat_ptr = first_entry >> 8;
-	*block_size_ptr = block_size_of_config((uint8_t) first_entry);
+int parse_first_fat_entry(uint32_t first_entry, uint16_t* block_size_ptr, uint16_t* blocks_in_fat_ptr, bool* fat32_ptr) {
+	uint8_t block_size_config = (uint8_t) first_entry;
+	*fat32_ptr = block_size_config & FAT32_BLOCK_SIZE_CONFIG_FLAG;
+	if (*fat32_ptr) {
+		// the entry is 32 bits wide, with 16 of them for blocks_in_fat
+		if (first_entry >> 24 != 0) {
+			return -1;
+		}
+		*blocks_in_fat_ptr = (uint16_t) (first_entry >> 8);
+		block_size_config &= ~FAT32_BLOCK_SIZE_CONFIG_FLAG;
+	} else {
+		// only the low 16 bits are the first entry. The rest is the entry of the root directory
+		*blocks_in_fat_ptr = (uint8_t) (first_entry >> 8);
+	}
+	*block_size_ptr = block_size_of_config(block_size_config);
 
-	if (block_size_ptr == 0) {
+	if (*block_size_ptr == 0 || *blocks_in_fat_ptr == 0) {
 		return -1;
 	}
 	return 0;
 }
+
+int parse_mount_options(const char* options) {
+	int flags = 0;
+	const char* option = options;
+	while (*option != '\0') {
+		size_t len = strcspn(option, ",");
+		if (len == strlen("dedup") && strncmp(option, "dedup", len) == 0) {
+			flags |= MOUNT_DEDUP;
+		} else if (len == strlen("pack") && strncmp(option, "pack", len) == 0) {
+			flags |= MOUNT_PACK;
+		} else if (len == strlen("ro") && strncmp(option, "ro", len) == 0) {
+			flags |= MOUNT_READ_ONLY;
+		} else if (len == strlen("direct") && strncmp(option, "direct", len) == 0) {
+			flags |= MOUNT_DIRECT;
+		} else if (len == strlen("populate") && strncmp(option, "populate", len) == 0) {
+			flags |= MOUNT_POPULATE;
+		} else if (len == strlen("mlock") && strncmp(option, "mlock", len) == 0) {
+			flags |= MOUNT_MLOCK;
+		} else if (len == strlen("hugepage") && strncmp(option, "hugepage", len) == 0) {
+			flags |= MOUNT_HUGEPAGE;
+		} else if (len == strlen("sequential") && strncmp(option, "sequential", len) == 0) {
+			flags |= MOUNT_SEQUENTIAL;
+		} else if (len == strlen("random") && strncmp(option, "random", len) == 0) {
+			flags |= MOUNT_RANDOM;
+		} else if (len > 0) {
+			return -1;
+		}
+		option += len;
+		if (*option == ',') {
+			option++;
+		}
+	}
+	return flags;
+}
+
+int join_path(const char* cwd, const char* name, char* path) {
+	// the volume comes from name if it has one, and from cwd otherwise
+	const char* prefix = name;
+	const char* base = "";
+	const char* rest = name;
+	size_t prefix_len = 0;
+	const char* separator = strchr(name, VOLUME_SEPARATOR);
+	if (separator != NULL) {
+		prefix_len = separator - name + 1;
+		rest = separator + 1;
+	} else {
+		prefix = cwd;
+		separator = strchr(cwd, VOLUME_SEPARATOR);
+		prefix_len = separator == NULL ? 0 : separator - cwd + 1;
+		base = name[0] == '/' ? "" : cwd + prefix_len;
+	}
+	if (prefix_len + 1 >= MAX_PATH_SIZE) {
+		return -1;
+	}
+	memcpy(path, prefix, prefix_len);
+	path[prefix_len] = '/';
+
+	// path[0..len) is always a normalized path, and root_len long at the root
+	size_t root_len = prefix_len + 1;
+	size_t len = root_len;
+	const char* parts[] = {base, rest};
+	for (int i = 0; i < 2; i++) {
+		const char* component = parts[i];
+		while (*component != '\0') {
+			size_t component_len = strcspn(component, "/");
+			if (component_len == 2 && strncmp(component, "..", 2) == 0) {
+				// the parent of the root is the root
+				while (len > root_len && path[len - 1] != '/') {
+					len--;
+				}
+				if (len > root_len) {
+					len--;
+				}
+			} else if (component_len > 0 && !(component_len == 1 && component[0] == '.')) {
+				if (len + 1 + component_len >= MAX_PATH_SIZE) {
+					return -1;
+				}
+				if (len > root_len) {
+					path[len++] = '/';
+				}
+				memcpy(path + len, component, component_len);
+				len += component_len;
+			}
+			component += component_len;
+			if (*component == '/') {
+				component++;
+			}
+		}
+	}
+	path[len] = '\0';
+	return 0;
+}
+
+uint32_t count_zero_entries(const uint16_t* entries, uint32_t n) {
+	uint32_t count = 0;
+	uint32_t i = 0;
+#ifdef ZERO_LANES
+	for (; i + ZERO_LANES <= n; i += ZERO_LANES) {
+		count += __builtin_popcount(ZERO_MASK(entries + i)) / 2;
+	}
+#endif
+	for (; i < n; i++) {
+		count += entries[i] == 0;
+	}
+	return count;
+}
+
+uint32_t longest_zero_run(const uint16_t* entries, uint32_t n) {
+	uint32_t longest = 0;
+	uint32_t run = 0;
+	uint32_t i = 0;
+#ifdef ZERO_LANES
+	// whole vectors of zeros or non-zeros only extend or end the current run
+	for (; i + ZERO_LANES <= n; i += ZERO_LANES) {
+		uint32_t mask = ZERO_MASK(entries + i);
+		if (mask == ZERO_MASK_ALL) {
+			run += ZERO_LANES;
+			continue;
+		}
+		if (mask == 0) {
+			longest = run > longest ? run : longest;
+			run = 0;
+			continue;
+		}
+		for (uint32_t j = i; j < i + ZERO_LANES; j++) {
+			if (entries[j] == 0) {
+				run += 1;
+			} else {
+				longest = run > longest ? run : longest;
+				run = 0;
+			}
+		}
+	}
+#endif
+	for (; i < n; i++) {
+		if (entries[i] == 0) {
+			run += 1;
+		} else {
+			longest = run > longest ? run : longest;
+			run = 0;
+		}
+	}
+	return run > longest ? run : longest;
+}
+
+uint32_t count_zero_entries32(const uint32_t* entries, uint32_t n) {
+	uint32_t count = 0;
+	uint32_t i = 0;
+#ifdef ZERO_LANES
+	for (; i + ZERO_LANES32 <= n; i += ZERO_LANES32) {
+		count += __builtin_popcount(ZERO_MASK32(entries + i)) / 4;
+	}
+#endif
+	for (; i < n; i++) {
+		count += entries[i] == 0;
+	}
+	return count;
+}
+
+uint32_t longest_zero_run32(const uint32_t* entries, uint32_t n) {
+	uint32_t longest = 0;
+	uint32_t run = 0;
+	uint32_t i = 0;
+#ifdef ZERO_LANES
+	for (; i + ZERO_LANES32 <= n; i += ZERO_LANES32) {
+		uint32_t mask = ZERO_MASK32(entries + i);
+		if (mask == ZERO_MASK_ALL) {
+			run += ZERO_LANES32;
+			continue;
+		}
+		if (mask == 0) {
+			longest = run > longest ? run : longest;
+			run = 0;
+			continue;
+		}
+		for (uint32_t j = i; j < i + ZERO_LANES32; j++) {
+			if (entries[j] == 0) {
+				run += 1;
+			} else {
+				longest = run > longest ? run : longest;
+				run = 0;
+			}
+		}
+	}
+#endif
+	for (; i < n; i++) {
+		if (entries[i] == 0) {
+			run += 1;
+		} else {
+			longest = run > longest ? run : longest;
+			run = 0;
+		}
+	}
+	return run > longest ? run : longest;
+}
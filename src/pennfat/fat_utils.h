@@ -1,8 +1,13 @@
 #ifndef PENNFAT_FAT_UTILS_H
 #define PENNFAT_FAT_UTILS_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
+// set in the block size config of the first FAT entry of a MKFS_FAT32 image, whose FAT
+// entries are 32 bits wide (the first one being (blocks_in_fat << 8) | flag | config)
+#define FAT32_BLOCK_SIZE_CONFIG_FLAG 0x80
+
 /**
  * Maps 0,1,2,3,4 to 256,512,1024,2048,4096 bytes
  *
@@ -11,8 +16,52 @@
 uint16_t block_size_of_config(uint8_t block_size_config);
 
 /**
- * Parse the first entry of the fat into block_size and blocks_in_fat 
+ * Parse the first entry of the fat into block_size, blocks_in_fat and whether the FAT has
+ * 32-bit entries. first_entry is the first 4 bytes of the image, since it isn't known yet
+ * how wide the entry is
+ *
+ * -1 return indicates the entry is not one mkfs writes
+ */
+int parse_first_fat_entry(uint32_t first_entry, uint16_t* block_size_ptr, uint16_t* blocks_in_fat_ptr, bool* fat32_ptr);
+
+/**
+ * Parse a comma separated list of mount options (e.g., "dedup,direct") into MOUNT_* flags
+ *
+ * -1 return indicates an unknown option was passed
+ */
+int parse_mount_options(const char* options);
+
+/**
+ * Resolve name against the working directory cwd into path (MAX_PATH_SIZE bytes): a name
+ * with a volume prefix (e.g., "scratch:a/f") starts at the root of that volume, one starting
+ * with '/' at the root of cwd's volume, and anything else at cwd. "." and ".." are resolved
+ * along the way (".." of the root is the root), so the result is always of the form
+ * "[volume:]/a/b", with "/" for the root itself. An empty cwd is the root of the default volume
+ *
+ * -1 return indicates the result would be longer than MAX_PATH_SIZE - 1 characters
+ */
+int join_path(const char* cwd, const char* name, char* path);
+
+/**
+ * Count the entries of entries[0..n) that are 0. Vectorized with AVX2 or SSE2 when the
+ * compiler targets them
+ */
+uint32_t count_zero_entries(const uint16_t* entries, uint32_t n);
+
+/**
+ * Length of the longest run of consecutive 0 entries in entries[0..n). Vectorized like
+ * count_zero_entries
+ */
+uint32_t longest_zero_run(const uint16_t* entries, uint32_t n);
+
+/**
+ * count_zero_entries for a FAT with 32-bit entries
+ */
+uint32_t count_zero_entries32(const uint32_t* entries, uint32_t n);
+
+/**
+ * longest_zero_run for a FAT with 32-bit entries
  */
-int parse_first_fat_entry(uint16_t first_entry, uint16_t* block_size_ptr, uint8_t* blocks_in_fat_ptr);
+uint32_t longest_zero_run32(const uint32_t* entries, uint32_t n);
 
 #endif // PENNFAT_FAT_UTILS_H
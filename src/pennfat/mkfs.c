@@ -3,16 +3,23 @@
 
 #include <fcntl.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 
 int mkfs(char *fs_name, uint8_t blocks_in_fat, uint8_t block_size_config)
+{
+	return mkfs_with_flags(fs_name, blocks_in_fat, block_size_config, 0);
+}
+
+int mkfs_with_flags(char *fs_name, uint16_t blocks_in_fat, uint8_t block_size_config, int flags)
 {
 	// the size of the filesystem is equal to the size of the fat plus the size of the data region
 	// The size of the fat is just blocks_in_fat * block_size_of_config(block_size_config)
 	// The size of the data region is block size * (number of FAT entries - 1)
 
-	if (blocks_in_fat < 1 || blocks_in_fat > 32)
+	bool fat32 = flags & MKFS_FAT32;
+	if (blocks_in_fat < 1 || (!fat32 && blocks_in_fat > 32))
 	{
 		return BAD_BLOCKS_IN_FAT_VAL;
 	}
@@ -25,13 +32,21 @@ int mkfs(char *fs_name, uint8_t blocks_in_fat, uint8_t block_size_config)
 	}
 
 	uint32_t fat_size = (uint32_t)block_size * blocks_in_fat;
-	uint32_t blocks_in_data_region = block_size_config == 4 ? (fat_size / 2) - 2 : (fat_size / 2) - 1;
-
-	if (blocks_in_data_region >= (1 << 16))
+	uint32_t blocks_in_data_region;
+	if (fat32)
 	{
-		// should be impossible because the the max fat_size should be 4096 bytes * 32
-		// but if we do reach this case, return an UNKNOWN_ERROR
-		return MKFS_UNKNOWN_ERROR;
+		// at most 2^26 - 1, so the end of file marker 0xFFFFFFFF is never a block number
+		blocks_in_data_region = (fat_size / 4) - 1;
+	}
+	else
+	{
+		blocks_in_data_region = block_size_config == 4 ? (fat_size / 2) - 2 : (fat_size / 2) - 1;
+		if (blocks_in_data_region >= (1 << 16))
+		{
+			// should be impossible because the the max fat_size should be 4096 bytes * 32
+			// but if we do reach this case, return an UNKNOWN_ERROR
+			return MKFS_UNKNOWN_ERROR;
+		}
 	}
 
 	// Create a file with that size that represents ourfilesystem
@@ -47,7 +62,11 @@ int mkfs(char *fs_name, uint8_t blocks_in_fat, uint8_t block_size_config)
 		return EMKFS_CALLOC_FAILED;
 	}
 
-	for (uint32_t i = 0; i < (blocks_in_data_region + blocks_in_fat); i++)
+	// the FAT and the root directory are written out. The rest of a fat32 image can be
+	// gigabytes of blocks nothing has used yet, so it is left for the host to zero-fill
+	// (and to allocate as it is written) rather than written out here
+	uint32_t n_blocks_to_write = fat32 ? blocks_in_fat + 1 : blocks_in_data_region + blocks_in_fat;
+	for (uint32_t i = 0; i < n_blocks_to_write; i++)
 	{
 		ssize_t written_bytes = write(fs_fd, empty_block, block_size);
 		// error writing
@@ -60,6 +79,11 @@ int mkfs(char *fs_name, uint8_t blocks_in_fat, uint8_t block_size_config)
 			return EMKFS_WRITE_LESS;
 		}
 	}
+	free(empty_block);
+	if (fat32 && ftruncate(fs_fd, ((off_t)blocks_in_data_region + blocks_in_fat) * block_size) < 0)
+	{
+		return EMKFS_WRITE_FAILED;
+	}
 
 	// Go back to the start and write the first FAT entry
 	if (lseek(fs_fd, 0, SEEK_SET) < 0)
@@ -67,15 +91,29 @@ int mkfs(char *fs_name, uint8_t blocks_in_fat, uint8_t block_size_config)
 		return EMKFS_LSEEK_FAILED;
 	}
 
-	uint16_t entries[2];
-	entries[0] = (((uint16_t)blocks_in_fat) << 8) | block_size_config;
-	entries[1] = 0xFFFF; // TODO: replace 0xFFFF magic number
-	ssize_t written_bytes = write(fs_fd, entries, 2 * sizeof(uint16_t));
+	ssize_t written_bytes;
+	size_t entries_size;
+	if (fat32)
+	{
+		uint32_t entries[2];
+		entries[0] = ((uint32_t)blocks_in_fat << 8) | FAT32_BLOCK_SIZE_CONFIG_FLAG | block_size_config;
+		entries[1] = 0xFFFFFFFF;
+		entries_size = sizeof(entries);
+		written_bytes = write(fs_fd, entries, entries_size);
+	}
+	else
+	{
+		uint16_t entries[2];
+		entries[0] = (((uint16_t)blocks_in_fat) << 8) | block_size_config;
+		entries[1] = 0xFFFF; // TODO: replace 0xFFFF magic number
+		entries_size = sizeof(entries);
+		written_bytes = write(fs_fd, entries, entries_size);
+	}
 	if (written_bytes < 0)
 	{
 		return EMKFS_WRITE_FAILED;
 	}
-	else if (written_bytes < 2 * sizeof(uint16_t))
+	else if ((size_t)written_bytes < entries_size)
 	{
 		return EMKFS_WRITE_LESS;
 	}
@@ -86,5 +124,11 @@ int mkfs(char *fs_name, uint8_t blocks_in_fat, uint8_t block_size_config)
 		return EMKFS_CLOSE_FAILED;
 	}
 
+	// a snapshot index left behind by an older image with this name describes blocks
+	// this one doesn't have, and would stop it from mounting
+	char index_path[256];
+	snprintf(index_path, sizeof(index_path), "%s.snapshots", fs_name);
+	unlink(index_path);
+
 	return 0;
 }
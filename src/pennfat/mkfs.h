@@ -12,6 +12,9 @@
 #define EMKFS_CALLOC_FAILED 9
 #define EMKFS_CLOSE_FAILED 10
 
+// flags for mkfs_with_flags
+#define MKFS_FAT32 1 // 32-bit FAT entries, for volumes of up to 2^26 - 1 blocks and files over 4GB
+
 #include <stdint.h>
 
 /**
@@ -21,4 +24,16 @@
  */
 int mkfs(char* fs_name, uint8_t blocks_in_fat, uint8_t block_size_config);
 
+/**
+ * Create a new filesystem with extra options
+ *
+ * With MKFS_FAT32 the FAT has 32-bit entries, so it can be up to 65535 blocks long (rather
+ * than 32) and address that many more blocks, and the sizes of files on it are 64 bits wide.
+ * Only the FAT and the root directory are written out: the data region is left for the host
+ * to fill in with zeros, so making a large image is quick and takes little space until it is used.
+ *
+ * Returns 0 on success and a non-zero error code on error
+ */
+int mkfs_with_flags(char* fs_name, uint16_t blocks_in_fat, uint8_t block_size_config, int flags);
+
 #endif // PENNFAT_MKFS_H
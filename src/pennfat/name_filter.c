@@ -0,0 +1,98 @@
+#include "src/pennfat/name_filter.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+// 16 bits per name with 6 probes keeps false positives around 0.1% at capacity
+#define NAME_FILTER_BITS_PER_NAME 16
+#define NAME_FILTER_N_PROBES 6
+#define NAME_FILTER_MIN_BITS 1024
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+uint64_t name_hash(const char *name)
+{
+    uint64_t hash = FNV_OFFSET_BASIS;
+    for (const unsigned char *c = (const unsigned char *)name; *c != '\0'; c++)
+    {
+        hash = (hash ^ *c) * FNV_PRIME;
+    }
+    hash ^= hash >> 30;
+    hash *= 0xbf58476d1ce4e5b9ULL;
+    hash ^= hash >> 27;
+    hash *= 0x94d049bb133111ebULL;
+    hash ^= hash >> 31;
+    return hash;
+}
+
+name_filter *name_filter_new(uint32_t capacity)
+{
+    name_filter *filter = (name_filter *)malloc(sizeof(name_filter));
+    if (filter == NULL)
+    {
+        return NULL;
+    }
+
+    uint32_t n_bits = NAME_FILTER_MIN_BITS;
+    while (n_bits / NAME_FILTER_BITS_PER_NAME < capacity && n_bits < (UINT32_C(1) << 31))
+    {
+        n_bits *= 2;
+    }
+    filter->bits = (uint64_t *)calloc(n_bits / 64, sizeof(uint64_t));
+    if (filter->bits == NULL)
+    {
+        free(filter);
+        return NULL;
+    }
+    filter->n_bits = n_bits;
+    filter->capacity = n_bits / NAME_FILTER_BITS_PER_NAME;
+    filter->count = 0;
+    return filter;
+}
+
+void name_filter_free(name_filter *filter)
+{
+    if (filter == NULL)
+    {
+        return;
+    }
+    free(filter->bits);
+    free(filter);
+}
+
+void name_filter_add(name_filter *filter, const char *name)
+{
+    // double hashing: probe i is at h1 + i * h2
+    uint64_t hash = name_hash(name);
+    uint32_t h1 = (uint32_t)hash;
+    uint32_t h2 = (uint32_t)(hash >> 32) | 1;
+    for (uint32_t i = 0; i < NAME_FILTER_N_PROBES; i++)
+    {
+        uint32_t bit = (h1 + i * h2) & (filter->n_bits - 1);
+        filter->bits[bit / 64] |= (uint64_t)1 << (bit % 64);
+    }
+    filter->count += 1;
+}
+
+bool name_filter_may_contain(const name_filter *filter, const char *name)
+{
+    uint64_t hash = name_hash(name);
+    uint32_t h1 = (uint32_t)hash;
+    uint32_t h2 = (uint32_t)(hash >> 32) | 1;
+    for (uint32_t i = 0; i < NAME_FILTER_N_PROBES; i++)
+    {
+        uint32_t bit = (h1 + i * h2) & (filter->n_bits - 1);
+        if ((filter->bits[bit / 64] & ((uint64_t)1 << (bit % 64))) == 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool name_filter_is_full(const name_filter *filter)
+{
+    return filter->count > filter->capacity;
+}
@@ -0,0 +1,48 @@
+#ifndef PENNFAT_NAME_FILTER_H
+#define PENNFAT_NAME_FILTER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Bloom filter over the names in the root directory. A name that was never added is
+ * reported as absent with high probability, and a name that was added is always reported
+ * as possibly present. Names can't be removed, so the filter is rebuilt from scratch
+ * when deleted names have piled up or it holds more names than it was sized for.
+ */
+typedef struct name_filter_st
+{
+    uint64_t *bits;
+    uint32_t n_bits;   // always a power of 2
+    uint32_t capacity; // number of names the filter was sized for
+    uint32_t count;    // number of names added
+} name_filter;
+
+/**
+ * FNV-1a over the name followed by the splitmix64 finalizer. Subdirectories place their
+ * entries by it too, so it is part of the on-disk format and must never change.
+ */
+uint64_t name_hash(const char *name);
+
+/**
+ * Allocate an empty filter with room for capacity names.
+ * Returns NULL if malloc fails.
+ */
+name_filter *name_filter_new(uint32_t capacity);
+
+void name_filter_free(name_filter *filter);
+
+void name_filter_add(name_filter *filter, const char *name);
+
+/**
+ * Returns false if name was definitely never added to filter.
+ */
+bool name_filter_may_contain(const name_filter *filter, const char *name);
+
+/**
+ * Returns whether more names were added than the filter was sized for, after which
+ * its false positive rate climbs quickly.
+ */
+bool name_filter_is_full(const name_filter *filter);
+
+#endif // PENNFAT_NAME_FILTER_H
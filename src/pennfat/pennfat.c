@@ -1,5 +1,6 @@
 #include "src/pennfat/mkfs.h"
 #include "src/pennfat/fat.h"
+#include "src/pennfat/fat_utils.h"
 #include "src/pennfat/fat_constants.h"
 #include <string.h>
 #include <stdint.h>
@@ -130,7 +131,8 @@ int main(void)
 
 		if (strcmp(tokens[0], "mkfs") == 0)
 		{
-			if (n_tokens != 4)
+			// mkfs FS_NAME BLOCKS_IN_FAT BLOCK_SIZE_CONFIG [-F 16|32]
+			if (n_tokens != 4 && n_tokens != 6)
 			{
 				char* err_msg = "mkfs got an incorrect number of arguments\n";
 				k_write(STDERR_FILENO, err_msg, strlen(err_msg));
@@ -139,7 +141,22 @@ int main(void)
 
 			char *fs_name = tokens[1];
 
-			uint8_t blocks_in_fat;
+			int mkfs_flags = 0;
+			if (n_tokens == 6)
+			{
+				if (strcmp(tokens[4], "-F") != 0 || (strcmp(tokens[5], "16") != 0 && strcmp(tokens[5], "32") != 0))
+				{
+					char* err_msg = "mkfs: the FAT width must be given as -F 16 or -F 32\n";
+					k_write(STDERR_FILENO, err_msg, strlen(err_msg));
+					goto cleanup_tokens;
+				}
+				if (strcmp(tokens[5], "32") == 0)
+				{
+					mkfs_flags |= MKFS_FAT32;
+				}
+			}
+
+			uint16_t blocks_in_fat;
 			{
 				bool ok;
 				long long_blocks_in_fat = safe_strtol(tokens[2], "mkfs BLOCKS_IN_FAT arg", &ok);
@@ -147,13 +164,17 @@ int main(void)
 				{
 					goto cleanup_tokens;
 				}
-				if (long_blocks_in_fat < 1 || long_blocks_in_fat > 32)
+				if (long_blocks_in_fat < 1 || long_blocks_in_fat > ((mkfs_flags & MKFS_FAT32) ? UINT16_MAX : 32))
 				{
 					char* err_msg = "mkfs BLOCKS_IN_FAT arg: must be between 1 and 32 inclusive\n";
+					if (mkfs_flags & MKFS_FAT32)
+					{
+						err_msg = "mkfs BLOCKS_IN_FAT arg: must be between 1 and 65535 inclusive with -F 32\n";
+					}
 					k_write(STDERR_FILENO, err_msg, strlen(err_msg));
 					goto cleanup_tokens;
 				}
-				blocks_in_fat = (uint8_t)long_blocks_in_fat;
+				blocks_in_fat = (uint16_t)long_blocks_in_fat;
 			}
 
 			uint8_t block_size_config;
@@ -174,7 +195,7 @@ int main(void)
 				block_size_config = (uint8_t)long_block_size_config;
 			}
 
-			int mkfs_err = mkfs(fs_name, blocks_in_fat, block_size_config);
+			int mkfs_err = mkfs_with_flags(fs_name, blocks_in_fat, block_size_config, mkfs_flags);
 			if (mkfs_err != 0)
 			{
 				k_fprintf_short(STDERR_FILENO, "Failed to mkfs with error code %d\n", mkfs_err);
@@ -183,14 +204,39 @@ int main(void)
 		}
 		else if (strcmp(tokens[0], "mount") == 0)
 		{
-			if (n_tokens != 2)
+			// mount FS_NAME [-o OPTION,...] [-v VOLUME]
+			if (n_tokens % 2 != 0 || n_tokens > 6)
 			{
 				char* err_msg = "mount got wrong number of arguments\n";
 				k_write(STDERR_FILENO, err_msg, strlen(err_msg));
 				goto cleanup_tokens;
 			}
 
-			int mount_err = mount(tokens[1]);
+			int flags = 0;
+			char* volume = "";
+			for (int i = 2; i < n_tokens; i += 2)
+			{
+				if (strcmp(tokens[i], "-o") == 0)
+				{
+					flags = parse_mount_options(tokens[i + 1]);
+					if (flags < 0)
+					{
+						k_fprintf_short(STDERR_FILENO, "mount: unknown option in %s\n", tokens[i + 1]);
+						goto cleanup_tokens;
+					}
+				}
+				else if (strcmp(tokens[i], "-v") == 0)
+				{
+					volume = tokens[i + 1];
+				}
+				else
+				{
+					k_fprintf_short(STDERR_FILENO, "mount: unknown flag %s\n", tokens[i]);
+					goto cleanup_tokens;
+				}
+			}
+
+			int mount_err = mount_volume(volume, tokens[1], flags);
 			if (mount_err != 0)
 			{
 				char* err_msg = "Failed to mount with error code %d\n";
@@ -200,9 +246,10 @@ int main(void)
 		}
 		else if (strcmp(tokens[0], "umount") == 0 || strcmp(tokens[0], "unmount") == 0)
 		{
-			if (n_tokens != 1)
+			// umount [VOLUME], which unmounts every volume when none is given
+			if (n_tokens > 2)
 			{
-				char* err_msg = "unmount got wrong number of arguments (expected no arguments)\n";
+				char* err_msg = "unmount got wrong number of arguments (expected at most 1 argument)\n";
 				k_write(STDERR_FILENO, err_msg, strlen(err_msg));
 				goto cleanup_tokens;
 			}
@@ -213,7 +260,7 @@ int main(void)
 				goto cleanup_tokens;
 			}
 
-			int unmount_err = unmount();
+			int unmount_err = n_tokens == 2 ? unmount_volume(tokens[1]) : unmount();
 			if (unmount_err != 0)
 			{
 				char* err_msg = "Failed to unmount with error code %d\n";
@@ -301,6 +348,31 @@ int main(void)
 				goto cleanup_tokens;
 			}
 		}
+		else if (strcmp(tokens[0], "mkdir") == 0 || strcmp(tokens[0], "rmdir") == 0)
+		{
+			bool is_mkdir = strcmp(tokens[0], "mkdir") == 0;
+			if (n_tokens != 2)
+			{
+				char* err_msg = "%s got wrong number of arguments\n";
+				k_fprintf_short(STDERR_FILENO, err_msg, tokens[0]);
+				goto cleanup_tokens;
+			}
+			if (!is_mounted())
+			{
+				char* err_msg = "%s: there is no filesystem mounted\n";
+				k_fprintf_short(STDERR_FILENO, err_msg, tokens[0]);
+				goto cleanup_tokens;
+			}
+
+			// paths start at the root, there is no working directory here
+			int dir_status = is_mkdir ? k_mkdir(tokens[1]) : k_rmdir(tokens[1]);
+			if (dir_status != 0)
+			{
+				char* err_msg = "%s: failed with error code %d\n";
+				k_fprintf_short(STDERR_FILENO, err_msg, tokens[0], dir_status);
+				goto cleanup_tokens;
+			}
+		}
 		else if (strcmp(tokens[0], "cat") == 0)
 		{
 			if (!is_mounted())
@@ -532,6 +604,12 @@ int main(void)
 			// cp SOURCE DEST (both in PennFAT)
 			else if (n_tokens == 3)
 			{
+				// share the source's blocks if we can, which doesn't copy any data
+				if (k_clone(tokens[1], tokens[2]) == 0)
+				{
+					goto cleanup_tokens;
+				}
+
 				// Open source file
 				int src_fd = k_open(tokens[1], F_READ);
 				if (src_fd < 0)
@@ -552,18 +630,19 @@ int main(void)
 				}
 
 				// Copy data
-				char buffer[1024];
-				int bytes_read;
-				while ((bytes_read = k_read(src_fd, sizeof(buffer), buffer)) > 0)
+				uint64_t offset = 0;
+				int bytes_copied;
+				while ((bytes_copied = k_copy_range(src_fd, offset, dest_fd, offset, UINT64_MAX - offset)) > 0)
 				{
-					if (k_write(dest_fd, buffer, bytes_read) < 0)
-					{
-						char* err_msg = "cp: Error - failed to write to destination file\n";
-						k_write(STDERR_FILENO, err_msg, strlen(err_msg));
-						k_close(src_fd);
-						k_close(dest_fd);
-						goto cleanup_tokens;
-					}
+					offset += bytes_copied;
+				}
+				if (bytes_copied < 0)
+				{
+					char* err_msg = "cp: Error - failed to copy to destination file with error code %d\n";
+					k_fprintf_short(STDERR_FILENO, err_msg, bytes_copied);
+					k_close(src_fd);
+					k_close(dest_fd);
+					goto cleanup_tokens;
 				}
 
 				k_close(src_fd);
@@ -649,6 +728,106 @@ int main(void)
 				goto cleanup_tokens;
 			}
 		}
+		else if (strcmp(tokens[0], "fsstat") == 0)
+		{
+			bool reset = n_tokens == 2 && strcmp(tokens[1], "-r") == 0;
+			if (n_tokens != 1 && !reset)
+			{
+				char* err_msg = "usage: fsstat [-r]\n";
+				k_write(STDERR_FILENO, err_msg, strlen(err_msg));
+				goto cleanup_tokens;
+			}
+			if (!is_mounted())
+			{
+				char* err_msg = "fsstat: there is no filesystem mounted\n";
+				k_write(STDERR_FILENO, err_msg, strlen(err_msg));
+				goto cleanup_tokens;
+			}
+
+			int fsstat_status = k_fsstats_print();
+			if (fsstat_status != 0)
+			{
+				char* err_msg = "fsstat: failed with error code %d\n";
+				k_fprintf_short(STDERR_FILENO, err_msg, fsstat_status);
+				goto cleanup_tokens;
+			}
+			if (reset)
+			{
+				k_fsstats_reset();
+			}
+		}
+		else if (strcmp(tokens[0], "df") == 0)
+		{
+			if (n_tokens != 1)
+			{
+				char* err_msg = "usage: df\n";
+				k_write(STDERR_FILENO, err_msg, strlen(err_msg));
+				goto cleanup_tokens;
+			}
+			if (!is_mounted())
+			{
+				char* err_msg = "df: there is no filesystem mounted\n";
+				k_write(STDERR_FILENO, err_msg, strlen(err_msg));
+				goto cleanup_tokens;
+			}
+			fs_statfs statfs;
+			int statfs_status = k_statfs(&statfs);
+			if (statfs_status != 0)
+			{
+				char* err_msg = "df: failed with error code %d\n";
+				k_fprintf_short(STDERR_FILENO, err_msg, statfs_status);
+				goto cleanup_tokens;
+			}
+			k_fprintf_short(STDOUT_FILENO, "%10s %10s %10s %10s %10s\n", "block_size", "blocks", "used", "free", "largest");
+			k_fprintf_short(STDOUT_FILENO, "%10u %10u %10u %10u %10u\n", statfs.block_size, statfs.total_blocks,
+			                statfs.total_blocks - statfs.free_blocks, statfs.free_blocks, statfs.largest_free_run);
+		}
+		else if (strcmp(tokens[0], "snapshot") == 0)
+		{
+			bool is_list = n_tokens >= 2 && strcmp(tokens[1], "list") == 0;
+			if (n_tokens != (is_list ? 2 : 3))
+			{
+				char* err_msg = "usage: snapshot create NAME | list | rollback NAME | delete NAME\n";
+				k_write(STDERR_FILENO, err_msg, strlen(err_msg));
+				goto cleanup_tokens;
+			}
+			if (!is_mounted())
+			{
+				char* err_msg = "snapshot: there is no filesystem mounted\n";
+				k_write(STDERR_FILENO, err_msg, strlen(err_msg));
+				goto cleanup_tokens;
+			}
+
+			int snapshot_status;
+			if (is_list)
+			{
+				snapshot_status = k_snapshot_list();
+			}
+			else if (strcmp(tokens[1], "create") == 0)
+			{
+				snapshot_status = k_snapshot_create(tokens[2]);
+			}
+			else if (strcmp(tokens[1], "rollback") == 0)
+			{
+				snapshot_status = k_snapshot_rollback(tokens[2]);
+			}
+			else if (strcmp(tokens[1], "delete") == 0)
+			{
+				snapshot_status = k_snapshot_delete(tokens[2]);
+			}
+			else
+			{
+				char* err_msg = "snapshot: unknown subcommand %s\n";
+				k_fprintf_short(STDERR_FILENO, err_msg, tokens[1]);
+				goto cleanup_tokens;
+			}
+			if (snapshot_status != 0)
+			{
+				char* err_msg = "snapshot: failed with error code %d\n";
+				k_fprintf_short(STDERR_FILENO, err_msg, snapshot_status);
+				goto cleanup_tokens;
+			}
+		}
 		else
 		{
 			char* err_msg = "Unrecognized command\n";
@@ -0,0 +1,200 @@
+#include "src/scheduler/aio.h"
+#include "src/scheduler/kernel.h"
+#include "src/pennfat/fat.h"
+#include "src/utils/error_codes.h"
+
+static aio_request aio_requests[AIO_MAX_REQUESTS];
+static uint64_t next_seq = 0;
+
+// block the worker last stopped at. The next request it takes is the first at or after it
+static int head_block = 0;
+
+int k_aio_submit(pid_t pid, int op, int global_fd, uint16_t generation, int mode, char* buf, uint32_t n, uint32_t offset) {
+    for (int id = 0; id < AIO_MAX_REQUESTS; id++) {
+        if (!aio_requests[id].in_use) {
+            aio_requests[id] = (aio_request){
+                .in_use = true,
+                .done = n == 0,
+                .op = op,
+                .pid = pid,
+                .global_fd = global_fd,
+                .generation = generation,
+                .mode = mode,
+                .buf = buf,
+                .offset = offset,
+                .n = n,
+                .n_done = 0,
+                .result = 0,
+                .seq = next_seq++};
+            return id;
+        }
+    }
+    return EK_AIO_TOO_MANY_REQUESTS;
+}
+
+static aio_request* find_request(pid_t pid, int id) {
+    if (id < 0 || id >= AIO_MAX_REQUESTS || !aio_requests[id].in_use || aio_requests[id].pid != pid) {
+        return NULL;
+    }
+    return &aio_requests[id];
+}
+
+int k_aio_block(pcb_t* process, int id) {
+    aio_request* request = find_request(process->pid, id);
+    if (request == NULL) {
+        return EK_AIO_NO_SUCH_REQUEST;
+    }
+    if (request->done) {
+        process->waited_aio = -1;
+        return 0;
+    }
+    process->waited_aio = id;
+    block_process(process);
+    return 1;
+}
+
+int k_aio_reap(pid_t pid, int id) {
+    aio_request* request = find_request(pid, id);
+    if (request == NULL || !request->done) {
+        return EK_AIO_NO_SUCH_REQUEST;
+    }
+    request->in_use = false;
+    return request->result;
+}
+
+/**
+ * Mark request as done with result, and wake up its process if it is waiting for it
+ */
+static void complete(aio_request* request, int result) {
+    request->done = true;
+    request->result = result;
+
+    pcb_t* process = k_get_process_by_pid(request->pid);
+    if (process != NULL && process->state == PROCESS_BLOCKED && process->waited_aio == request - aio_requests) {
+        process->waited_aio = -1;
+        unblock_process(process);
+    }
+}
+
+/**
+ * Whether request has to wait for an older request on the same fd. Every k_write ends the file
+ * where it stops, so writes (and reads after them) must happen in the order they were submitted
+ */
+static bool is_ordered_after_pending(aio_request* request) {
+    for (int id = 0; id < AIO_MAX_REQUESTS; id++) {
+        aio_request* other = &aio_requests[id];
+        if (other->in_use && !other->done && other->global_fd == request->global_fd && other->seq < request->seq &&
+            (other->op == AIO_WRITE || request->op == AIO_WRITE)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Pick the pending request to serve next (see aio.h), completing any whose file was closed
+ * on the way. Returns NULL if there are none. Sets *block to the block it touches next
+ */
+static aio_request* next_request(int* block) {
+    for (int id = 0; id < AIO_MAX_REQUESTS; id++) {
+        aio_request* request = &aio_requests[id];
+        if (request->in_use && !request->done && k_getgeneration(request->global_fd) != request->generation) {
+            complete(request, E_STALE_FD);
+        }
+    }
+
+    aio_request* ahead = NULL; // first request at or after head_block
+    aio_request* lowest = NULL; // first request overall, to wrap around to
+    int ahead_block = 0;
+    int lowest_block = 0;
+    for (int id = 0; id < AIO_MAX_REQUESTS; id++) {
+        aio_request* request = &aio_requests[id];
+        if (!request->in_use || request->done || is_ordered_after_pending(request)) {
+            continue;
+        }
+        int request_block = k_bmap(request->global_fd, request->offset + request->n_done);
+        if (request_block < 0) {
+            complete(request, request_block);
+            continue;
+        }
+
+        if (lowest == NULL || request_block < lowest_block || (request_block == lowest_block && request->seq < lowest->seq)) {
+            lowest = request;
+            lowest_block = request_block;
+        }
+        if (request_block >= head_block &&
+            (ahead == NULL || request_block < ahead_block || (request_block == ahead_block && request->seq < ahead->seq))) {
+            ahead = request;
+            ahead_block = request_block;
+        }
+    }
+    *block = ahead != NULL ? ahead_block : lowest_block;
+    return ahead != NULL ? ahead : lowest;
+}
+
+/**
+ * Move up to budget bytes of request. Returns the number of bytes moved
+ */
+static uint32_t serve(aio_request* request, uint32_t budget) {
+    uint32_t n = request->n - request->n_done;
+    if (n > budget) {
+        n = budget;
+    }
+
+    int status = k_lseek(request->global_fd, request->offset + request->n_done, F_SEEK_SET);
+    if (status < 0) {
+        complete(request, status);
+        return 0;
+    }
+
+    int bytes_moved;
+    if (request->op == AIO_READ) {
+        bytes_moved = k_read(request->global_fd, n, request->buf + request->n_done);
+    } else {
+        int old_mode = k_getmode(request->global_fd);
+        status = k_setmode(request->global_fd, request->mode);
+        if (status != 0) {
+            complete(request, status);
+            return 0;
+        }
+        bytes_moved = k_write(request->global_fd, request->buf + request->n_done, n);
+        k_setmode(request->global_fd, old_mode);
+    }
+
+    if (bytes_moved < 0) {
+        // report what was moved before the error, like a short read or write would
+        complete(request, request->n_done > 0 ? (int)request->n_done : bytes_moved);
+        return 0;
+    }
+    request->n_done += bytes_moved;
+    // a read stops at the end of the file, and a short write means the disk is full
+    if (request->n_done == request->n || bytes_moved == 0 || (request->op == AIO_WRITE && (uint32_t)bytes_moved < n)) {
+        complete(request, request->n_done);
+    }
+    return bytes_moved;
+}
+
+void k_aio_run(uint32_t budget) {
+    while (budget > 0) {
+        int block;
+        aio_request* request = next_request(&block);
+        if (request == NULL) {
+            return;
+        }
+        // every round either moves some bytes or completes the request, so this ends
+        uint32_t bytes_moved = serve(request, budget);
+        budget -= bytes_moved;
+
+        // carry on from where this request stopped
+        int stopped_at = k_bmap(request->global_fd, request->offset + request->n_done);
+        head_block = stopped_at > 0 ? stopped_at : block;
+    }
+}
+
+void k_aio_cancel(pid_t pid) {
+    for (int id = 0; id < AIO_MAX_REQUESTS; id++) {
+        if (aio_requests[id].in_use && aio_requests[id].pid == pid) {
+            aio_requests[id].in_use = false;
+        }
+    }
+}
@@ -0,0 +1,79 @@
+#ifndef AIO_H
+#define AIO_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "src/scheduler/scheduler.h"
+
+/**
+ * Asynchronous file I/O (see s_aio_read, s_aio_write and s_aio_wait).
+ *
+ * Submitting a request only queues it. The scheduler serves the queue between quanta,
+ * up to AIO_BYTES_PER_TICK bytes at a time, so a process can keep computing (or other
+ * processes can run) while its I/O is in flight, and a big request doesn't hold up the
+ * scheduler for longer than a small one.
+ *
+ * Pending requests are served in elevator order of the disk block they touch next rather
+ * than in the order they were submitted: the worker sweeps up the disk, taking the
+ * request at or after the block it stopped at, and starts over from the lowest block once
+ * none is left ahead of it. Requests for neighbouring parts of a file therefore run back
+ * to back however they were submitted and interleaved with other processes' requests.
+ * The exception is a write, which (like s_write) ends the file where it stops: it never
+ * overtakes, or is overtaken by, an older request on the same fd.
+ */
+
+#define AIO_MAX_REQUESTS 64
+#define AIO_BYTES_PER_TICK 65536 // most bytes moved each time the scheduler runs the worker
+
+#define AIO_READ 0
+#define AIO_WRITE 1
+
+typedef struct aio_request_st {
+    bool in_use;
+    bool done;
+    int op;              // AIO_READ or AIO_WRITE
+    pid_t pid;           // process that submitted the request
+    int global_fd;
+    uint16_t generation; // of global_fd when the request was submitted (see k_getgeneration)
+    int mode;            // mode of the process-level fd, set on global_fd around writes
+    char* buf;
+    uint32_t offset;     // offset in the file the request starts at
+    uint32_t n;          // bytes requested
+    uint32_t n_done;     // bytes moved so far
+    int result;          // bytes moved, or negative error code, once done
+    uint64_t seq;        // submission order, to break ties between requests on the same block
+} aio_request;
+
+/**
+ * Queue a request to move n bytes between buf and global_fd, starting at offset in the
+ * file. buf must stay valid until the request is waited for.
+ * Returns the id of the request, or a negative error code.
+ */
+int k_aio_submit(pid_t pid, int op, int global_fd, uint16_t generation, int mode, char* buf, uint32_t n, uint32_t offset);
+
+/**
+ * Block process until request id is done, like k_sleep. Returns 1 if it was blocked (and
+ * should suspend itself and call this again once it runs), 0 if the request is done, or a
+ * negative error code if process has no request id.
+ */
+int k_aio_block(pcb_t* process, int id);
+
+/**
+ * Free request id of pid, which must be done.
+ * Returns the bytes it moved, or its negative error code.
+ */
+int k_aio_reap(pid_t pid, int id);
+
+/**
+ * Serve pending requests, moving at most budget bytes. Called by the scheduler between quanta
+ */
+void k_aio_run(uint32_t budget);
+
+/**
+ * Drop every request of pid, done or not, so its buffers aren't touched after it exits
+ */
+void k_aio_cancel(pid_t pid);
+
+#endif // AIO_H
@@ -4,33 +4,41 @@
 #include <stdio.h> // for vsnprintf
 
 #include "src/pennfat/fat.h"
+#include "src/pennfat/fat_utils.h"
 #include "src/scheduler/kernel.h"
 #include "src/utils/error_codes.h"
 #include "src/scheduler/sys.h"
+#include "src/scheduler/latency.h"
+#include "src/scheduler/aio.h"
+#include "src/scheduler/spthread.h"
 
-#define PROCESS_FD_TABLE_ENTRY_NOT_FOUND_SENTINEL 0xFFFF
+#define ES_PROCESS_FILE_TABLE_FULL -100
 
-// TODO: are we allowed to do this as a syscall?
-int find_empty_spot_in_process_fd_table(void)
+/**
+ * Resolve fname against the working directory of the current process (see join_path)
+ * into path, which is MAX_PATH_SIZE bytes. Returns 0 on success, or -1 with errno set
+ */
+static int to_path(const char *fname, char *path)
 {
     pcb_t *current_process = k_get_current_process();
-    for (uint32_t i = 0; i < PROCESS_FD_TABLE_SIZE; i++)
+    if (join_path(current_process != NULL ? current_process->cwd : "", fname, path) != 0)
     {
-        // check if the entry already exists (requires ref_count > 0)
-        if (!current_process->process_fd_table[i].in_use)
-        {
-            return i;
-        }
+        s_set_errno(E_PATH_TOO_LONG);
+        return -1;
     }
-    return PROCESS_FD_TABLE_ENTRY_NOT_FOUND_SENTINEL;
+    return 0;
 }
 
-#define ES_PROCESS_FILE_TABLE_FULL -100
-
-int s_open(const char *fname, int mode)
+static int s_open_untimed(const char *fname, int mode)
 {
+    char path[MAX_PATH_SIZE];
+    if (to_path(fname, path) != 0)
+    {
+        return -1;
+    }
+
     // try to open the file at the kernel level
-    int global_fd = k_open(fname, mode);
+    int global_fd = k_open(path, mode);
     // TODO: some kind of error translation?
     if (global_fd < 0)
     {
@@ -38,109 +46,175 @@ int s_open(const char *fname, int mode)
         return -1;
     }
 
-    // find an empty spot in the process fd table
-    uint32_t empty_spot = find_empty_spot_in_process_fd_table();
-    if (empty_spot == PROCESS_FD_TABLE_ENTRY_NOT_FOUND_SENTINEL)
+    // take an empty spot in the process fd table
+    pcb_t *current_process = k_get_current_process();
+    int fd = k_fd_alloc(current_process);
+    if (fd < 0)
     {
-        s_set_errno(E_PROCESS_FILE_TABLE_FULL);
+        k_close(global_fd);
+        s_set_errno(fd);
         return -1;
     }
 
     // update the process fd table
-    pcb_t *current_process = k_get_current_process();
-    current_process->process_fd_table[empty_spot].global_fd = global_fd;
-    current_process->process_fd_table[empty_spot].in_use = true;
-    current_process->process_fd_table[empty_spot].offset = 0;
-    current_process->process_fd_table[empty_spot].mode = mode;
-    return empty_spot;
+    process_fd_entry *fd_entry = &current_process->process_fd_table[fd];
+    fd_entry->global_fd = global_fd;
+    fd_entry->generation = k_getgeneration(global_fd);
+    fd_entry->offset = 0;
+    fd_entry->mode = mode & ~(F_DIRECT | F_LOG); // both stick to the global fd or the file (see k_open)
+    return fd;
+}
+
+int s_open(const char *fname, int mode)
+{
+    uint64_t start_ns = latency_start();
+    int fd = s_open_untimed(fname, mode);
+    latency_record(LATENCY_S_OPEN, start_ns);
+    return fd;
 }
 
 #define ES_READ_UNKNOWN_FD -101
 #define ES_READ_NO_TERMINAL_CONTROL -106
 
-int s_read(int fd, int n, char *buf)
+static int s_read_untimed(int fd, int n, char *buf)
 {
     pcb_t *current_process = k_get_current_process();
-    if (fd >= PROCESS_FD_TABLE_SIZE || !current_process->process_fd_table[fd].in_use)
+    process_fd_entry *fd_entry;
+    int lookup_status = k_fd_lookup(current_process, fd, &fd_entry);
+    if (lookup_status != 0)
     {
-        s_set_errno(E_READ_UNKNOWN_FD);
+        s_set_errno(lookup_status == E_UNKNOWN_FD ? E_READ_UNKNOWN_FD : lookup_status);
         return -1;
     }
 
-    int global_fd = current_process->process_fd_table[fd].global_fd;
+    int global_fd = fd_entry->global_fd;
     if (global_fd == STDIN_FD && k_tcgetpid() != current_process->pid) {        
         k_fprintf_short(STDERR_FD, "[WARN]: process %d tried to read from terminal STDIN without terminal control\n", current_process->pid);
         s_kill(current_process->pid, P_SIGSTOP);
     }
 
     // set the offset in the global fd table
-    k_lseek(current_process->process_fd_table[fd].global_fd, current_process->process_fd_table[fd].offset, F_SEEK_SET);
-    int bytes_read = k_read(current_process->process_fd_table[fd].global_fd, n, buf);
-    current_process->process_fd_table[fd].offset += bytes_read;
+    k_lseek(fd_entry->global_fd, fd_entry->offset, F_SEEK_SET);
+    int bytes_read = k_read(fd_entry->global_fd, n, buf);
+    fd_entry->offset += bytes_read;
     return bytes_read;
 }
 
-int s_write(int fd, const char *str, int n)
+int s_read(int fd, int n, char *buf)
+{
+    uint64_t start_ns = latency_start();
+    int bytes_read = s_read_untimed(fd, n, buf);
+    latency_record(LATENCY_S_READ, start_ns);
+    return bytes_read;
+}
+
+static int s_write_untimed(int fd, const char *str, int n)
 {
     pcb_t *current_process = k_get_current_process();
-    if (fd >= PROCESS_FD_TABLE_SIZE || !current_process->process_fd_table[fd].in_use)
+    process_fd_entry *fd_entry;
+    int lookup_status = k_fd_lookup(current_process, fd, &fd_entry);
+    if (lookup_status != 0)
     {
-        s_set_errno(E_UNKNOWN_FD);
+        s_set_errno(lookup_status);
         return -1;
     }
 
-    int global_fd = current_process->process_fd_table[fd].global_fd;
+    int global_fd = fd_entry->global_fd;
     if (global_fd == STDIN_FD && k_tcgetpid() != current_process->pid) {
         k_fprintf_short(STDERR_FD, "[WARN]: process %d tried to write to terminal STDIN without terminal control\n", current_process->pid);
         s_kill(current_process->pid, P_SIGSTOP);
     }
 
     // set the offset in the global fd table
-    int seek_status = k_lseek(current_process->process_fd_table[fd].global_fd, current_process->process_fd_table[fd].offset, F_SEEK_SET);
+    int64_t seek_status = k_lseek(fd_entry->global_fd, fd_entry->offset, F_SEEK_SET);
     if (seek_status != EK_LSEEK_SPECIAL_FD && seek_status < 0) // it's OK if the fd is a special fd
     {
         s_set_errno(seek_status);
         return -1;
     }
 
-    int old_mode = k_getmode(current_process->process_fd_table[fd].global_fd);
-    int setmode_status = k_setmode(current_process->process_fd_table[fd].global_fd, current_process->process_fd_table[fd].mode);
+    int old_mode = k_getmode(fd_entry->global_fd);
+    int setmode_status = k_setmode(fd_entry->global_fd, fd_entry->mode);
     if (setmode_status != 0)
     {
         s_set_errno(setmode_status);
         return -1;
     }
 
-    int bytes_written = k_write(current_process->process_fd_table[fd].global_fd, str, n);
+    int bytes_written = k_write(fd_entry->global_fd, str, n);
 
-    if (k_setmode(current_process->process_fd_table[fd].global_fd, old_mode) != 0)
+    if (k_setmode(fd_entry->global_fd, old_mode) != 0)
     {
         s_set_errno(setmode_status);
         return -1;
     }
 
-    current_process->process_fd_table[fd].offset += bytes_written;
+    fd_entry->offset += bytes_written;
+    return bytes_written;
+}
+
+int s_write(int fd, const char *str, int n)
+{
+    uint64_t start_ns = latency_start();
+    int bytes_written = s_write_untimed(fd, str, n);
+    latency_record(LATENCY_S_WRITE, start_ns);
     return bytes_written;
 }
 
 
-int s_close(int fd)
+static int s_close_untimed(int fd)
 {
     pcb_t *current_process = k_get_current_process();
-    if (fd >= PROCESS_FD_TABLE_SIZE || !current_process->process_fd_table[fd].in_use)
+    process_fd_entry *fd_entry;
+    int lookup_status = k_fd_lookup(current_process, fd, &fd_entry);
+    if (lookup_status != 0)
     {
-        s_set_errno(E_UNKNOWN_FD);
+        s_set_errno(lookup_status);
         return -1;
     }
     // close the global fd
-    k_close(current_process->process_fd_table[fd].global_fd);
-    current_process->process_fd_table[fd].in_use = false;
+    k_close(fd_entry->global_fd);
+    k_fd_release(current_process, fd);
+    return 0;
+}
+
+int s_close(int fd)
+{
+    uint64_t start_ns = latency_start();
+    int status = s_close_untimed(fd);
+    latency_record(LATENCY_S_CLOSE, start_ns);
+    return status;
+}
+
+static int s_unlink_untimed(const char *fname)
+{
+    char path[MAX_PATH_SIZE];
+    if (to_path(fname, path) != 0) {
+        return -1;
+    }
+    int status = k_unlink(path);
+    if (status != 0) {
+        s_set_errno(status);
+        return -1;
+    }
     return 0;
 }
 
 int s_unlink(const char *fname)
 {
-    int status = k_unlink(fname);
+    uint64_t start_ns = latency_start();
+    int status = s_unlink_untimed(fname);
+    latency_record(LATENCY_S_UNLINK, start_ns);
+    return status;
+}
+
+static int s_ls_untimed(const char *filename)
+{
+    char path[MAX_PATH_SIZE];
+    if (to_path(filename != NULL ? filename : "", path) != 0) {
+        return -1;
+    }
+    int status = k_ls(path);
     if (status != 0) {
         s_set_errno(status);
         return -1;
@@ -150,7 +224,19 @@ int s_unlink(const char *fname)
 
 int s_ls(const char *filename)
 {
-    int status = k_ls(filename);
+    uint64_t start_ns = latency_start();
+    int status = s_ls_untimed(filename);
+    latency_record(LATENCY_S_LS, start_ns);
+    return status;
+}
+
+static int s_chmod_untimed(const char *fname, uint8_t perm, int mode)
+{
+    char path[MAX_PATH_SIZE];
+    if (to_path(fname, path) != 0) {
+        return -1;
+    }
+    int status = k_chmod(path, perm, mode);
     if (status != 0) {
         s_set_errno(status);
         return -1;
@@ -160,7 +246,20 @@ int s_ls(const char *filename)
 
 int s_chmod(const char *fname, uint8_t perm, int mode)
 {
-    int status = k_chmod(fname, perm, mode);
+    uint64_t start_ns = latency_start();
+    int status = s_chmod_untimed(fname, perm, mode);
+    latency_record(LATENCY_S_CHMOD, start_ns);
+    return status;
+}
+
+static int s_mv_untimed(const char *src, const char *dest)
+{
+    char src_path[MAX_PATH_SIZE];
+    char dest_path[MAX_PATH_SIZE];
+    if (to_path(src, src_path) != 0 || to_path(dest, dest_path) != 0) {
+        return -1;
+    }
+    int status = k_mv(src_path, dest_path);
     if (status != 0) {
         s_set_errno(status);
         return -1;
@@ -170,14 +269,280 @@ int s_chmod(const char *fname, uint8_t perm, int mode)
 
 int s_mv(const char *src, const char *dest)
 {
-    int status = k_mv(src, dest);
+    uint64_t start_ns = latency_start();
+    int status = s_mv_untimed(src, dest);
+    latency_record(LATENCY_S_MV, start_ns);
+    return status;
+}
+
+int s_clone(const char *src, const char *dest)
+{
+    char src_path[MAX_PATH_SIZE];
+    char dest_path[MAX_PATH_SIZE];
+    if (to_path(src, src_path) != 0 || to_path(dest, dest_path) != 0) {
+        return -1;
+    }
+    int status = k_clone(src_path, dest_path);
+    if (status != 0) {
+        s_set_errno(status);
+        return -1;
+    }
+    return 0;
+}
+
+int s_mkdir(const char *path)
+{
+    char full_path[MAX_PATH_SIZE];
+    if (to_path(path, full_path) != 0) {
+        return -1;
+    }
+    int status = k_mkdir(full_path);
+    if (status != 0) {
+        s_set_errno(status);
+        return -1;
+    }
+    return 0;
+}
+
+int s_rmdir(const char *path)
+{
+    char full_path[MAX_PATH_SIZE];
+    if (to_path(path, full_path) != 0) {
+        return -1;
+    }
+    int status = k_rmdir(full_path);
+    if (status != 0) {
+        s_set_errno(status);
+        return -1;
+    }
+    return 0;
+}
+
+int s_chdir(const char *path)
+{
+    char full_path[MAX_PATH_SIZE];
+    if (to_path(path, full_path) != 0) {
+        return -1;
+    }
+    directory_entry dir_entry;
+    int status = k_stat(full_path, &dir_entry);
     if (status != 0) {
         s_set_errno(status);
         return -1;
     }
+    if (dir_entry.type != FILE_TYPE_DIRECTORY) {
+        s_set_errno(E_NOT_A_DIRECTORY);
+        return -1;
+    }
+
+    pcb_t *current_process = k_get_current_process();
+    if (current_process != NULL) {
+        strcpy(current_process->cwd, full_path); // join_path checked it fits
+    }
     return 0;
 }
 
+int s_copy_range(int fd_in, uint64_t off_in, int fd_out, uint64_t off_out, uint64_t len)
+{
+    pcb_t *current_process = k_get_current_process();
+    process_fd_entry *in_entry;
+    process_fd_entry *out_entry;
+    int lookup_status = k_fd_lookup(current_process, fd_in, &in_entry);
+    if (lookup_status == 0)
+    {
+        lookup_status = k_fd_lookup(current_process, fd_out, &out_entry);
+    }
+    if (lookup_status != 0)
+    {
+        s_set_errno(lookup_status);
+        return -1;
+    }
+    if (out_entry->mode == F_READ)
+    {
+        s_set_errno(EK_COPY_RANGE_WRONG_PERMISSIONS);
+        return -1;
+    }
+
+    int bytes_copied = k_copy_range(in_entry->global_fd, off_in, out_entry->global_fd, off_out, len);
+    if (bytes_copied < 0)
+    {
+        s_set_errno(bytes_copied);
+        return -1;
+    }
+    return bytes_copied;
+}
+
+int s_log_append(int fd, const char *rec, int len)
+{
+    pcb_t *current_process = k_get_current_process();
+    process_fd_entry *fd_entry;
+    int lookup_status = k_fd_lookup(current_process, fd, &fd_entry);
+    if (lookup_status != 0)
+    {
+        s_set_errno(lookup_status);
+        return -1;
+    }
+    if (fd_entry->mode == F_READ)
+    {
+        s_set_errno(EK_LOG_APPEND_WRONG_PERMISSIONS);
+        return -1;
+    }
+
+    int idx = k_log_append(fd_entry->global_fd, rec, len);
+    if (idx < 0)
+    {
+        s_set_errno(idx);
+        return -1;
+    }
+    return idx;
+}
+
+int s_log_read(int fd, uint32_t idx, char *buf, uint32_t size)
+{
+    pcb_t *current_process = k_get_current_process();
+    process_fd_entry *fd_entry;
+    int lookup_status = k_fd_lookup(current_process, fd, &fd_entry);
+    if (lookup_status != 0)
+    {
+        s_set_errno(lookup_status);
+        return -1;
+    }
+
+    int len = k_log_read(fd_entry->global_fd, idx, buf, size);
+    if (len < 0)
+    {
+        s_set_errno(len);
+        return -1;
+    }
+    return len;
+}
+
+/**
+ * Queue an asynchronous request for n bytes at offset of the file open as fd (see k_aio_submit)
+ */
+static int s_aio_submit(int op, int fd, char *buf, int n, uint32_t offset)
+{
+    pcb_t *current_process = k_get_current_process();
+    process_fd_entry *fd_entry;
+    int lookup_status = k_fd_lookup(current_process, fd, &fd_entry);
+    if (lookup_status != 0)
+    {
+        s_set_errno(lookup_status);
+        return -1;
+    }
+    if (fd_entry->global_fd == STDIN_FD || fd_entry->global_fd == STDOUT_FD || fd_entry->global_fd == STDERR_FD)
+    {
+        s_set_errno(EK_AIO_SPECIAL_FD);
+        return -1;
+    }
+    if (n < 0)
+    {
+        s_set_errno(EK_AIO_BAD_LENGTH);
+        return -1;
+    }
+    if (op == AIO_WRITE && fd_entry->mode == F_READ)
+    {
+        s_set_errno(EK_AIO_WRONG_PERMISSIONS);
+        return -1;
+    }
+
+    int id = k_aio_submit(current_process->pid, op, fd_entry->global_fd, fd_entry->generation, fd_entry->mode, buf, n, offset);
+    if (id < 0)
+    {
+        s_set_errno(id);
+        return -1;
+    }
+    return id;
+}
+
+int s_aio_read(int fd, int n, char *buf, uint32_t offset)
+{
+    return s_aio_submit(AIO_READ, fd, buf, n, offset);
+}
+
+int s_aio_write(int fd, const char *str, int n, uint32_t offset)
+{
+    return s_aio_submit(AIO_WRITE, fd, (char *)str, n, offset);
+}
+
+int s_aio_wait(int id)
+{
+    pcb_t *current_process = k_get_current_process();
+    int status;
+    // like s_sleep, check again every time the process runs in case something else woke it up
+    while ((status = k_aio_block(current_process, id)) == 1)
+    {
+        spthread_suspend_self();
+    }
+    if (status < 0)
+    {
+        s_set_errno(status);
+        return -1;
+    }
+
+    int result = k_aio_reap(current_process->pid, id);
+    if (result < 0)
+    {
+        s_set_errno(result);
+        return -1;
+    }
+    return result;
+}
+
+int s_snapshot_create(const char *name)
+{
+    int status = k_snapshot_create(name);
+    if (status != 0) {
+        s_set_errno(status);
+        return -1;
+    }
+    return 0;
+}
+
+int s_snapshot_list(void)
+{
+    int status = k_snapshot_list();
+    if (status != 0) {
+        s_set_errno(status);
+        return -1;
+    }
+    return 0;
+}
+
+int s_snapshot_rollback(const char *name)
+{
+    int status = k_snapshot_rollback(name);
+    if (status != 0) {
+        s_set_errno(status);
+        return -1;
+    }
+    return 0;
+}
+
+int s_snapshot_delete(const char *name)
+{
+    int status = k_snapshot_delete(name);
+    if (status != 0) {
+        s_set_errno(status);
+        return -1;
+    }
+    return 0;
+}
+
+int s_isatty(int fd)
+{
+    pcb_t *current_process = k_get_current_process();
+    process_fd_entry *fd_entry;
+    int lookup_status = k_fd_lookup(current_process, fd, &fd_entry);
+    if (lookup_status != 0)
+    {
+        s_set_errno(lookup_status);
+        return -1;
+    }
+    int global_fd = fd_entry->global_fd;
+    return global_fd == STDIN_FD || global_fd == STDOUT_FD || global_fd == STDERR_FD;
+}
+
 char S_FPRINTF_SHORT_BUF[1024];
 
 int s_fprintf_short(int fd, const char *format, ...)
@@ -196,3 +561,109 @@ int s_fprintf_short(int fd, const char *format, ...)
     }
     return s_write(fd, S_FPRINTF_SHORT_BUF, strlen(S_FPRINTF_SHORT_BUF));
 }
+
+void *s_mmap(int fd, uint32_t offset, uint32_t len, int prot)
+{
+    pcb_t *current_process = k_get_current_process();
+    process_fd_entry *fd_entry;
+    int lookup_status = k_fd_lookup(current_process, fd, &fd_entry);
+    if (lookup_status != 0)
+    {
+        s_set_errno(lookup_status);
+        return NULL;
+    }
+    if ((prot & F_PROT_WRITE) && fd_entry->mode == F_READ)
+    {
+        s_set_errno(EK_MMAP_WRONG_PERMISSIONS);
+        return NULL;
+    }
+
+    void *addr;
+    int status = k_mmap(current_process->pid, fd_entry->global_fd, offset, len, prot, &addr);
+    if (status != 0)
+    {
+        s_set_errno(status);
+        return NULL;
+    }
+    return addr;
+}
+
+int s_msync(void *addr)
+{
+    int status = k_msync(addr);
+    if (status != 0) {
+        s_set_errno(status);
+        return -1;
+    }
+    return 0;
+}
+
+int s_munmap(void *addr)
+{
+    int status = k_munmap(addr);
+    if (status != 0) {
+        s_set_errno(status);
+        return -1;
+    }
+    return 0;
+}
+
+void s_fsstats_reset(void)
+{
+    k_fsstats_reset();
+}
+
+int s_fsstats_print(void)
+{
+    int status = k_fsstats_print();
+    if (status != 0) {
+        s_set_errno(status);
+        return -1;
+    }
+    return 0;
+}
+
+int s_reclaim(uint32_t max_blocks)
+{
+    int n_freed = k_reclaim(max_blocks);
+    if (n_freed < 0) {
+        s_set_errno(n_freed);
+        return -1;
+    }
+    return n_freed;
+}
+
+void s_reclaim_async(int enabled)
+{
+    k_reclaim_async(enabled != 0);
+}
+
+int s_statfs(fs_statfs *statfs_ptr)
+{
+    int status = k_statfs(statfs_ptr);
+    if (status != 0) {
+        s_set_errno(status);
+        return -1;
+    }
+    return 0;
+}
+
+int s_mount(const char *volume, char *fs_name, int flags)
+{
+    int status = mount_volume(volume, fs_name, flags);
+    if (status != 0) {
+        s_set_errno(E_MOUNT_FAILED); // mount errors are positive EMOUNT_* codes
+        return -1;
+    }
+    return 0;
+}
+
+int s_unmount(const char *volume)
+{
+    int status = unmount_volume(volume);
+    if (status != 0) {
+        s_set_errno(status < 0 ? status : E_UNMOUNT_FAILED);
+        return -1;
+    }
+    return 0;
+}
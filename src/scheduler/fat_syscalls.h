@@ -3,7 +3,7 @@
 /**
  * @brief Open a file
  * @param fname file name
- * @param mode mode to open the file with (i.e., F_READ, F_WRITE, F_APPEND)
+ * @param mode mode to open the file with (i.e., F_READ, F_WRITE, F_APPEND), optionally with F_DIRECT and F_LOG (see k_open)
  * @return int process-level file descriptor, or negative error code
  */
 int s_open(const char *fname, int mode);
@@ -42,7 +42,7 @@ int s_unlink(const char *fname);
 
 /**
  * @brief List the contents of a directory  
- * @param filename directory to list the contents of
+ * @param filename directory to list the contents of, NULL for the working directory
  * @return int 0 on success, or negative error code
  */
 int s_ls(const char *filename);
@@ -64,6 +64,203 @@ int s_chmod(const char *fname, uint8_t perm, int mode);
  */
 int s_mv(const char *src, const char *dest);
 
+/**
+ * @brief Create dest as a copy of src without copying any data (see k_clone)
+ * @param src source file name
+ * @param dest destination file name
+ * @return int 0 on success, or negative error code
+ */
+int s_clone(const char *src, const char *dest);
+
+/**
+ * @brief Create a directory (see k_mkdir). Like every path passed to a file syscall, a
+ * relative path starts at the working directory of the process (see s_chdir)
+ * @param path path of the new directory
+ * @return int 0 on success, or -1 on error (with errno set)
+ */
+int s_mkdir(const char *path);
+
+/**
+ * @brief Remove an empty directory
+ * @param path path of the directory
+ * @return int 0 on success, or -1 on error (with errno set)
+ */
+int s_rmdir(const char *path);
+
+/**
+ * @brief Change the working directory of the process, which its children inherit
+ * @param path path of the directory, "/" for the root and "scratch:/" for the root of the volume mounted as scratch
+ * @return int 0 on success, or -1 on error (with errno set)
+ */
+int s_chdir(const char *path);
+
+/**
+ * @brief Copy len bytes between two files without passing them through the caller (see k_copy_range)
+ * @param fd_in process-level file descriptor to copy from
+ * @param off_in offset in fd_in to start copying from
+ * @param fd_out process-level file descriptor to copy to
+ * @param off_out offset in fd_out to start copying to
+ * @param len number of bytes to copy
+ * @return int number of bytes copied (0 at the end of fd_in), or negative error code
+ */
+int s_copy_range(int fd_in, uint64_t off_in, int fd_out, uint64_t off_out, uint64_t len);
+
+/**
+ * @brief Append a record to a log file opened with F_LOG (see k_log_append). The fd must
+ * be open for writing, but its offset doesn't matter and doesn't change
+ * @param fd process-level file descriptor of the log
+ * @param rec bytes of the record
+ * @param len number of bytes in the record
+ * @return int index of the record in the log, or -1 on error (with errno set)
+ */
+int s_log_append(int fd, const char *rec, int len);
+
+/**
+ * @brief Read a record of a log file (see k_log_read). The offset of fd doesn't matter and doesn't change
+ * @param fd process-level file descriptor of the log
+ * @param idx index of the record
+ * @param buf buffer to read the record into
+ * @param size size of buf. Only that much of a longer record is read
+ * @return int length of the whole record, or -1 on error (with errno set)
+ */
+int s_log_read(int fd, uint32_t idx, char *buf, uint32_t size);
+
+/**
+ * @brief Start reading from a file in the background. The read happens as the kernel gets
+ * to it (see aio.h), and s_aio_wait collects the result. The offset of fd doesn't matter and doesn't change
+ * @param fd process-level file descriptor to read from
+ * @param n number of bytes to read from the file
+ * @param buf buffer to read the bytes into. It must not be used until the request is waited for
+ * @param offset offset in the file to start reading at
+ * @return int id of the request, or -1 on error (with errno set)
+ */
+int s_aio_read(int fd, int n, char *buf, uint32_t offset);
+
+/**
+ * @brief Start writing to a file in the background, like s_aio_read
+ * @param fd process-level file descriptor to write to
+ * @param str bytes to write. They must not be changed until the request is waited for
+ * @param n number of bytes to write to the file
+ * @param offset offset in the file to start writing at
+ * @return int id of the request, or -1 on error (with errno set)
+ */
+int s_aio_write(int fd, const char *str, int n, uint32_t offset);
+
+/**
+ * @brief Block until a request made by s_aio_read or s_aio_write is done, and free it.
+ * Every request must be waited for exactly once; those still pending when the process exits are dropped
+ * @param id id of the request
+ * @return int number of bytes read or written (less than asked at the end of the file or when the
+ * disk is full), or -1 on error (with errno set)
+ */
+int s_aio_wait(int id);
+
+/**
+ * @brief Snapshot the mounted volume under name (see k_snapshot_create)
+ * @param name snapshot name
+ * @return int 0 on success, or negative error code
+ */
+int s_snapshot_create(const char *name);
+
+/**
+ * @brief List the snapshots of the mounted volume to stdout
+ * @return int 0 on success, or negative error code
+ */
+int s_snapshot_list(void);
+
+/**
+ * @brief Restore the mounted volume to the snapshot called name (see k_snapshot_rollback)
+ * @param name snapshot name
+ * @return int 0 on success, or negative error code
+ */
+int s_snapshot_rollback(const char *name);
+
+/**
+ * @brief Delete the snapshot called name, releasing the blocks only it was holding
+ * @param name snapshot name
+ * @return int 0 on success, or negative error code
+ */
+int s_snapshot_delete(const char *name);
+
+/**
+ * @brief Map part of an open file into memory (see k_mmap)
+ * @param fd process-level file descriptor of the file to map
+ * @param offset offset in the file the mapping starts at
+ * @param len number of bytes to map, clamped to the end of the file
+ * @param prot F_PROT_READ, F_PROT_WRITE or both. F_PROT_WRITE needs fd to be writable
+ * @return void* start of the mapping, or NULL on error
+ */
+void *s_mmap(int fd, uint32_t offset, uint32_t len, int prot);
+
+/**
+ * @brief Write the changes made through a writable mapping back to its file
+ * @param addr address returned by s_mmap
+ * @return int 0 on success, or negative error code
+ */
+int s_msync(void *addr);
+
+/**
+ * @brief Write back and remove a mapping made by s_mmap
+ * @param addr address returned by s_mmap
+ * @return int 0 on success, or negative error code
+ */
+int s_munmap(void *addr);
+
+/**
+ * @brief Zero the filesystem counters
+ */
+void s_fsstats_reset(void);
+
+/**
+ * @brief Print the filesystem counters to stdout
+ * @return int 0 on success, or negative error code
+ */
+int s_fsstats_print(void);
+
+/**
+ * @brief Free up to max_blocks blocks of deleted files that are waiting to be reclaimed (see k_reclaim)
+ * @param max_blocks most blocks to free
+ * @return int number of blocks freed, or negative error code
+ */
+int s_reclaim(uint32_t max_blocks);
+
+/**
+ * @brief Turn queueing large frees for the reclaimer process on (non-zero) or off (0)
+ * @param enabled whether large frees should be queued
+ */
+void s_reclaim_async(int enabled);
+
+/**
+ * @brief Check whether a file descriptor refers to the terminal (i.e., stdin, stdout or stderr)
+ * rather than a file, for example after being redirected
+ * @param fd process-level file descriptor
+ * @return int 1 if it does, 0 if it doesn't, or -1 on error (with errno set)
+ */
+int s_isatty(int fd);
+
+/**
+ * @brief Get the size of the filesystem and how much of it is free (see k_statfs)
+ * @param statfs_ptr where to store the result
+ * @return int 0 on success, or -1 on error (with errno set)
+ */
+int s_statfs(fs_statfs *statfs_ptr);
+
+/**
+ * @brief Mount another image as a named volume (see mount_volume)
+ * @param volume name of the volume, which prefixes the names of its files (e.g., "scratch:f")
+ * @param fs_name file name of the image in the host filesystem
+ * @param flags bitwise or of MOUNT_* flags
+ * @return int 0 on success, or -1 on error (with errno set)
+ */
+int s_mount(const char *volume, char *fs_name, int flags);
+
+/**
+ * @brief Unmount a named volume, closing the files that are open on it (see unmount_volume)
+ * @param volume name the volume was mounted with
+ * @return int 0 on success, or -1 on error (with errno set)
+ */
+int s_unmount(const char *volume);
+
 /**
  * @brief Like dprintf but using pennfat and limited to 1023 characters
  * @param fd process-level file descriptor to write to
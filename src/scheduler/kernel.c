@@ -56,6 +56,46 @@ static char** duplicate_argv(char *const argv[]) {
     return new_argv;
 }
 
+/**
+ * @brief Sets up the file descriptor table of a new process.
+ *
+ * A child gets a copy of its parent's table. Otherwise the table starts out with
+ * PROCESS_FD_TABLE_INITIAL_SIZE entries, of which only STDIN, STDOUT, and STDERR
+ * are in use, and k_fd_alloc grows it when a process opens more files.
+ *
+ * @param proc The new process.
+ * @param parent Its parent, or NULL for init.
+ * @return 0 on success, or a negative error code.
+ */
+static int init_process_fd_table(pcb_t *proc, pcb_t *parent) {
+    int size = parent ? parent->process_fd_table_size : PROCESS_FD_TABLE_INITIAL_SIZE;
+    proc->process_fd_table = (process_fd_entry*) malloc(size * sizeof(process_fd_entry));
+    if (!proc->process_fd_table) {
+        return E_FAILED_TO_ALLOCATE;
+    }
+    proc->process_fd_table_size = size;
+
+    if (parent != NULL) {
+        // copy the process file descriptor table to the child
+        memcpy(proc->process_fd_table, parent->process_fd_table, size * sizeof(process_fd_entry));
+        proc->process_fd_free_head = parent->process_fd_free_head;
+        return 0;
+    }
+
+    for (int i = 0; i < size; i++) {
+        proc->process_fd_table[i] = (process_fd_entry){
+            .global_fd = i,
+            .generation = 0, // the special fds are never released
+            .offset = 0,
+            .mode = F_READ,
+            .in_use = i <= STDERR_FD,
+            .next_free = i + 1 < size ? i + 1 : -1};
+    }
+    proc->process_fd_table[STDIN_FD].mode = F_WRITE;
+    proc->process_fd_free_head = STDERR_FD + 1;
+    return 0;
+}
+
 /**
  * @brief Creates a new process control block (PCB) as a child of the given parent,
  *        initializes its thread, and adds it to the scheduler's ready queue.
@@ -109,24 +149,12 @@ pid_t k_proc_create(pcb_t *parent, void *(*func)(void *), char *const argv[], pr
     proc->prev = NULL;
     proc->next = NULL;
     proc->waited_child = -2;
-    for (int i = 0; i < PROCESS_FD_TABLE_SIZE; i++) {
-        proc->process_fd_table[i].in_use = false;
-    }
+    proc->waited_aio = -1;
+    proc->process_fd_table = NULL; // set up once the process is otherwise ready (see init_process_fd_table)
     proc->ignore_sigint = false;
     proc->ignore_sigtstp = false;
-
-    proc->process_fd_table[STDIN_FD].in_use = true;
-    proc->process_fd_table[STDIN_FD].mode = F_WRITE;
-    proc->process_fd_table[STDIN_FD].global_fd = STDIN_FD;
-    proc->process_fd_table[STDIN_FD].offset = 0;
-    proc->process_fd_table[STDOUT_FD].in_use = true;
-    proc->process_fd_table[STDOUT_FD].mode = F_READ;
-    proc->process_fd_table[STDOUT_FD].global_fd = STDOUT_FD;
-    proc->process_fd_table[STDOUT_FD].offset = 0;
-    proc->process_fd_table[STDERR_FD].in_use = true;
-    proc->process_fd_table[STDERR_FD].mode = F_READ;
-    proc->process_fd_table[STDERR_FD].global_fd = STDERR_FD;
-    proc->process_fd_table[STDERR_FD].offset = 0;
+    proc->latencies = NULL;
+    strcpy(proc->cwd, parent ? parent->cwd : "");
 
     // this is the init process
     if (parent == NULL) {
@@ -205,7 +233,8 @@ pid_t k_proc_create(pcb_t *parent, void *(*func)(void *), char *const argv[], pr
     log_create(proc->pid, proc->priority, proc->command);
 
     child_process_t* child_process = (child_process_t*) malloc(sizeof(child_process_t));
-    if (!child_process) {
+    if (!child_process || init_process_fd_table(proc, parent) != 0) {
+        free(child_process);
         if (proc->command) free(proc->command);
         if (proc->argv) {
             for (int i = 0; proc->argv[i] != NULL; i++) {
@@ -224,11 +253,6 @@ pid_t k_proc_create(pcb_t *parent, void *(*func)(void *), char *const argv[], pr
         linked_list_push_tail(parent->children, child_process);
     }
 
-    if (parent != NULL) {
-        // copy the process file descriptor table to the child
-        memcpy(proc->process_fd_table, parent->process_fd_table, sizeof(proc->process_fd_table));
-    }
-
 
     // Add to scheduler ready queue (assuming k_add_to_ready_queue exists and is declared)
     // This function should likely reside in scheduler.c but be declared in kernel.h or scheduler.h (included by kernel.c)
@@ -284,6 +308,7 @@ int k_proc_cleanup(pcb_t *proc) {
                 }
                 if (child->process->thread) free(child->process->thread); // Thread struct, not joining here.
                 if (child->process->children) free(child->process->children); // List struct itself
+                free(child->process->process_fd_table);
                 free(child->process); // Free the child PCB
                 free(child); // Free the child PCB
                 return E_NO_INIT_PROCESS;
@@ -313,8 +338,81 @@ int k_proc_cleanup(pcb_t *proc) {
         free(proc->argv);
         proc->argv = NULL;
     }
+    free(proc->latencies);
+    proc->latencies = NULL;
+    free(proc->process_fd_table);
+    proc->process_fd_table = NULL;
 
     // 4. Free the PCB structure itself
     free(proc);
     return 0;
 }
+
+/**
+ * @brief Takes an unused entry of a process's file descriptor table.
+ *
+ * Unused entries are linked through next_free, so this is O(1) unless the table is full,
+ * in which case it is doubled (up to PROCESS_FD_TABLE_SIZE entries) and the new entries
+ * go on the free list.
+ *
+ * @param proc The process to allocate the file descriptor in.
+ * @return int The process-level file descriptor, or a negative error code.
+ */
+int k_fd_alloc(pcb_t *proc) {
+    if (proc->process_fd_free_head == -1) {
+        if (proc->process_fd_table_size >= PROCESS_FD_TABLE_SIZE) {
+            return E_PROCESS_FILE_TABLE_FULL;
+        }
+        int new_size = proc->process_fd_table_size * 2;
+        if (new_size > PROCESS_FD_TABLE_SIZE) {
+            new_size = PROCESS_FD_TABLE_SIZE;
+        }
+        process_fd_entry* new_table = (process_fd_entry*) realloc(proc->process_fd_table, new_size * sizeof(process_fd_entry));
+        if (!new_table) {
+            return E_FAILED_TO_ALLOCATE;
+        }
+        for (int i = proc->process_fd_table_size; i < new_size; i++) {
+            new_table[i].in_use = false;
+            new_table[i].next_free = i + 1 < new_size ? i + 1 : -1;
+        }
+        proc->process_fd_free_head = proc->process_fd_table_size;
+        proc->process_fd_table = new_table;
+        proc->process_fd_table_size = new_size;
+    }
+
+    int fd = proc->process_fd_free_head;
+    proc->process_fd_free_head = proc->process_fd_table[fd].next_free;
+    proc->process_fd_table[fd].in_use = true;
+    return fd;
+}
+
+/**
+ * @brief Returns an entry of a process's file descriptor table to its free list.
+ * @param proc The process that owns the file descriptor.
+ * @param fd The process-level file descriptor, which must be in use.
+ */
+void k_fd_release(pcb_t *proc, int fd) {
+    proc->process_fd_table[fd].in_use = false;
+    proc->process_fd_table[fd].next_free = proc->process_fd_free_head;
+    proc->process_fd_free_head = fd;
+}
+
+/**
+ * @brief Looks up an open file descriptor of a process, checking that the global
+ * file descriptor it refers to is still the one it opened.
+ * @param proc The process that owns the file descriptor.
+ * @param fd The process-level file descriptor.
+ * @param entry_ptr Where to store a pointer to the entry.
+ * @return 0 on success, E_UNKNOWN_FD if fd is not open, or E_STALE_FD.
+ */
+int k_fd_lookup(pcb_t *proc, int fd, process_fd_entry **entry_ptr) {
+    if (fd < 0 || fd >= proc->process_fd_table_size || !proc->process_fd_table[fd].in_use) {
+        return E_UNKNOWN_FD;
+    }
+    process_fd_entry* entry = &proc->process_fd_table[fd];
+    if (k_getgeneration(entry->global_fd) != entry->generation) {
+        return E_STALE_FD;
+    }
+    *entry_ptr = entry;
+    return 0;
+}
@@ -26,6 +26,32 @@ pid_t k_proc_create(pcb_t *parent, void *(*func)(void *), char *const argv[], pr
  */
 int k_proc_cleanup(pcb_t *proc);
 
+/**
+ * @brief Takes an unused entry of a process's file descriptor table, growing the table if it is full.
+ * The entry is marked in use, and the caller fills in the rest.
+ * @param proc The process to allocate the file descriptor in.
+ * @return int The process-level file descriptor, or a negative error code.
+ */
+int k_fd_alloc(pcb_t *proc);
+
+/**
+ * @brief Returns an entry of a process's file descriptor table to its free list.
+ * @param proc The process that owns the file descriptor.
+ * @param fd The process-level file descriptor, which must be in use.
+ */
+void k_fd_release(pcb_t *proc, int fd);
+
+/**
+ * @brief Looks up an open file descriptor of a process.
+ * Fails with E_STALE_FD if the global file descriptor it refers to was closed since
+ * (e.g., by the parent the entry was inherited from), even if it was reused after.
+ * @param proc The process that owns the file descriptor.
+ * @param fd The process-level file descriptor.
+ * @param entry_ptr Where to store a pointer to the entry.
+ * @return 0 on success, or a negative error code.
+ */
+int k_fd_lookup(pcb_t *proc, int fd, process_fd_entry **entry_ptr);
+
 /**
  * @brief Adds a process to the appropriate scheduler ready queue based on its priority.
  * @param proc The process control block to add.
@@ -0,0 +1,130 @@
+#include "src/scheduler/latency.h"
+#include "src/scheduler/kernel.h"
+#include "src/scheduler/scheduler.h"
+#include "src/utils/error_codes.h"
+
+#include <stdlib.h>
+#include <time.h>
+
+static latency_histogram global_histograms[N_LATENCY_SYSCALLS];
+
+static const char* syscall_names[N_LATENCY_SYSCALLS] = {
+    "s_open", "s_read", "s_write", "s_close", "s_unlink", "s_ls", "s_mv", "s_chmod",
+};
+
+const char* latency_syscall_name(int syscall) {
+    if (syscall < 0 || syscall >= N_LATENCY_SYSCALLS) {
+        return "unknown";
+    }
+    return syscall_names[syscall];
+}
+
+uint64_t latency_start(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int latency_bucket_of(uint64_t value_ns) {
+    if (value_ns < LATENCY_SUB_BUCKETS) {
+        return value_ns;
+    }
+    int exponent = 63 - __builtin_clzll(value_ns);
+    if (exponent > LATENCY_MAX_EXPONENT) {
+        return LATENCY_N_BUCKETS - 1;
+    }
+    int sub_bucket = (value_ns >> (exponent - LATENCY_SUB_BUCKET_BITS)) & (LATENCY_SUB_BUCKETS - 1);
+    return LATENCY_SUB_BUCKETS * (exponent - LATENCY_SUB_BUCKET_BITS + 1) + sub_bucket;
+}
+
+uint64_t latency_bucket_upper_bound(int bucket) {
+    if (bucket < LATENCY_SUB_BUCKETS) {
+        return bucket;
+    }
+    int exponent = bucket / LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKET_BITS - 1;
+    uint64_t sub_bucket = bucket % LATENCY_SUB_BUCKETS;
+    uint64_t width = 1ULL << (exponent - LATENCY_SUB_BUCKET_BITS);
+    return ((LATENCY_SUB_BUCKETS + sub_bucket) << (exponent - LATENCY_SUB_BUCKET_BITS)) + width - 1;
+}
+
+void latency_histogram_add(latency_histogram* histogram, uint64_t value_ns) {
+    atomic_fetch_add_explicit(&histogram->counts[latency_bucket_of(value_ns)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->total_count, 1, memory_order_relaxed);
+    uint64_t max_ns = atomic_load_explicit(&histogram->max_ns, memory_order_relaxed);
+    while (value_ns > max_ns &&
+           !atomic_compare_exchange_weak_explicit(&histogram->max_ns, &max_ns, value_ns,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+void latency_record(int syscall, uint64_t start_ns) {
+    uint64_t elapsed_ns = latency_start() - start_ns;
+    latency_histogram_add(&global_histograms[syscall], elapsed_ns);
+
+    pcb_t* current_process = k_get_current_process();
+    if (current_process == NULL) {
+        return;
+    }
+    if (current_process->latencies == NULL) {
+        // only processes that touch files pay for the histograms. If this fails the
+        // call is still counted globally
+        current_process->latencies = (syscall_latencies*) calloc(1, sizeof(syscall_latencies));
+        if (current_process->latencies == NULL) {
+            return;
+        }
+    }
+    latency_histogram_add(&current_process->latencies->histograms[syscall], elapsed_ns);
+}
+
+void latency_histogram_summarize(latency_histogram* histogram, latency_summary* summary) {
+    // the counts can move while we read them, so work from one pass over the buckets
+    uint64_t counts[LATENCY_N_BUCKETS];
+    uint64_t total_count = 0;
+    for (int i = 0; i < LATENCY_N_BUCKETS; i++) {
+        counts[i] = atomic_load_explicit(&histogram->counts[i], memory_order_relaxed);
+        total_count += counts[i];
+    }
+
+    summary->count = total_count;
+    summary->max_ns = atomic_load_explicit(&histogram->max_ns, memory_order_relaxed);
+    uint64_t* percentiles[] = {&summary->p50_ns, &summary->p99_ns, &summary->p999_ns};
+    const double quantiles[] = {0.5, 0.99, 0.999};
+    for (int p = 0; p < 3; p++) {
+        // rank of the sample at this quantile, counting from 1
+        uint64_t rank = (uint64_t)(quantiles[p] * total_count);
+        if (rank < quantiles[p] * total_count || rank == 0) {
+            rank += 1;
+        }
+        *percentiles[p] = 0;
+        uint64_t seen = 0;
+        for (int i = 0; i < LATENCY_N_BUCKETS && total_count > 0; i++) {
+            seen += counts[i];
+            if (seen >= rank) {
+                uint64_t upper_bound = latency_bucket_upper_bound(i);
+                *percentiles[p] = upper_bound < summary->max_ns ? upper_bound : summary->max_ns;
+                break;
+            }
+        }
+    }
+}
+
+int k_latency_summarize(pid_t pid, int syscall, latency_summary* summary) {
+    if (syscall < 0 || syscall >= N_LATENCY_SYSCALLS) {
+        return E_INVALID_ARGUMENT;
+    }
+    if (pid == LATENCY_ALL_PROCESSES) {
+        latency_histogram_summarize(&global_histograms[syscall], summary);
+        return 0;
+    }
+
+    pcb_t* process = k_get_process_by_pid(pid);
+    if (process == NULL) {
+        return E_NO_SUCH_PROCESS;
+    }
+    if (process->latencies == NULL) {
+        *summary = (latency_summary){0};
+        return 0;
+    }
+    latency_histogram_summarize(&process->latencies->histograms[syscall], summary);
+    return 0;
+}
@@ -0,0 +1,95 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// file syscalls whose latency is recorded
+#define LATENCY_S_OPEN 0
+#define LATENCY_S_READ 1
+#define LATENCY_S_WRITE 2
+#define LATENCY_S_CLOSE 3
+#define LATENCY_S_UNLINK 4
+#define LATENCY_S_LS 5
+#define LATENCY_S_MV 6
+#define LATENCY_S_CHMOD 7
+#define N_LATENCY_SYSCALLS 8
+
+// pid to pass to latency_summarize for the totals across every process
+#define LATENCY_ALL_PROCESSES -1
+
+// log-linear buckets: values below 8ns get a bucket each, then every power of 2 is split
+// into 8 linear sub-buckets (so bucket bounds are within 12.5% of any value they hold),
+// up to 2^40ns (~18 minutes) which catches everything above it
+#define LATENCY_SUB_BUCKET_BITS 3
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BUCKET_BITS)
+#define LATENCY_MAX_EXPONENT 40
+#define LATENCY_N_BUCKETS (LATENCY_SUB_BUCKETS * (LATENCY_MAX_EXPONENT - LATENCY_SUB_BUCKET_BITS + 2))
+
+/**
+ * HDR-style histogram of latencies in nanoseconds. Recording is a few relaxed atomic
+ * adds, so it never takes a lock and never allocates.
+ */
+typedef struct latency_histogram_st {
+    _Atomic uint64_t counts[LATENCY_N_BUCKETS];
+    _Atomic uint64_t total_count;
+    _Atomic uint64_t max_ns;
+} latency_histogram;
+
+typedef struct syscall_latencies_st {
+    latency_histogram histograms[N_LATENCY_SYSCALLS];
+} syscall_latencies;
+
+typedef struct latency_summary_st {
+    uint64_t count;
+    uint64_t p50_ns;
+    uint64_t p99_ns;
+    uint64_t p999_ns;
+    uint64_t max_ns;
+} latency_summary;
+
+/**
+ * Name of a LATENCY_S_* syscall, e.g. "s_write"
+ */
+const char* latency_syscall_name(int syscall);
+
+/**
+ * Current time on the monotonic clock in nanoseconds, to pass to latency_record later
+ */
+uint64_t latency_start(void);
+
+/**
+ * Record the time since start_ns as one call of syscall, both globally and for the
+ * current process
+ */
+void latency_record(int syscall, uint64_t start_ns);
+
+/**
+ * Index of the bucket value_ns is counted in
+ */
+int latency_bucket_of(uint64_t value_ns);
+
+/**
+ * Largest value that falls in bucket
+ */
+uint64_t latency_bucket_upper_bound(int bucket);
+
+/**
+ * Add value_ns to histogram
+ */
+void latency_histogram_add(latency_histogram* histogram, uint64_t value_ns);
+
+/**
+ * Summarize histogram. Percentiles are reported as the upper bound of the bucket they fall in.
+ */
+void latency_histogram_summarize(latency_histogram* histogram, latency_summary* summary);
+
+/**
+ * Summarize the latencies of syscall for the process pid, or across all processes
+ * (including ones that have exited) if pid is LATENCY_ALL_PROCESSES.
+ * Returns 0 on success and a negative error code on error.
+ */
+int k_latency_summarize(pid_t pid, int syscall, latency_summary* summary);
+
+#endif // LATENCY_H
@@ -11,6 +11,7 @@
 #include <asm-generic/signal-defs.h>
 #include <stdbool.h> // Required for bool type
 #include "src/utils/error_codes.h"
+#include "src/scheduler/aio.h"
 
 // TODO: remove this as soon as we switch k_log
 #include <stdio.h>
@@ -318,6 +319,9 @@ void _run_next_process()
     // Update the blocked processes before selecting the next process
     _update_blocked_processes();
 
+    // Move asynchronous I/O along, which may wake up processes waiting for it
+    k_aio_run(AIO_BYTES_PER_TICK);
+
     if (!shell_spawned) {
         shell_spawned = k_get_process_by_pid(2) != NULL;
     }
@@ -820,6 +824,8 @@ int k_proc_exit(pcb_t *process, int exit_status) {
     // todo - when we call s_kill, the process is a bit weird
     unblock_parents(process);
     reparent_children(process);
+    k_aio_cancel(process->pid);
+    k_munmap_all(process->pid); // writes back what it left in its writable mappings
     if (process->pid == scheduler_state->current_process->pid) {
         spthread_exit(NULL); // Use spthread library's exit mechanism
     }
@@ -11,6 +11,8 @@
 #include "../../lib/linked_list.h" 
 
 #include "./spthread.h" 
+#include "./latency.h"
+#include "src/pennfat/fat_constants.h"
 
 // Will have 3 queues for RUNNING (based on priority), and one for every other state
 typedef enum {   
@@ -44,13 +46,16 @@ struct child_process_st {
  * Process level file descriptor table
  */
 
-#define PROCESS_FD_TABLE_SIZE 128 
+#define PROCESS_FD_TABLE_SIZE 128 // most entries a process fd table can grow to
+#define PROCESS_FD_TABLE_INITIAL_SIZE 4
 typedef struct process_fd_entry_st
 {
     uint16_t global_fd; // file descriptor
-    uint32_t offset;
+    uint16_t generation; // generation of global_fd when it was opened (see k_getgeneration)
+    uint64_t offset;
     uint8_t mode; // F_READ, F_WRITE, F_APPEND
     bool in_use;
+    int16_t next_free; // next unused entry after this one while not in use, -1 at the end
 } process_fd_entry;
 
 
@@ -70,12 +75,19 @@ struct pcb_st {
     pid_t pgid;          
     child_process_ll_t children;
 
-    // Process level file descriptor table
-    process_fd_entry process_fd_table[PROCESS_FD_TABLE_SIZE];
+    // Process level file descriptor table, grown on demand (see k_fd_alloc)
+    process_fd_entry* process_fd_table;
+    int process_fd_table_size;
+    int process_fd_free_head; // first unused entry of process_fd_table, -1 if there is none
+
+    // working directory that relative paths passed to file syscalls start at (see join_path),
+    // inherited from the parent. "" is the root of the default volume
+    char cwd[MAX_PATH_SIZE];
 
     // Process state
     process_state state;
     pid_t waited_child;
+    int waited_aio; // asynchronous I/O request the process is blocked in s_aio_wait for, -1 if none
 
     // Signal handling
     bool ignore_sigint;
@@ -84,6 +96,9 @@ struct pcb_st {
     // error number
     int errnumber;
 
+    // latencies of this process's file syscalls, allocated on its first one
+    syscall_latencies* latencies;
+
     // Process priority
     priority_t priority;
     double sleep_time;
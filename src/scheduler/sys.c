@@ -10,6 +10,7 @@
 #include <signal.h> // For signal definitions (SIGTERM, SIGSTOP, SIGCONT)
 #include <unistd.h> // For _exit? No, use spthread_exit or infinite loop.
 #include "src/utils/error_codes.h"
+#include "src/utils/stream.h"
 // Forward declaration for the scheduler function (to be implemented later)
 void run_scheduler(); 
 
@@ -37,13 +38,9 @@ pid_t s_spawn(void* (*func)(void*), char *argv[], int fd0, int fd1, priority_t p
     }
     
     if (parent != NULL) {
-        if (fd0 < 0 || fd0 >= PROCESS_FD_TABLE_SIZE || fd1 < 0 || fd1 >= PROCESS_FD_TABLE_SIZE) {
-            s_set_errno(E_INVALID_ARGUMENT);
-            return -1;
-        }
-        process_fd_entry stdin_fd_entry = parent->process_fd_table[fd0];
-        process_fd_entry stdout_fd_entry = parent->process_fd_table[fd1];
-        if (stdin_fd_entry.in_use == false || stdout_fd_entry.in_use == false) {
+        process_fd_entry* stdin_fd_entry;
+        process_fd_entry* stdout_fd_entry;
+        if (k_fd_lookup(parent, fd0, &stdin_fd_entry) != 0 || k_fd_lookup(parent, fd1, &stdout_fd_entry) != 0) {
             s_set_errno(E_INVALID_ARGUMENT);
             return -1;
         }
@@ -51,8 +48,8 @@ pid_t s_spawn(void* (*func)(void*), char *argv[], int fd0, int fd1, priority_t p
         // TODO: is this the right behavior? or is the intended behavior that the child process should inherit only the
         // *global* file descriptor that fd0 and fd1 (process level fds) point to?
         // The current implementation means that the child process will also inherit the mode and offset of the parent process
-        k_get_process_by_pid(new_pid)->process_fd_table[STDIN_FD] = stdin_fd_entry;
-        k_get_process_by_pid(new_pid)->process_fd_table[STDOUT_FD] = stdout_fd_entry; 
+        k_get_process_by_pid(new_pid)->process_fd_table[STDIN_FD] = *stdin_fd_entry;
+        k_get_process_by_pid(new_pid)->process_fd_table[STDOUT_FD] = *stdout_fd_entry; 
     }
 
     return new_pid;
@@ -180,6 +177,7 @@ int s_kill(pid_t pid, int signal) {
 void s_exit(int status) {
     pcb_t* current = k_get_current_process();
     if (current) {
+        u_streams_exit(); // write out whatever the process's streams still buffer
         // Notify the kernel that this process is exiting
         int ret = k_proc_exit(current, status);
         if (ret != 0) {
@@ -333,3 +331,12 @@ int s_init_scheduler() {
 void s_run_scheduler() {
     run_scheduler();
 }
+
+int s_latency(pid_t pid, int syscall, latency_summary* summary) {
+    int status = k_latency_summarize(pid, syscall, summary);
+    if (status != 0) {
+        s_set_errno(status);
+        return -1;
+    }
+    return 0;
+}
@@ -14,6 +14,16 @@
 
 #define S_SPAWN_INVALID_FD_ERROR -100
 
+/**
+ * @brief Summarize the recorded latencies of a file syscall.
+ *
+ * @param pid Process to summarize, or LATENCY_ALL_PROCESSES for every process.
+ * @param syscall Which syscall (one of the LATENCY_S_* constants).
+ * @param summary Set to the call count, p50/p99/p999 and max latency in nanoseconds.
+ * @return 0 on success, -1 on error (e.g., process not found).
+ */
+int s_latency(pid_t pid, int syscall, latency_summary* summary);
+
 /**
  * @brief Create a child process that executes the function `func`.
  * The child will retain some attributes of the parent.
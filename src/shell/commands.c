@@ -8,9 +8,11 @@
 #include "../scheduler/sys.h"
 #include "../scheduler/spthread.h"
 #include "src/pennfat/fat_constants.h"
+#include "src/pennfat/fat_utils.h"
 #include "jobs.h"
 #include "stress.h"
 #include "src/utils/errno.h"
+#include "src/utils/stream.h"
 #define BUFFER_SIZE 256
 
 
@@ -233,30 +235,40 @@ void* kill_process_shell(void* arg, char* first_term) {
 void* man(void* arg) {
     //char** command = (char**)arg;
  
-    s_write(STDERR_FILENO, "Available commands:\n\n", strlen("Available commands:\n\n"));
-    s_write(STDERR_FILENO, "ps          - List all running processes and their states\n", strlen("ps          - List all running processes and their states\n"));
-    s_write(STDERR_FILENO, "zombify     - Create a zombie process\n", strlen("zombify     - Create a zombie process\n"));
-    s_write(STDERR_FILENO, "orphanify   - Create an orphan process\n", strlen("orphanify   - Create an orphan process\n"));
-    s_write(STDERR_FILENO, "busy        - Start a CPU-intensive process\n", strlen("busy        - Start a CPU-intensive process\n"));
-    s_write(STDERR_FILENO, "sleep <n>   - Sleep for n ticks\n", strlen("sleep <n>   - Sleep for n ticks\n"));
-    s_write(STDERR_FILENO, "nice_pid <pid> <priority>            - Change priority of process <pid> to <priority> (0-2)\n", strlen("nice_pid <pid> <priority>            - Change priority of process <pid> to <priority> (0-2)\n"));
-    s_write(STDERR_FILENO, "nice <priority> <command>   - spawns a process <command> with priority <priority>\n", strlen("nice <priority> <command>   - spawns a process <command> with priority <priority>\n"));
-    s_write(STDERR_FILENO, "kill -term <pid> - Terminate process <pid>\n", strlen("kill -term <pid> - Terminate process <pid>\n"));
-    s_write(STDERR_FILENO, "kill -stop <pid> - Stop process <pid>\n", strlen("kill -stop <pid> - Stop process <pid>\n"));
-    s_write(STDERR_FILENO, "kill -cont <pid> - Continue process <pid>\n", strlen("kill -cont <pid> - Continue process <pid>\n"));
-    s_write(STDERR_FILENO, "ls          - List all files in the current directory\n", strlen("ls          - List all files in the current directory\n"));
-    s_write(STDERR_FILENO, "bg <job_id> - brings job id to the background\n  ", strlen("bg <job_id> - brings job id to the background\n"));
-    s_write(STDERR_FILENO, "fg <job_id> - brings job id to the foreground\n  ", strlen("fg <job_id> - brings job id to the foreground\n"));
-    s_write(STDERR_FILENO, "jobs        - List all jobs\n", strlen("jobs        - List all jobs\n"));
-    s_write(STDERR_FILENO, "echo <message> - Print <message> to the shell\n", strlen("echo <message> - Print <message> to the shell\n"));
-    s_write(STDERR_FILENO, "touch <filename> - Create a new file with name <filename>\n", strlen("touch <filename> - Create a new file with name <filename>\n"));
-    s_write(STDERR_FILENO, "rm <filename> - Delete the file <filename>\n", strlen("rm <filename> - Delete the file <filename>\n"));
-    s_write(STDERR_FILENO, "cp <source> <destination> - Copy the file <source> to <destination>\n", strlen("cp <source> <destination> - Copy the file <source> to <destination>\n"));
-    s_write(STDERR_FILENO, "cat <filename> - Print the contents of the file <filename>\n", strlen("cat <filename> - Print the contents of the file <filename>\n"));
-    s_write(STDERR_FILENO, "chmod <mode> <filename> - Change the permissions of <filename> to <mode>\n", strlen("chmod <mode> <filename> - Change the permissions of <filename> to <mode>\n"));
-    s_write(STDERR_FILENO, "mv <source> <destination> - Move the file <source> to <destination>\n", strlen("mv <source> <destination> - Move the file <source> to <destination>\n"));
-    s_write(STDERR_FILENO, "logout - logs the user out of pennos\n", strlen("logout - logs the user out of pennos\n"));
-    s_write(STDERR_FILENO, "man         - Show this help message\n", strlen("man         - Show this help message\n"));
+    u_setvbuf(u_stderr, U_FULLY_BUFFERED, 0); // the whole help goes out in one s_write, at s_exit
+    u_fputs("Available commands:\n\n", u_stderr);
+    u_fputs("ps          - List all running processes and their states\n", u_stderr);
+    u_fputs("zombify     - Create a zombie process\n", u_stderr);
+    u_fputs("orphanify   - Create an orphan process\n", u_stderr);
+    u_fputs("busy        - Start a CPU-intensive process\n", u_stderr);
+    u_fputs("sleep <n>   - Sleep for n ticks\n", u_stderr);
+    u_fputs("nice_pid <pid> <priority>            - Change priority of process <pid> to <priority> (0-2)\n", u_stderr);
+    u_fputs("nice <priority> <command>   - spawns a process <command> with priority <priority>\n", u_stderr);
+    u_fputs("kill -term <pid> - Terminate process <pid>\n", u_stderr);
+    u_fputs("kill -stop <pid> - Stop process <pid>\n", u_stderr);
+    u_fputs("kill -cont <pid> - Continue process <pid>\n", u_stderr);
+    u_fputs("ls          - List all files in the current directory\n", u_stderr);
+    u_fputs("bg <job_id> - brings job id to the background\n", u_stderr);
+    u_fputs("fg <job_id> - brings job id to the foreground\n", u_stderr);
+    u_fputs("jobs        - List all jobs\n", u_stderr);
+    u_fputs("echo <message> - Print <message> to the shell\n", u_stderr);
+    u_fputs("touch <filename> - Create a new file with name <filename>\n", u_stderr);
+    u_fputs("rm <filename> - Delete the file <filename>\n", u_stderr);
+    u_fputs("mkdir <directory> - Create a new directory with name <directory>\n", u_stderr);
+    u_fputs("rmdir <directory> - Delete the empty directory <directory>\n", u_stderr);
+    u_fputs("cd [directory] - Change the working directory to <directory>, or to the root\n", u_stderr);
+    u_fputs("cp <source> <destination> - Copy the file <source> to <destination>\n", u_stderr);
+    u_fputs("cat <filename> - Print the contents of the file <filename>\n", u_stderr);
+    u_fputs("chmod <mode> <filename> - Change the permissions of <filename> to <mode>\n", u_stderr);
+    u_fputs("mv <source> <destination> - Move the file <source> to <destination>\n", u_stderr);
+    u_fputs("snapshot create|list|rollback|delete [name] - Manage snapshots of the file system\n", u_stderr);
+    u_fputs("fsstat [-r] - Show filesystem counters (-r also resets them)\n", u_stderr);
+    u_fputs("df - Show how many blocks of the file system are free\n", u_stderr);
+    u_fputs("mount <image> <volume> [options] - Mount another image, whose files are then named <volume>:<filename>\n", u_stderr);
+    u_fputs("umount <volume> - Unmount a volume mounted with mount\n", u_stderr);
+    u_fputs("latency [pid] - Show file syscall latency percentiles for all processes or one\n", u_stderr);
+    u_fputs("logout - logs the user out of pennos\n", u_stderr);
+    u_fputs("man         - Show this help message\n", u_stderr);
 
 
     
@@ -281,18 +293,11 @@ void* ls(void* arg) {
 
 void* echo(void* arg) {
     char** command = (char**) arg;
-    int ret = s_write(STDOUT_FILENO, command[1], strlen(command[1]));
-    if (ret < 0) {
-        s_exit(ret);
-        return NULL;
-    }
-
-    int ret2 = s_write(STDOUT_FILENO, "\n", 1);
-    if (ret2 < 0) {
-        s_exit(ret2);
+    if (u_fputs(command[1], u_stdout) < 0 || u_fputs("\n", u_stdout) < 0) {
+        u_perror("echo");
+        s_exit(-1);
         return NULL;
     }
-    u_perror("echo");
     s_exit(0);
     return NULL;
 }
@@ -351,6 +356,44 @@ void* rm(void* arg) {
     return NULL;
 }
 
+void* mkdir_command(void* arg) {
+    char** command = (char**)arg;
+    if (command[1] == NULL) {
+        char* error_message = "mkdir got wrong number of arguments (expected at least 1 argument)\n";
+        s_write(STDERR_FILENO, error_message, strlen(error_message));
+        s_exit(-200);
+        return NULL;
+    }
+    for (int i = 1; command[i] != NULL; i++) {
+        if (s_mkdir(command[i]) < 0) {
+            u_perror("mkdir");
+            s_exit(-1);
+            return NULL;
+        }
+    }
+    s_exit(0);
+    return NULL;
+}
+
+void* rmdir_command(void* arg) {
+    char** command = (char**)arg;
+    if (command[1] == NULL) {
+        char* error_message = "rmdir got wrong number of arguments (expected at least 1 argument)\n";
+        s_write(STDERR_FILENO, error_message, strlen(error_message));
+        s_exit(-200);
+        return NULL;
+    }
+    for (int i = 1; command[i] != NULL; i++) {
+        if (s_rmdir(command[i]) < 0) {
+            u_perror("rmdir");
+            s_exit(-1);
+            return NULL;
+        }
+    }
+    s_exit(0);
+    return NULL;
+}
+
 void* cp(void* arg) {
     char** command = (char**)arg;
 
@@ -362,6 +405,14 @@ void* cp(void* arg) {
         return NULL;
     }
 
+    // share the source's blocks if we can, which doesn't copy any data
+    if (s_clone(command[1], command[2]) == 0)
+    {
+        s_exit(0);
+        return NULL;
+    }
+    s_set_errno(0); // fall back to copying the data (in the kernel)
+
     // Open source file
     int src_fd = s_open(command[1], F_READ);
     if (src_fd < 0)
@@ -382,18 +433,19 @@ void* cp(void* arg) {
     }
 
     // Copy data
-    char buffer[1024];
-    int bytes_read;
-    while ((bytes_read = s_read(src_fd, sizeof(buffer), buffer)) > 0)
+    uint64_t offset = 0;
+    int bytes_copied;
+    while ((bytes_copied = s_copy_range(src_fd, offset, dest_fd, offset, UINT64_MAX - offset)) > 0)
     {
-        if (s_write(dest_fd, buffer, bytes_read) < 0)
-        {
-            u_perror("cp");
-            s_close(src_fd);
-            s_close(dest_fd);
-            s_exit(dest_fd);
-            return NULL;
-        }
+        offset += bytes_copied;
+    }
+    if (bytes_copied < 0)
+    {
+        u_perror("cp");
+        s_close(src_fd);
+        s_close(dest_fd);
+        s_exit(dest_fd);
+        return NULL;
     }
 
     s_close(src_fd);
@@ -506,6 +558,163 @@ void* mv(void* arg) {
     return NULL;
 }
 
+void* snapshot(void* arg) {
+    char** command = (char**)arg;
+    char* usage = "usage: snapshot create NAME | list | rollback NAME | delete NAME\n";
+    if (command[1] == NULL) {
+        s_write(STDERR_FILENO, usage, strlen(usage));
+        s_exit(-200);
+        return NULL;
+    }
+
+    bool takes_name = strcmp(command[1], "list") != 0;
+    bool has_right_args = takes_name ? command[2] != NULL && command[3] == NULL : command[2] == NULL;
+    if (!has_right_args) {
+        s_write(STDERR_FILENO, usage, strlen(usage));
+        s_exit(-200);
+        return NULL;
+    }
+
+    int snapshot_status;
+    if (strcmp(command[1], "create") == 0) {
+        snapshot_status = s_snapshot_create(command[2]);
+    } else if (strcmp(command[1], "list") == 0) {
+        snapshot_status = s_snapshot_list();
+    } else if (strcmp(command[1], "rollback") == 0) {
+        snapshot_status = s_snapshot_rollback(command[2]);
+    } else if (strcmp(command[1], "delete") == 0) {
+        snapshot_status = s_snapshot_delete(command[2]);
+    } else {
+        s_write(STDERR_FILENO, usage, strlen(usage));
+        s_exit(-200);
+        return NULL;
+    }
+    if (snapshot_status < 0) {
+        u_perror("snapshot");
+        s_exit(-1);
+        return NULL;
+    }
+    s_exit(0);
+    return NULL;
+}
+
+void* fsstat(void* arg) {
+    char** command = (char**)arg;
+    bool reset = command[1] != NULL && strcmp(command[1], "-r") == 0;
+    if ((command[1] != NULL && !reset) || (reset && command[2] != NULL)) {
+        char* error_message = "usage: fsstat [-r]\n";
+        s_write(STDERR_FILENO, error_message, strlen(error_message));
+        s_exit(-200);
+        return NULL;
+    }
+    if (s_fsstats_print() < 0) {
+        u_perror("fsstat");
+        s_exit(-1);
+        return NULL;
+    }
+    if (reset) {
+        s_fsstats_reset();
+    }
+    s_exit(0);
+    return NULL;
+}
+
+void* df(void* arg) {
+    char** command = (char**)arg;
+    if (command[1] != NULL) {
+        char* error_message = "usage: df\n";
+        s_write(STDERR_FILENO, error_message, strlen(error_message));
+        s_exit(-200);
+        return NULL;
+    }
+    fs_statfs statfs;
+    if (s_statfs(&statfs) < 0) {
+        u_perror("df");
+        s_exit(-1);
+        return NULL;
+    }
+    s_fprintf_short(STDOUT_FILENO, "%10s %10s %10s %10s %10s\n", "block_size", "blocks", "used", "free", "largest");
+    s_fprintf_short(STDOUT_FILENO, "%10u %10u %10u %10u %10u\n", statfs.block_size, statfs.total_blocks,
+                    statfs.total_blocks - statfs.free_blocks, statfs.free_blocks, statfs.largest_free_run);
+    s_exit(0);
+    return NULL;
+}
+
+void* mount_command(void* arg) {
+    char** command = (char**)arg;
+    if (command[1] == NULL || command[2] == NULL || (command[3] != NULL && command[4] != NULL)) {
+        char* error_message = "usage: mount <image> <volume> [options]\n";
+        s_write(STDERR_FILENO, error_message, strlen(error_message));
+        s_exit(-200);
+        return NULL;
+    }
+    int flags = command[3] != NULL ? parse_mount_options(command[3]) : 0;
+    if (flags < 0) {
+        s_fprintf_short(STDERR_FILENO, "mount: unknown option in %s\n", command[3]);
+        s_exit(-200);
+        return NULL;
+    }
+    if (s_mount(command[2], command[1], flags) < 0) {
+        u_perror("mount");
+        s_exit(-1);
+        return NULL;
+    }
+    s_exit(0);
+    return NULL;
+}
+
+void* umount_command(void* arg) {
+    char** command = (char**)arg;
+    if (command[1] == NULL || command[2] != NULL) {
+        char* error_message = "usage: umount <volume>\n";
+        s_write(STDERR_FILENO, error_message, strlen(error_message));
+        s_exit(-200);
+        return NULL;
+    }
+    if (s_unmount(command[1]) < 0) {
+        u_perror("umount");
+        s_exit(-1);
+        return NULL;
+    }
+    s_exit(0);
+    return NULL;
+}
+
+void* latency(void* arg) {
+    char** command = (char**)arg;
+    if (command[1] != NULL && command[2] != NULL) {
+        char* error_message = "usage: latency [pid]\n";
+        s_write(STDERR_FILENO, error_message, strlen(error_message));
+        s_exit(-200);
+        return NULL;
+    }
+    pid_t pid = command[1] == NULL ? LATENCY_ALL_PROCESSES : atoi(command[1]);
+
+    // summarize everything before printing, so the report doesn't count its own s_writes
+    latency_summary summaries[N_LATENCY_SYSCALLS];
+    for (int syscall = 0; syscall < N_LATENCY_SYSCALLS; syscall++) {
+        if (s_latency(pid, syscall, &summaries[syscall]) < 0) {
+            u_perror("latency");
+            s_exit(-1);
+            return NULL;
+        }
+    }
+
+    char buf[BUFFER_SIZE];
+    int len = snprintf(buf, BUFFER_SIZE, "%-9s %8s %10s %10s %10s %10s (us)\n", "SYSCALL", "CALLS", "P50", "P99", "P999", "MAX");
+    s_write(STDOUT_FILENO, buf, len);
+    for (int syscall = 0; syscall < N_LATENCY_SYSCALLS; syscall++) {
+        latency_summary* summary = &summaries[syscall];
+        len = snprintf(buf, BUFFER_SIZE, "%-9s %8llu %10.1f %10.1f %10.1f %10.1f\n",
+                       latency_syscall_name(syscall), (unsigned long long)summary->count,
+                       summary->p50_ns / 1000.0, summary->p99_ns / 1000.0,
+                       summary->p999_ns / 1000.0, summary->max_ns / 1000.0);
+        s_write(STDOUT_FILENO, buf, len);
+    }
+    s_exit(0);
+    return NULL;
+}
+
 void* hang_helper(void* arg) {
     s_exit(0);
     return NULL;
@@ -555,12 +764,36 @@ void* execute_command(void* arg) {
     if (strcmp(ctx[0], "chmod") == 0) {
         return chmod(ctx);
     }
+    if (strcmp(ctx[0], "mkdir") == 0) {
+        return mkdir_command(ctx);
+    }
+    if (strcmp(ctx[0], "rmdir") == 0) {
+        return rmdir_command(ctx);
+    }
     if (strcmp(ctx[0], "cat") == 0) {
         return cat(ctx);
     }
     if (strcmp(ctx[0], "mv") == 0) {
         return mv(ctx);
     }
+    if (strcmp(ctx[0], "snapshot") == 0) {
+        return snapshot(ctx);
+    }
+    if (strcmp(ctx[0], "fsstat") == 0) {
+        return fsstat(ctx);
+    }
+    if (strcmp(ctx[0], "df") == 0) {
+        return df(ctx);
+    }
+    if (strcmp(ctx[0], "mount") == 0) {
+        return mount_command(ctx);
+    }
+    if (strcmp(ctx[0], "umount") == 0) {
+        return umount_command(ctx);
+    }
+    if (strcmp(ctx[0], "latency") == 0) {
+        return latency(ctx);
+    }
     if (strcmp(ctx[0], "busy") == 0) {
         char* priority_level = ctx[1] == NULL ? "1" : ctx[1];
         return busy(ctx, priority_level);
@@ -10,6 +10,7 @@
 #include "../scheduler/sys.h"
 #include "../scheduler/logger.h"
 #include "../scheduler/fat_syscalls.h" // Added include
+#include "src/utils/stream.h"
 
 typedef linked_list(job_ll_node) job_ll;
 
@@ -37,15 +38,15 @@ static job_ll* jobs = &_jobs;
 void print_job_command(job* job) {
   for (size_t i = 0; i < job->cmd->num_commands; i++) {
     if (i > 0) {
-      s_fprintf_short(STDERR_FILENO, " | ");
+      u_fprintf(u_stderr, " | ");
     }
 
     char **command = job->cmd->commands[i];
     for (size_t j = 0; command[j] != NULL; j++) {
       if (j > 0) {
-        s_fprintf_short(STDERR_FILENO, " ");
+        u_fprintf(u_stderr, " ");
       }
-      s_fprintf_short(STDERR_FILENO, "%s", command[j]);
+      u_fprintf(u_stderr, "%s", command[j]);
     }
   }
 }
@@ -54,16 +55,16 @@ void print_job_command(job* job) {
  * @brief Handles the "jobs" built-in command.
  *
  * Iterates through the global jobs list and prints information
- * (job ID and command) for each job to stderr using s_fprintf_short.
+ * (job ID and command) for each job to stderr using u_fprintf.
  */
 void handle_jobs() {
   job_ll_node* node = linked_list_head(jobs);
 
   while (node != NULL) {
-    s_fprintf_short(STDERR_FILENO, "[%lu] %s ", node->job->id, 
+    u_fprintf(u_stderr, "[%lu] %s ", node->job->id, 
             (node->job->status == J_RUNNING_BG) ? "Running" : "Stopped");
     print_job_command(node->job);
-    s_fprintf_short(STDERR_FILENO, "\n");
+    u_fprintf(u_stderr, "\n");
     node = linked_list_next(node);
   }
 }
@@ -76,9 +77,9 @@ void handle_jobs() {
 void print_all_jobs() {
   job_ll_node* node = linked_list_head(jobs);
   while (node != NULL) {
-    s_fprintf_short(STDERR_FILENO, "[%lu] ", node->job->id);
-    s_fprintf_short(STDERR_FILENO, "%d", node->job->pid);
-    s_fprintf_short(STDERR_FILENO, "\n");
+    u_fprintf(u_stderr, "[%lu] ", node->job->id);
+    u_fprintf(u_stderr, "%d", node->job->pid);
+    u_fprintf(u_stderr, "\n");
     node = linked_list_next(node);
   }
 }
@@ -111,7 +112,7 @@ void handle_fg(struct parsed_command* cmd) {
 
     // Check if we found the job
     if (node == NULL) {
-      s_fprintf_short(STDERR_FILENO, "No job with id %ld\n", target_id);
+      u_fprintf(u_stderr, "No job with id %ld\n", target_id);
       return;
     }
   } else {
@@ -119,7 +120,7 @@ void handle_fg(struct parsed_command* cmd) {
     // so we have LIFO
     
     if (node == NULL) {
-      s_fprintf_short(STDERR_FILENO, "No jobs to fg\n");
+      u_fprintf(u_stderr, "No jobs to fg\n");
       return;
     }
   }
@@ -133,7 +134,7 @@ void handle_fg(struct parsed_command* cmd) {
               // mark the job as running in the foreground
   
   print_job_command(job);
-  s_fprintf_short(STDERR_FILENO, "\n");
+  u_fprintf(u_stderr, "\n");
 
   if (job->status == J_STOPPED) {
     s_kill(job->pid, P_SIGCONT);
@@ -177,7 +178,7 @@ void handle_bg(struct parsed_command* cmd) {
 
     // Check if we found the job
     if (node == NULL) {
-      s_fprintf_short(STDERR_FILENO, "No job with id %ld\n", target_id);
+      u_fprintf(u_stderr, "No job with id %ld\n", target_id);
       return;
     }
   } else {
@@ -185,14 +186,14 @@ void handle_bg(struct parsed_command* cmd) {
     // LIFO!
 
     if (node == NULL) {
-      s_fprintf_short(STDERR_FILENO, "No jobs to bg\n");
+      u_fprintf(u_stderr, "No jobs to bg\n");
       return;
     }
   }
     
   job* job = node->job;
   if (job->status == J_RUNNING_FG || job->status == J_RUNNING_BG) {
-    s_fprintf_short(STDERR_FILENO, "Job %ld is already running in foreground or background\n", job->id);
+    u_fprintf(u_stderr, "Job %ld is already running in foreground or background\n", job->id);
     return;
   }
 
@@ -201,9 +202,9 @@ void handle_bg(struct parsed_command* cmd) {
   // Resume the job in the background
   s_kill(job->pid, P_SIGCONT);
 
-  s_fprintf_short(STDERR_FILENO, "[%lu] ", node->job->id);
+  u_fprintf(u_stderr, "[%lu] ", node->job->id);
   print_job_command(job);
-  s_fprintf_short(STDERR_FILENO, " &\n");
+  u_fprintf(u_stderr, " &\n");
 }
 
 /**
@@ -248,13 +249,13 @@ bool handle_jobs_commands(struct parsed_command* cmd) {
  */
 void enqueue_job(job* job) {
   if (job->status != J_STOPPED && job->status != J_RUNNING_BG) {
-    s_fprintf_short(STDERR_FILENO, "Cannot enqueue a job that is not stopped or running in the background (cannot enqueue foreground jobs).\n");
+    u_fprintf(u_stderr, "Cannot enqueue a job that is not stopped or running in the background (cannot enqueue foreground jobs).\n");
     exit(EXIT_FAILURE);
   }
 
   job_ll_node* node = (job_ll_node*) malloc(sizeof(job_ll_node));
   if (!node) {
-    s_fprintf_short(STDERR_FILENO, "Failed to allocate job_ll_node\n");
+    u_fprintf(u_stderr, "Failed to allocate job_ll_node\n");
     return;
   }
 
@@ -381,7 +382,7 @@ void remove_job_by_pid(pid_t pid) {
 void add_foreground_job(job* job) {
   job_ll_node* node = (job_ll_node*) malloc(sizeof(job_ll_node));
   if (!node) {
-    s_fprintf_short(STDERR_FILENO, "Failed to allocate job_ll_node\n");
+    u_fprintf(u_stderr, "Failed to allocate job_ll_node\n");
     return;
   }
 
@@ -14,10 +14,33 @@
 #include "src/pennfat/fat.h"
 #include <string.h>
 #include "src/scheduler/fat_syscalls.h"
+#include "src/utils/stream.h"
+#include "src/utils/errno.h"
 #include "./jobs.h"
 
 jid_t job_id = 0;
 
+/**
+ * @brief Handle `cd` in the shell itself, since a child changing its working
+ * directory wouldn't change the shell's (which the commands it spawns inherit)
+ * @return Whether cmd was a cd command
+ */
+static bool handle_cd_command(struct parsed_command* cmd) {
+    if (cmd->num_commands != 1 || strcmp(cmd->commands[0][0], "cd") != 0) {
+        return false;
+    }
+    char** command = cmd->commands[0];
+    if (command[1] != NULL && command[2] != NULL) {
+        char* error_message = "usage: cd [directory]\n";
+        s_write(STDERR_FILENO, error_message, strlen(error_message));
+        return true;
+    }
+    if (s_chdir(command[1] == NULL ? "/" : command[1]) < 0) {
+        u_perror("cd");
+    }
+    return true;
+}
+
 static void* shell_loop(void* arg) {
     s_ignore_sigint(true);
     s_ignore_sigtstp(true);
@@ -36,9 +59,9 @@ static void* shell_loop(void* arg) {
                 job* job = find_job_by_pid(pid);
                 if (job != NULL) {
                     // Print completion message before removing/destroying
-                    s_fprintf_short(STDERR_FILENO, "[%lu] Done ", job->id);
-                    print_job_command(job); // Uses fprintf, prints command without newline
-                    s_fprintf_short(STDERR_FILENO, "\n"); // Add newline
+                    u_fprintf(u_stderr, "[%lu] Done ", job->id);
+                    print_job_command(job); // prints command without newline
+                    u_fprintf(u_stderr, "\n"); // Add newline
                     remove_job_by_pid(pid); // Removes job from list and destroys it
                 }
             }
@@ -71,7 +94,7 @@ static void* shell_loop(void* arg) {
             free(parsed_command);
             continue; // do nothing and try reading again
         }
-        bool is_jobs_command = handle_jobs_commands(parsed_command);
+        bool is_jobs_command = handle_jobs_commands(parsed_command) || handle_cd_command(parsed_command);
 
         if (is_jobs_command) {
             // jobs commands are handled by the shell, and not execve'd
@@ -95,7 +118,7 @@ static void* shell_loop(void* arg) {
             execute_job(job_ptr);
             // Add logging for background job start
             if (job_ptr->pid > 0) { // Ensure PID is valid before printing
-                s_fprintf_short(STDERR_FILENO, "[%lu] %d\n", job_ptr->id, job_ptr->pid);
+                u_fprintf(u_stderr, "[%lu] %d\n", job_ptr->id, job_ptr->pid);
             }
             //s_waitpid(-1, NULL, true);
             enqueue_job(job_ptr);
@@ -115,11 +138,36 @@ static void* shell_loop(void* arg) {
     return NULL;
 }
 
+#define RECLAIM_BLOCKS_PER_CALL 64
+#define RECLAIM_IDLE_TICKS 1
+
+/**
+ * @brief Frees the blocks of large deleted files in the background
+ * 
+ * Runs at low priority and frees at most RECLAIM_BLOCKS_PER_CALL blocks
+ * per syscall, so that rm of a huge file returns right away and the
+ * reclaimer can be preempted between batches. Sleeps while there is
+ * nothing to free.
+ * 
+ * @param arg 
+ * @return void* 
+ */
+static void* reclaimer_process(void* arg) {
+    s_reclaim_async(true);
+    while (true) {
+        if (s_reclaim(RECLAIM_BLOCKS_PER_CALL) <= 0) {
+            s_sleep(RECLAIM_IDLE_TICKS);
+        }
+    }
+
+    return NULL;
+}
+
 /**
  * @brief Spawns the shell process
  * 
  * This process is responsible for spawning the shell process
- * and waiting for it to exit.
+ * and the block reclaimer, and waiting for them to exit.
  * 
  * @param arg 
  * @return void* 
@@ -129,6 +177,9 @@ static void* init_process(void* arg) {
     pid_t pid = s_spawn(shell_loop, (char*[]){"shell", NULL}, STDIN_FILENO, STDOUT_FILENO, PRIORITY_HIGH);
     s_tcsetpid(pid);
 
+    // Spawn the block reclaimer after the shell so that the shell is still PID 2
+    s_spawn(reclaimer_process, (char*[]){"reclaimer", NULL}, STDIN_FILENO, STDOUT_FILENO, PRIORITY_LOW);
+
     // Consume any zombies
     int wstatus;
     pid_t result;
@@ -1,5 +1,6 @@
 #include "src/utils/errno.h"
 #include "src/scheduler/sys.h"
+#include "src/utils/stream.h"
 #include <string.h>
 char err_message[101]; // buffer for error message so we don't have to allocate memory
 
@@ -119,6 +120,8 @@ char* u_strerror(int errno) {
             strcpy(err_message, "Time failed"); break;
         case EK_WRITE_WRITE_FAILED:
             strcpy(err_message, "Write failed"); break;
+        case EK_WRITE_UNSHARE_FAILED:
+            strcpy(err_message, "Failed to copy shared blocks"); break;
 
         case EK_UNLINK_FILE_NOT_FOUND:
             strcpy(err_message, "Unlink: File not found"); break;
@@ -180,6 +183,236 @@ char* u_strerror(int errno) {
         case EK_GETMODE_FD_NOT_IN_USE:
             strcpy(err_message, "FD not in use"); break;
 
+        case EK_CLONE_FILE_NOT_FOUND:
+            strcpy(err_message, "Clone: File not found"); break;
+        case EK_CLONE_INVALID_FILENAME:
+            strcpy(err_message, "Invalid filename"); break;
+        case EK_CLONE_OPEN_FAILED:
+            strcpy(err_message, "Open failed"); break;
+        case EK_CLONE_TOO_MANY_REFERENCES:
+            strcpy(err_message, "Too many references to block"); break;
+        case EK_CLONE_TIME_FAILED:
+            strcpy(err_message, "Time failed"); break;
+        case EK_CLONE_WRITE_ROOT_DIR_ENTRY_FAILED:
+            strcpy(err_message, "Write root dir entry failed"); break;
+        case EK_CLONE_CLOSE_FAILED:
+            strcpy(err_message, "Close failed"); break;
+
+        case EK_COPY_RANGE_FD_OUT_OF_RANGE:
+            strcpy(err_message, "FD out of range"); break;
+        case EK_COPY_RANGE_FD_NOT_IN_TABLE:
+            strcpy(err_message, "FD not in table"); break;
+        case EK_COPY_RANGE_SPECIAL_FD:
+            strcpy(err_message, "Special FD"); break;
+        case EK_COPY_RANGE_WRONG_PERMISSIONS:
+            strcpy(err_message, "Wrong permissions"); break;
+        case EK_COPY_RANGE_OVERLAP:
+            strcpy(err_message, "Source and destination ranges overlap"); break;
+        case EK_COPY_RANGE_UNSHARE_FAILED:
+            strcpy(err_message, "Failed to copy shared blocks"); break;
+        case EK_COPY_RANGE_NO_EMPTY_BLOCKS:
+            strcpy(err_message, "No empty blocks"); break;
+        case EK_COPY_RANGE_GET_BLOCK_FAILED:
+            strcpy(err_message, "Get block failed"); break;
+        case EK_COPY_RANGE_WRITE_BLOCK_FAILED:
+            strcpy(err_message, "Write block failed"); break;
+        case EK_COPY_RANGE_MALLOC_FAILED:
+            strcpy(err_message, "Malloc failed"); break;
+        case EK_COPY_RANGE_TIME_FAILED:
+            strcpy(err_message, "Time failed"); break;
+        case EK_COPY_RANGE_WRITE_ROOT_DIR_ENTRY_FAILED:
+            strcpy(err_message, "Write root dir entry failed"); break;
+
+        case EK_SNAPSHOT_INVALID_NAME:
+            strcpy(err_message, "Invalid snapshot name"); break;
+        case EK_SNAPSHOT_EXISTS:
+            strcpy(err_message, "Snapshot already exists"); break;
+        case EK_SNAPSHOT_NOT_FOUND:
+            strcpy(err_message, "Snapshot not found"); break;
+        case EK_SNAPSHOT_TOO_MANY:
+            strcpy(err_message, "Too many snapshots"); break;
+        case EK_SNAPSHOT_FILES_OPEN:
+            strcpy(err_message, "Files are open"); break;
+        case EK_SNAPSHOT_MALLOC_FAILED:
+            strcpy(err_message, "Malloc failed"); break;
+        case EK_SNAPSHOT_SIDECAR_FAILED:
+            strcpy(err_message, "Failed to access snapshot file"); break;
+        case EK_SNAPSHOT_GET_BLOCK_FAILED:
+            strcpy(err_message, "Get block failed"); break;
+        case EK_SNAPSHOT_WRITE_BLOCK_FAILED:
+            strcpy(err_message, "Write block failed"); break;
+        case EK_SNAPSHOT_WRITE_FAILED:
+            strcpy(err_message, "Write failed"); break;
+
+        case EK_MMAP_FD_OUT_OF_RANGE:
+            strcpy(err_message, "File descriptor out of range"); break;
+        case EK_MMAP_FD_NOT_IN_TABLE:
+            strcpy(err_message, "File descriptor not in table"); break;
+        case EK_MMAP_SPECIAL_FD:
+            strcpy(err_message, "Cannot map special file descriptor"); break;
+        case EK_MMAP_BAD_PROT:
+            strcpy(err_message, "Invalid protection flags"); break;
+        case EK_MMAP_WRONG_PERMISSIONS:
+            strcpy(err_message, "Wrong permissions"); break;
+        case EK_MMAP_BAD_RANGE:
+            strcpy(err_message, "Range is outside the file"); break;
+        case EK_MMAP_TOO_MANY_MAPPINGS:
+            strcpy(err_message, "Too many mappings"); break;
+        case EK_MMAP_MALLOC_FAILED:
+            strcpy(err_message, "Malloc failed"); break;
+        case EK_MMAP_GET_BLOCK_FAILED:
+            strcpy(err_message, "Get block failed"); break;
+        case EK_MSYNC_NOT_MAPPED:
+            strcpy(err_message, "Address is not mapped"); break;
+        case EK_MSYNC_UNSHARE_FAILED:
+            strcpy(err_message, "Failed to unshare blocks"); break;
+        case EK_MSYNC_GET_BLOCK_FAILED:
+            strcpy(err_message, "Get block failed"); break;
+        case EK_MSYNC_WRITE_BLOCK_FAILED:
+            strcpy(err_message, "Write block failed"); break;
+        case EK_MSYNC_TIME_FAILED:
+            strcpy(err_message, "Time failed"); break;
+        case EK_MSYNC_WRITE_ROOT_DIR_ENTRY_FAILED:
+            strcpy(err_message, "Write root dir entry failed"); break;
+        case EK_MUNMAP_NOT_MAPPED:
+            strcpy(err_message, "Address is not mapped"); break;
+
+        case EK_FSSTATS_WRITE_FAILED:
+            strcpy(err_message, "Write failed"); break;
+
+        case EK_GETGENERATION_FD_OUT_OF_RANGE:
+            strcpy(err_message, "FD out of range"); break;
+        case EK_GETGENERATION_FD_NOT_IN_USE:
+            strcpy(err_message, "FD not in use"); break;
+
+        case EK_CLOSE_FD_NOT_IN_TABLE:
+            strcpy(err_message, "FD not in table"); break;
+        case EK_READ_GET_BLOCK_FAILED:
+            strcpy(err_message, "Get block failed"); break;
+        case EK_WRITE_UNPACK_FAILED:
+        case EK_COPY_RANGE_UNPACK_FAILED:
+        case EK_MMAP_UNPACK_FAILED:
+        case EK_CLONE_UNPACK_FAILED:
+            strcpy(err_message, "Failed to move packed file to its own block"); break;
+        case EK_COMPACT_ROOT_DIR_MALLOC_FAILED:
+            strcpy(err_message, "Malloc failed"); break;
+        case EK_COMPACT_ROOT_DIR_GET_BLOCK_FAILED:
+            strcpy(err_message, "Get block failed"); break;
+        case EK_COMPACT_ROOT_DIR_WRITE_BLOCK_FAILED:
+            strcpy(err_message, "Write block failed"); break;
+        case EK_COMPACT_ROOT_DIR_NO_SPACE:
+            strcpy(err_message, "No space left on the filesystem"); break;
+
+        case EK_READ_ONLY_FS:
+            strcpy(err_message, "Filesystem is mounted read-only"); break;
+        case EK_STAT_FILE_NOT_FOUND:
+            strcpy(err_message, "File not found"); break;
+        case EK_STAT_FIND_FILE_IN_ROOT_DIR_FAILED:
+            strcpy(err_message, "Find file in root dir failed"); break;
+
+        case EK_MV_CROSS_VOLUME:
+            strcpy(err_message, "Files are on different volumes"); break;
+        case EK_CLONE_CROSS_VOLUME:
+            strcpy(err_message, "Files are on different volumes"); break;
+        case EK_COPY_RANGE_CROSS_VOLUME:
+            strcpy(err_message, "Files are on different volumes"); break;
+        case EK_COPY_RANGE_OFFSET_OVERFLOW:
+            strcpy(err_message, "Offset overflow"); break;
+        case EK_UNKNOWN_VOLUME:
+            strcpy(err_message, "No volume is mounted with that name"); break;
+
+        case EK_OPEN_DIRECT_UNSUPPORTED:
+            strcpy(err_message, "Direct I/O is not supported on this filesystem"); break;
+
+        case EK_OPEN_NOT_A_LOG:
+            strcpy(err_message, "File is not a log"); break;
+        case EK_WRITE_LOG_FILE:
+            strcpy(err_message, "Log files can only be appended to"); break;
+        case EK_COPY_RANGE_LOG_FILE:
+            strcpy(err_message, "Log files can only be appended to"); break;
+        case EK_MMAP_LOG_FILE:
+            strcpy(err_message, "Log files can only be appended to"); break;
+        case EK_LOG_APPEND_FD_OUT_OF_RANGE:
+            strcpy(err_message, "FD out of range"); break;
+        case EK_LOG_APPEND_FD_NOT_IN_TABLE:
+            strcpy(err_message, "FD not in table"); break;
+        case EK_LOG_APPEND_NOT_A_LOG:
+            strcpy(err_message, "File is not a log"); break;
+        case EK_LOG_APPEND_BAD_LENGTH:
+            strcpy(err_message, "Invalid record length"); break;
+        case EK_LOG_APPEND_NO_SPACE:
+            strcpy(err_message, "No space left for the record"); break;
+        case EK_LOG_APPEND_MALLOC_FAILED:
+            strcpy(err_message, "Malloc failed"); break;
+        case EK_LOG_APPEND_WRONG_PERMISSIONS:
+            strcpy(err_message, "Wrong permissions"); break;
+        case EK_LOG_READ_FD_OUT_OF_RANGE:
+            strcpy(err_message, "FD out of range"); break;
+        case EK_LOG_READ_FD_NOT_IN_TABLE:
+            strcpy(err_message, "FD not in table"); break;
+        case EK_LOG_READ_NOT_A_LOG:
+            strcpy(err_message, "File is not a log"); break;
+        case EK_LOG_READ_NO_SUCH_RECORD:
+            strcpy(err_message, "No such record"); break;
+        case EK_LOG_READ_CORRUPT:
+            strcpy(err_message, "Log file is corrupt"); break;
+        case EK_LOG_READ_MALLOC_FAILED:
+            strcpy(err_message, "Malloc failed"); break;
+        case EK_BMAP_FD_OUT_OF_RANGE:
+            strcpy(err_message, "FD out of range"); break;
+        case EK_BMAP_FD_NOT_IN_TABLE:
+            strcpy(err_message, "FD not in table"); break;
+        case EK_AIO_SPECIAL_FD:
+            strcpy(err_message, "Asynchronous I/O only works on files"); break;
+        case EK_AIO_BAD_LENGTH:
+            strcpy(err_message, "Invalid length"); break;
+        case EK_AIO_WRONG_PERMISSIONS:
+            strcpy(err_message, "Wrong permissions"); break;
+        case EK_AIO_TOO_MANY_REQUESTS:
+            strcpy(err_message, "Too many asynchronous I/O requests"); break;
+        case EK_AIO_NO_SUCH_REQUEST:
+            strcpy(err_message, "No such asynchronous I/O request"); break;
+        case EK_OPEN_IS_DIRECTORY:
+            strcpy(err_message, "Is a directory"); break;
+        case EK_UNLINK_IS_DIRECTORY:
+            strcpy(err_message, "Is a directory"); break;
+        case EK_MV_INTO_ITSELF:
+            strcpy(err_message, "Cannot move a directory into itself"); break;
+        case EK_MV_DEST_IS_DIRECTORY:
+            strcpy(err_message, "Destination is a directory"); break;
+        case EK_MV_FIND_FILE_FAILED:
+            strcpy(err_message, "Failed to look up file"); break;
+        case EK_MKDIR_INVALID_FILENAME:
+            strcpy(err_message, "Invalid directory name"); break;
+        case EK_MKDIR_PARENT_NOT_FOUND:
+            strcpy(err_message, "No such directory"); break;
+        case EK_MKDIR_EXISTS:
+            strcpy(err_message, "File exists"); break;
+        case EK_MKDIR_NO_SPACE:
+            strcpy(err_message, "No space left on the filesystem"); break;
+        case EK_MKDIR_FIND_FILE_FAILED:
+            strcpy(err_message, "Failed to look up directory"); break;
+        case EK_MKDIR_WRITE_BLOCK_FAILED:
+            strcpy(err_message, "Failed to write block"); break;
+        case EK_MKDIR_WRITE_DIR_ENTRY_FAILED:
+            strcpy(err_message, "Failed to write directory entry"); break;
+        case EK_MKDIR_TIME_FAILED:
+            strcpy(err_message, "Failed to get time"); break;
+        case EK_RMDIR_INVALID_FILENAME:
+            strcpy(err_message, "Invalid directory name"); break;
+        case EK_RMDIR_NOT_FOUND:
+            strcpy(err_message, "No such directory"); break;
+        case EK_RMDIR_NOT_A_DIRECTORY:
+            strcpy(err_message, "Not a directory"); break;
+        case EK_RMDIR_NOT_EMPTY:
+            strcpy(err_message, "Directory not empty"); break;
+        case EK_RMDIR_FIND_FILE_FAILED:
+            strcpy(err_message, "Failed to look up directory"); break;
+        case EK_RMDIR_GET_BLOCK_FAILED:
+            strcpy(err_message, "Failed to read block"); break;
+        case EK_RMDIR_WRITE_DIR_ENTRY_FAILED:
+            strcpy(err_message, "Failed to write directory entry"); break;
+
         // fs syscall errors
         case E_UNKNOWN_FD:
             strcpy(err_message, "Unknown FD"); break;
@@ -189,8 +422,26 @@ char* u_strerror(int errno) {
             strcpy(err_message, "Read: Unknown FD"); break;
         case E_STRING_FORMAT_FAILED:
             strcpy(err_message, "String format failed"); break;
+        case E_MOUNT_FAILED:
+            strcpy(err_message, "Mount failed"); break;
+        case E_UNMOUNT_FAILED:
+            strcpy(err_message, "Unmount failed"); break;
+        case E_STREAM_WRONG_MODE:
+            strcpy(err_message, "Stream not opened for that"); break;
+        case E_STREAM_MALLOC_FAILED:
+            strcpy(err_message, "Could not allocate stream"); break;
+        case E_STREAM_BAD_BUFFERING:
+            strcpy(err_message, "Invalid stream buffering"); break;
+        case E_STREAM_SHORT_WRITE:
+            strcpy(err_message, "Stream could not be written out"); break;
         case E_STRING_TOO_LONG_FOR_PRINTF_BUF:
             strcpy(err_message, "String too long for printf buf"); break;
+        case E_STALE_FD:
+            strcpy(err_message, "FD refers to a file that has since been closed"); break;
+        case E_NOT_A_DIRECTORY:
+            strcpy(err_message, "Not a directory"); break;
+        case E_PATH_TOO_LONG:
+            strcpy(err_message, "Path too long"); break;
 
         default:
             strcpy(err_message, "Unknown error"); break;
@@ -204,11 +455,7 @@ void u_perror(const char *s) {
         return;
     }
 
-    s_write(STDERR_FILENO, s, strlen(s));
-    s_write(STDERR_FILENO, ": ", 2);
-    // NOTE: there is a risk that if the above S_WRITE fails, the error message will be for the wrong error.
-    // This is ok because we anticipate that this should never happen.
     char* error_message = u_strerror(err_no); // TODO: replace with actual error code once we store it in the PCB
-    s_write(STDERR_FILENO, error_message, strlen(error_message));
-    s_write(STDERR_FILENO, "\n", 1);
+    // the whole line reaches s_write at once, so it isn't interleaved with other output
+    u_fprintf(u_stderr, "%s: %s\n", s, error_message);
 }
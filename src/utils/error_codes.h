@@ -69,6 +69,7 @@
 #define EK_WRITE_NO_EMPTY_BLOCKS -52
 #define EK_WRITE_TIME_FAILED -53
 #define EK_WRITE_WRITE_FAILED -54
+#define EK_WRITE_UNSHARE_FAILED -82
 
 #define EK_UNLINK_FILE_NOT_FOUND -55
 #define EK_UNLINK_FIND_FILE_IN_ROOT_DIR_FAILED -56
@@ -103,12 +104,148 @@
 #define EK_GETMODE_FD_OUT_OF_RANGE -80
 #define EK_GETMODE_FD_NOT_IN_USE -81
 
+#define EK_CLONE_FILE_NOT_FOUND -83
+#define EK_CLONE_INVALID_FILENAME -84
+#define EK_CLONE_OPEN_FAILED -85
+#define EK_CLONE_TOO_MANY_REFERENCES -86
+#define EK_CLONE_TIME_FAILED -87
+#define EK_CLONE_WRITE_ROOT_DIR_ENTRY_FAILED -88
+#define EK_CLONE_CLOSE_FAILED -89
+
+#define EK_COPY_RANGE_FD_OUT_OF_RANGE -90
+#define EK_COPY_RANGE_FD_NOT_IN_TABLE -91
+#define EK_COPY_RANGE_SPECIAL_FD -92
+#define EK_COPY_RANGE_WRONG_PERMISSIONS -93
+#define EK_COPY_RANGE_OVERLAP -94
+#define EK_COPY_RANGE_UNSHARE_FAILED -95
+#define EK_COPY_RANGE_NO_EMPTY_BLOCKS -96
+#define EK_COPY_RANGE_GET_BLOCK_FAILED -97
+#define EK_COPY_RANGE_WRITE_BLOCK_FAILED -98
+#define EK_COPY_RANGE_MALLOC_FAILED -99
+#define EK_COPY_RANGE_TIME_FAILED -107
+#define EK_COPY_RANGE_WRITE_ROOT_DIR_ENTRY_FAILED -108
+
+#define EK_SNAPSHOT_INVALID_NAME -109
+#define EK_SNAPSHOT_EXISTS -110
+#define EK_SNAPSHOT_NOT_FOUND -111
+#define EK_SNAPSHOT_TOO_MANY -112
+#define EK_SNAPSHOT_FILES_OPEN -113
+#define EK_SNAPSHOT_MALLOC_FAILED -114
+#define EK_SNAPSHOT_SIDECAR_FAILED -115
+#define EK_SNAPSHOT_GET_BLOCK_FAILED -116
+#define EK_SNAPSHOT_WRITE_BLOCK_FAILED -117
+#define EK_SNAPSHOT_WRITE_FAILED -118
+
+#define EK_MMAP_FD_OUT_OF_RANGE -119
+#define EK_MMAP_FD_NOT_IN_TABLE -120
+#define EK_MMAP_SPECIAL_FD -121
+#define EK_MMAP_BAD_PROT -122
+#define EK_MMAP_WRONG_PERMISSIONS -123
+#define EK_MMAP_BAD_RANGE -124
+#define EK_MMAP_TOO_MANY_MAPPINGS -125
+#define EK_MMAP_MALLOC_FAILED -126
+#define EK_MMAP_GET_BLOCK_FAILED -127
+
+#define EK_MSYNC_NOT_MAPPED -128
+#define EK_MSYNC_UNSHARE_FAILED -129
+#define EK_MSYNC_GET_BLOCK_FAILED -130
+#define EK_MSYNC_WRITE_BLOCK_FAILED -131
+#define EK_MSYNC_TIME_FAILED -132
+#define EK_MSYNC_WRITE_ROOT_DIR_ENTRY_FAILED -133
+
+#define EK_MUNMAP_NOT_MAPPED -134
+
+#define EK_FSSTATS_WRITE_FAILED -135
+
+#define EK_GETGENERATION_FD_OUT_OF_RANGE -136
+#define EK_GETGENERATION_FD_NOT_IN_USE -137
+
+#define EK_CLOSE_FD_NOT_IN_TABLE -139
+
+#define EK_READ_GET_BLOCK_FAILED -140
+#define EK_WRITE_UNPACK_FAILED -141
+#define EK_COPY_RANGE_UNPACK_FAILED -142
+#define EK_MMAP_UNPACK_FAILED -143
+#define EK_CLONE_UNPACK_FAILED -144
+
+#define EK_COMPACT_ROOT_DIR_MALLOC_FAILED -145
+#define EK_COMPACT_ROOT_DIR_GET_BLOCK_FAILED -146
+#define EK_COMPACT_ROOT_DIR_WRITE_BLOCK_FAILED -147
+
+#define EK_READ_ONLY_FS -148
+#define EK_STAT_FILE_NOT_FOUND -149
+#define EK_STAT_FIND_FILE_IN_ROOT_DIR_FAILED -150
+
+#define EK_MV_CROSS_VOLUME -151
+#define EK_CLONE_CROSS_VOLUME -152
+#define EK_COPY_RANGE_CROSS_VOLUME -153
+#define EK_UNKNOWN_VOLUME -154
+
+#define EK_OPEN_DIRECT_UNSUPPORTED -157
+
+#define EK_OPEN_NOT_A_LOG -162
+#define EK_WRITE_LOG_FILE -163
+#define EK_COPY_RANGE_LOG_FILE -164
+#define EK_MMAP_LOG_FILE -165
+#define EK_LOG_APPEND_FD_OUT_OF_RANGE -166
+#define EK_LOG_APPEND_FD_NOT_IN_TABLE -167
+#define EK_LOG_APPEND_NOT_A_LOG -168
+#define EK_LOG_APPEND_BAD_LENGTH -169
+#define EK_LOG_APPEND_NO_SPACE -170
+#define EK_LOG_APPEND_MALLOC_FAILED -171
+#define EK_LOG_APPEND_WRONG_PERMISSIONS -172
+#define EK_LOG_READ_FD_OUT_OF_RANGE -173
+#define EK_LOG_READ_FD_NOT_IN_TABLE -174
+#define EK_LOG_READ_NOT_A_LOG -175
+#define EK_LOG_READ_NO_SUCH_RECORD -176
+#define EK_LOG_READ_CORRUPT -177
+#define EK_LOG_READ_MALLOC_FAILED -178
+#define EK_BMAP_FD_OUT_OF_RANGE -179
+#define EK_BMAP_FD_NOT_IN_TABLE -180
+#define EK_AIO_SPECIAL_FD -181
+#define EK_AIO_BAD_LENGTH -182
+#define EK_AIO_WRONG_PERMISSIONS -183
+#define EK_AIO_TOO_MANY_REQUESTS -184
+#define EK_AIO_NO_SUCH_REQUEST -185
+#define EK_OPEN_IS_DIRECTORY -186
+#define EK_UNLINK_IS_DIRECTORY -187
+#define EK_MV_INTO_ITSELF -188
+#define EK_MV_DEST_IS_DIRECTORY -189
+#define EK_MV_FIND_FILE_FAILED -190
+#define EK_MKDIR_INVALID_FILENAME -191
+#define EK_MKDIR_PARENT_NOT_FOUND -192
+#define EK_MKDIR_EXISTS -193
+#define EK_MKDIR_NO_SPACE -194
+#define EK_MKDIR_FIND_FILE_FAILED -195
+#define EK_MKDIR_WRITE_BLOCK_FAILED -196
+#define EK_MKDIR_WRITE_DIR_ENTRY_FAILED -197
+#define EK_MKDIR_TIME_FAILED -198
+#define EK_RMDIR_INVALID_FILENAME -199
+#define EK_RMDIR_NOT_FOUND -200
+#define EK_RMDIR_NOT_A_DIRECTORY -201
+#define EK_RMDIR_NOT_EMPTY -202
+#define EK_RMDIR_FIND_FILE_FAILED -203
+#define EK_RMDIR_GET_BLOCK_FAILED -204
+#define EK_RMDIR_WRITE_DIR_ENTRY_FAILED -205
+
+#define EK_COMPACT_ROOT_DIR_NO_SPACE -208
+#define EK_COPY_RANGE_OFFSET_OVERFLOW -209
+
 // fs syscall errors
 #define E_UNKNOWN_FD -103
 #define E_PROCESS_FILE_TABLE_FULL -100
 #define E_READ_UNKNOWN_FD -101
 #define E_STRING_FORMAT_FAILED -104
 #define E_STRING_TOO_LONG_FOR_PRINTF_BUF -105
+#define E_STALE_FD -138
+#define E_MOUNT_FAILED -155
+#define E_UNMOUNT_FAILED -156
+#define E_STREAM_WRONG_MODE -158
+#define E_STREAM_MALLOC_FAILED -159
+#define E_STREAM_BAD_BUFFERING -160
+#define E_STREAM_SHORT_WRITE -161
+#define E_NOT_A_DIRECTORY -206
+#define E_PATH_TOO_LONG -207
 
 
 #endif // PENNOS_ERROR_CODES_H
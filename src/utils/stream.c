@@ -0,0 +1,293 @@
+#include "src/utils/stream.h"
+#include "src/utils/error_codes.h"
+#include "src/scheduler/sys.h"
+#include "src/scheduler/fat_syscalls.h"
+#include <stdarg.h>
+#include <stdio.h> // for vsnprintf
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+_Thread_local u_stream u_stdin_stream = {.fd = STDIN_FILENO, .mode = F_READ, .buffering = U_AUTO_BUFFERED, .size = U_BUFSIZ};
+_Thread_local u_stream u_stdout_stream = {.fd = STDOUT_FILENO, .mode = F_WRITE, .buffering = U_AUTO_BUFFERED, .size = U_BUFSIZ};
+_Thread_local u_stream u_stderr_stream = {.fd = STDERR_FILENO, .mode = F_WRITE, .buffering = U_AUTO_BUFFERED, .size = U_BUFSIZ};
+
+// streams opened by u_fopen in this process, most recent first
+static _Thread_local u_stream* open_streams = NULL;
+
+u_stream* u_fopen(const char* fname, int mode) {
+    if (mode != F_READ && mode != F_WRITE && mode != F_APPEND) {
+        s_set_errno(E_STREAM_WRONG_MODE);
+        return NULL;
+    }
+    u_stream* stream = (u_stream*)malloc(sizeof(u_stream));
+    if (stream == NULL) {
+        s_set_errno(E_STREAM_MALLOC_FAILED);
+        return NULL;
+    }
+    int fd = s_open(fname, mode);
+    if (fd < 0) {
+        free(stream);
+        return NULL;
+    }
+    *stream = (u_stream){
+        .fd = fd,
+        .mode = mode,
+        .buffering = U_FULLY_BUFFERED,
+        .buf = NULL,
+        .size = U_BUFSIZ,
+        .len = 0,
+        .pos = 0,
+        .owns_fd = true,
+        .eof = false,
+        .next = open_streams};
+    open_streams = stream;
+    return stream;
+}
+
+int u_setvbuf(u_stream* stream, int buffering, size_t size) {
+    if (stream->buf != NULL || buffering < U_UNBUFFERED || buffering > U_AUTO_BUFFERED) {
+        s_set_errno(E_STREAM_BAD_BUFFERING);
+        return -1;
+    }
+    stream->buffering = buffering;
+    stream->size = size == 0 ? U_BUFSIZ : size;
+    return 0;
+}
+
+/**
+ * Allocate the buffer of a stream on its first use, settling U_AUTO_BUFFERED on the way.
+ * Returns false (with errno set) if it couldn't be allocated
+ */
+static bool setup_buffer(u_stream* stream) {
+    if (stream->buf != NULL) {
+        return true;
+    }
+    if (stream->buffering == U_AUTO_BUFFERED) {
+        stream->buffering = s_isatty(stream->fd) == 1 ? U_LINE_BUFFERED : U_FULLY_BUFFERED;
+    }
+    stream->buf = (char*)malloc(stream->size);
+    if (stream->buf == NULL) {
+        s_set_errno(E_STREAM_MALLOC_FAILED);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * s_write all n bytes of buf, however many calls it takes. Returns 0 on success, -1 on error
+ */
+static int write_all(int fd, const char* buf, size_t n) {
+    while (n > 0) {
+        int bytes_written = s_write(fd, buf, n);
+        if (bytes_written < 0) {
+            return -1;
+        }
+        if (bytes_written == 0) {
+            s_set_errno(E_STREAM_SHORT_WRITE); // e.g., the filesystem is full
+            return -1;
+        }
+        buf += bytes_written;
+        n -= bytes_written;
+    }
+    return 0;
+}
+
+int u_fflush(u_stream* stream) {
+    if (stream->mode == F_READ || stream->len == 0) {
+        return 0;
+    }
+    // the buffer is emptied even on error, so a failing fd doesn't make every later write fail too
+    int status = write_all(stream->fd, stream->buf, stream->len);
+    stream->len = 0;
+    return status;
+}
+
+int u_fwrite(const char* buf, int n, u_stream* stream) {
+    if (stream->mode == F_READ) {
+        s_set_errno(E_STREAM_WRONG_MODE);
+        return -1;
+    }
+    if (n <= 0) {
+        return 0;
+    }
+    if (!setup_buffer(stream)) {
+        return -1;
+    }
+    if (stream->buffering == U_UNBUFFERED) {
+        return write_all(stream->fd, buf, n) == 0 ? n : -1;
+    }
+
+    // make room, and don't bother copying what wouldn't fit anyway
+    if (stream->len + n > stream->size) {
+        if (u_fflush(stream) != 0) {
+            return -1;
+        }
+        if ((size_t)n >= stream->size) {
+            return write_all(stream->fd, buf, n) == 0 ? n : -1;
+        }
+    }
+    memcpy(stream->buf + stream->len, buf, n);
+    stream->len += n;
+    if (stream->buffering == U_LINE_BUFFERED && memchr(buf, '\n', n) != NULL) {
+        if (u_fflush(stream) != 0) {
+            return -1;
+        }
+    }
+    return n;
+}
+
+int u_fputs(const char* str, u_stream* stream) {
+    return u_fwrite(str, strlen(str), stream);
+}
+
+int u_fprintf(u_stream* stream, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if (len < 0) {
+        s_set_errno(E_STRING_FORMAT_FAILED);
+        return -1;
+    }
+
+    // format straight into the stream's buffer if it fits, otherwise somewhere big enough
+    if (stream->mode != F_READ && setup_buffer(stream) && stream->buffering != U_UNBUFFERED &&
+        stream->len + len < stream->size) {
+        va_start(args, format);
+        vsnprintf(stream->buf + stream->len, len + 1, format, args);
+        va_end(args);
+        char* formatted = stream->buf + stream->len;
+        stream->len += len;
+        if (stream->buffering == U_LINE_BUFFERED && memchr(formatted, '\n', len) != NULL) {
+            if (u_fflush(stream) != 0) {
+                return -1;
+            }
+        }
+        return len;
+    }
+
+    char* formatted = (char*)malloc(len + 1);
+    if (formatted == NULL) {
+        s_set_errno(E_STREAM_MALLOC_FAILED);
+        return -1;
+    }
+    va_start(args, format);
+    vsnprintf(formatted, len + 1, format, args);
+    va_end(args);
+    int status = u_fwrite(formatted, len, stream);
+    free(formatted);
+    return status;
+}
+
+/**
+ * Read more of the file into the (empty) buffer of a stream. Returns the number of bytes
+ * read, 0 at the end of the file, or -1 on error
+ */
+static int fill_buffer(u_stream* stream) {
+    size_t capacity = stream->buffering == U_UNBUFFERED ? 1 : stream->size;
+    int bytes_read = s_read(stream->fd, capacity, stream->buf);
+    if (bytes_read < 0) {
+        return -1;
+    }
+    stream->pos = 0;
+    stream->len = bytes_read;
+    stream->eof = bytes_read == 0;
+    return bytes_read;
+}
+
+int u_fread(char* buf, int n, u_stream* stream) {
+    if (stream->mode != F_READ) {
+        s_set_errno(E_STREAM_WRONG_MODE);
+        return -1;
+    }
+    if (!setup_buffer(stream)) {
+        return -1;
+    }
+
+    int n_copied = 0;
+    while (n_copied < n) {
+        if (stream->pos == stream->len) {
+            // big reads go straight into the caller's buffer
+            if ((size_t)(n - n_copied) >= stream->size && stream->buffering != U_UNBUFFERED) {
+                int bytes_read = s_read(stream->fd, n - n_copied, buf + n_copied);
+                if (bytes_read < 0) {
+                    return n_copied > 0 ? n_copied : -1;
+                }
+                stream->eof = bytes_read == 0;
+                return n_copied + bytes_read;
+            }
+            int bytes_read = fill_buffer(stream);
+            if (bytes_read <= 0) {
+                return n_copied > 0 || bytes_read == 0 ? n_copied : -1;
+            }
+        }
+        size_t n_to_copy = stream->len - stream->pos;
+        if (n_to_copy > (size_t)(n - n_copied)) {
+            n_to_copy = n - n_copied;
+        }
+        memcpy(buf + n_copied, stream->buf + stream->pos, n_to_copy);
+        stream->pos += n_to_copy;
+        n_copied += n_to_copy;
+    }
+    return n_copied;
+}
+
+char* u_fgets(char* buf, int size, u_stream* stream) {
+    if (stream->mode != F_READ) {
+        s_set_errno(E_STREAM_WRONG_MODE);
+        return NULL;
+    }
+    if (size <= 0 || !setup_buffer(stream)) {
+        return NULL;
+    }
+
+    int n_copied = 0;
+    while (n_copied < size - 1) {
+        if (stream->pos == stream->len && fill_buffer(stream) <= 0) {
+            break;
+        }
+        char c = stream->buf[stream->pos++];
+        buf[n_copied++] = c;
+        if (c == '\n') {
+            break;
+        }
+    }
+    buf[n_copied] = '\0';
+    return n_copied > 0 ? buf : NULL;
+}
+
+int u_fclose(u_stream* stream) {
+    int status = u_fflush(stream);
+    if (stream->owns_fd && s_close(stream->fd) != 0) {
+        status = -1;
+    }
+    for (u_stream** link = &open_streams; *link != NULL; link = &(*link)->next) {
+        if (*link == stream) {
+            *link = stream->next;
+            break;
+        }
+    }
+    free(stream->buf);
+    free(stream);
+    return status;
+}
+
+void u_streams_exit(void) {
+    // best effort: there is no one left to report a failed flush to
+    while (open_streams != NULL) {
+        u_stream* stream = open_streams;
+        open_streams = stream->next;
+        u_fflush(stream);
+        free(stream->buf);
+        free(stream);
+    }
+    u_stream* standard_streams[] = {u_stdin, u_stdout, u_stderr};
+    for (int i = 0; i < 3; i++) {
+        u_fflush(standard_streams[i]);
+        free(standard_streams[i]->buf);
+        standard_streams[i]->buf = NULL;
+        standard_streams[i]->len = 0;
+        standard_streams[i]->pos = 0;
+    }
+}
@@ -0,0 +1,124 @@
+#ifndef PENNOS_STREAM_H
+#define PENNOS_STREAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Buffered streams on top of s_open, s_read and s_write, like stdio's FILE.
+ *
+ * Every s_write goes through k_lseek, k_setmode, k_write and k_setmode again, so a
+ * command that prints a line a few words at a time pays for that several times over.
+ * Writes to a stream collect in its buffer and reach s_write once per line (or once per
+ * full buffer), and reads fill the buffer with one s_read and are served from it.
+ *
+ * Streams belong to the process (thread) that made them: u_stdin, u_stdout and u_stderr
+ * are separate for every process, and s_exit flushes and frees all of the calling
+ * process's streams. Output still buffered when a process is killed is lost.
+ *
+ * Usage example:
+ * @code
+ * u_fprintf(u_stdout, "[%d] %s\n", id, name); // one s_write, at the newline
+ * u_stream *log = u_fopen("log", F_APPEND);
+ * u_fputs("started\n", log);
+ * u_fclose(log);
+ * @endcode
+ */
+
+#define U_BUFSIZ 4096 // default buffer size
+
+// how a stream buffers (see u_setvbuf)
+#define U_UNBUFFERED 0     // every write goes straight to s_write, and reads take a byte at a time
+#define U_LINE_BUFFERED 1  // writes are flushed at every newline, as well as when the buffer is full
+#define U_FULLY_BUFFERED 2 // writes are flushed when the buffer is full, and by u_fflush, u_fclose and s_exit
+#define U_AUTO_BUFFERED 3  // line buffered when the fd is the terminal, fully buffered otherwise. Decided on first use
+
+typedef struct u_stream_st {
+    int fd;          // process-level fd
+    int mode;        // F_READ, F_WRITE or F_APPEND. F_READ streams can only be read, the others only written
+    int buffering;   // U_* buffering
+    char *buf;       // allocated on first use
+    size_t size;     // capacity of buf
+    size_t len;      // bytes in buf: waiting to be written, or read from the fd
+    size_t pos;      // next byte of buf to hand out when reading
+    bool owns_fd;    // whether u_fclose closes fd (streams from u_fopen, but not the standard streams)
+    bool eof;        // a read reached the end of the file
+    struct u_stream_st *next; // next stream opened by u_fopen in the same process
+} u_stream;
+
+extern _Thread_local u_stream u_stdin_stream;
+extern _Thread_local u_stream u_stdout_stream;
+extern _Thread_local u_stream u_stderr_stream;
+
+#define u_stdin (&u_stdin_stream)
+#define u_stdout (&u_stdout_stream)
+#define u_stderr (&u_stderr_stream)
+
+/**
+ * @brief Open a file as a stream. It is U_FULLY_BUFFERED with U_BUFSIZ bytes of buffer
+ * until changed with u_setvbuf
+ * @param fname file name
+ * @param mode mode to open the file with (i.e., F_READ, F_WRITE, F_APPEND)
+ * @return u_stream* the stream, or NULL on error (with errno set)
+ */
+u_stream *u_fopen(const char *fname, int mode);
+
+/**
+ * @brief Change how a stream buffers. Only allowed before the first read or write
+ * @param stream stream to change
+ * @param buffering U_UNBUFFERED, U_LINE_BUFFERED, U_FULLY_BUFFERED or U_AUTO_BUFFERED
+ * @param size bytes of buffer, 0 for U_BUFSIZ
+ * @return int 0 on success, or -1 on error (with errno set)
+ */
+int u_setvbuf(u_stream *stream, int buffering, size_t size);
+
+/**
+ * @brief Write n bytes to a stream. Writes at least as big as the buffer skip it
+ * @return int n on success, or -1 on error (with errno set)
+ */
+int u_fwrite(const char *buf, int n, u_stream *stream);
+
+/**
+ * @brief Write a string (without its terminating null byte) to a stream
+ * @return int number of bytes written, or -1 on error (with errno set)
+ */
+int u_fputs(const char *str, u_stream *stream);
+
+/**
+ * @brief Write formatted output to a stream. Unlike s_fprintf_short, the output can be of any length
+ * @return int number of bytes written, or -1 on error (with errno set)
+ */
+int u_fprintf(u_stream *stream, const char *format, ...);
+
+/**
+ * @brief Read up to n bytes from a stream
+ * @return int number of bytes read (0 at the end of the file), or -1 on error (with errno set)
+ */
+int u_fread(char *buf, int n, u_stream *stream);
+
+/**
+ * @brief Read a line from a stream, including its newline, into buf. Reads at most size - 1
+ * bytes, and always null terminates buf
+ * @return char* buf, or NULL at the end of the file with nothing read or on error (with errno set)
+ */
+char *u_fgets(char *buf, int size, u_stream *stream);
+
+/**
+ * @brief Write everything buffered in a stream. Does nothing to streams that are read
+ * @return int 0 on success, or -1 on error (with errno set)
+ */
+int u_fflush(u_stream *stream);
+
+/**
+ * @brief Flush a stream opened by u_fopen, close its file and free it
+ * @return int 0 on success, or -1 if the flush or close failed (with errno set). The stream is freed either way
+ */
+int u_fclose(u_stream *stream);
+
+/**
+ * @brief Flush every stream of the calling process and free their buffers. Called by s_exit;
+ * the streams of a process that has exited can't be used anymore
+ */
+void u_streams_exit(void);
+
+#endif // PENNOS_STREAM_H
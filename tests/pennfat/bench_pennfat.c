@@ -0,0 +1,644 @@
+#include "src/pennfat/fat.h"
+#include "src/pennfat/mkfs.h"
+#include "src/utils/error_codes.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+// Microbenchmarks for the pennfat kernel functions. Each scenario runs on a freshly
+// made image and reports throughput and per-operation latency percentiles as JSON,
+// so runs before and after a change to fat.c can be diffed directly.
+//
+// usage: bench_pennfat [-q] [-o FILE]
+//   -q       quick run (1/8th of the work), for smoke testing
+//   -o FILE  write the JSON report to FILE instead of stdout
+
+#define BENCH_FS_NAME "benchfs999"
+#define IO_SIZE 4096
+#define MAX_SEQ_FILE_SIZE (8 * 1024 * 1024)
+#define RANDOM_READ_FILE_SIZE (4 * 1024 * 1024)
+#define LOG_RECORD_SIZE 128
+#define SMALL_FILE_SIZE 100
+#define READ_ONLY_MAX_THREADS 8
+#define FAT_MAPPING_ROUNDS 16
+
+typedef struct bench_result_st
+{
+    const char *name;
+    uint16_t block_size;
+    uint64_t ops;
+    uint64_t bytes; // 0 for scenarios where throughput in bytes is meaningless
+    uint64_t total_ns;
+    uint64_t *latencies_ns; // one per op
+    uint64_t faults_at_start; // page faults of the process when the result was started
+} bench_result;
+
+FILE *out = NULL;
+bool first_result = true;
+int scale = 1; // divisor applied to the amount of work in quick mode
+
+uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint64_t page_faults(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_minflt + usage.ru_majflt;
+}
+
+int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+uint64_t percentile(const uint64_t *sorted, uint64_t n, double p)
+{
+    if (n == 0)
+    {
+        return 0;
+    }
+    uint64_t idx = (uint64_t)(p * (n - 1) + 0.5);
+    return sorted[idx];
+}
+
+bench_result new_result(const char *name, uint64_t max_ops)
+{
+    bench_result result = {.name = name, .block_size = 0, .ops = 0, .bytes = 0, .total_ns = 0, .latencies_ns = NULL, .faults_at_start = 0};
+    result.latencies_ns = (uint64_t *)malloc(max_ops * sizeof(uint64_t));
+    if (result.latencies_ns == NULL)
+    {
+        fprintf(stderr, "bench: malloc failed\n");
+        exit(1);
+    }
+    result.faults_at_start = page_faults();
+    return result;
+}
+
+void record(bench_result *result, uint64_t start_ns, uint64_t n_bytes)
+{
+    uint64_t elapsed = now_ns() - start_ns;
+    result->latencies_ns[result->ops] = elapsed;
+    result->ops += 1;
+    result->bytes += n_bytes;
+    result->total_ns += elapsed;
+}
+
+void report(bench_result *result)
+{
+    uint64_t n_faults = page_faults() - result->faults_at_start;
+    qsort(result->latencies_ns, result->ops, sizeof(uint64_t), compare_u64);
+    double seconds = result->total_ns / 1e9;
+    fprintf(out, "%s\n    {\"name\": \"%s\", \"block_size\": %u, \"ops\": %llu, \"seconds\": %.6f, ",
+            first_result ? "" : ",", result->name, result->block_size, (unsigned long long)result->ops, seconds);
+    fprintf(out, "\"ops_per_sec\": %.1f, \"mb_per_sec\": %.3f, \"page_faults\": %llu, ",
+            seconds > 0 ? result->ops / seconds : 0.0,
+            seconds > 0 ? result->bytes / seconds / (1024 * 1024) : 0.0,
+            (unsigned long long)n_faults);
+    fprintf(out, "\"latency_ns\": {\"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"max\": %llu}}",
+            (unsigned long long)percentile(result->latencies_ns, result->ops, 0.50),
+            (unsigned long long)percentile(result->latencies_ns, result->ops, 0.90),
+            (unsigned long long)percentile(result->latencies_ns, result->ops, 0.99),
+            (unsigned long long)(result->ops > 0 ? result->latencies_ns[result->ops - 1] : 0));
+    first_result = false;
+    free(result->latencies_ns);
+    result->latencies_ns = NULL;
+}
+
+void check(bool ok, const char *what)
+{
+    if (!ok)
+    {
+        fprintf(stderr, "bench: %s failed\n", what);
+        unmount();
+        remove(BENCH_FS_NAME);
+        exit(1);
+    }
+}
+
+/**
+ * Bytes of data a fresh image with these parameters can hold
+ */
+uint64_t fs_capacity(uint8_t blocks_in_fat, uint8_t block_size_config)
+{
+    uint64_t block_size = 256 << block_size_config;
+    uint64_t n_blocks = blocks_in_fat * block_size / 2 - 1;
+    if (n_blocks > 0xFFFE)
+    {
+        n_blocks = 0xFFFE;
+    }
+    return (n_blocks - 1) * block_size; // minus the root directory
+}
+
+/**
+ * Make and mount a fresh image that can hold at least min_capacity bytes (or as
+ * close to it as the block size allows). Returns the block size.
+ */
+uint16_t fresh_fs(uint8_t block_size_config, uint64_t min_capacity)
+{
+    uint8_t blocks_in_fat = 1;
+    while (blocks_in_fat < 32 && fs_capacity(blocks_in_fat, block_size_config) < min_capacity)
+    {
+        blocks_in_fat += 1;
+    }
+    remove(BENCH_FS_NAME);
+    check(mkfs(BENCH_FS_NAME, blocks_in_fat, block_size_config) == 0, "mkfs");
+    check(mount(BENCH_FS_NAME) == 0, "mount");
+    return 256 << block_size_config;
+}
+
+void done_fs(void)
+{
+    check(unmount() == 0, "unmount");
+    remove(BENCH_FS_NAME);
+}
+
+void bench_sequential(uint8_t block_size_config, char *buf)
+{
+    // leave room for the file at every block size, even though the smallest images are only ~1MB
+    uint64_t file_size = MAX_SEQ_FILE_SIZE / scale;
+    uint64_t capacity = fs_capacity(32, block_size_config);
+    if (file_size > capacity / 2)
+    {
+        file_size = capacity / 2 / IO_SIZE * IO_SIZE;
+    }
+    uint64_t n_ops = file_size / IO_SIZE;
+    uint16_t block_size = fresh_fs(block_size_config, 2 * file_size);
+
+    bench_result write_result = new_result("seq_write", n_ops);
+    write_result.block_size = block_size;
+    int fd = k_open("seq", F_WRITE);
+    check(fd >= 0, "k_open");
+    for (uint64_t i = 0; i < n_ops; i++)
+    {
+        uint64_t start = now_ns();
+        check(k_write(fd, buf, IO_SIZE) == IO_SIZE, "k_write");
+        record(&write_result, start, IO_SIZE);
+    }
+    report(&write_result);
+
+    bench_result read_result = new_result("seq_read", n_ops);
+    read_result.block_size = block_size;
+    check(k_lseek(fd, 0, F_SEEK_SET) == 0, "k_lseek");
+    for (uint64_t i = 0; i < n_ops; i++)
+    {
+        uint64_t start = now_ns();
+        check(k_read(fd, IO_SIZE, buf) == IO_SIZE, "k_read");
+        record(&read_result, start, IO_SIZE);
+    }
+    report(&read_result);
+
+    check(k_close(fd) == 0, "k_close");
+    done_fs();
+}
+
+void bench_random_read(char *buf)
+{
+    uint64_t file_size = RANDOM_READ_FILE_SIZE / scale;
+    uint64_t n_chunks = file_size / IO_SIZE;
+    uint16_t block_size = fresh_fs(2, 2 * file_size);
+
+    int fd = k_open("random", F_WRITE);
+    check(fd >= 0, "k_open");
+    for (uint64_t i = 0; i < n_chunks; i++)
+    {
+        check(k_write(fd, buf, IO_SIZE) == IO_SIZE, "k_write");
+    }
+
+    uint64_t n_ops = 4 * n_chunks;
+    bench_result result = new_result("random_read_4k", n_ops);
+    result.block_size = block_size;
+    srand(42); // same offsets every run
+    for (uint64_t i = 0; i < n_ops; i++)
+    {
+        int offset = (rand() % n_chunks) * IO_SIZE;
+        uint64_t start = now_ns();
+        check(k_lseek(fd, offset, F_SEEK_SET) == offset, "k_lseek");
+        check(k_read(fd, IO_SIZE, buf) == IO_SIZE, "k_read");
+        record(&result, start, IO_SIZE);
+    }
+    report(&result);
+
+    check(k_close(fd) == 0, "k_close");
+    done_fs();
+}
+
+// one of the threads of bench_read_only_readers, reading through an fd of its own
+typedef struct bench_reader_st
+{
+    int fd;
+    uint64_t n_chunks;
+    uint64_t n_ops;
+    unsigned int seed;
+    char buf[IO_SIZE];
+    uint64_t *latencies_ns; // n_ops of them
+} bench_reader;
+
+void *bench_reader_main(void *arg)
+{
+    bench_reader *reader = (bench_reader *)arg;
+    for (uint64_t i = 0; i < reader->n_ops; i++)
+    {
+        int offset = (rand_r(&reader->seed) % reader->n_chunks) * IO_SIZE;
+        uint64_t start = now_ns();
+        check(k_lseek(reader->fd, offset, F_SEEK_SET) == offset, "k_lseek");
+        check(k_read(reader->fd, IO_SIZE, reader->buf) == IO_SIZE, "k_read");
+        reader->latencies_ns[i] = now_ns() - start;
+    }
+    return NULL;
+}
+
+/**
+ * Random reads from a read-only mount by 1, 2, 4, ... threads at once. Unlike the other
+ * scenarios, seconds is wall clock time, so ops_per_sec is the throughput of all of them
+ */
+void bench_read_only_readers(char *buf)
+{
+    uint64_t file_size = RANDOM_READ_FILE_SIZE / scale;
+    uint64_t n_chunks = file_size / IO_SIZE;
+    uint16_t block_size = fresh_fs(2, 2 * file_size);
+
+    int fd = k_open("random", F_WRITE);
+    check(fd >= 0, "k_open");
+    for (uint64_t i = 0; i < n_chunks; i++)
+    {
+        check(k_write(fd, buf, IO_SIZE) == IO_SIZE, "k_write");
+    }
+    check(k_close(fd) == 0, "k_close");
+    check(unmount() == 0, "unmount");
+    check(mount_with_flags(BENCH_FS_NAME, MOUNT_READ_ONLY) == 0, "mount");
+
+    uint64_t n_ops = 4 * n_chunks;
+    static bench_reader readers[READ_ONLY_MAX_THREADS];
+    pthread_t threads[READ_ONLY_MAX_THREADS];
+    char name[64];
+    for (int n_threads = 1; n_threads <= READ_ONLY_MAX_THREADS; n_threads *= 2)
+    {
+        snprintf(name, sizeof(name), "read_only_random_read_4k_%d_threads", n_threads);
+        bench_result result = new_result(name, n_threads * n_ops);
+        result.block_size = block_size;
+        for (int i = 0; i < n_threads; i++)
+        {
+            readers[i].fd = k_open("random", F_READ);
+            check(readers[i].fd >= 0, "k_open");
+            readers[i].n_chunks = n_chunks;
+            readers[i].n_ops = n_ops;
+            readers[i].seed = 42 + i; // same offsets every run
+            readers[i].latencies_ns = result.latencies_ns + i * n_ops;
+        }
+
+        uint64_t start = now_ns();
+        for (int i = 0; i < n_threads; i++)
+        {
+            check(pthread_create(&threads[i], NULL, bench_reader_main, &readers[i]) == 0, "pthread_create");
+        }
+        for (int i = 0; i < n_threads; i++)
+        {
+            check(pthread_join(threads[i], NULL) == 0, "pthread_join");
+        }
+        result.total_ns = now_ns() - start;
+        result.ops = n_threads * n_ops;
+        result.bytes = result.ops * IO_SIZE;
+        report(&result);
+
+        for (int i = 0; i < n_threads; i++)
+        {
+            check(k_close(readers[i].fd) == 0, "k_close");
+        }
+    }
+    done_fs();
+}
+
+void bench_small_files(char *buf)
+{
+    uint64_t n_files = 2000 / scale;
+    uint64_t n_rounds = 4;
+    uint16_t block_size = fresh_fs(1, n_files * 512 * 2);
+
+    bench_result create_result = new_result("small_file_create", n_files * n_rounds);
+    bench_result unlink_result = new_result("small_file_unlink", n_files * n_rounds);
+    create_result.block_size = block_size;
+    unlink_result.block_size = block_size;
+    char name[32];
+    for (uint64_t round = 0; round < n_rounds; round++)
+    {
+        for (uint64_t i = 0; i < n_files; i++)
+        {
+            snprintf(name, sizeof(name), "f%llu", (unsigned long long)i);
+            uint64_t start = now_ns();
+            int fd = k_open(name, F_WRITE);
+            check(fd >= 0, "k_open");
+            check(k_write(fd, buf, SMALL_FILE_SIZE) == SMALL_FILE_SIZE, "k_write");
+            check(k_close(fd) == 0, "k_close");
+            record(&create_result, start, SMALL_FILE_SIZE);
+        }
+        for (uint64_t i = 0; i < n_files; i++)
+        {
+            snprintf(name, sizeof(name), "f%llu", (unsigned long long)i);
+            uint64_t start = now_ns();
+            check(k_unlink(name) == 0, "k_unlink");
+            record(&unlink_result, start, 0);
+        }
+    }
+    report(&create_result);
+    report(&unlink_result);
+    done_fs();
+}
+
+void bench_ls(void)
+{
+    uint64_t n_files = 4000 / scale;
+    uint16_t block_size = fresh_fs(2, 1024 * 1024);
+
+    char name[32];
+    for (uint64_t i = 0; i < n_files; i++)
+    {
+        snprintf(name, sizeof(name), "f%llu", (unsigned long long)i);
+        int fd = k_open(name, F_WRITE);
+        check(fd >= 0, "k_open");
+        check(k_close(fd) == 0, "k_close");
+    }
+
+    uint64_t n_ops = 20;
+    bench_result list_result = new_result("ls_root_dir", n_ops);
+    bench_result lookup_result = new_result("ls_one_file", n_ops);
+    list_result.block_size = block_size;
+    lookup_result.block_size = block_size;
+    snprintf(name, sizeof(name), "f%llu", (unsigned long long)(n_files - 1)); // worst case: the last entry
+    for (uint64_t i = 0; i < n_ops; i++)
+    {
+        uint64_t start = now_ns();
+        check(k_ls(NULL) == 0, "k_ls");
+        record(&list_result, start, 0);
+
+        start = now_ns();
+        check(k_ls(name) == 0, "k_ls");
+        record(&lookup_result, start, 0);
+    }
+    report(&list_result);
+    report(&lookup_result);
+    done_fs();
+}
+
+void bench_append_log(char *buf)
+{
+    uint64_t n_ops = 32768 / scale;
+    uint16_t block_size = fresh_fs(2, 3 * n_ops * LOG_RECORD_SIZE);
+
+    bench_result result = new_result("append_log", n_ops);
+    result.block_size = block_size;
+    int fd = k_open("log", F_APPEND);
+    check(fd >= 0, "k_open");
+    for (uint64_t i = 0; i < n_ops; i++)
+    {
+        uint64_t start = now_ns();
+        check(k_write(fd, buf, LOG_RECORD_SIZE) == LOG_RECORD_SIZE, "k_write");
+        record(&result, start, LOG_RECORD_SIZE);
+    }
+    report(&result);
+    check(k_close(fd) == 0, "k_close");
+
+    // the same records as a log file, then read back in order and at random
+    bench_result log_result = new_result("log_append", n_ops);
+    log_result.block_size = block_size;
+    fd = k_open("records", F_APPEND | F_LOG);
+    check(fd >= 0, "k_open");
+    for (uint64_t i = 0; i < n_ops; i++)
+    {
+        uint64_t start = now_ns();
+        check(k_log_append(fd, buf, LOG_RECORD_SIZE) == (int)i, "k_log_append");
+        record(&log_result, start, LOG_RECORD_SIZE);
+    }
+    report(&log_result);
+
+    bench_result scan_result = new_result("log_scan", n_ops);
+    scan_result.block_size = block_size;
+    for (uint64_t i = 0; i < n_ops; i++)
+    {
+        uint64_t start = now_ns();
+        check(k_log_read(fd, i, buf, LOG_RECORD_SIZE) == LOG_RECORD_SIZE, "k_log_read");
+        record(&scan_result, start, LOG_RECORD_SIZE);
+    }
+    report(&scan_result);
+
+    bench_result random_result = new_result("log_random_read", n_ops);
+    random_result.block_size = block_size;
+    srand(42); // same records every run
+    for (uint64_t i = 0; i < n_ops; i++)
+    {
+        uint32_t idx = rand() % n_ops;
+        uint64_t start = now_ns();
+        check(k_log_read(fd, idx, buf, LOG_RECORD_SIZE) == LOG_RECORD_SIZE, "k_log_read");
+        record(&random_result, start, LOG_RECORD_SIZE);
+    }
+    report(&random_result);
+
+    check(k_close(fd) == 0, "k_close");
+    done_fs();
+}
+
+/**
+ * Leave the page faults taken since faults_at_start (e.g., by untimed setup) out of result
+ */
+void skip_faults(bench_result *result, uint64_t faults_at_start)
+{
+    result->faults_at_start += page_faults() - faults_at_start;
+}
+
+/**
+ * Mount an image with a large FAT, then take the first walk along a long chain of it, with
+ * each set of hints for the FAT mapping. The page faults of the two are reported apart:
+ * mounting reads the whole FAT, so that is where a prefault moves them from
+ */
+void bench_fat_mapping(char *buf)
+{
+    const char *suffixes[] = {"", "_populate", "_hugepage", "_mlock", "_sequential", "_random"};
+    int hints[] = {0, MOUNT_POPULATE, MOUNT_POPULATE | MOUNT_HUGEPAGE, MOUNT_MLOCK, MOUNT_SEQUENTIAL, MOUNT_RANDOM};
+    static char names[2][sizeof(suffixes) / sizeof(suffixes[0])][32];
+
+    // the biggest FAT there is (32 pages, more than the kernel maps around one fault), and a
+    // long chain to walk
+    remove(BENCH_FS_NAME);
+    check(mkfs(BENCH_FS_NAME, 32, 4) == 0, "mkfs");
+    check(mount(BENCH_FS_NAME) == 0, "mount");
+    uint64_t n_chunks = RANDOM_READ_FILE_SIZE / scale / IO_SIZE;
+    int fd = k_open("chain", F_WRITE);
+    check(fd >= 0, "k_open");
+    for (uint64_t i = 0; i < n_chunks; i++)
+    {
+        check(k_write(fd, buf, IO_SIZE) == IO_SIZE, "k_write");
+    }
+    check(k_close(fd) == 0, "k_close");
+    check(unmount() == 0, "unmount");
+
+    int last = (int)(n_chunks * IO_SIZE - 1);
+    uint64_t n_rounds = FAT_MAPPING_ROUNDS / scale > 0 ? FAT_MAPPING_ROUNDS / scale : 1;
+    for (size_t i = 0; i < sizeof(hints) / sizeof(hints[0]); i++)
+    {
+        // one round first, so the faults of growing the heap aren't counted against the hints
+        if (mount_with_flags(BENCH_FS_NAME, hints[i]) != 0)
+        {
+            fprintf(stderr, "bench: skipping hints %d, which failed to mount (e.g., mlock beyond RLIMIT_MEMLOCK)\n", hints[i]);
+            continue;
+        }
+        fd = k_open("chain", F_READ);
+        check(fd >= 0 && k_lseek(fd, last, F_SEEK_SET) == last && k_read(fd, 1, buf) == 1, "walk");
+        check(k_close(fd) == 0 && unmount() == 0, "unmount");
+
+        snprintf(names[0][i], sizeof(names[0][i]), "fat_mount%s", suffixes[i]);
+        snprintf(names[1][i], sizeof(names[1][i]), "fat_first_walk%s", suffixes[i]);
+        bench_result mount_result = new_result(names[0][i], n_rounds);
+        bench_result walk_result = new_result(names[1][i], n_rounds);
+        mount_result.block_size = 4096;
+        walk_result.block_size = 4096;
+        for (uint64_t round = 0; round < n_rounds; round++)
+        {
+            uint64_t faults = page_faults();
+            uint64_t start = now_ns();
+            check(mount_with_flags(BENCH_FS_NAME, hints[i]) == 0, "mount_with_flags");
+            record(&mount_result, start, 0);
+            skip_faults(&walk_result, faults);
+
+            faults = page_faults();
+            start = now_ns();
+            fd = k_open("chain", F_READ);
+            check(fd >= 0 && k_lseek(fd, last, F_SEEK_SET) == last && k_read(fd, 1, buf) == 1, "walk");
+            record(&walk_result, start, 0);
+            skip_faults(&mount_result, faults);
+
+            faults = page_faults();
+            check(k_close(fd) == 0 && unmount() == 0, "unmount");
+            skip_faults(&mount_result, faults);
+            skip_faults(&walk_result, faults);
+        }
+        report(&mount_result);
+        report(&walk_result);
+    }
+    remove(BENCH_FS_NAME);
+}
+
+/**
+ * Sequential writes and reads of 4K blocks through the host page cache and with F_DIRECT,
+ * from an aligned buffer. The page cache numbers include the host caching the image, which
+ * direct I/O gives up to keep big streams from evicting everything else
+ */
+void bench_direct_io(char *buf)
+{
+    uint64_t file_size = MAX_SEQ_FILE_SIZE / scale;
+    uint64_t n_ops = file_size / IO_SIZE;
+    char *aligned_buf;
+    check(posix_memalign((void **)&aligned_buf, DIRECT_IO_ALIGN, IO_SIZE) == 0, "posix_memalign");
+    memcpy(aligned_buf, buf, IO_SIZE);
+
+    const char *names[][2] = {{"seq_write_page_cache", "seq_read_page_cache"}, {"seq_write_direct", "seq_read_direct"}};
+    for (int direct = 0; direct <= 1; direct++)
+    {
+        uint16_t block_size = fresh_fs(4, 2 * file_size);
+        int fd = k_open("seq", F_WRITE | (direct ? F_DIRECT : 0));
+        if (fd == EK_OPEN_DIRECT_UNSUPPORTED)
+        {
+            fprintf(stderr, "bench: skipping direct I/O, which the host filesystem doesn't support\n");
+            done_fs();
+            break;
+        }
+        check(fd >= 0, "k_open");
+
+        bench_result write_result = new_result(names[direct][0], n_ops);
+        write_result.block_size = block_size;
+        for (uint64_t i = 0; i < n_ops; i++)
+        {
+            uint64_t start = now_ns();
+            check(k_write(fd, aligned_buf, IO_SIZE) == IO_SIZE, "k_write");
+            record(&write_result, start, IO_SIZE);
+        }
+        report(&write_result);
+
+        bench_result read_result = new_result(names[direct][1], n_ops);
+        read_result.block_size = block_size;
+        check(k_lseek(fd, 0, F_SEEK_SET) == 0, "k_lseek");
+        for (uint64_t i = 0; i < n_ops; i++)
+        {
+            uint64_t start = now_ns();
+            check(k_read(fd, IO_SIZE, aligned_buf) == IO_SIZE, "k_read");
+            record(&read_result, start, IO_SIZE);
+        }
+        report(&read_result);
+
+        check(k_close(fd) == 0, "k_close");
+        done_fs();
+    }
+    free(aligned_buf);
+}
+
+int main(int argc, char **argv)
+{
+    const char *out_path = NULL;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-q") == 0)
+        {
+            scale = 8;
+        }
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+        {
+            out_path = argv[++i];
+        }
+        else
+        {
+            fprintf(stderr, "usage: %s [-q] [-o FILE]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    // k_ls prints to STDOUT_FD, so point that at /dev/null and keep the real stdout for the report
+    out = out_path != NULL ? fopen(out_path, "w") : fdopen(dup(STDOUT_FILENO), "w");
+    int dev_null = open("/dev/null", O_WRONLY);
+    if (out == NULL || dev_null == -1 || dup2(dev_null, STDOUT_FILENO) == -1)
+    {
+        fprintf(stderr, "bench: failed to set up output\n");
+        return 1;
+    }
+    close(dev_null);
+
+    char *buf = (char *)malloc(IO_SIZE);
+    if (buf == NULL)
+    {
+        fprintf(stderr, "bench: malloc failed\n");
+        return 1;
+    }
+    for (int i = 0; i < IO_SIZE; i++)
+    {
+        buf[i] = 'a' + i % 26;
+    }
+
+    fprintf(out, "{\n  \"quick\": %s,\n  \"results\": [", scale > 1 ? "true" : "false");
+    for (uint8_t block_size_config = 0; block_size_config <= 4; block_size_config++)
+    {
+        bench_sequential(block_size_config, buf);
+    }
+    bench_random_read(buf);
+    bench_read_only_readers(buf);
+    bench_small_files(buf);
+    bench_ls();
+    bench_append_log(buf);
+    bench_direct_io(buf);
+    bench_fat_mapping(buf);
+    fprintf(out, "\n  ]\n}\n");
+
+    free(buf);
+    return fclose(out) == 0 ? 0 : 1;
+}
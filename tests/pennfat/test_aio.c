@@ -0,0 +1,206 @@
+#include "acutest.h"
+#include "src/pennfat/fat.h"
+#include "src/pennfat/mkfs.h"
+#include "src/scheduler/aio.h"
+#include "src/scheduler/kernel.h"
+#include "src/utils/error_codes.h"
+#include <stdio.h>
+
+// the queue in aio.c runs against the real filesystem, with just enough of the scheduler
+// stubbed out below for it to wake up the one process these tests pretend to be
+
+char *test_fs_name = "testfs997";
+
+#define TEST_PID 1
+
+pcb_t test_process = {.pid = TEST_PID, .state = PROCESS_RUNNING, .waited_aio = -1};
+
+pcb_t *k_get_process_by_pid(pid_t pid)
+{
+    return pid == TEST_PID ? &test_process : NULL;
+}
+
+void block_process(pcb_t *process)
+{
+    process->state = PROCESS_BLOCKED;
+}
+
+void unblock_process(pcb_t *process)
+{
+    process->state = PROCESS_RUNNING;
+}
+
+/**
+ * Mount a fresh volume with 256 byte blocks holding f, which is n_blocks blocks of data
+ * whose i-th byte is 'a' + i % 26, and return a global fd of f opened with mode
+ */
+int setup_file(uint32_t n_blocks, int mode)
+{
+    remove(test_fs_name); // assume this succeeded
+    TEST_CHECK(mkfs(test_fs_name, 1, 0) == 0);
+    TEST_CHECK(mount(test_fs_name) == 0);
+
+    char data[256];
+    int fd = k_open("f", F_WRITE);
+    TEST_CHECK(fd >= 0);
+    for (uint32_t i = 0; i < n_blocks; i++)
+    {
+        for (int j = 0; j < sizeof(data); j++)
+        {
+            data[j] = 'a' + (i * sizeof(data) + j) % 26;
+        }
+        TEST_CHECK(k_write(fd, data, sizeof(data)) == sizeof(data));
+    }
+    TEST_CHECK(k_close(fd) == 0);
+
+    fd = k_open("f", mode);
+    TEST_CHECK(fd >= 0);
+    return fd;
+}
+
+int submit(int op, int fd, char *buf, uint32_t n, uint32_t offset)
+{
+    int id = k_aio_submit(TEST_PID, op, fd, k_getgeneration(fd), op == AIO_WRITE ? F_WRITE : F_READ, buf, n, offset);
+    TEST_CHECK(id >= 0);
+    return id;
+}
+
+// whether request id is done, without freeing it
+bool is_done(int id)
+{
+    return k_aio_block(&test_process, id) == 0;
+}
+
+void test_aio_elevator(void)
+{
+    int fd = setup_file(12, F_READ);
+    for (uint32_t i = 1; i < 12; i++)
+    {
+        TEST_CHECK(k_bmap(fd, i * 256) > k_bmap(fd, (i - 1) * 256)); // so block order is offset order
+    }
+
+    // requests are served going up the disk, whatever order they came in
+    char bufs[3][256];
+    uint32_t offsets[3] = {10 * 256, 2 * 256, 6 * 256};
+    int ids[3];
+    for (int i = 0; i < 3; i++)
+    {
+        ids[i] = submit(AIO_READ, fd, bufs[i], 256, offsets[i]);
+    }
+    k_aio_run(256);
+    TEST_CHECK(is_done(ids[1]) && !is_done(ids[2]) && !is_done(ids[0]));
+    k_aio_run(256);
+    TEST_CHECK(is_done(ids[2]) && !is_done(ids[0]));
+    k_aio_run(256);
+    TEST_CHECK(is_done(ids[0]));
+    for (int i = 0; i < 3; i++)
+    {
+        TEST_CHECK(k_aio_reap(TEST_PID, ids[i]) == 256);
+        TEST_CHECK(bufs[i][0] == 'a' + offsets[i] % 26);
+    }
+
+    // the sweep carries on from block 11, and only starts over from the bottom once nothing is ahead
+    int low = submit(AIO_READ, fd, bufs[0], 256, 1 * 256);
+    int high = submit(AIO_READ, fd, bufs[1], 256, 11 * 256);
+    k_aio_run(256);
+    TEST_CHECK(is_done(high) && !is_done(low));
+    k_aio_run(256);
+    TEST_CHECK(is_done(low));
+    TEST_CHECK(k_aio_reap(TEST_PID, low) == 256);
+    TEST_CHECK(k_aio_reap(TEST_PID, high) == 256);
+
+    TEST_CHECK(k_close(fd) == 0);
+    TEST_CHECK(unmount() == 0);
+}
+
+void test_aio_same_fd_order(void)
+{
+    int fd = setup_file(12, F_APPEND); // F_WRITE would empty it, and each write runs as F_WRITE anyway
+    char writes[2][256];
+    memset(writes[0], 'X', sizeof(writes[0]));
+    memset(writes[1], 'Y', sizeof(writes[1]));
+
+    // a read isn't served before an older write of the same fd, even when it is lower down the disk
+    int first = submit(AIO_WRITE, fd, writes[0], 256, 10 * 256);
+    char out[256];
+    int second = submit(AIO_READ, fd, out, 256, 0);
+    k_aio_run(256);
+    TEST_CHECK(is_done(first) && !is_done(second));
+    k_aio_run(256);
+    TEST_CHECK(k_aio_reap(TEST_PID, first) == 256);
+    TEST_CHECK(k_aio_reap(TEST_PID, second) == 256);
+    TEST_CHECK(out[0] == 'a');
+
+    // nor is a later write, since each write ends the file where it stops
+    first = submit(AIO_WRITE, fd, writes[0], 256, 8 * 256);
+    second = submit(AIO_WRITE, fd, writes[1], 256, 0);
+    k_aio_run(256);
+    TEST_CHECK(is_done(first) && !is_done(second));
+    k_aio_run(256);
+    TEST_CHECK(k_aio_reap(TEST_PID, first) == 256);
+    TEST_CHECK(k_aio_reap(TEST_PID, second) == 256);
+    TEST_CHECK(k_lseek(fd, 0, F_SEEK_END) == 256);
+
+    // reads of the same fd are still reordered among themselves (see test_aio_elevator)
+    TEST_CHECK(k_close(fd) == 0);
+    TEST_CHECK(unmount() == 0);
+}
+
+void test_aio_chunks(void)
+{
+    int fd = setup_file(4, F_READ);
+
+    // a big request is moved a budget at a time, and the process waiting for it wakes up at the end
+    char out[1000];
+    memset(out, 0, sizeof(out));
+    int id = submit(AIO_READ, fd, out, sizeof(out), 0);
+    TEST_CHECK(k_aio_block(&test_process, id) == 1);
+    TEST_CHECK(test_process.state == PROCESS_BLOCKED);
+    for (int i = 1; i <= 3; i++)
+    {
+        k_aio_run(300);
+        TEST_CHECK(out[i * 300 - 1] == 'a' + (i * 300 - 1) % 26);
+        TEST_CHECK(out[i * 300] == 0);
+        TEST_CHECK(!is_done(id));
+        TEST_CHECK(test_process.state == PROCESS_BLOCKED);
+    }
+    k_aio_run(300);
+    TEST_CHECK(test_process.state == PROCESS_RUNNING && test_process.waited_aio == -1);
+    TEST_CHECK(k_aio_reap(TEST_PID, id) == sizeof(out));
+    TEST_CHECK(out[999] == 'a' + 999 % 26);
+
+    // a read past the end of the file stops there
+    id = submit(AIO_READ, fd, out, sizeof(out), 3 * 256 + 100);
+    k_aio_run(UINT32_MAX);
+    TEST_CHECK(k_aio_reap(TEST_PID, id) == 156);
+
+    TEST_CHECK(k_close(fd) == 0);
+    TEST_CHECK(unmount() == 0);
+}
+
+void test_aio_closed_fd(void)
+{
+    int fd = setup_file(2, F_READ);
+
+    // closing the file fails its pending requests, even once its fd is handed out again
+    char out[256];
+    int id = submit(AIO_READ, fd, out, sizeof(out), 0);
+    TEST_CHECK(k_close(fd) == 0);
+    TEST_CHECK(k_open("f", F_READ) == fd);
+    TEST_CHECK(k_aio_block(&test_process, id) == 1);
+    k_aio_run(UINT32_MAX);
+    TEST_CHECK(test_process.state == PROCESS_RUNNING);
+    TEST_CHECK(k_aio_reap(TEST_PID, id) == E_STALE_FD);
+    TEST_CHECK(k_aio_reap(TEST_PID, id) == EK_AIO_NO_SUCH_REQUEST);
+
+    TEST_CHECK(k_close(fd) == 0);
+    TEST_CHECK(unmount() == 0);
+}
+
+TEST_LIST = {
+    {"test_aio_elevator", test_aio_elevator},
+    {"test_aio_same_fd_order", test_aio_same_fd_order},
+    {"test_aio_chunks", test_aio_chunks},
+    {"test_aio_closed_fd", test_aio_closed_fd},
+    {NULL, NULL} // important: need to have this
+};
@@ -0,0 +1,131 @@
+#include "acutest.h"
+#include "src/scheduler/latency.h"
+#include "src/scheduler/kernel.h"
+#include "src/utils/error_codes.h"
+
+// latency.c only needs to find processes, so the scheduler is stubbed out with the one
+// process these tests pretend to be
+
+#define TEST_PID 1
+
+pcb_t test_process = {.pid = TEST_PID, .latencies = NULL};
+
+pcb_t *k_get_current_process(void)
+{
+    return &test_process;
+}
+
+pcb_t *k_get_process_by_pid(pid_t pid)
+{
+    return pid == TEST_PID ? &test_process : NULL;
+}
+
+void test_latency_buckets(void)
+{
+    // below 8ns every value has a bucket of its own
+    for (uint64_t v = 0; v < LATENCY_SUB_BUCKETS; v++)
+    {
+        TEST_CHECK(latency_bucket_of(v) == v);
+        TEST_CHECK(latency_bucket_upper_bound(v) == v);
+    }
+
+    // from there on a power of 2 starts a bucket 1/8th of it wide, and the one before ends just below it
+    for (int exponent = LATENCY_SUB_BUCKET_BITS; exponent <= LATENCY_MAX_EXPONENT; exponent++)
+    {
+        uint64_t power = 1ULL << exponent;
+        int bucket = latency_bucket_of(power);
+        TEST_CHECK(bucket == LATENCY_SUB_BUCKETS * (exponent - LATENCY_SUB_BUCKET_BITS + 1));
+        TEST_CHECK(latency_bucket_upper_bound(bucket) == power + power / LATENCY_SUB_BUCKETS - 1);
+        TEST_CHECK(latency_bucket_of(power - 1) == bucket - 1);
+        TEST_CHECK(latency_bucket_upper_bound(bucket - 1) == power - 1);
+        TEST_MSG("exponent %d", exponent);
+    }
+    TEST_CHECK(latency_bucket_of(16) == latency_bucket_of(17));
+    TEST_CHECK(latency_bucket_of(18) == latency_bucket_of(17) + 1);
+
+    // every value is within its bucket and less than 12.5% below the bound reported for it
+    for (uint64_t v = 1; v < (1ULL << 20); v = v * 9 / 8 + 1)
+    {
+        int bucket = latency_bucket_of(v);
+        uint64_t upper_bound = latency_bucket_upper_bound(bucket);
+        TEST_CHECK(v <= upper_bound && (bucket == 0 || v > latency_bucket_upper_bound(bucket - 1)));
+        TEST_CHECK(upper_bound - v <= v / LATENCY_SUB_BUCKETS);
+        TEST_MSG("value %llu", (unsigned long long)v);
+    }
+
+    // the top bucket ends the range, and catches everything past it
+    int top = LATENCY_N_BUCKETS - 1;
+    uint64_t end = 1ULL << (LATENCY_MAX_EXPONENT + 1);
+    TEST_CHECK(latency_bucket_of(end - 1) == top);
+    TEST_CHECK(latency_bucket_upper_bound(top) == end - 1);
+    TEST_CHECK(latency_bucket_of(end) == top);
+    TEST_CHECK(latency_bucket_of(UINT64_MAX) == top);
+}
+
+void test_latency_percentiles(void)
+{
+    latency_histogram histogram = {0};
+    latency_summary summary;
+    latency_histogram_summarize(&histogram, &summary);
+    TEST_CHECK(summary.count == 0 && summary.p50_ns == 0 && summary.p999_ns == 0 && summary.max_ns == 0);
+
+    // the median of 1, 2 and 3 is the 2nd sample
+    for (uint64_t v = 1; v <= 3; v++)
+    {
+        latency_histogram_add(&histogram, v);
+    }
+    latency_histogram_summarize(&histogram, &summary);
+    TEST_CHECK(summary.count == 3 && summary.p50_ns == 2 && summary.p99_ns == 3 && summary.max_ns == 3);
+
+    // 990 fast calls and 10 slow ones: the 990th sample is fast, the 999th slow
+    histogram = (latency_histogram){0};
+    for (int i = 0; i < 990; i++)
+    {
+        latency_histogram_add(&histogram, 5);
+    }
+    for (int i = 0; i < 10; i++)
+    {
+        latency_histogram_add(&histogram, 100000);
+    }
+    latency_histogram_summarize(&histogram, &summary);
+    TEST_CHECK(summary.count == 1000);
+    TEST_CHECK(summary.p50_ns == 5);
+    TEST_CHECK(summary.p99_ns == 5);
+    // the bucket bound of 100000 is above it, but nothing was slower than max
+    TEST_CHECK(latency_bucket_upper_bound(latency_bucket_of(100000)) > 100000);
+    TEST_CHECK(summary.p999_ns == 100000 && summary.max_ns == 100000);
+
+    // a percentile that isn't clamped by max reports its bucket's upper bound
+    latency_histogram_add(&histogram, 200000);
+    latency_histogram_summarize(&histogram, &summary);
+    TEST_CHECK(summary.p999_ns == latency_bucket_upper_bound(latency_bucket_of(100000)));
+    TEST_CHECK(summary.max_ns == 200000);
+}
+
+void test_latency_per_process(void)
+{
+    latency_summary before;
+    TEST_CHECK(k_latency_summarize(LATENCY_ALL_PROCESSES, LATENCY_S_READ, &before) == 0);
+
+    // a call counts both globally and for the current process
+    latency_record(LATENCY_S_READ, latency_start());
+    latency_summary summary;
+    TEST_CHECK(k_latency_summarize(LATENCY_ALL_PROCESSES, LATENCY_S_READ, &summary) == 0);
+    TEST_CHECK(summary.count == before.count + 1);
+    TEST_CHECK(k_latency_summarize(TEST_PID, LATENCY_S_READ, &summary) == 0);
+    TEST_CHECK(summary.count == 1);
+    TEST_CHECK(k_latency_summarize(TEST_PID, LATENCY_S_WRITE, &summary) == 0);
+    TEST_CHECK(summary.count == 0);
+
+    TEST_CHECK(k_latency_summarize(TEST_PID + 1, LATENCY_S_READ, &summary) == E_NO_SUCH_PROCESS);
+    TEST_CHECK(k_latency_summarize(TEST_PID, N_LATENCY_SYSCALLS, &summary) == E_INVALID_ARGUMENT);
+    free(test_process.latencies);
+    test_process.latencies = NULL;
+}
+
+TEST_LIST = {
+    {"test_latency_buckets", test_latency_buckets},
+    {"test_latency_percentiles", test_latency_percentiles},
+    {"test_latency_per_process", test_latency_per_process},
+    {NULL, NULL} // important: need to have this
+};
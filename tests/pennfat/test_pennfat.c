@@ -1,13 +1,44 @@
 #include "acutest.h"
 #include "src/pennfat/fat.h"
 #include "src/pennfat/mkfs.h"
+#include "src/pennfat/fat_utils.h"
 #include "src/utils/error_codes.h"
 #include <stdio.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/resource.h>
 
 // this will be a min sized fs, so it will have
 // 1 block and 256 byte blocks
 char *test_fs_name = "testfs999";
 
+// the volume the last k_* call on this thread worked on (see fat.c)
+extern _Thread_local fat16_fs *current_volume;
+#define fs (*current_volume)
+
+// number of entries in the FAT, including the first one
+size_t n_fat_entries(void)
+{
+    return fs.fat_size / (fs.fat32 ? sizeof(uint32_t) : sizeof(uint16_t));
+}
+
+// FAT entry i, as it is stored
+uint32_t fat_at(size_t i)
+{
+    return fs.fat32 ? ((uint32_t *)fs.fat)[i] : ((uint16_t *)fs.fat)[i];
+}
+
+// number of blocks in use (including the root directory)
+int n_used_blocks(void)
+{
+    int n_used = 0;
+    for (size_t i = 1; i < n_fat_entries(); i++)
+    {
+        n_used += fat_at(i) != 0;
+    }
+    return n_used;
+}
+
 void test_k_write_read(void)
 {
     remove(test_fs_name); // assume this succeeded
@@ -368,6 +399,1695 @@ void test_k_ls_multiple_files(void)
     TEST_CHECK(unmount() == 0);
 }
 
+void test_dedup(void)
+{
+    remove(test_fs_name); // assume this succeeded
+    char dedup_sidecar_name[64];
+    snprintf(dedup_sidecar_name, sizeof(dedup_sidecar_name), "%s.dedup", test_fs_name);
+    remove(dedup_sidecar_name);
+
+    TEST_CHECK(mkfs(test_fs_name, 1, 0) == 0);
+
+    TEST_CHECK(mount_with_flags(test_fs_name, MOUNT_DEDUP) == 0);
+
+    // 3 blocks worth of data with 256 byte blocks
+    char data[600];
+    for (int i = 0; i < sizeof(data); i++)
+    {
+        data[i] = 'a' + i % 26;
+    }
+
+    int fd = k_open("a", F_WRITE);
+    TEST_CHECK(fd >= 0);
+    TEST_CHECK(k_write(fd, data, sizeof(data)) == sizeof(data));
+    TEST_CHECK(k_close(fd) == 0);
+    TEST_CHECK(n_used_blocks() == 4);
+
+    // an identical file shares all of its blocks once closed
+    fd = k_open("b", F_WRITE);
+    TEST_CHECK(fd >= 0);
+    TEST_CHECK(k_write(fd, data, sizeof(data)) == sizeof(data));
+    TEST_CHECK(k_close(fd) == 0);
+    TEST_CHECK(n_used_blocks() == 4);
+    TEST_MSG("Produced %d", n_used_blocks());
+
+    // modifying b copies the shared blocks instead of changing a
+    fd = k_open("b", F_APPEND);
+    TEST_CHECK(fd >= 0);
+    TEST_CHECK(k_write(fd, "!", 1) == 1);
+    TEST_CHECK(k_close(fd) == 0);
+    TEST_CHECK(n_used_blocks() == 7);
+
+    char out[700];
+    fd = k_open("a", F_READ);
+    TEST_CHECK(k_read(fd, sizeof(out), out) == sizeof(data));
+    TEST_CHECK(memcmp(out, data, sizeof(data)) == 0);
+    TEST_CHECK(k_close(fd) == 0);
+
+    fd = k_open("b", F_READ);
+    TEST_CHECK(k_read(fd, sizeof(out), out) == sizeof(data) + 1);
+    TEST_CHECK(memcmp(out, data, sizeof(data)) == 0 && out[sizeof(data)] == '!');
+    TEST_CHECK(k_close(fd) == 0);
+
+    // shared blocks are only freed once the last file using them is gone
+    fd = k_open("c", F_WRITE);
+    TEST_CHECK(fd >= 0);
+    TEST_CHECK(k_write(fd, data, sizeof(data)) == sizeof(data));
+    TEST_CHECK(k_close(fd) == 0);
+    TEST_CHECK(n_used_blocks() == 7);
+    TEST_CHECK(k_unlink("a") == 0);
+    TEST_CHECK(n_used_blocks() == 7);
+    TEST_CHECK(k_unlink("c") == 0);
+    TEST_CHECK(n_used_blocks() == 4);
+    TEST_CHECK(k_unlink("b") == 0);
+    TEST_CHECK(n_used_blocks() == 1);
+
+    TEST_CHECK(unmount() == 0);
+    remove(dedup_sidecar_name);
+}
+
+void test_k_clone(void)
+{
+    remove(test_fs_name); // assume this succeeded
+
+    TEST_CHECK(mkfs(test_fs_name, 1, 0) == 0);
+
+    TEST_CHECK(mount(test_fs_name) == 0);
+
+    char data[600];
+    for (int i = 0; i < sizeof(data); i++)
+    {
+        data[i] = 'a' + i % 26;
+    }
+
+    int fd = k_open("a", F_WRITE);
+    TEST_CHECK(fd >= 0);
+    TEST_CHECK(k_write(fd, data, sizeof(data)) == sizeof(data));
+    TEST_CHECK(k_close(fd) == 0);
+    TEST_CHECK(n_used_blocks() == 4);
+
+    // cloning doesn't allocate any blocks
+    TEST_CHECK(k_clone("a", "b") == 0);
+    TEST_CHECK(n_used_blocks() == 4);
+    TEST_CHECK(k_clone("missing", "c") == EK_CLONE_FILE_NOT_FOUND);
+
+    // writing to the source copies the shared blocks so b keeps the old contents
+    fd = k_open("a", F_APPEND);
+    TEST_CHECK(fd >= 0);
+    TEST_CHECK(k_write(fd, "!", 1) == 1);
+    TEST_CHECK(k_close(fd) == 0);
+    TEST_CHECK(n_used_blocks() == 7);
+
+    char out[700];
+    fd = k_open("b", F_READ);
+    TEST_CHECK(k_read(fd, sizeof(out), out) == sizeof(data));
+    TEST_CHECK(memcmp(out, data, sizeof(data)) == 0);
+    TEST_CHECK(k_close(fd) == 0);
+
+    fd = k_open("a", F_READ);
+    TEST_CHECK(k_read(fd, sizeof(out), out) == sizeof(data) + 1);
+    TEST_CHECK(out[sizeof(data)] == '!');
+    TEST_CHECK(k_close(fd) == 0);
+
+    // cloning over an existing file releases its blocks
+    TEST_CHECK(k_clone("a", "b") == 0);
+    TEST_CHECK(n_used_blocks() == 4);
+    TEST_CHECK(k_unlink("a") == 0);
+    TEST_CHECK(n_used_blocks() == 4);
+    TEST_CHECK(k_unlink("b") == 0);
+    TEST_CHECK(n_used_blocks() == 1);
+
+    TEST_CHECK(unmount() == 0);
+}
+
+void test_k_copy_range(void)
+{
+    remove(test_fs_name); // assume this succeeded
+
+    TEST_CHECK(mkfs(test_fs_name, 1, 0) == 0);
+
+    TEST_CHECK(mount(test_fs_name) == 0);
+
+    char data[600];
+    for (int i = 0; i < sizeof(data); i++)
+    {
+        data[i] = 'a' + i % 26;
+    }
+
+    int a_fd = k_open("a", F_WRITE);
+    TEST_CHECK(a_fd >= 0);
+    TEST_CHECK(k_write(a_fd, data, sizeof(data)) == sizeof(data));
+
+    // whole file, block aligned
+    int b_fd = k_open("b", F_WRITE);
+    TEST_CHECK(b_fd >= 0);
+    TEST_CHECK(k_copy_range(a_fd, 0, b_fd, 0, UINT32_MAX) == sizeof(data));
+    TEST_CHECK(k_copy_range(a_fd, sizeof(data), b_fd, sizeof(data), UINT32_MAX) == 0);
+
+    char out[700];
+    TEST_CHECK(k_lseek(b_fd, 0, F_SEEK_SET) == 0);
+    TEST_CHECK(k_read(b_fd, sizeof(out), out) == sizeof(data));
+    TEST_CHECK(memcmp(out, data, sizeof(data)) == 0);
+
+    // copying into the middle of a file doesn't truncate it
+    TEST_CHECK(k_copy_range(a_fd, 0, b_fd, 300, 5) == 5);
+    TEST_CHECK(k_lseek(b_fd, 0, F_SEEK_END) == sizeof(data));
+
+    // unaligned, leaving a hole after the end of the output
+    int c_fd = k_open("c", F_WRITE);
+    TEST_CHECK(c_fd >= 0);
+    TEST_CHECK(k_write(c_fd, "0123456789", 10) == 10);
+    TEST_CHECK(k_copy_range(a_fd, 100, c_fd, 50, 300) == 300);
+    TEST_CHECK(k_lseek(c_fd, 0, F_SEEK_SET) == 0);
+    TEST_CHECK(k_read(c_fd, sizeof(out), out) == 350);
+    TEST_CHECK(memcmp(out, "0123456789", 10) == 0);
+    for (int i = 10; i < 50; i++)
+    {
+        TEST_CHECK(out[i] == '\0');
+    }
+    TEST_CHECK(memcmp(out + 50, data + 100, 300) == 0);
+
+    TEST_CHECK(k_copy_range(a_fd, 0, a_fd, 100, 200) == EK_COPY_RANGE_OVERLAP);
+
+    TEST_CHECK(k_close(a_fd) == 0);
+    TEST_CHECK(k_close(b_fd) == 0);
+    TEST_CHECK(k_close(c_fd) == 0);
+    TEST_CHECK(unmount() == 0);
+}
+
+void test_snapshot(void)
+{
+    remove(test_fs_name); // assume this succeeded
+
+    TEST_CHECK(mkfs(test_fs_name, 1, 0) == 0);
+
+    TEST_CHECK(mount(test_fs_name) == 0);
+
+    char data[600];
+    for (int i = 0; i < sizeof(data); i++)
+    {
+        data[i] = 'a' + i % 26;
+    }
+
+    int fd = k_open("a", F_WRITE);
+    TEST_CHECK(fd >= 0);
+    TEST_CHECK(k_write(fd, data, sizeof(data)) == sizeof(data));
+    TEST_CHECK(k_close(fd) == 0);
+    TEST_CHECK(n_used_blocks() == 4);
+
+    // taking a snapshot doesn't allocate any blocks
+    TEST_CHECK(k_snapshot_create("s1") == 0);
+    TEST_CHECK(n_used_blocks() == 4);
+    TEST_CHECK(k_snapshot_create("s1") == EK_SNAPSHOT_EXISTS);
+    TEST_CHECK(k_snapshot_create("") == EK_SNAPSHOT_INVALID_NAME);
+
+    // modify a, delete it and create b. The pinned blocks of a are never handed out again
+    fd = k_open("a", F_APPEND);
+    TEST_CHECK(fd >= 0);
+    TEST_CHECK(k_write(fd, "!", 1) == 1);
+    TEST_CHECK(k_close(fd) == 0);
+    TEST_CHECK(n_used_blocks() == 4);
+    TEST_CHECK(k_unlink("a") == 0);
+    fd = k_open("b", F_WRITE);
+    TEST_CHECK(fd >= 0);
+    TEST_CHECK(k_write(fd, data, sizeof(data)) == sizeof(data));
+    TEST_CHECK(n_used_blocks() == 4);
+
+    // can't roll back while files are open
+    TEST_CHECK(k_snapshot_rollback("s1") == EK_SNAPSHOT_FILES_OPEN);
+    TEST_CHECK(k_close(fd) == 0);
+    TEST_CHECK(k_snapshot_rollback("missing") == EK_SNAPSHOT_NOT_FOUND);
+
+    TEST_CHECK(k_snapshot_rollback("s1") == 0);
+    TEST_CHECK(n_used_blocks() == 4);
+    TEST_CHECK(k_open("b", F_READ) < 0);
+    char out[700];
+    fd = k_open("a", F_READ);
+    TEST_CHECK(fd >= 0);
+    TEST_CHECK(k_read(fd, sizeof(out), out) == sizeof(data));
+    TEST_CHECK(memcmp(out, data, sizeof(data)) == 0);
+    TEST_CHECK(k_close(fd) == 0);
+
+    // snapshots survive a remount
+    TEST_CHECK(unmount() == 0);
+    TEST_CHECK(mount(test_fs_name) == 0);
+    TEST_CHECK(k_snapshot_create("s1") == EK_SNAPSHOT_EXISTS);
+
+    // once the snapshot is gone the blocks a no longer uses can be reused
+    TEST_CHECK(k_snapshot_delete("s1") == 0);
+    TEST_CHECK(k_snapshot_delete("s1") == EK_SNAPSHOT_NOT_FOUND);
+    TEST_CHECK(k_unlink("a") == 0);
+    TEST_CHECK(n_used_blocks() == 1);
+
+    TEST_CHECK(unmount() == 0);
+}
+
+void test_k_mmap(void)
+{
+    remove(test_fs_name); // assume this succeeded
+
+    TEST_CHECK(mkfs(test_fs_name, 1, 0) == 0);
+
+    TEST_CHECK(mount(test_fs_name) == 0);
+
+    char data[600];
+    for (int i = 0; i < sizeof(data); i++)
+    {
+        data[i] = 'a' + i % 26;
+    }
+
+    // a is laid out contiguously, so a read-only mapping comes straight from the image
+    int a_fd = k_open("a", F_WRITE);
+    TEST_CHECK(a_fd >= 0);
+    TEST_CHECK(k_write(a_fd, data, sizeof(data)) == sizeof(data));
+    void *addr;
+    TEST_CHECK(k_mmap(0, a_fd, 10, 10000, F_PROT_READ, &addr) == 0);
+    TEST_CHECK(memcmp(addr, data + 10, sizeof(data) - 10) == 0);
+    TEST_CHECK(k_mmap(0, a_fd, sizeof(data), 1, F_PROT_READ, &addr) == EK_MMAP_BAD_RANGE);
+    TEST_CHECK(k_mmap(0, a_fd, 0, 1, 4, &addr) == EK_MMAP_BAD_PROT);
+    TEST_CHECK(k_close(a_fd) == 0);
+
+    // the mapping keeps a alive after it is closed and unlinked
+    TEST_CHECK(k_unlink("a") == 0);
+    TEST_CHECK(n_used_blocks() == 4);
+    TEST_CHECK(memcmp(addr, data + 10, sizeof(data) - 10) == 0);
+    TEST_CHECK(k_munmap(addr) == 0);
+    TEST_CHECK(k_munmap(addr) == EK_MUNMAP_NOT_MAPPED);
+    TEST_CHECK(n_used_blocks() == 1);
+
+    // b is fragmented by c, and shares its blocks with a clone
+    int b_fd = k_open("b", F_WRITE);
+    TEST_CHECK(k_write(b_fd, data, 300) == 300);
+    int c_fd = k_open("c", F_WRITE);
+    TEST_CHECK(k_write(c_fd, data, 300) == 300);
+    TEST_CHECK(k_close(c_fd) == 0);
+    TEST_CHECK(k_write(b_fd, data + 300, 300) == 300);
+    TEST_CHECK(k_clone("b", "d") == 0);
+
+    TEST_CHECK(k_mmap(0, b_fd, 200, 300, F_PROT_READ | F_PROT_WRITE, &addr) == 0);
+    TEST_CHECK(memcmp(addr, data + 200, 300) == 0);
+    memset(addr, 'X', 300);
+
+    // writes reach the file on msync
+    char out[700];
+    TEST_CHECK(k_lseek(b_fd, 0, F_SEEK_SET) == 0);
+    TEST_CHECK(k_read(b_fd, sizeof(out), out) == sizeof(data));
+    TEST_CHECK(memcmp(out, data, sizeof(data)) == 0);
+    TEST_CHECK(k_msync(addr) == 0);
+    TEST_CHECK(k_lseek(b_fd, 0, F_SEEK_SET) == 0);
+    TEST_CHECK(k_read(b_fd, sizeof(out), out) == sizeof(data));
+    TEST_CHECK(memcmp(out, data, 200) == 0);
+    TEST_CHECK(out[200] == 'X' && out[499] == 'X');
+    TEST_CHECK(memcmp(out + 500, data + 500, 100) == 0);
+    TEST_CHECK(k_munmap(addr) == 0);
+    TEST_CHECK(k_close(b_fd) == 0);
+
+    // but not to the clone
+    int d_fd = k_open("d", F_READ);
+    TEST_CHECK(k_read(d_fd, sizeof(out), out) == sizeof(data));
+    TEST_CHECK(memcmp(out, data, sizeof(data)) == 0);
+    TEST_CHECK(k_close(d_fd) == 0);
+
+    // a process that exits gives up its mappings, writing them back, but leaves other processes' alone
+    void *other_addr;
+    b_fd = k_open("b", F_APPEND);
+    TEST_CHECK(k_mmap(7, b_fd, 0, 100, F_PROT_READ | F_PROT_WRITE, &addr) == 0);
+    TEST_CHECK(k_mmap(8, b_fd, 0, 100, F_PROT_READ, &other_addr) == 0);
+    TEST_CHECK(k_close(b_fd) == 0);
+    memset(addr, 'Y', 100);
+    TEST_CHECK(k_munmap_all(7) == 0);
+    TEST_CHECK(k_munmap(addr) == EK_MUNMAP_NOT_MAPPED);
+    TEST_CHECK(k_msync(other_addr) == 0); // still mapped
+    TEST_CHECK(k_munmap_all(8) == 0);
+    TEST_CHECK(k_munmap(other_addr) == EK_MUNMAP_NOT_MAPPED);
+    b_fd = k_open("b", F_READ);
+    TEST_CHECK(k_read(b_fd, sizeof(out), out) == sizeof(data));
+    TEST_CHECK(out[0] == 'Y' && out[99] == 'Y' && out[100] == data[100]);
+    TEST_CHECK(k_close(b_fd) == 0);
+
+    // and once nothing maps a deleted file, its blocks are freed
+    TEST_CHECK(k_unlink("b") == 0);
+    TEST_CHECK(k_unlink("c") == 0);
+    TEST_CHECK(k_unlink("d") == 0);
+    TEST_CHECK(n_used_blocks() == 1);
+
+    TEST_CHECK(unmount() == 0);
+}
+
+void test_fsstats(void)
+{
+    remove(test_fs_name); // assume this succeeded
+
+    TEST_CHECK(mkfs(test_fs_name, 1, 0) == 0);
+
+    TEST_CHECK(mount(test_fs_name) == 0);
+
+    char data[600] = {0};
+    int fd = k_open("a", F_WRITE);
+    TEST_CHECK(fd >= 0);
+    TEST_CHECK(k_write(fd, data, sizeof(data)) == sizeof(data));
+
+    fs_stats stats;
+    k_fsstats(&stats);
+    TEST_CHECK(stats.dir_lookups >= 1);
+    TEST_CHECK(stats.alloc_scans >= 1);
+    TEST_CHECK(stats.write_block_calls >= 3);
+    TEST_CHECK(stats.write_block_bytes == stats.write_block_calls * 256);
+
+    k_fsstats_reset();
+    k_fsstats(&stats);
+    TEST_CHECK(stats.get_block_calls == 0 && stats.write_block_calls == 0 && stats.chain_hops == 0);
+
+    // reading the 3 blocks of a touches each once
+    char out[600];
+    TEST_CHECK(k_lseek(fd, 0, F_SEEK_SET) == 0);
+    TEST_CHECK(k_read(fd, sizeof(out), out) == sizeof(out));
+    k_fsstats(&stats);
+    TEST_CHECK(stats.get_block_calls == 3);
+    TEST_CHECK(stats.get_block_bytes == 3 * 256);
+    TEST_CHECK(stats.write_block_calls == 0);
+    TEST_CHECK(stats.chain_hops >= 2);
+    TEST_CHECK(k_close(fd) == 0);
+
+    TEST_CHECK(unmount() == 0);
+}
+
+void test_block_map(void)
+{
+    remove(test_fs_name); // assume this succeeded
+
+    TEST_CHECK(mkfs(test_fs_name, 1, 0) == 0);
+
+    TEST_CHECK(mount(test_fs_name) == 0);
+
+    char data[5120];
+    for (int i = 0; i < sizeof(data); i++)
+    {
+        data[i] = 'a' + i % 23;
+    }
+
+    int fd = k_open("a", F_WRITE);
+    TEST_CHECK(fd >= 0);
+    TEST_CHECK(k_write(fd, data, sizeof(data)) == sizeof(data));
+
+    // once the chain has been walked, seeking around costs no more hops
+    char out[sizeof(data)];
+    TEST_CHECK(k_lseek(fd, 0, F_SEEK_SET) == 0);
+    TEST_CHECK(k_read(fd, sizeof(out), out) == sizeof(out));
+    TEST_CHECK(memcmp(out, data, sizeof(data)) == 0);
+    k_fsstats_reset();
+    uint32_t offsets[] = {4900, 300, 2600, 5000, 0, 1234};
+    for (int i = 0; i < sizeof(offsets) / sizeof(offsets[0]); i++)
+    {
+        TEST_CHECK(k_lseek(fd, offsets[i], F_SEEK_SET) == offsets[i]);
+        TEST_CHECK(k_read(fd, 10, out) == 10);
+        TEST_CHECK(memcmp(out, data + offsets[i], 10) == 0);
+    }
+    fs_stats stats;
+    k_fsstats(&stats);
+    TEST_CHECK(stats.chain_hops <= 2 * sizeof(offsets) / sizeof(offsets[0]));
+
+    // a write in the middle cuts the chain after it, and the map with it
+    TEST_CHECK(k_lseek(fd, 1000, F_SEEK_SET) == 1000);
+    TEST_CHECK(k_write(fd, "XYZ", 3) == 3);
+    TEST_CHECK(k_lseek(fd, 1003, F_SEEK_SET) == 1003);
+    TEST_CHECK(k_read(fd, 10, out) == 0);
+    TEST_CHECK(k_lseek(fd, 990, F_SEEK_SET) == 990);
+    TEST_CHECK(k_read(fd, sizeof(out), out) == 13);
+    TEST_CHECK(memcmp(out, data + 990, 10) == 0 && memcmp(out + 10, "XYZ", 3) == 0);
+
+    // writing past the end grows the chain again
+    TEST_CHECK(k_lseek(fd, 3000, F_SEEK_SET) == 3000);
+    TEST_CHECK(k_write(fd, data, 100) == 100);
+    TEST_CHECK(k_lseek(fd, 2000, F_SEEK_SET) == 2000);
+    TEST_CHECK(k_read(fd, sizeof(out), out) == 1100);
+    TEST_CHECK(out[0] == 0 && out[999] == 0);
+    TEST_CHECK(memcmp(out + 1000, data, 100) == 0);
+
+    // writing to a clone copies the shared blocks, which the map has to follow
+    TEST_CHECK(k_clone("a", "b") == 0);
+    TEST_CHECK(k_lseek(fd, 50, F_SEEK_SET) == 50);
+    TEST_CHECK(k_write(fd, "Q", 1) == 1);
+    TEST_CHECK(k_lseek(fd, 0, F_SEEK_SET) == 0);
+    TEST_CHECK(k_read(fd, sizeof(out), out) == 51);
+    TEST_CHECK(memcmp(out, data, 50) == 0 && out[50] == 'Q');
+    TEST_CHECK(k_close(fd) == 0);
+
+    int b_fd = k_open("b", F_READ);
+    TEST_CHECK(b_fd >= 0);
+    TEST_CHECK(k_lseek(b_fd, 3000, F_SEEK_SET) == 3000);
+    TEST_CHECK(k_read(b_fd, sizeof(out), out) == 100);
+    TEST_CHECK(memcmp(out, data, 100) == 0);
+    TEST_CHECK(k_close(b_fd) == 0);
+
+    // reopening for write truncates the file, and must not reuse the old map
+    fd = k_open("a", F_WRITE);
+    TEST_CHECK(fd >= 0);
+    TEST_CHECK(k_write(fd, data + 7, 600) == 600);
+    TEST_CHECK(k_lseek(fd, 500, F_SEEK_SET) == 500);
+    TEST_CHECK(k_read(fd, sizeof(out), out) == 100);
+    TEST_CHECK(memcmp(out, data + 507, 100) == 0);
+    TEST_CHECK(k_close(fd) == 0);
+
+    TEST_CHECK(unmount() == 0);
+}
+
+void test_reclaim(void)
+{
+    remove(test_fs_name); // assume this succeeded
+
+    TEST_CHECK(mkfs(test_fs_name, 1, 0) == 0);
+
+    TEST_CHECK(mount(test_fs_name) == 0);
+    k_reclaim_async(true);
+
+    static char data[100 * 256];
+    memset(data, 'r', sizeof(data));
+
+    // small files are still freed on the spot
+    int fd = k_open("small", F_WRITE);
+    TEST_CHECK(k_write(fd, data, 512) == 512);
+    TEST_CHECK(k_close(fd) == 0);
+    TEST_CHECK(k_unlink("small") == 0);
+    TEST_CHECK(n_used_blocks() == 1);
+
+    // but unlinking a large one only queues its chain
+    fd = k_open("a", F_WRITE);
+    TEST_CHECK(k_write(fd, data, sizeof(data)) == sizeof(data));
+    TEST_CHECK(k_close(fd) == 0);
+    TEST_CHECK(n_used_blocks() == 101);
+    TEST_CHECK(k_unlink("a") == 0);
+    TEST_CHECK(n_used_blocks() == 101);
+
+    // which the reclaimer frees a bit at a time
+    TEST_CHECK(k_reclaim(10) == 10);
+    TEST_CHECK(n_used_blocks() == 91);
+
+    // and the allocator frees the rest itself when it runs out of space
+    fd = k_open("b", F_WRITE);
+    TEST_CHECK(k_write(fd, data, sizeof(data)) == sizeof(data));
+    TEST_CHECK(n_used_blocks() == 101);
+    TEST_CHECK(k_reclaim(1000) == 0);
+
+    // truncating a large file at open queues it as well
+    TEST_CHECK(k_close(fd) == 0);
+    fd = k_open("b", F_WRITE);
+    TEST_CHECK(fd >= 0);
+    TEST_CHECK(n_used_blocks() == 101);
+    TEST_CHECK(k_write(fd, "b", 1) == 1);
+    TEST_CHECK(k_close(fd) == 0);
+    TEST_CHECK(k_reclaim(1000) == 100);
+    TEST_CHECK(n_used_blocks() == 2);
+
+    k_reclaim_async(false);
+    TEST_CHECK(unmount() == 0);
+}
+
+void test_fd_generations(void)
+{
+    remove(test_fs_name); // assume this succeeded
+
+    TEST_CHECK(mkfs(test_fs_name, 1, 0) == 0);
+
+    TEST_CHECK(mount(test_fs_name) == 0);
+
+    int a_fd = k_open("a", F_WRITE);
+    TEST_CHECK(a_fd == 3);
+    int a_generation = k_getgeneration(a_fd);
+    TEST_CHECK(a_generation >= 0);
+    int b_fd = k_open("b", F_WRITE);
+    TEST_CHECK(b_fd == 4);
+
+    // opening a again shares its entry
+    int a_fd2 = k_open("a", F_READ);
+    TEST_CHECK(a_fd2 == a_fd);
+    TEST_CHECK(k_close(a_fd2) == 0);
+    TEST_CHECK(k_getgeneration(a_fd) == a_generation);
+
+    // the released entry is the next one handed out, but as a new generation
+    TEST_CHECK(k_close(a_fd) == 0);
+    TEST_CHECK(k_getgeneration(a_fd) == EK_GETGENERATION_FD_NOT_IN_USE);
+    TEST_CHECK(k_close(a_fd) == EK_CLOSE_FD_NOT_IN_TABLE);
+    int c_fd = k_open("c", F_WRITE);
+    TEST_CHECK(c_fd == a_fd);
+    TEST_CHECK(k_getgeneration(c_fd) != a_generation);
+
+    // a failed open doesn't use up an entry
+    TEST_CHECK(k_open("missing", F_READ) < 0);
+    int d_fd = k_open("d", F_WRITE);
+    TEST_CHECK(d_fd == 5);
+
+    TEST_CHECK(k_close(b_fd) == 0);
+    TEST_CHECK(k_close(c_fd) == 0);
+    TEST_CHECK(k_close(d_fd) == 0);
+    TEST_CHECK(unmount() == 0);
+}
+
+void test_pack(void)
+{
+    remove(test_fs_name); // assume this succeeded
+
+    TEST_CHECK(mkfs(test_fs_name, 1, 1) == 0);
+
+    TEST_CHECK(mount_with_flags(test_fs_name, MOUNT_PACK) == 0);
+
+    // small files share one block once they are closed
+    const char *names[] = {"a", "b", "c"};
+    const char *contents[] = {"first", "second file", "third"};
+    for (int i = 0; i < 3; i++)
+    {
+        int fd = k_open(names[i], F_WRITE);
+        TEST_CHECK(k_write(fd, contents[i], strlen(contents[i])) == strlen(contents[i]));
+        TEST_CHECK(k_close(fd) == 0);
+    }
+    TEST_CHECK(n_used_blocks() == 2);
+
+    char buf[64];
+    for (int i = 0; i < 3; i++)
+    {
+        int fd = k_open(names[i], F_READ);
+        memset(buf, 0, sizeof(buf));
+        TEST_CHECK(k_read(fd, sizeof(buf), buf) == strlen(contents[i]));
+        TEST_CHECK(strcmp(buf, contents[i]) == 0);
+        TEST_CHECK(k_close(fd) == 0);
+    }
+
+    // writing to one moves it back to a block of its own, and packs it again at close
+    int fd = k_open("b", F_APPEND);
+    TEST_CHECK(n_used_blocks() == 2);
+    TEST_CHECK(k_write(fd, "!", 1) == 1);
+    TEST_CHECK(n_used_blocks() == 3);
+    TEST_CHECK(k_close(fd) == 0);
+    TEST_CHECK(n_used_blocks() == 2);
+
+    fd = k_open("b", F_READ);
+    memset(buf, 0, sizeof(buf));
+    TEST_CHECK(k_lseek(fd, 7, F_SEEK_SET) == 7);
+    TEST_CHECK(k_read(fd, sizeof(buf), buf) == 5);
+    TEST_CHECK(strcmp(buf, "file!") == 0);
+    TEST_CHECK(k_close(fd) == 0);
+
+    // files that need more than half a block keep their own
+    static char big[300];
+    memset(big, 'x', sizeof(big));
+    fd = k_open("big", F_WRITE);
+    TEST_CHECK(k_write(fd, big, sizeof(big)) == sizeof(big));
+    TEST_CHECK(k_close(fd) == 0);
+    TEST_CHECK(n_used_blocks() == 3);
+
+    // packed files are still readable without the flag
+    TEST_CHECK(unmount() == 0);
+    TEST_CHECK(mount(test_fs_name) == 0);
+    fd = k_open("c", F_READ);
+    memset(buf, 0, sizeof(buf));
+    TEST_CHECK(k_read(fd, sizeof(buf), buf) == 5);
+    TEST_CHECK(strcmp(buf, "third") == 0);
+    TEST_CHECK(k_close(fd) == 0);
+
+    // and the shared block is freed with the last file in it
+    TEST_CHECK(k_unlink("a") == 0);
+    TEST_CHECK(k_unlink("b") == 0);
+    TEST_CHECK(n_used_blocks() == 3);
+    TEST_CHECK(k_unlink("c") == 0);
+    TEST_CHECK(k_unlink("big") == 0);
+    TEST_CHECK(n_used_blocks() == 1);
+
+    TEST_CHECK(unmount() == 0);
+}
+
+void test_root_dir_compaction(void)
+{
+    remove(test_fs_name); // assume this succeeded
+
+    TEST_CHECK(mkfs(test_fs_name, 1, 0) == 0);
+
+    TEST_CHECK(mount(test_fs_name) == 0);
+
+    // 12 entries fill 3 blocks of 4, and the end of directory entry takes a 4th
+    char name[8];
+    for (int i = 0; i < 12; i++)
+    {
+        snprintf(name, sizeof(name), "f%d", i);
+        int fd = k_open(name, F_WRITE);
+        TEST_CHECK(fd >= 0);
+        TEST_CHECK(k_close(fd) == 0);
+    }
+    TEST_CHECK(n_used_blocks() == 4);
+
+    // open files follow their entries when they move, including deleted ones
+    int deleted_fd = k_open("f0", F_READ);
+    int open_fd = k_open("f11", F_APPEND);
+    TEST_CHECK(k_unlink("f0") == 0);
+    for (int i = 1; i <= 6; i++)
+    {
+        snprintf(name, sizeof(name), "f%d", i);
+        TEST_CHECK(k_unlink(name) == 0);
+    }
+
+    // half of the directory was deleted entries, so it shrinks to the 6 left in 2 blocks
+    fs_stats stats;
+    k_fsstats(&stats);
+    TEST_CHECK(stats.dir_compactions == 1);
+    TEST_CHECK(n_used_blocks() == 2);
+    TEST_CHECK(fs.n_dir_entries == 6 && fs.n_dir_tombstones == 0);
+
+    TEST_CHECK(k_write(open_fd, "x", 1) == 1);
+    TEST_CHECK(k_close(open_fd) == 0);
+    TEST_CHECK(k_close(deleted_fd) == 0);
+    TEST_CHECK(fs.n_dir_tombstones == 1);
+    TEST_CHECK(k_open("f0", F_READ) == EK_OPEN_FILE_DOES_NOT_EXIST);
+
+    // and looking up the last file reads no more blocks than it would on a fresh volume
+    k_fsstats_reset();
+    int fd = k_open("f11", F_READ);
+    TEST_CHECK(fd >= 0);
+    k_fsstats(&stats);
+    TEST_CHECK(stats.dir_block_reads == 2);
+    TEST_CHECK(k_close(fd) == 0);
+
+    TEST_CHECK(unmount() == 0);
+    TEST_CHECK(mount(test_fs_name) == 0);
+    TEST_CHECK(fs.n_dir_entries == 6 && fs.n_dir_tombstones == 1);
+    char buf[4] = {0};
+    fd = k_open("f11", F_READ);
+    TEST_CHECK(k_read(fd, sizeof(buf), buf) == 1);
+    TEST_CHECK(buf[0] == 'x');
+    TEST_CHECK(k_close(fd) == 0);
+    for (int i = 7; i < 11; i++)
+    {
+        snprintf(name, sizeof(name), "f%d", i);
+        fd = k_open(name, F_READ);
+        TEST_CHECK(fd >= 0);
+        TEST_CHECK(k_close(fd) == 0);
+    }
+
+    // a compaction whose writes fail leaves the directory and the free blocks as they were
+    int rw_fd = fs.fd;
+    fs.fd = open(test_fs_name, O_RDONLY);
+    TEST_CHECK(fs.fd >= 0);
+    TEST_CHECK(k_compact_root_dir() == EK_COMPACT_ROOT_DIR_WRITE_BLOCK_FAILED);
+    TEST_CHECK(close(fs.fd) == 0);
+    fs.fd = rw_fd;
+    TEST_CHECK(n_used_blocks() == 3);
+    TEST_CHECK(fs.n_dir_entries == 6 && fs.n_dir_tombstones == 1);
+    TEST_CHECK(k_compact_root_dir() == 0);
+    TEST_CHECK(n_used_blocks() == 3);
+    TEST_CHECK(fs.n_dir_entries == 5 && fs.n_dir_tombstones == 0);
+    for (int i = 7; i < 12; i++)
+    {
+        snprintf(name, sizeof(name), "f%d", i);
+        fd = k_open(name, F_READ);
+        TEST_CHECK(fd >= 0);
+        TEST_CHECK(k_close(fd) == 0);
+    }
+
+    TEST_CHECK(unmount() == 0);
+}
+
+void test_name_filter(void)
+{
+    remove(test_fs_name); // assume this succeeded
+
+    TEST_CHECK(mkfs(test_fs_name, 1, 0) == 0);
+
+    TEST_CHECK(mount(test_fs_name) == 0);
+
+    // more files than the filter is first sized for, so it gets rebuilt along the way
+    char name[16];
+    for (int i = 0; i < 100; i++)
+    {
+        snprintf(name, sizeof(name), "file%d", i);
+        int fd = k_open(name, F_WRITE);
+        TEST_CHECK(fd >= 0);
+        TEST_CHECK(k_close(fd) == 0);
+    }
+
+    // most lookups of missing names don't read the directory at all
+    fs_stats stats;
+    k_fsstats_reset();
+    for (int i = 0; i < 100; i++)
+    {
+        snprintf(name, sizeof(name), "missing%d", i);
+        TEST_CHECK(k_open(name, F_READ) == EK_OPEN_FILE_DOES_NOT_EXIST);
+    }
+    TEST_CHECK(k_unlink("missing") == EK_UNLINK_FILE_NOT_FOUND);
+    k_fsstats(&stats);
+    TEST_CHECK(stats.name_filter_skips + stats.name_filter_fps == 101);
+    TEST_CHECK(stats.name_filter_fps <= 5);
+    TEST_MSG("%llu false positives", (unsigned long long)stats.name_filter_fps);
+
+    // and every file that exists is still found, including renamed ones
+    TEST_CHECK(k_mv("file0", "renamed") == 0);
+    int fd = k_open("renamed", F_READ);
+    TEST_CHECK(fd >= 0);
+    TEST_CHECK(k_close(fd) == 0);
+    TEST_CHECK(k_open("file0", F_READ) == EK_OPEN_FILE_DOES_NOT_EXIST);
+    for (int i = 1; i < 100; i++)
+    {
+        snprintf(name, sizeof(name), "file%d", i);
+        fd = k_open(name, F_READ);
+        TEST_CHECK(fd >= 0);
+        TEST_CHECK(k_close(fd) == 0);
+    }
+
+    TEST_CHECK(unmount() == 0);
+}
+
+void test_slab(void)
+{
+    remove(test_fs_name); // assume this succeeded
+
+    TEST_CHECK(mkfs(test_fs_name, 1, 0) == 0);
+
+    TEST_CHECK(mount(test_fs_name) == 0);
+
+    // a file with a block map longer than a slab object, and a few short ones
+    static char data[40 * 256];
+    int fd = k_open("big", F_WRITE);
+    TEST_CHECK(k_write(fd, data, sizeof(data)) == sizeof(data));
+    TEST_CHECK(k_close(fd) == 0);
+    char name[8];
+    for (int i = 0; i < 8; i++)
+    {
+        snprintf(name, sizeof(name), "f%d", i);
+        fd = k_open(name, F_WRITE);
+        TEST_CHECK(k_write(fd, "x", 1) == 1);
+        TEST_CHECK(k_close(fd) == 0);
+    }
+
+    fs_stats stats;
+    k_fsstats(&stats);
+    TEST_CHECK(stats.slab_in_use == 0);
+    uint64_t capacity = stats.slab_capacity;
+    TEST_CHECK(capacity > 0);
+
+    // once warmed up, opening and closing files doesn't grow the caches, and failed opens
+    // give back what they took
+    int fds[9];
+    char buf[1];
+    for (int round = 0; round < 100; round++)
+    {
+        fds[8] = k_open("big", F_READ);
+        TEST_CHECK(k_lseek(fds[8], sizeof(data) - 1, F_SEEK_SET) == sizeof(data) - 1);
+        TEST_CHECK(k_read(fds[8], 1, buf) == 1);
+        for (int i = 0; i < 8; i++)
+        {
+            snprintf(name, sizeof(name), "f%d", i);
+            fds[i] = k_open(name, F_READ);
+            TEST_CHECK(k_read(fds[i], 1, buf) == 1 && buf[0] == 'x');
+        }
+        TEST_CHECK(k_open("missing", F_READ) == EK_OPEN_FILE_DOES_NOT_EXIST);
+        k_fsstats(&stats);
+        TEST_CHECK(stats.slab_in_use == 17); // 9 dir entries and the block maps of the short files (big outgrew its slab object)
+        for (int i = 0; i < 9; i++)
+        {
+            TEST_CHECK(k_close(fds[i]) == 0);
+        }
+    }
+    k_fsstats(&stats);
+    TEST_CHECK(stats.slab_in_use == 0);
+    TEST_CHECK(stats.slab_capacity == capacity);
+
+    TEST_CHECK(unmount() == 0);
+}
+
+/**
+ * Count the allocatable blocks and the longest run of them by walking the FAT
+ */
+void scan_free_blocks(uint32_t *n_free_ptr, uint32_t *longest_ptr)
+{
+    uint32_t n_free = 0, run = 0, longest = 0;
+    for (size_t i = 1; i < n_fat_entries(); i++)
+    {
+        bool is_free = fat_at(i) == 0 && fs.snap_refs[i] == 0;
+        n_free += is_free;
+        run = is_free ? run + 1 : 0;
+        longest = run > longest ? run : longest;
+    }
+    *n_free_ptr = n_free;
+    *longest_ptr = longest;
+}
+
+void test_statfs(void)
+{
+    remove(test_fs_name); // assume this succeeded
+
+    TEST_CHECK(mkfs(test_fs_name, 1, 0) == 0);
+
+    TEST_CHECK(mount(test_fs_name) == 0);
+
+    fs_statfs statfs;
+    TEST_CHECK(k_statfs(&statfs) == 0);
+    TEST_CHECK(statfs.block_size == 256);
+    TEST_CHECK(statfs.total_blocks == 127);
+    TEST_CHECK(statfs.free_blocks == 126); // the root directory takes block 1
+    TEST_CHECK(statfs.largest_free_run == 126);
+
+    // fragment the free space: write 3 files, then delete the middle one and shrink the first
+    static char data[20 * 256];
+    const char *names[] = {"a", "b", "c"};
+    for (int i = 0; i < 3; i++)
+    {
+        int fd = k_open(names[i], F_WRITE);
+        TEST_CHECK(k_write(fd, data, sizeof(data)) == sizeof(data));
+        TEST_CHECK(k_close(fd) == 0);
+    }
+    TEST_CHECK(k_unlink("b") == 0);
+    int fd = k_open("a", F_WRITE);
+    TEST_CHECK(k_write(fd, data, 256) == 256);
+    TEST_CHECK(k_close(fd) == 0);
+
+    uint32_t n_free, longest;
+    scan_free_blocks(&n_free, &longest);
+    TEST_CHECK(k_statfs(&statfs) == 0);
+    TEST_CHECK(statfs.free_blocks == n_free);
+    TEST_CHECK(statfs.free_blocks == 126 - 21);
+    TEST_CHECK(statfs.largest_free_run == longest);
+
+    // blocks a snapshot still has aren't free, even once the live volume lets go of them
+    TEST_CHECK(k_snapshot_create("s") == 0);
+    TEST_CHECK(k_unlink("c") == 0);
+    scan_free_blocks(&n_free, &longest);
+    TEST_CHECK(k_statfs(&statfs) == 0);
+    TEST_CHECK(statfs.free_blocks == n_free);
+    TEST_CHECK(statfs.largest_free_run == longest);
+    TEST_CHECK(k_snapshot_delete("s") == 0);
+    TEST_CHECK(k_statfs(&statfs) == 0);
+    TEST_CHECK(statfs.free_blocks == 125);
+
+    // the count survives a remount, where it is computed from scratch
+    TEST_CHECK(unmount() == 0);
+    TEST_CHECK(mount(test_fs_name) == 0);
+    TEST_CHECK(k_statfs(&statfs) == 0);
+    TEST_CHECK(statfs.free_blocks == 125);
+    TEST_CHECK(statfs.largest_free_run == 125); // everything after a
+    TEST_CHECK(unmount() == 0);
+}
+
+#define READ_ONLY_N_THREADS 4
+
+// each reader thread gets its own fd to the same file and checks every byte of it
+typedef struct read_only_reader_st
+{
+    int fd;
+    bool ok;
+} read_only_reader;
+
+void *read_only_reader_main(void *arg)
+{
+    read_only_reader *reader = (read_only_reader *)arg;
+    char buf[1000];
+    directory_entry dir_entry;
+    reader->ok = true;
+    for (int round = 0; round < 50; round++)
+    {
+        reader->ok &= k_stat("big", &dir_entry) == 0 && dir_entry.size == sizeof(buf);
+        reader->ok &= k_stat("missing", &dir_entry) == EK_STAT_FILE_NOT_FOUND;
+        reader->ok &= k_lseek(reader->fd, round % 10, F_SEEK_SET) == round % 10;
+        int n = k_read(reader->fd, sizeof(buf), buf);
+        reader->ok &= n == (int)sizeof(buf) - round % 10;
+        for (int i = 0; i < n; i++)
+        {
+            reader->ok &= buf[i] == (char)((i + round % 10) % 251);
+        }
+    }
+    return NULL;
+}
+
+void test_read_only_mount(void)
+{
+    remove(test_fs_name); // assume this succeeded
+
+    TEST_CHECK(mkfs(test_fs_name, 1, 1) == 0);
+
+    TEST_CHECK(mount_with_flags(test_fs_name, MOUNT_PACK) == 0);
+    char data[1000];
+    for (size_t i = 0; i < sizeof(data); i++)
+    {
+        data[i] = (char)(i % 251);
+    }
+    int fd = k_open("big", F_WRITE);
+    TEST_CHECK(k_write(fd, data, sizeof(data)) == sizeof(data));
+    TEST_CHECK(k_close(fd) == 0);
+    fd = k_open("small", F_WRITE);
+    TEST_CHECK(k_write(fd, "packed", 6) == 6);
+    TEST_CHECK(k_close(fd) == 0);
+    TEST_CHECK(unmount() == 0);
+
+    TEST_CHECK(mount_with_flags(test_fs_name, MOUNT_READ_ONLY) == 0);
+
+    // everything that would change the image is turned away up front
+    TEST_CHECK(k_open("big", F_WRITE) == EK_READ_ONLY_FS);
+    TEST_CHECK(k_open("new", F_APPEND) == EK_READ_ONLY_FS);
+    TEST_CHECK(k_unlink("big") == EK_READ_ONLY_FS);
+    TEST_CHECK(k_chmod("big", P_READ_ONLY_FILE_PERMISSION, F_CHMOD_SET) == EK_READ_ONLY_FS);
+    TEST_CHECK(k_mv("big", "moved") == EK_READ_ONLY_FS);
+    TEST_CHECK(k_clone("big", "copy") == EK_READ_ONLY_FS);
+    TEST_CHECK(k_snapshot_create("s") == EK_READ_ONLY_FS);
+    TEST_CHECK(k_compact_root_dir() == EK_READ_ONLY_FS);
+    fd = k_open("big", F_READ);
+    TEST_CHECK(fd >= 0);
+    TEST_CHECK(k_write(fd, "x", 1) == EK_READ_ONLY_FS);
+    TEST_CHECK(k_copy_range(fd, 0, fd, 10, 10) == EK_READ_ONLY_FS);
+    void *addr;
+    TEST_CHECK(k_mmap(0, fd, 0, 10, F_PROT_READ | F_PROT_WRITE, &addr) == EK_READ_ONLY_FS);
+    TEST_CHECK(k_close(fd) == 0);
+
+    // reading a packed file, including through a mapping, doesn't unpack it
+    directory_entry dir_entry;
+    TEST_CHECK(k_stat("small", &dir_entry) == 0);
+    TEST_CHECK(dir_entry.frag_block != 0);
+    char buf[16];
+    fd = k_open("small", F_READ);
+    TEST_CHECK(k_read(fd, sizeof(buf), buf) == 6);
+    TEST_CHECK(memcmp(buf, "packed", 6) == 0);
+    TEST_CHECK(k_mmap(0, fd, 0, 6, F_PROT_READ, &addr) == 0);
+    TEST_CHECK(memcmp(addr, "packed", 6) == 0);
+    TEST_CHECK(k_munmap(addr) == 0);
+    TEST_CHECK(k_close(fd) == 0);
+
+    // opens of the same file get fds of their own, which threads read at the same time
+    pthread_t threads[READ_ONLY_N_THREADS];
+    read_only_reader readers[READ_ONLY_N_THREADS];
+    for (int i = 0; i < READ_ONLY_N_THREADS; i++)
+    {
+        readers[i].fd = k_open("big", F_READ);
+        TEST_CHECK(readers[i].fd >= 0);
+        TEST_CHECK(i == 0 || readers[i].fd != readers[i - 1].fd);
+    }
+    for (int i = 0; i < READ_ONLY_N_THREADS; i++)
+    {
+        TEST_CHECK(pthread_create(&threads[i], NULL, read_only_reader_main, &readers[i]) == 0);
+    }
+    for (int i = 0; i < READ_ONLY_N_THREADS; i++)
+    {
+        TEST_CHECK(pthread_join(threads[i], NULL) == 0);
+        TEST_CHECK(readers[i].ok);
+        TEST_CHECK(k_close(readers[i].fd) == 0);
+    }
+    TEST_CHECK(unmount() == 0);
+
+    // and nothing was written
+    TEST_CHECK(mount(test_fs_name) == 0);
+    fd = k_open("big", F_READ);
+    char check[1000];
+    TEST_CHECK(k_read(fd, sizeof(check), check) == sizeof(check));
+    TEST_CHECK(memcmp(check, data, sizeof(data)) == 0);
+    TEST_CHECK(k_close(fd) == 0);
+    TEST_CHECK(k_stat("small", &dir_entry) == 0);
+    TEST_CHECK(dir_entry.frag_block != 0);
+    TEST_CHECK(unmount() == 0);
+}
+
+void test_volumes(void)
+{
+    char *scratch_fs_name = "testfs998";
+    remove(test_fs_name); // assume these succeeded
+    remove(scratch_fs_name);
+
+    TEST_CHECK(mkfs(test_fs_name, 1, 0) == 0);
+    TEST_CHECK(mkfs(scratch_fs_name, 1, 0) == 0);
+
+    TEST_CHECK(mount(test_fs_name) == 0);
+    TEST_CHECK(mount_volume("scratch", scratch_fs_name, 0) == 0);
+    TEST_CHECK(mount_volume("scratch", scratch_fs_name, 0) == EMOUNT_ALREADY_MOUNTED);
+    TEST_CHECK(mount_volume("bad:name", scratch_fs_name, 0) == EMOUNT_BAD_VOLUME_NAME);
+
+    // the same name on each volume is a different file
+    int fd = k_open("f", F_WRITE);
+    TEST_CHECK(k_write(fd, "default", 7) == 7);
+    int scratch_fd = k_open("scratch:f", F_WRITE);
+    TEST_CHECK(k_write(scratch_fd, "scratch!!", 9) == 9);
+    TEST_CHECK(k_close(fd) == 0);
+    TEST_CHECK(k_close(scratch_fd) == 0);
+
+    directory_entry dir_entry;
+    TEST_CHECK(k_stat("f", &dir_entry) == 0);
+    TEST_CHECK(dir_entry.size == 7);
+    TEST_CHECK(k_stat(":f", &dir_entry) == 0); // an empty prefix is the default volume
+    TEST_CHECK(dir_entry.size == 7);
+    TEST_CHECK(k_stat("scratch:f", &dir_entry) == 0);
+    TEST_CHECK(dir_entry.size == 9);
+    TEST_CHECK(k_open("nope:f", F_READ) == EK_UNKNOWN_VOLUME);
+
+    // files can't move between volumes
+    TEST_CHECK(k_mv("f", "scratch:g") == EK_MV_CROSS_VOLUME);
+    TEST_CHECK(k_clone("scratch:f", "g") == EK_CLONE_CROSS_VOLUME);
+    TEST_CHECK(k_mv("scratch:f", "scratch:g") == 0);
+    TEST_CHECK(k_stat("scratch:f", &dir_entry) == EK_STAT_FILE_NOT_FOUND);
+
+    // but their data can be copied across, at the offsets given even to an F_APPEND fd
+    fd = k_open("f", F_APPEND);
+    scratch_fd = k_open("scratch:g", F_READ);
+    TEST_CHECK(k_copy_range(scratch_fd, 0, fd, 2, UINT64_MAX) == 9);
+    TEST_CHECK(k_copy_range(scratch_fd, 9, fd, 11, 1) == 0);
+    TEST_CHECK(k_lseek(scratch_fd, 0, F_SEEK_CUR) == 0);
+
+    // deleting most of a volume's root directory compacts that volume's (see test_root_dir_compaction)
+    char name[16];
+    for (int i = 0; i < 8; i++)
+    {
+        snprintf(name, sizeof(name), "scratch:t%d", i);
+        int t_fd = k_open(name, F_WRITE);
+        TEST_CHECK(t_fd >= 0);
+        TEST_CHECK(k_close(t_fd) == 0);
+    }
+    k_fsstats_reset();
+    for (int i = 0; i < 8; i++)
+    {
+        snprintf(name, sizeof(name), "scratch:t%d", i);
+        TEST_CHECK(k_unlink(name) == 0);
+        TEST_CHECK(strcmp(fs.volume_name, "scratch") == 0);
+    }
+    fs_stats stats;
+    k_fsstats(&stats);
+    TEST_CHECK(stats.dir_compactions == 1);
+    // it ran at the 5th unlink, which left g and t5 to t7, and t5 to t7 were deleted after
+    TEST_CHECK(fs.n_dir_entries == 4 && fs.n_dir_tombstones == 3);
+
+    // unmounting scratch closes its files but leaves the default volume's open
+    TEST_CHECK(unmount_volume("scratch") == 0);
+    TEST_CHECK(unmount_volume("scratch") == EK_UNKNOWN_VOLUME);
+    TEST_CHECK(k_read(scratch_fd, 1, (char[1]){0}) < 0);
+    TEST_CHECK(k_write(fd, "+", 1) == 1);
+    TEST_CHECK(k_close(fd) == 0);
+
+    // and what was written to it is still there when it comes back
+    TEST_CHECK(mount_volume("scratch", scratch_fs_name, 0) == 0);
+    char buf[16] = {0};
+    scratch_fd = k_open("scratch:g", F_READ);
+    TEST_CHECK(k_read(scratch_fd, sizeof(buf), buf) == 9);
+    TEST_CHECK(memcmp(buf, "scratch!!", 9) == 0);
+    TEST_CHECK(k_close(scratch_fd) == 0);
+    TEST_CHECK(k_stat("f", &dir_entry) == 0);
+    TEST_CHECK(dir_entry.size == 12);
+    fd = k_open("f", F_READ);
+    TEST_CHECK(k_read(fd, sizeof(buf), buf) == 12);
+    TEST_CHECK(memcmp(buf, "descratch!!+", 12) == 0);
+    TEST_CHECK(k_close(fd) == 0);
+
+    // a copy bigger than the buffer between volumes goes through it a piece at a time
+    char data[20000];
+    for (int i = 0; i < sizeof(data); i++)
+    {
+        data[i] = 'a' + i % 26;
+    }
+    fd = k_open("big", F_WRITE);
+    TEST_CHECK(k_write(fd, data, sizeof(data)) == sizeof(data));
+    scratch_fd = k_open("scratch:big", F_WRITE);
+    uint64_t offset = 0;
+    int bytes_copied;
+    while ((bytes_copied = k_copy_range(fd, offset, scratch_fd, offset, UINT64_MAX - offset)) > 0)
+    {
+        offset += bytes_copied;
+    }
+    TEST_CHECK(bytes_copied == 0 && offset == sizeof(data));
+    TEST_CHECK(k_close(fd) == 0);
+    TEST_CHECK(k_close(scratch_fd) == 0);
+    char copy[sizeof(data)];
+    scratch_fd = k_open("scratch:big", F_READ);
+    TEST_CHECK(k_read(scratch_fd, sizeof(copy), copy) == sizeof(copy));
+    TEST_CHECK(memcmp(copy, data, sizeof(data)) == 0);
+    TEST_CHECK(k_close(scratch_fd) == 0);
+
+    TEST_CHECK(unmount() == 0);
+    TEST_CHECK(!is_mounted());
+    remove(scratch_fs_name);
+}
+
+void test_direct_io(void)
+{
+    remove(test_fs_name); // assume this succeeded
+
+    // 256 byte blocks are smaller than a sector, so O_DIRECT can't address them
+    TEST_CHECK(mkfs(test_fs_name, 1, 0) == 0);
+    TEST_CHECK(mount_with_flags(test_fs_name, MOUNT_DIRECT) == EMOUNT_DIRECT_UNSUPPORTED);
+    TEST_CHECK(!is_mounted());
+    TEST_CHECK(mount(test_fs_name) == 0);
+    TEST_CHECK(k_open("f", F_WRITE | F_DIRECT) == EK_OPEN_DIRECT_UNSUPPORTED);
+    TEST_CHECK(unmount() == 0);
+
+    remove(test_fs_name);
+    TEST_CHECK(mkfs(test_fs_name, 4, 1) == 0); // 512 byte blocks
+    TEST_CHECK(mount(test_fs_name) == 0);
+    TEST_CHECK(fs.direct_fd == -1); // only opened once something asks for it
+
+    // whole blocks from an aligned buffer, then a partial block and one from an unaligned buffer
+    static char expected[10 * 512 + 300];
+    for (size_t i = 0; i < sizeof(expected); i++)
+    {
+        expected[i] = 'a' + i % 23;
+    }
+    char *aligned;
+    TEST_CHECK(posix_memalign((void **)&aligned, DIRECT_IO_ALIGN, sizeof(expected) + 1) == 0);
+    memcpy(aligned, expected, sizeof(expected));
+    int fd = k_open("f", F_WRITE | F_DIRECT);
+    TEST_CHECK(fd >= 0);
+    TEST_CHECK(fs.direct_fd >= 0);
+    TEST_CHECK(k_write(fd, aligned, 8 * 512 + 100) == 8 * 512 + 100);
+    memcpy(aligned + 1, expected + 8 * 512 + 100, sizeof(expected) - (8 * 512 + 100));
+    TEST_CHECK(k_write(fd, aligned + 1, sizeof(expected) - (8 * 512 + 100)) == sizeof(expected) - (8 * 512 + 100));
+    TEST_CHECK(k_close(fd) == 0);
+
+    // the page cache and direct reads see the same data, into aligned buffers and not
+    static char buf[sizeof(expected) + 1];
+    fd = k_open("f", F_READ);
+    TEST_CHECK(k_read(fd, sizeof(buf), buf) == sizeof(expected));
+    TEST_CHECK(memcmp(buf, expected, sizeof(expected)) == 0);
+    TEST_CHECK(k_close(fd) == 0);
+    fd = k_open("f", F_READ | F_DIRECT);
+    memset(aligned, 0, sizeof(expected) + 1);
+    TEST_CHECK(k_read(fd, sizeof(expected), aligned) == sizeof(expected));
+    TEST_CHECK(memcmp(aligned, expected, sizeof(expected)) == 0);
+    TEST_CHECK(k_lseek(fd, 0, F_SEEK_SET) == 0);
+    TEST_CHECK(k_read(fd, sizeof(expected), aligned + 1) == sizeof(expected));
+    TEST_CHECK(memcmp(aligned + 1, expected, sizeof(expected)) == 0);
+    TEST_CHECK(k_close(fd) == 0);
+
+    // a direct read right after a write through the page cache still sees it
+    fd = k_open("g", F_WRITE);
+    TEST_CHECK(k_write(fd, expected, 2 * 512) == 2 * 512);
+    int direct_fd = k_open("g", F_READ | F_DIRECT);
+    TEST_CHECK(k_lseek(direct_fd, 0, F_SEEK_SET) == 0); // the fds share an offset
+    TEST_CHECK(k_read(direct_fd, 2 * 512, aligned) == 2 * 512);
+    TEST_CHECK(memcmp(aligned, expected, 2 * 512) == 0);
+    TEST_CHECK(k_close(direct_fd) == 0);
+    TEST_CHECK(k_close(fd) == 0);
+
+    // with the mount option every file is direct, and the data survives the remount
+    TEST_CHECK(unmount() == 0);
+    TEST_CHECK(mount_with_flags(test_fs_name, MOUNT_DIRECT) == 0);
+    TEST_CHECK(fs.direct_fd >= 0);
+    fd = k_open("f", F_READ);
+    memset(buf, 0, sizeof(buf));
+    TEST_CHECK(k_read(fd, sizeof(buf), buf) == sizeof(expected));
+    TEST_CHECK(memcmp(buf, expected, sizeof(expected)) == 0);
+    TEST_CHECK(k_close(fd) == 0);
+    TEST_CHECK(unmount() == 0);
+
+    TEST_CHECK(mount(test_fs_name) == 0);
+    TEST_CHECK(fs.direct_fd == -1);
+    TEST_CHECK(unmount() == 0);
+    free(aligned);
+}
+
+// kB of this process's memory locked with mlock, from /proc/self/status
+long locked_kb(void)
+{
+    FILE *status = fopen("/proc/self/status", "r");
+    if (status == NULL)
+    {
+        return -1;
+    }
+    char line[128];
+    long kb = -1;
+    while (fgets(line, sizeof(line), status) != NULL)
+    {
+        if (sscanf(line, "VmLck: %ld kB", &kb) == 1)
+        {
+            break;
+        }
+    }
+    fclose(status);
+    return kb;
+}
+
+void test_mount_hints(void)
+{
+    TEST_CHECK(parse_mount_options("populate,mlock,hugepage,sequential,random") ==
+               (MOUNT_POPULATE | MOUNT_MLOCK | MOUNT_HUGEPAGE | MOUNT_SEQUENTIAL | MOUNT_RANDOM));
+
+    remove(test_fs_name); // assume this succeeded
+    TEST_CHECK(mkfs(test_fs_name, 4, 0) == 0);
+
+    // the hints don't change what the filesystem does, whichever of them the kernel takes
+    static char data[40 * 256];
+    static char buf[sizeof(data)];
+    for (size_t i = 0; i < sizeof(data); i++)
+    {
+        data[i] = 'a' + i % 19;
+    }
+    int hints[] = {MOUNT_POPULATE, MOUNT_HUGEPAGE | MOUNT_POPULATE, MOUNT_SEQUENTIAL, MOUNT_RANDOM | MOUNT_SEQUENTIAL, MOUNT_POPULATE | MOUNT_READ_ONLY};
+    for (size_t i = 0; i < sizeof(hints) / sizeof(hints[0]); i++)
+    {
+        TEST_CHECK(mount_with_flags(test_fs_name, hints[i]) == 0);
+        if (!(hints[i] & MOUNT_READ_ONLY))
+        {
+            int fd = k_open("f", F_WRITE);
+            TEST_CHECK(k_write(fd, data, sizeof(data)) == sizeof(data));
+            TEST_CHECK(k_close(fd) == 0);
+        }
+        int fd = k_open("f", F_READ);
+        TEST_CHECK(k_read(fd, sizeof(buf), buf) == sizeof(data));
+        TEST_CHECK(memcmp(buf, data, sizeof(data)) == 0);
+        TEST_CHECK(k_close(fd) == 0);
+        TEST_CHECK(unmount() == 0);
+    }
+
+    // the FAT stays locked in memory until the unmount
+    long kb_before = locked_kb();
+    TEST_CHECK(mount_with_flags(test_fs_name, MOUNT_MLOCK) == 0);
+    TEST_CHECK(locked_kb() >= kb_before + (long)(fs.fat_size / 1024));
+    TEST_CHECK(unmount() == 0);
+    TEST_CHECK(locked_kb() == kb_before);
+}
+
+/**
+ * Fill rec with the contents of record i of the log in test_log_file, and return its length
+ */
+int log_test_record(uint32_t i, char *rec)
+{
+    int len = i == 100 ? 700 : (int)(i * 7 % 50); // record 100 spans a few blocks
+    for (int j = 0; j < len; j++)
+    {
+        rec[j] = 'a' + (i + j) % 26;
+    }
+    return len;
+}
+
+void test_log_file(void)
+{
+    remove(test_fs_name); // assume this succeeded
+    TEST_CHECK(mkfs(test_fs_name, 4, 0) == 0);
+    TEST_CHECK(mount(test_fs_name) == 0);
+
+    static char rec[1024];
+    static char buf[1024];
+    int fd = k_open("log", F_APPEND | F_LOG);
+    TEST_CHECK(fd >= 0);
+    for (uint32_t i = 0; i < 300; i++)
+    {
+        TEST_CHECK(k_log_append(fd, rec, log_test_record(i, rec)) == (int)i);
+    }
+
+    // records can be read in any order, and long ones are cut to the buffer
+    uint32_t order[] = {0, 299, 100, 64, 63, 1, 2, 3, 200, 201, 128, 5};
+    for (size_t i = 0; i < sizeof(order) / sizeof(order[0]); i++)
+    {
+        int len = log_test_record(order[i], rec);
+        TEST_CHECK(k_log_read(fd, order[i], buf, sizeof(buf)) == len);
+        TEST_CHECK(memcmp(buf, rec, len) == 0);
+    }
+    log_test_record(100, rec);
+    TEST_CHECK(k_log_read(fd, 100, buf, 10) == 700);
+    TEST_CHECK(memcmp(buf, rec, 10) == 0);
+    TEST_CHECK(k_log_read(fd, 300, buf, sizeof(buf)) == EK_LOG_READ_NO_SUCH_RECORD);
+
+    // appends while reading keep the index up to date
+    for (uint32_t i = 300; i < 330; i++)
+    {
+        TEST_CHECK(k_log_append(fd, rec, log_test_record(i, rec)) == (int)i);
+    }
+    int len = log_test_record(320, rec);
+    TEST_CHECK(k_log_read(fd, 320, buf, sizeof(buf)) == len);
+    TEST_CHECK(memcmp(buf, rec, len) == 0);
+
+    // nothing but k_log_append can change a log
+    TEST_CHECK(k_write(fd, "x", 1) == EK_WRITE_LOG_FILE);
+    TEST_CHECK(k_close(fd) == 0);
+    TEST_CHECK(unmount() == 0);
+
+    // the records and their count survive a remount, and a full scan reads them all back
+    TEST_CHECK(mount(test_fs_name) == 0);
+    fd = k_open("log", F_READ);
+    for (uint32_t i = 0; i < 330; i++)
+    {
+        len = log_test_record(i, rec);
+        TEST_CHECK(k_log_read(fd, i, buf, sizeof(buf)) == len);
+        TEST_CHECK(memcmp(buf, rec, len) == 0);
+    }
+    // under the records is a plain stream of length prefixed records
+    uint32_t header;
+    TEST_CHECK(k_lseek(fd, 0, F_SEEK_SET) == 0);
+    TEST_CHECK(k_read(fd, sizeof(header), (char *)&header) == sizeof(header));
+    TEST_CHECK(header == 0);
+    TEST_CHECK(k_read(fd, sizeof(header), (char *)&header) == sizeof(header));
+    TEST_CHECK(header == 7);
+    TEST_CHECK(k_close(fd) == 0);
+
+    // only an empty file (or one about to be emptied) becomes a log
+    fd = k_open("f", F_WRITE);
+    TEST_CHECK(k_write(fd, "data", 4) == 4);
+    TEST_CHECK(k_close(fd) == 0);
+    TEST_CHECK(k_open("f", F_APPEND | F_LOG) == EK_OPEN_NOT_A_LOG);
+    TEST_CHECK(k_open("f", F_READ | F_LOG) == EK_OPEN_NOT_A_LOG);
+    fd = k_open("f", F_READ);
+    TEST_CHECK(k_log_read(fd, 0, buf, sizeof(buf)) == EK_LOG_READ_NOT_A_LOG);
+    TEST_CHECK(k_close(fd) == 0);
+
+    // opening a log with F_WRITE empties it
+    fd = k_open("log", F_WRITE);
+    TEST_CHECK(k_log_read(fd, 0, buf, sizeof(buf)) == EK_LOG_READ_NO_SUCH_RECORD);
+    TEST_CHECK(k_log_append(fd, "new", 3) == 0);
+    TEST_CHECK(k_log_read(fd, 0, buf, sizeof(buf)) == 3);
+    TEST_CHECK(memcmp(buf, "new", 3) == 0);
+    TEST_CHECK(k_close(fd) == 0);
+    TEST_CHECK(unmount() == 0);
+}
+
+void test_bmap(void)
+{
+    remove(test_fs_name); // assume this succeeded
+
+    TEST_CHECK(mkfs(test_fs_name, 1, 0) == 0); // 256 byte blocks
+
+    TEST_CHECK(mount(test_fs_name) == 0);
+
+    int fd = k_open("f", F_WRITE);
+    TEST_CHECK(k_bmap(fd, 0) == 0); // no blocks yet
+
+    char buf[600];
+    memset(buf, 'f', sizeof(buf));
+    TEST_CHECK(k_write(fd, buf, sizeof(buf)) == sizeof(buf));
+    int first = k_bmap(fd, 0);
+    int second = k_bmap(fd, 256);
+    int third = k_bmap(fd, 599);
+    TEST_CHECK(first > 0);
+    TEST_CHECK(k_bmap(fd, 255) == first);
+    TEST_CHECK(second > 0 && second != first);
+    TEST_CHECK(third > 0 && third != first && third != second);
+    TEST_CHECK(k_bmap(fd, 600) == third); // still in the last block
+    TEST_CHECK(k_bmap(fd, 768) == 0);
+
+    // another file's blocks are its own
+    int g_fd = k_open("g", F_WRITE);
+    TEST_CHECK(k_write(g_fd, buf, 10) == 10);
+    int g_block = k_bmap(g_fd, 0);
+    TEST_CHECK(g_block > 0 && g_block != first && g_block != second && g_block != third);
+
+    TEST_CHECK(k_bmap(STDIN_FD, 0) == 0);
+    TEST_CHECK(k_bmap(-1, 0) == EK_BMAP_FD_OUT_OF_RANGE);
+    TEST_CHECK(k_close(g_fd) == 0);
+    TEST_CHECK(k_bmap(g_fd, 0) == EK_BMAP_FD_NOT_IN_TABLE);
+    TEST_CHECK(k_close(fd) == 0);
+    TEST_CHECK(unmount() == 0);
+}
+
+void test_fat32(void)
+{
+    remove(test_fs_name); // assume this succeeded
+
+    // 1100 blocks of FAT hold 70400 32-bit entries, more than a FAT16 can address
+    TEST_CHECK(mkfs_with_flags(test_fs_name, 1100, 0, MKFS_FAT32) == 0); // 256 byte blocks
+
+    TEST_CHECK(mount(test_fs_name) == 0);
+    TEST_CHECK(fs.fat32);
+
+    fs_statfs statfs;
+    TEST_CHECK(k_statfs(&statfs) == 0);
+    TEST_CHECK(statfs.block_size == 256);
+    TEST_CHECK(statfs.total_blocks == 70399);
+    TEST_CHECK(statfs.free_blocks == 70398); // the root directory takes block 1
+
+    // writing past the end fills the gap, so the last block is beyond block 65535
+    uint32_t tail_offset = 66000 * 256;
+    int fd = k_open("big", F_WRITE);
+    TEST_CHECK(k_lseek(fd, tail_offset, F_SEEK_SET) == tail_offset);
+    TEST_CHECK(k_write(fd, "tail", 4) == 4);
+    TEST_CHECK(k_bmap(fd, tail_offset) > 65535);
+
+    // offsets past 4GiB are fine, but the volume can't hold a block there
+    int64_t far_offset = (int64_t)5 << 30;
+    TEST_CHECK(k_lseek(fd, far_offset, F_SEEK_SET) == far_offset);
+    TEST_CHECK(k_write(fd, "x", 1) == 0);
+    TEST_CHECK(k_lseek(fd, 0, F_SEEK_END) == tail_offset + 4);
+    TEST_CHECK(k_close(fd) == 0);
+
+    TEST_CHECK(unmount() == 0);
+    TEST_CHECK(mount(test_fs_name) == 0);
+    TEST_CHECK(fs.fat32);
+
+    directory_entry dir_entry;
+    TEST_CHECK(k_stat("big", &dir_entry) == 0);
+    TEST_CHECK(dir_entry_size(&dir_entry) == tail_offset + 4);
+
+    char buf[8];
+    fd = k_open("big", F_READ);
+    TEST_CHECK(k_lseek(fd, tail_offset - 4, F_SEEK_SET) == tail_offset - 4);
+    TEST_CHECK(k_read(fd, sizeof(buf), buf) == sizeof(buf));
+    TEST_CHECK(memcmp(buf, "\0\0\0\0tail", sizeof(buf)) == 0);
+
+    // k_copy_range offsets aren't cut to 32 bits either
+    int copy_fd = k_open("copy", F_WRITE);
+    TEST_CHECK(k_copy_range(fd, ((uint64_t)1 << 32) + 4, copy_fd, 0, 4) == 0);
+    TEST_CHECK(k_copy_range(fd, tail_offset, copy_fd, ((uint64_t)1 << 32) + 8, 4) == EK_COPY_RANGE_NO_EMPTY_BLOCKS);
+    TEST_CHECK(k_copy_range(fd, tail_offset, copy_fd, 0, UINT64_MAX) == 4);
+    TEST_CHECK(k_lseek(copy_fd, 0, F_SEEK_END) == 4);
+    TEST_CHECK(k_close(copy_fd) == 0);
+    TEST_CHECK(k_close(fd) == 0);
+    TEST_CHECK(k_unlink("copy") == 0);
+
+    TEST_CHECK(k_unlink("big") == 0);
+    TEST_CHECK(k_statfs(&statfs) == 0);
+    TEST_CHECK(statfs.free_blocks == 70398);
+    TEST_CHECK(unmount() == 0);
+
+    // a FAT16 image still caps offsets at 4GiB
+    remove(test_fs_name);
+    TEST_CHECK(mkfs(test_fs_name, 1, 0) == 0);
+    TEST_CHECK(mount(test_fs_name) == 0);
+    TEST_CHECK(!fs.fat32);
+    fd = k_open("f", F_WRITE);
+    TEST_CHECK(k_lseek(fd, far_offset, F_SEEK_SET) == EK_LSEEK_OFFSET_OVERFLOW);
+    TEST_CHECK(k_copy_range(fd, 0, fd, far_offset, 1) == EK_COPY_RANGE_OFFSET_OVERFLOW);
+    TEST_CHECK(k_close(fd) == 0);
+    TEST_CHECK(unmount() == 0);
+}
+
+void test_subdirs(void)
+{
+    remove(test_fs_name); // assume this succeeded
+
+    TEST_CHECK(mkfs(test_fs_name, 4, 1) == 0); // 512 byte blocks, 8 entries to a block
+
+    TEST_CHECK(mount(test_fs_name) == 0);
+
+    TEST_CHECK(k_mkdir("a") == 0);
+    TEST_CHECK(k_mkdir("a") == EK_MKDIR_EXISTS);
+    TEST_CHECK(k_mkdir("/a/b") == 0);
+    TEST_CHECK(k_mkdir("missing/b") == EK_MKDIR_PARENT_NOT_FOUND);
+    TEST_CHECK(k_mkdir("a/..") == EK_MKDIR_INVALID_FILENAME);
+    TEST_CHECK(k_mkdir("a/this-is-a-31-character-dir-name") == 0);
+    TEST_CHECK(k_rmdir("a/this-is-a-31-character-dir-name") == 0);
+    TEST_CHECK(k_mkdir("a/this-is-a-32-character-dir-names") == EK_MKDIR_INVALID_FILENAME);
+
+    // the same name can be in different directories
+    const char *paths[] = {"f", "a/f", "/a/b/f"};
+    for (int i = 0; i < 3; i++)
+    {
+        int fd = k_open(paths[i], F_WRITE);
+        TEST_CHECK(fd >= 0);
+        TEST_CHECK(k_write(fd, paths[i], strlen(paths[i])) == strlen(paths[i]));
+        TEST_CHECK(k_close(fd) == 0);
+    }
+    char buf[16];
+    for (int i = 0; i < 3; i++)
+    {
+        int fd = k_open(paths[i], F_READ);
+        TEST_CHECK(fd >= 0);
+        TEST_CHECK(k_read(fd, sizeof(buf), buf) == strlen(paths[i]));
+        TEST_CHECK(memcmp(buf, paths[i], strlen(paths[i])) == 0);
+        TEST_CHECK(k_close(fd) == 0);
+    }
+
+    directory_entry dir_entry;
+    TEST_CHECK(k_stat("a/b", &dir_entry) == 0);
+    TEST_CHECK(dir_entry.type == FILE_TYPE_DIRECTORY);
+    TEST_CHECK(k_stat("/", &dir_entry) == 0);
+    TEST_CHECK(dir_entry.type == FILE_TYPE_DIRECTORY);
+    TEST_CHECK(k_ls("a") == 0);
+
+    // directories are not files
+    TEST_CHECK(k_open("a", F_READ) == EK_OPEN_IS_DIRECTORY);
+    TEST_CHECK(k_unlink("a") == EK_UNLINK_IS_DIRECTORY);
+    TEST_CHECK(k_rmdir("a") == EK_RMDIR_NOT_EMPTY);
+    TEST_CHECK(k_rmdir("f") == EK_RMDIR_NOT_A_DIRECTORY);
+    TEST_CHECK(k_open("f/g", F_WRITE) == EK_OPEN_FILE_DOES_NOT_EXIST);
+
+    // a directory splits its buckets as it fills up, and a lookup in it still reads one block
+    char name[32];
+    fs_stats stats;
+    k_fsstats_reset();
+    for (int i = 0; i < 100; i++)
+    {
+        snprintf(name, sizeof(name), "a/b/file%d", i);
+        int fd = k_open(name, F_WRITE);
+        TEST_CHECK(fd >= 0);
+        TEST_CHECK(k_close(fd) == 0);
+    }
+    k_fsstats(&stats);
+    TEST_CHECK(stats.dir_splits > 0);
+
+    k_fsstats_reset();
+    for (int i = 0; i < 100; i++)
+    {
+        snprintf(name, sizeof(name), "a/b/file%d", i);
+        int fd = k_open(name, F_READ);
+        TEST_CHECK(fd >= 0);
+        TEST_CHECK(k_close(fd) == 0);
+    }
+    k_fsstats(&stats);
+    // one block of the root, one of a and one of b for each path
+    TEST_CHECK(stats.dir_block_reads == 3 * 100);
+    TEST_MSG("%llu directory blocks read", (unsigned long long)stats.dir_block_reads);
+
+    // moving across directories and into one, and open files follow the move
+    TEST_CHECK(k_mv("a/b/file0", "moved") == 0);
+    TEST_CHECK(k_open("a/b/file0", F_READ) == EK_OPEN_FILE_DOES_NOT_EXIST);
+    int fd = k_open("moved", F_READ);
+    TEST_CHECK(fd >= 0);
+    TEST_CHECK(k_mv("moved", "a") == 0);
+    TEST_CHECK(k_stat("a/moved", &dir_entry) == 0);
+    TEST_CHECK(k_close(fd) == 0);
+    TEST_CHECK(k_mv("a", "a/b") == EK_MV_INTO_ITSELF);
+    TEST_CHECK(k_mv("a/moved", "/") == 0);
+    TEST_CHECK(k_mv("moved", "a") == 0);
+    TEST_CHECK(k_mv("f", "a/b") == 0); // replaces a/b/f
+    fd = k_open("a/b/f", F_READ);
+    TEST_CHECK(k_read(fd, sizeof(buf), buf) == 1);
+    TEST_CHECK(buf[0] == 'f');
+    TEST_CHECK(k_close(fd) == 0);
+
+    // everything survives a remount
+    TEST_CHECK(unmount() == 0);
+    TEST_CHECK(mount(test_fs_name) == 0);
+    for (int i = 1; i < 100; i++)
+    {
+        snprintf(name, sizeof(name), "a/b/file%d", i);
+        TEST_CHECK(k_stat(name, &dir_entry) == 0);
+    }
+    TEST_CHECK(k_stat("a/moved", &dir_entry) == 0);
+
+    // and a rollback puts back the directories as they were
+    TEST_CHECK(k_snapshot_create("s1") == 0);
+    TEST_CHECK(k_unlink("a/b/file1") == 0);
+    TEST_CHECK(k_mkdir("c") == 0);
+    TEST_CHECK(k_snapshot_rollback("s1") == 0);
+    TEST_CHECK(k_stat("a/b/file1", &dir_entry) == 0);
+    TEST_CHECK(k_stat("c", &dir_entry) != 0);
+    TEST_CHECK(k_snapshot_delete("s1") == 0);
+
+    // emptying the tree gives every block back
+    for (int i = 1; i < 100; i++)
+    {
+        snprintf(name, sizeof(name), "a/b/file%d", i);
+        TEST_CHECK(k_unlink(name) == 0);
+    }
+    TEST_CHECK(k_unlink("a/b/f") == 0);
+    TEST_CHECK(k_unlink("a/f") == 0);
+    TEST_CHECK(k_unlink("a/moved") == 0);
+    TEST_CHECK(k_rmdir("a/b") == 0);
+    TEST_CHECK(k_rmdir("a") == 0);
+    TEST_CHECK(k_stat("a", &dir_entry) != 0);
+    TEST_CHECK(n_used_blocks() == 1);
+
+    TEST_CHECK(unmount() == 0);
+}
+
+void test_subdir_split_failure(void)
+{
+    remove(test_fs_name); // assume this succeeded
+
+    TEST_CHECK(mkfs(test_fs_name, 4, 1) == 0); // 512 byte blocks, 8 entries to a block
+
+    TEST_CHECK(mount(test_fs_name) == 0);
+
+    // a's bucket goes after a file that is then deleted, so b's buckets, and the one a split
+    // of b allocates, are below it in the image
+    char block[512] = {0};
+    int fd = k_open("pad", F_WRITE);
+    for (int i = 0; i < 4; i++)
+    {
+        TEST_CHECK(k_write(fd, block, sizeof(block)) == sizeof(block));
+    }
+    TEST_CHECK(k_close(fd) == 0);
+    TEST_CHECK(k_mkdir("a") == 0);
+    TEST_CHECK(k_unlink("pad") == 0);
+    TEST_CHECK(k_mkdir("a/b") == 0);
+    directory_entry a_entry;
+    directory_entry dir_entry;
+    TEST_CHECK(k_stat("a", &a_entry) == 0);
+    TEST_CHECK(k_stat("a/b", &dir_entry) == 0);
+    TEST_CHECK(dir_entry_first_block(&dir_entry) + 1 < dir_entry_first_block(&a_entry));
+
+    // b's one bucket is full, and all of its files stay open through the failed splits below
+    char name[16];
+    int fds[8];
+    for (int i = 0; i < 8; i++)
+    {
+        snprintf(name, sizeof(name), "a/b/f%d", i);
+        fds[i] = k_open(name, F_WRITE);
+        TEST_CHECK(fds[i] >= 0);
+    }
+    int n_used = n_used_blocks();
+    k_fsstats_reset();
+
+    // writing b's new size into a's bucket fails, after b's old bucket lost its moved entries
+    struct rlimit old_limit;
+    struct rlimit limit;
+    TEST_CHECK(getrlimit(RLIMIT_FSIZE, &old_limit) == 0);
+    limit.rlim_cur = fs.fat_size + (rlim_t)(dir_entry_first_block(&a_entry) - 1) * fs.block_size;
+    limit.rlim_max = old_limit.rlim_max;
+    signal(SIGXFSZ, SIG_IGN);
+    TEST_CHECK(setrlimit(RLIMIT_FSIZE, &limit) == 0);
+    TEST_CHECK(k_open("a/b/f8", F_WRITE) < 0);
+    TEST_CHECK(setrlimit(RLIMIT_FSIZE, &old_limit) == 0);
+
+    // and writing the new bucket fails before anything else is written
+    int rw_fd = fs.fd;
+    fs.fd = open(test_fs_name, O_RDONLY);
+    TEST_CHECK(fs.fd >= 0);
+    TEST_CHECK(k_open("a/b/f8", F_WRITE) < 0);
+    TEST_CHECK(close(fs.fd) == 0);
+    fs.fd = rw_fd;
+
+    // either way the directory is as it was, and the open files still write their own entries
+    fs_stats stats;
+    k_fsstats(&stats);
+    TEST_CHECK(stats.dir_splits == 0);
+    TEST_CHECK(n_used_blocks() == n_used);
+    TEST_CHECK(k_stat("a/b", &dir_entry) == 0);
+    TEST_CHECK(dir_entry_size(&dir_entry) == 512);
+    for (int i = 0; i < 8; i++)
+    {
+        snprintf(name, sizeof(name), "a/b/f%d", i);
+        TEST_CHECK(k_stat(name, &dir_entry) == 0);
+        TEST_MSG("%s", name);
+    }
+    for (int i = 0; i < 8; i++)
+    {
+        TEST_CHECK(k_write(fds[i], block, i + 1) == i + 1);
+        TEST_CHECK(k_close(fds[i]) == 0);
+    }
+    for (int i = 0; i < 8; i++)
+    {
+        snprintf(name, sizeof(name), "a/b/f%d", i);
+        TEST_CHECK(k_stat(name, &dir_entry) == 0);
+        TEST_CHECK(dir_entry_size(&dir_entry) == i + 1);
+        TEST_MSG("%s", name);
+    }
+
+    // once the writes go through, the split does too
+    fd = k_open("a/b/f8", F_WRITE);
+    TEST_CHECK(fd >= 0);
+    TEST_CHECK(k_close(fd) == 0);
+    k_fsstats(&stats);
+    TEST_CHECK(stats.dir_splits == 1);
+    TEST_CHECK(unmount() == 0);
+    TEST_CHECK(mount(test_fs_name) == 0);
+    TEST_CHECK(k_stat("a/b", &dir_entry) == 0);
+    TEST_CHECK(dir_entry_size(&dir_entry) == 2 * 512);
+    for (int i = 0; i < 9; i++)
+    {
+        snprintf(name, sizeof(name), "a/b/f%d", i);
+        TEST_CHECK(k_stat(name, &dir_entry) == 0);
+        TEST_CHECK(dir_entry_size(&dir_entry) == (i < 8 ? i + 1 : 0));
+        TEST_MSG("%s", name);
+    }
+
+    TEST_CHECK(unmount() == 0);
+}
+
 TEST_LIST = {
     {"test_k_write_read", test_k_write_read},
     {"test_k_lseek_past_end", test_k_lseek_past_end},
@@ -380,5 +2100,28 @@ TEST_LIST = {
     {"test_k_ls_after_unlink", test_k_ls_after_unlink},
     {"test_k_ls_on_non_existent_file", test_k_ls_on_non_existent_file},
     {"test_k_ls_multiple_files", test_k_ls_multiple_files},
+    {"test_dedup", test_dedup},
+    {"test_k_clone", test_k_clone},
+    {"test_k_copy_range", test_k_copy_range},
+    {"test_snapshot", test_snapshot},
+    {"test_k_mmap", test_k_mmap},
+    {"test_fsstats", test_fsstats},
+    {"test_block_map", test_block_map},
+    {"test_reclaim", test_reclaim},
+    {"test_fd_generations", test_fd_generations},
+    {"test_pack", test_pack},
+    {"test_root_dir_compaction", test_root_dir_compaction},
+    {"test_name_filter", test_name_filter},
+    {"test_slab", test_slab},
+    {"test_statfs", test_statfs},
+    {"test_read_only_mount", test_read_only_mount},
+    {"test_volumes", test_volumes},
+    {"test_direct_io", test_direct_io},
+    {"test_mount_hints", test_mount_hints},
+    {"test_log_file", test_log_file},
+    {"test_bmap", test_bmap},
+    {"test_fat32", test_fat32},
+    {"test_subdirs", test_subdirs},
+    {"test_subdir_split_failure", test_subdir_split_failure},
     {NULL, NULL} // important: need to have this
 };